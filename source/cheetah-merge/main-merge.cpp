@@ -0,0 +1,757 @@
+//
+//  main-merge.cpp
+//  cheetah-merge
+//
+//  Combine the output of a run that was split between several jobs
+//  (nRunShards/runShard in the .ini file, or the shard option of the front ends).
+//  Each job writes its files with a -shard<i> suffix; this puts them back together:
+//    - powder sums (-sum.h5) and histograms are added up, and their sigmas and statistics recomputed
+//    - event files (.cxi, SACLA multi-event .h5) get the event stacks of all jobs appended in job order,
+//      the running sums of their class groups added up and their means and sigmas recomputed
+//    - text logs (frames.txt, peaks.txt, ...) are concatenated, keeping the header line once
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+#include <hdf5.h>
+#include <hdf5_hl.h>
+
+#include "cheetah.h"
+
+
+/*
+ *	What kind of Cheetah output a file is
+ */
+enum {
+	MERGE_UNKNOWN = 0,
+	MERGE_POWDER,
+	MERGE_HISTOGRAM,
+	MERGE_EVENTS,
+	MERGE_TEXT
+};
+
+// Datasets are merged in blocks of rows of about this size, so that histograms and stacks need not fit in memory
+static const size_t mergeBlockBytes = 64*1024*1024;
+
+
+static int endsWith(const char *s, const char *suffix) {
+	size_t ls = strlen(s);
+	size_t lsuffix = strlen(suffix);
+	return ls >= lsuffix && strcmp(s + ls - lsuffix, suffix) == 0;
+}
+
+static int startsWith(const char *s, const char *prefix) {
+	return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+static const char *baseName(const char *path) {
+	const char *slash = strrchr(path, '/');
+	return slash == NULL ? path : slash+1;
+}
+
+static std::string parentPath(const char *path) {
+	std::string p(path);
+	size_t slash = p.rfind('/');
+	if(slash == std::string::npos || slash == 0)
+		return "/";
+	return p.substr(0, slash);
+}
+
+static int pathExists(hid_t fh, const char *path) {
+	return H5LTpath_valid(fh, path, 0) > 0;
+}
+
+
+/*
+ *	Walk all links of an HDF5 file, calling fn for each object (groups, datasets) and soft link (type H5I_BADID).
+ *	The children of a group are skipped when fn returns non-zero for it.
+ */
+typedef int (*tVisitFn)(const char *path, H5I_type_t type, void *data);
+
+typedef struct {
+	std::string	path;
+	tVisitFn	fn;
+	void		*data;
+} tWalk;
+
+static herr_t walkLink(hid_t group, const char *name, const H5L_info_t *info, void *arg) {
+	tWalk *walk = (tWalk *) arg;
+	std::string path = walk->path + "/" + name;
+
+	if(info->type != H5L_TYPE_HARD) {
+		walk->fn(path.c_str(), H5I_BADID, walk->data);
+		return 0;
+	}
+	hid_t obj = H5Oopen(group, name, H5P_DEFAULT);
+	if(obj < 0)
+		return 0;
+	H5I_type_t type = H5Iget_type(obj);
+	H5Oclose(obj);
+
+	if(walk->fn(path.c_str(), type, walk->data) == 0 && type == H5I_GROUP) {
+		tWalk sub = *walk;
+		sub.path = path;
+		H5Literate_by_name(group, name, H5_INDEX_NAME, H5_ITER_INC, NULL, walkLink, &sub, H5P_DEFAULT);
+	}
+	return 0;
+}
+
+static void walkFile(hid_t fh, tVisitFn fn, void *data) {
+	tWalk walk;
+	walk.path = "";
+	walk.fn = fn;
+	walk.data = data;
+	H5Literate(fh, H5_INDEX_NAME, H5_ITER_INC, NULL, walkLink, &walk);
+}
+
+
+/*
+ *	Recognise the kind of file from its contents
+ */
+static herr_t findTagGroup(hid_t, const char *name, const H5L_info_t *, void *arg) {
+	if(startsWith(name, "tag-")) {
+		*((int *) arg) = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static int fileKind(const char *filename) {
+	if(endsWith(filename, ".txt"))
+		return MERGE_TEXT;
+
+	hid_t fh = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+	if(fh < 0)
+		return MERGE_UNKNOWN;
+
+	int kind = MERGE_UNKNOWN;
+	int sacla = 0;
+	if(pathExists(fh, "/data/histogramCount"))
+		kind = MERGE_HISTOGRAM;
+	else if(pathExists(fh, "/data/nframes"))
+		kind = MERGE_POWDER;
+	else if(pathExists(fh, "/entry_1") && pathExists(fh, "/cheetah"))
+		kind = MERGE_EVENTS;
+	else {
+		H5Literate(fh, H5_INDEX_NAME, H5_ITER_INC, NULL, findTagGroup, &sacla);
+		if(sacla)
+			kind = MERGE_EVENTS;
+	}
+	H5Fclose(fh);
+	return kind;
+}
+
+
+/*
+ *	Row blocks: select rows [row, row+nrows) of a dataspace of the given dims
+ */
+static hsize_t rowsPerBlock(int rank, const hsize_t *dims, size_t elementSize) {
+	size_t rowBytes = elementSize;
+	for(int i=1; i<rank; i++)
+		rowBytes *= dims[i];
+	hsize_t rows = mergeBlockBytes / (rowBytes > 0 ? rowBytes : 1);
+	return rows > 0 ? rows : 1;
+}
+
+static hid_t selectRows(hid_t space, int rank, const hsize_t *dims, hsize_t row, hsize_t nrows) {
+	hsize_t start[H5S_MAX_RANK];
+	hsize_t count[H5S_MAX_RANK];
+	for(int i=0; i<rank; i++) {
+		start[i] = 0;
+		count[i] = dims[i];
+	}
+	start[0] = row;
+	count[0] = nrows;
+	H5Sselect_hyperslab(space, H5S_SELECT_SET, start, NULL, count, NULL);
+	return H5Screate_simple(rank, count, NULL);
+}
+
+static long elementCount(int rank, const hsize_t *dims) {
+	long n = 1;
+	for(int i=0; i<rank; i++)
+		n *= dims[i];
+	return n;
+}
+
+
+/*
+ *	Add dataset path of file in to the same dataset of file out
+ */
+static int sumDataset(hid_t out, hid_t in, const char *path) {
+	hid_t din = H5Dopen(in, path, H5P_DEFAULT);
+	hid_t dout = H5Dopen(out, path, H5P_DEFAULT);
+	hid_t sin = H5Dget_space(din);
+	hid_t sout = H5Dget_space(dout);
+	int rank = H5Sget_simple_extent_ndims(sin);
+	hsize_t dims[H5S_MAX_RANK];
+	hsize_t dimsOut[H5S_MAX_RANK];
+	H5Sget_simple_extent_dims(sin, dims, NULL);
+	H5Sget_simple_extent_dims(sout, dimsOut, NULL);
+
+	int ok = (rank == H5Sget_simple_extent_ndims(sout));
+	for(int i=0; ok && i<rank; i++)
+		ok = (dims[i] == dimsOut[i]);
+	if(!ok) {
+		printf("Error: %s has different dimensions in the parts of the run\n", path);
+	}
+	else if(rank == 0) {
+		double a, b;
+		H5Dread(din, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &a);
+		H5Dread(dout, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &b);
+		b += a;
+		H5Dwrite(dout, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &b);
+	}
+	else if(elementCount(rank, dims) > 0) {
+		hsize_t rows = rowsPerBlock(rank, dims, sizeof(double));
+		if(rows > dims[0])
+			rows = dims[0];
+		long blockn = elementCount(rank, dims) / dims[0] * rows;
+		double *a = (double *) calloc(blockn, sizeof(double));
+		double *b = (double *) calloc(blockn, sizeof(double));
+		for(hsize_t row=0; row<dims[0]; row+=rows) {
+			hsize_t nrows = (dims[0]-row < rows) ? dims[0]-row : rows;
+			hid_t mem = selectRows(sin, rank, dims, row, nrows);
+			H5Sclose(selectRows(sout, rank, dims, row, nrows));
+			H5Dread(din, H5T_NATIVE_DOUBLE, mem, sin, H5P_DEFAULT, a);
+			H5Dread(dout, H5T_NATIVE_DOUBLE, mem, sout, H5P_DEFAULT, b);
+			long n = H5Sget_select_npoints(mem);
+			for(long i=0; i<n; i++)
+				b[i] += a[i];
+			H5Dwrite(dout, H5T_NATIVE_DOUBLE, mem, sout, H5P_DEFAULT, b);
+			H5Sclose(mem);
+		}
+		free(a);
+		free(b);
+	}
+
+	H5Sclose(sin);
+	H5Sclose(sout);
+	H5Dclose(din);
+	H5Dclose(dout);
+	return ok ? 0 : 1;
+}
+
+
+/*
+ *	Append the events of stack path of file in to the same stack of file out
+ *	(extending the other dimensions to the larger of the two, e.g. for peak lists)
+ */
+static int appendStack(hid_t out, hid_t in, const char *path) {
+	hid_t din = H5Dopen(in, path, H5P_DEFAULT);
+	hid_t dout = H5Dopen(out, path, H5P_DEFAULT);
+	hid_t sin = H5Dget_space(din);
+	hid_t sout = H5Dget_space(dout);
+	int rank = H5Sget_simple_extent_ndims(sin);
+	hsize_t dims[H5S_MAX_RANK];
+	hsize_t dimsOut[H5S_MAX_RANK];
+	H5Sget_simple_extent_dims(sin, dims, NULL);
+	H5Sget_simple_extent_dims(sout, dimsOut, NULL);
+
+	int ok = (rank == H5Sget_simple_extent_ndims(sout));
+	H5Sclose(sout);
+	if(!ok) {
+		printf("Error: %s has different dimensions in the parts of the run\n", path);
+	}
+	else if(elementCount(rank, dims) > 0) {
+		hsize_t nOld = dimsOut[0];
+		hsize_t newDims[H5S_MAX_RANK];
+		newDims[0] = dimsOut[0] + dims[0];
+		for(int i=1; i<rank; i++)
+			newDims[i] = (dims[i] > dimsOut[i]) ? dims[i] : dimsOut[i];
+		if(H5Dset_extent(dout, newDims) < 0) {
+			printf("Error: could not extend %s\n", path);
+			ok = 0;
+		}
+		else {
+			hid_t type = H5Dget_type(din);
+			size_t elementSize = H5Tget_size(type);
+			hsize_t rows = rowsPerBlock(rank, dims, elementSize);
+			if(rows > dims[0])
+				rows = dims[0];
+			char *buffer = (char *) calloc(elementCount(rank, dims) / dims[0] * rows, elementSize);
+			sout = H5Dget_space(dout);
+			for(hsize_t row=0; row<dims[0]; row+=rows) {
+				hsize_t nrows = (dims[0]-row < rows) ? dims[0]-row : rows;
+				hid_t mem = selectRows(sin, rank, dims, row, nrows);
+				H5Dread(din, type, mem, sin, H5P_DEFAULT, buffer);
+				H5Sclose(selectRows(sout, rank, dims, nOld+row, nrows));
+				H5Dwrite(dout, type, mem, sout, H5P_DEFAULT, buffer);
+				H5Sclose(mem);
+			}
+			H5Sclose(sout);
+			free(buffer);
+			H5Tclose(type);
+
+			// CXI stacks carry their event count (CXI::ATTR_NAME_NUM_EVENTS)
+			if(H5Aexists(dout, "numEvents") > 0) {
+				int numEvents = (int) newDims[0];
+				hid_t a = H5Aopen(dout, "numEvents", H5P_DEFAULT);
+				H5Awrite(a, H5T_NATIVE_INT32, &numEvents);
+				H5Aclose(a);
+			}
+		}
+	}
+
+	H5Sclose(sin);
+	H5Dclose(din);
+	H5Dclose(dout);
+	return ok ? 0 : 1;
+}
+
+static int isStack(hid_t fh, const char *path) {
+	hid_t dh = H5Dopen(fh, path, H5P_DEFAULT);
+	hid_t sh = H5Dget_space(dh);
+	int rank = H5Sget_simple_extent_ndims(sh);
+	hsize_t maxdims[H5S_MAX_RANK];
+	H5Sget_simple_extent_dims(sh, NULL, maxdims);
+	H5Sclose(sh);
+	H5Dclose(dh);
+	return rank > 0 && maxdims[0] == H5S_UNLIMITED;
+}
+
+
+/*
+ *	Which datasets are running sums, to be added up
+ */
+static int isRunningSum(int kind, const char *path) {
+	const char *name = baseName(path);
+	std::string parent = parentPath(path);
+	const char *group = baseName(parent.c_str());
+
+	switch(kind) {
+		case MERGE_POWDER:
+			return startsWith(path, "/data/") && !endsWith(name, "_sigma");
+		case MERGE_HISTOGRAM:
+			return strcmp(path, "/data/histogram") == 0 || strcmp(path, "/data/histogramCount") == 0;
+		case MERGE_EVENTS:
+			if(startsWith(group, "class_"))
+				return strcmp(name, "nframes") == 0 || startsWith(name, "sum_");
+			return strcmp(group, "pixel_histogram") == 0 && strcmp(name, "histogram") == 0;
+	}
+	return 0;
+}
+
+
+/*
+ *	Merge one object of a later part of the run into the output file
+ */
+typedef struct {
+	hid_t	in;
+	hid_t	out;
+	int		kind;
+	int		errors;
+} tMerge;
+
+static int mergeObject(const char *path, H5I_type_t type, void *data) {
+	tMerge *m = (tMerge *) data;
+
+	// Not in the output yet: take it as it is (e.g. the SACLA tag groups of this part)
+	if(!pathExists(m->out, path)) {
+		if(type == H5I_BADID) {
+			H5L_info_t info;
+			H5Lget_info(m->in, path, &info, H5P_DEFAULT);
+			if(info.type == H5L_TYPE_SOFT) {
+				char *target = (char *) calloc(info.u.val_size+1, 1);
+				H5Lget_val(m->in, path, target, info.u.val_size, H5P_DEFAULT);
+				H5Lcreate_soft(target, m->out, path, H5P_DEFAULT, H5P_DEFAULT);
+				free(target);
+			}
+		}
+		else if(H5Ocopy(m->in, path, m->out, path, H5P_DEFAULT, H5P_DEFAULT) < 0) {
+			printf("Error: could not copy %s\n", path);
+			m->errors++;
+		}
+		return 1;
+	}
+
+	if(type != H5I_DATASET)
+		return 0;
+
+	// Event stacks are appended, running sums added up, anything else is taken from the first part
+	if(m->kind == MERGE_EVENTS && isStack(m->in, path))
+		m->errors += appendStack(m->out, m->in, path);
+	else if(isRunningSum(m->kind, path))
+		m->errors += sumDataset(m->out, m->in, path);
+	return 0;
+}
+
+
+/*
+ *	Read or write a whole dataset as doubles
+ */
+static double *readDoubles(hid_t fh, const char *path, long *n) {
+	hid_t dh = H5Dopen(fh, path, H5P_DEFAULT);
+	hid_t sh = H5Dget_space(dh);
+	*n = H5Sget_simple_extent_npoints(sh);
+	double *buffer = (double *) calloc(*n > 0 ? *n : 1, sizeof(double));
+	H5Dread(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer);
+	H5Sclose(sh);
+	H5Dclose(dh);
+	return buffer;
+}
+
+static void writeDoubles(hid_t fh, const char *path, double *buffer) {
+	hid_t dh = H5Dopen(fh, path, H5P_DEFAULT);
+	H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer);
+	H5Dclose(dh);
+}
+
+
+/*
+ *	Recompute what is derived from the running sums, once all parts are in
+ */
+typedef struct {
+	hid_t	out;
+	int		kind;
+	int		errors;
+} tFinish;
+
+static int finishObject(const char *path, H5I_type_t type, void *data) {
+	tFinish *f = (tFinish *) data;
+	if(type != H5I_DATASET)
+		return 0;
+
+	std::string parent = parentPath(path);
+	const char *name = baseName(path);
+	long n, nn;
+
+	// Powder sum file: <name>_sigma from <name>, <name>_squared and nframes (as in savePowderPattern)
+	if(f->kind == MERGE_POWDER && endsWith(name, "_sigma")) {
+		std::string sum = std::string(path).substr(0, strlen(path) - strlen("_sigma"));
+		std::string squared = sum + "_squared";
+		if(!pathExists(f->out, sum.c_str()) || !pathExists(f->out, squared.c_str())) {
+			printf("Error: %s has no sum of squares to recompute %s from (was it written with nRunShards > 1?)\n", sum.c_str(), path);
+			f->errors++;
+			return 0;
+		}
+		double *nframes = readDoubles(f->out, (parent + "/nframes").c_str(), &n);
+		double *powder = readDoubles(f->out, sum.c_str(), &nn);
+		double *powderSquared = readDoubles(f->out, squared.c_str(), &n);
+		double *sigma = (double *) calloc(nn, sizeof(double));
+		double nf = nframes[0];
+		if(nf > 0) {
+			for(long i=0; i<nn; i++)
+				sigma[i] = sqrt(powderSquared[i]/nf - (powder[i]/nf)*(powder[i]/nf));
+			writeDoubles(f->out, path, sigma);
+		}
+		free(nframes);
+		free(powder);
+		free(powderSquared);
+		free(sigma);
+	}
+
+	// CXI class group: mean_<name> and sigma_<name> from sum_<name>, sum_squared_<name> and nframes (as in writeAccumulatedCXI)
+	if(f->kind == MERGE_EVENTS && startsWith(name, "sum_") && !startsWith(name, "sum_squared_")) {
+		std::string version = name + strlen("sum_");
+		std::string squared = parent + "/sum_squared_" + version;
+		std::string mean = parent + "/mean_" + version;
+		std::string sigma = parent + "/sigma_" + version;
+		std::string count = parent + "/nframes";
+		if(!pathExists(f->out, squared.c_str()) || !pathExists(f->out, mean.c_str()) ||
+		   !pathExists(f->out, sigma.c_str()) || !pathExists(f->out, count.c_str()))
+			return 0;
+		double *nframes = readDoubles(f->out, count.c_str(), &n);
+		double *powder = readDoubles(f->out, path, &nn);
+		double *powderSquared = readDoubles(f->out, squared.c_str(), &n);
+		double *meanBuffer = (double *) calloc(nn, sizeof(double));
+		double *sigmaBuffer = (double *) calloc(nn, sizeof(double));
+		double nf = nframes[0];
+		// (nothing accumulated yet if no part got to its first save interval)
+		if(nf > 0) {
+			for(long i=0; i<nn; i++) {
+				meanBuffer[i] = powder[i]/nf;
+				sigmaBuffer[i] = sqrt((powderSquared[i] - powder[i]*powder[i]/nf)/nf);
+			}
+			writeDoubles(f->out, mean.c_str(), meanBuffer);
+			writeDoubles(f->out, sigma.c_str(), sigmaBuffer);
+		}
+		free(nframes);
+		free(powder);
+		free(powderSquared);
+		free(meanBuffer);
+		free(sigmaBuffer);
+	}
+	return 0;
+}
+
+
+/*
+ *	Histogram file: recompute the per-pixel statistics from the summed histogram so that they cover all parts.
+ *	The histogram is read a block of rows at a time and the statistics of those rows written straight back.
+ */
+static int finishHistogram(const char *filename) {
+	hid_t fh = H5Fopen(filename, H5F_ACC_RDWR, H5P_DEFAULT);
+	if(fh < 0)
+		return 1;
+
+	hid_t dh = H5Dopen(fh, "/data/histogram", H5P_DEFAULT);
+	hid_t sh = H5Dget_space(dh);
+	hsize_t dims[3];
+	if(H5Sget_simple_extent_ndims(sh) != 3) {
+		printf("Error: %s: /data/histogram is not 3-dimensional\n", filename);
+		H5Sclose(sh);
+		H5Dclose(dh);
+		H5Fclose(fh);
+		return 1;
+	}
+	H5Sget_simple_extent_dims(sh, dims, NULL);
+
+	// The statistics datasets, in the order histogramStatistics fills them
+	const char *statNames[6] = {"/data/mean", "/data/variance", "/data/reduced-variance", "/data/chi-squared", "/data/kl-divergence", "/data/n"};
+	hid_t statDh[6];
+	hid_t statSh[6];
+	int errors = 0;
+	for(int k=0; k<6; k++) {
+		statDh[k] = H5Dopen(fh, statNames[k], H5P_DEFAULT);
+		statSh[k] = H5Dget_space(statDh[k]);
+	}
+
+	hsize_t rows = rowsPerBlock(3, dims, sizeof(uint32_t));
+	if(rows > dims[0])
+		rows = dims[0];
+	uint32_t *histogram = (uint32_t *) calloc(rows*dims[1]*dims[2], sizeof(uint32_t));
+	float *stat[6];
+	for(int k=0; k<6; k++)
+		stat[k] = (float *) calloc(rows*dims[1], sizeof(float));
+
+	for(hsize_t row=0; row<dims[0]; row+=rows) {
+		hsize_t nrows = (dims[0]-row < rows) ? dims[0]-row : rows;
+		hid_t mem = selectRows(sh, 3, dims, row, nrows);
+		if(H5Dread(dh, H5T_NATIVE_UINT32, mem, sh, H5P_DEFAULT, histogram) < 0)
+			errors++;
+		H5Sclose(mem);
+		histogramStatistics(histogram, nrows*dims[1], dims[2], stat[0], stat[1], stat[2], stat[3], stat[4], stat[5]);
+		for(int k=0; k<6; k++) {
+			mem = selectRows(statSh[k], 2, dims, row, nrows);
+			if(H5Dwrite(statDh[k], H5T_NATIVE_FLOAT, mem, statSh[k], H5P_DEFAULT, stat[k]) < 0)
+				errors++;
+			H5Sclose(mem);
+		}
+	}
+	if(errors)
+		printf("Error: %s: could not update the per-pixel statistics\n", filename);
+
+	for(int k=0; k<6; k++) {
+		free(stat[k]);
+		H5Sclose(statSh[k]);
+		H5Dclose(statDh[k]);
+	}
+	free(histogram);
+	H5Sclose(sh);
+	H5Dclose(dh);
+	H5Fclose(fh);
+	return errors ? 1 : 0;
+}
+
+
+/*
+ *	Copy a file as it is
+ */
+static int copyFile(const char *from, const char *to) {
+	FILE *in = fopen(from, "rb");
+	if(in == NULL) {
+		printf("Error: could not open %s\n", from);
+		return 1;
+	}
+	FILE *out = fopen(to, "wb");
+	if(out == NULL) {
+		printf("Error: could not create %s\n", to);
+		fclose(in);
+		return 1;
+	}
+	size_t bufferSize = 4*1024*1024;
+	char *buffer = (char *) malloc(bufferSize);
+	size_t n;
+	int errors = 0;
+	while((n = fread(buffer, 1, bufferSize, in)) > 0) {
+		if(fwrite(buffer, 1, n, out) != n) {
+			printf("Error: could not write %s\n", to);
+			errors++;
+			break;
+		}
+	}
+	free(buffer);
+	fclose(in);
+	fclose(out);
+	return errors;
+}
+
+
+/*
+ *	Text logs: one after the other, with the header (first) line of the first part only
+ */
+static int mergeText(const char *output, std::vector<std::string> &inputs) {
+	FILE *out = fopen(output, "w");
+	if(out == NULL) {
+		printf("Error: could not create %s\n", output);
+		return 1;
+	}
+
+	std::string header;
+	char *line = NULL;
+	size_t lineSize = 0;
+	int errors = 0;
+	for(size_t k=0; k<inputs.size(); k++) {
+		FILE *in = fopen(inputs[k].c_str(), "r");
+		if(in == NULL) {
+			printf("Error: could not open %s\n", inputs[k].c_str());
+			errors++;
+			continue;
+		}
+		ssize_t n;
+		long lineNumber = 0;
+		while((n = getline(&line, &lineSize, in)) >= 0) {
+			if(lineNumber++ == 0) {
+				if(k == 0)
+					header = line;
+				else if(header == line)
+					continue;
+			}
+			fwrite(line, 1, n, out);
+		}
+		fclose(in);
+	}
+	free(line);
+	fclose(out);
+	return errors;
+}
+
+
+/*
+ *	HDF5 files: start from a copy of the first part and merge the others into it
+ */
+static int mergeHDF5(const char *output, std::vector<std::string> &inputs, int kind) {
+	if(copyFile(inputs[0].c_str(), output))
+		return 1;
+
+	hid_t out = H5Fopen(output, H5F_ACC_RDWR, H5P_DEFAULT);
+	if(out < 0) {
+		printf("Error: could not open %s\n", output);
+		return 1;
+	}
+
+	int errors = 0;
+	for(size_t k=1; k<inputs.size(); k++) {
+		hid_t in = H5Fopen(inputs[k].c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+		if(in < 0) {
+			printf("Error: could not open %s\n", inputs[k].c_str());
+			errors++;
+			continue;
+		}
+		tMerge m;
+		m.in = in;
+		m.out = out;
+		m.kind = kind;
+		m.errors = 0;
+		walkFile(in, mergeObject, &m);
+		errors += m.errors;
+		H5Fclose(in);
+	}
+
+	tFinish f;
+	f.out = out;
+	f.kind = kind;
+	f.errors = 0;
+	walkFile(out, finishObject, &f);
+	errors += f.errors;
+	H5Fclose(out);
+
+	if(kind == MERGE_HISTOGRAM)
+		errors += finishHistogram(output);
+	return errors;
+}
+
+
+static int mergeFiles(const char *output, std::vector<std::string> &inputs) {
+	int kind = fileKind(inputs[0].c_str());
+	printf("Merging %lu files into %s\n", (unsigned long) inputs.size(), output);
+	switch(kind) {
+		case MERGE_TEXT:
+			return mergeText(output, inputs);
+		case MERGE_POWDER:
+		case MERGE_HISTOGRAM:
+		case MERGE_EVENTS:
+			return mergeHDF5(output, inputs, kind);
+	}
+	printf("Error: do not know how to merge %s (not a powder sum, histogram, event or text file)\n", inputs[0].c_str());
+	return 1;
+}
+
+
+/*
+ *	Merge every <name>-shard0<ext> in the current directory with its nShards-1 siblings into <name><ext>
+ */
+static int mergeDirectory(long nShards) {
+	DIR *dir = opendir(".");
+	if(dir == NULL) {
+		printf("Error: could not read the current directory\n");
+		return 1;
+	}
+	std::vector<std::string> firstParts;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL) {
+		if(strstr(entry->d_name, "-shard0.") != NULL)
+			firstParts.push_back(entry->d_name);
+	}
+	closedir(dir);
+
+	int errors = 0;
+	for(size_t f=0; f<firstParts.size(); f++) {
+		std::string name = firstParts[f];
+		size_t pos = name.rfind("-shard0.");
+		std::string prefix = name.substr(0, pos);
+		std::string ext = name.substr(pos + strlen("-shard0"));
+		std::string output = prefix + ext;
+
+		std::vector<std::string> inputs;
+		int missing = 0;
+		for(long i=0; i<nShards; i++) {
+			char part[64];
+			sprintf(part, "-shard%ld", i);
+			std::string input = prefix + part + ext;
+			FILE *fp = fopen(input.c_str(), "r");
+			if(fp == NULL) {
+				printf("Skipping %s: %s is missing\n", output.c_str(), input.c_str());
+				missing = 1;
+				break;
+			}
+			fclose(fp);
+			inputs.push_back(input);
+		}
+		if(missing) {
+			errors++;
+			continue;
+		}
+
+		// Stacks written as plain arrays (radial averages, spectra, ...) and calibrations are left as they are
+		if(fileKind(inputs[0].c_str()) == MERGE_UNKNOWN) {
+			printf("Leaving the parts of %s as they are\n", output.c_str());
+			continue;
+		}
+		errors += mergeFiles(output.c_str(), inputs);
+	}
+	return errors;
+}
+
+
+int main(int argc, const char * argv[])
+{
+	if(argc >= 4 && strcmp(argv[1], "-o") == 0) {
+		std::vector<std::string> inputs;
+		for(int i=3; i<argc; i++)
+			inputs.push_back(argv[i]);
+		return mergeFiles(argv[2], inputs) ? 1 : 0;
+	}
+	if(argc == 3 && strcmp(argv[1], "-n") == 0 && atol(argv[2]) >= 1) {
+		return mergeDirectory(atol(argv[2])) ? 1 : 0;
+	}
+
+	printf("Usage: %s -o output input-shard0 input-shard1 ...\n", argv[0]);
+	printf("       %s -n N   (merge every *-shard0.* in this directory with its N-1 siblings)\n", argv[0]);
+	return -1;
+}
@@ -0,0 +1,507 @@
+//
+//  cheetah-mpi.cpp
+//  cheetah-mpi
+//
+//  Reduction of the running sums of all ranks into rank 0, scheduling of events over the ranks
+//  and the CXI index of the files written by all ranks (see cheetah-mpi.h)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <hdf5.h>
+#include <hdf5_hl.h>
+
+#include "cheetah-mpi.h"
+
+static MPI_Comm cheetahComm = MPI_COMM_WORLD;
+static int      cheetahRank = 0;
+static int      cheetahSize = 1;
+
+// Counters up to which each rank has already been added into rank 0
+static std::vector<long>    sentCounters;
+static std::vector<double>  sentSums;
+
+// Arrays are reduced in blocks of this many elements (MPI counts are int)
+static const long reduceBlock = 1L << 24;
+
+
+/*
+ *  Make this process one part of the run: call before cheetahInit
+ */
+void cheetahMPIInit(cGlobal *global, MPI_Comm comm) {
+    cheetahComm = comm;
+    MPI_Comm_rank(comm, &cheetahRank);
+    MPI_Comm_size(comm, &cheetahSize);
+
+    global->nRunShards = cheetahSize;
+    global->runShard = cheetahRank;
+    global->reduceRunShards = cheetahMPIReduceRunShards;
+}
+
+
+/*
+ *  Add an array of all ranks into that of rank 0
+ *  Running totals (rebuilt from the powder shards every time) are sent as they are; accumulators
+ *  are cleared on the other ranks once sent, so that rank 0 keeps the total and they send only what
+ *  they add from now on.
+ */
+static void reduceArray(void *buffer, long n, MPI_Datatype type, int accumulator) {
+    if (buffer == NULL || n <= 0)
+        return;
+    int     typeSize;
+    MPI_Type_size(type, &typeSize);
+    char    *p = (char *) buffer;
+
+    for (long i=0; i<n; i+=reduceBlock) {
+        int count = (int) ((n-i < reduceBlock) ? n-i : reduceBlock);
+        if (cheetahRank == 0)
+            MPI_Reduce(MPI_IN_PLACE, p + i*typeSize, count, type, MPI_SUM, 0, cheetahComm);
+        else
+            MPI_Reduce(p + i*typeSize, NULL, count, type, MPI_SUM, 0, cheetahComm);
+    }
+    if (accumulator && cheetahRank != 0)
+        memset(buffer, 0, n*typeSize);
+}
+
+
+/*
+ *  Add the counters of all ranks into those of rank 0
+ *  The other ranks keep counting their own frames (for their logs) and send what they counted since last time.
+ */
+template <class T>
+static void reduceCounters(std::vector<T*> &counters, std::vector<T> &sent, MPI_Datatype type) {
+    long    n = counters.size();
+    if (sent.size() != counters.size())
+        sent.assign(n, 0);
+
+    std::vector<T>  delta(n, 0);
+    if (cheetahRank != 0) {
+        for (long i=0; i<n; i++) {
+            delta[i] = *counters[i] - sent[i];
+            sent[i] = *counters[i];
+        }
+    }
+    std::vector<T>  total(n, 0);
+    MPI_Reduce(&delta[0], &total[0], (int) n, type, MPI_SUM, 0, cheetahComm);
+    if (cheetahRank == 0) {
+        for (long i=0; i<n; i++)
+            *counters[i] += total[i];
+    }
+}
+
+
+/*
+ *  Hot pixel maps: a pixel is hot for every rank if it is hot for most of the ranks that have calibrated one
+ */
+static void combineHotPixels(cGlobal *global, long detIndex) {
+    cPixelDetectorCommon *detector = &global->detector[detIndex];
+    long    pix_nn = detector->pix_nn;
+    uint16_t *mask = detector->pixelmask_shared;
+
+    int     nCalibrated = detector->hotPixCalibrated ? 1 : 0;
+    int     *nHot = (int *) calloc(pix_nn, sizeof(int));
+    if (nCalibrated) {
+        for (long i=0; i<pix_nn; i++)
+            nHot[i] = (mask[i] & PIXEL_IS_HOT) ? 1 : 0;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &nCalibrated, 1, MPI_INT, MPI_SUM, cheetahComm);
+    MPI_Allreduce(MPI_IN_PLACE, nHot, (int) pix_nn, MPI_INT, MPI_SUM, cheetahComm);
+
+    if (nCalibrated > 0) {
+        long    hot = 0;
+        pthread_mutex_lock(&detector->pixelmask_shared_mutex);
+        for (long i=0; i<pix_nn; i++) {
+            if (2*nHot[i] > nCalibrated) {
+                mask[i] |= PIXEL_IS_HOT;
+                hot++;
+            }
+            else {
+                mask[i] &= ~(PIXEL_IS_HOT);
+            }
+        }
+        pthread_mutex_unlock(&detector->pixelmask_shared_mutex);
+        detector->nHot = hot;
+        detector->hotPixCalibrated = 1;
+        if (cheetahRank == 0)
+            printf("Detector %li: Hot pixel mask of %i ranks combined - %li hot pixels.\n", detIndex, nCalibrated, hot);
+    }
+    free(nHot);
+}
+
+
+/*
+ *  The reduceRunShards hook of cGlobal: add the running sums and counters of all ranks into rank 0
+ *  (collective: every rank calls it at the same point, through cheetahSaveInterval and cheetahExit)
+ */
+void cheetahMPIReduceRunShards(cGlobal *global) {
+
+    // Bring the histograms (and their frame counts) up to date first
+    DETECTOR_LOOP {
+        if (global->detector[detIndex].histogram)
+            flushHistogramShards(global, detIndex);
+    }
+
+    // Hit counters, frames in each powder and photon energy sums
+    std::vector<long*>  counters;
+    counters.push_back(&global->nprocessedframes);
+    counters.push_back(&global->nhits);
+    counters.push_back(&global->nhitsandblanks);
+    counters.push_back(&global->npowderHits);
+    counters.push_back(&global->npowderBlanks);
+    counters.push_back(&global->nespechits);
+    for (long powderClass=0; powderClass < global->nPowderClasses; powderClass++)
+        counters.push_back(&global->nPowderFrames[powderClass]);
+    DETECTOR_LOOP {
+        POWDER_LOOP {
+            counters.push_back(&global->detector[detIndex].nPowderFrames[powderClass]);
+        }
+        counters.push_back(&global->detector[detIndex].histogram_count);
+    }
+    reduceCounters(counters, sentCounters, MPI_LONG);
+
+    std::vector<double*> sums;
+    sums.push_back(&global->summedPhotonEnergyeV);
+    sums.push_back(&global->summedPhotonEnergyeVSquared);
+    reduceCounters(sums, sentSums, MPI_DOUBLE);
+
+    // Peak count range of each class
+    if (cheetahRank == 0) {
+        MPI_Reduce(MPI_IN_PLACE, global->nPeaksMin, MAX_POWDER_CLASSES, MPI_INT, MPI_MIN, 0, cheetahComm);
+        MPI_Reduce(MPI_IN_PLACE, global->nPeaksMax, MAX_POWDER_CLASSES, MPI_INT, MPI_MAX, 0, cheetahComm);
+    }
+    else {
+        MPI_Reduce(global->nPeaksMin, NULL, MAX_POWDER_CLASSES, MPI_INT, MPI_MIN, 0, cheetahComm);
+        MPI_Reduce(global->nPeaksMax, NULL, MAX_POWDER_CLASSES, MPI_INT, MPI_MAX, 0, cheetahComm);
+    }
+
+    DETECTOR_LOOP {
+        cPixelDetectorCommon *detector = &global->detector[detIndex];
+
+        // Powder sums (running totals when rebuilt from powder shards)
+        int accumulator = (detector->nPowderShards <= 0);
+        FOREACH_DATAFORMAT_T(i_f, cDataVersion::DATA_FORMATS) {
+            if (!isBitOptionSet(detector->powderFormat, *i_f))
+                continue;
+            cDataVersion dataV(NULL, detector, detector->powderVersion, *i_f);
+            while (dataV.next()) {
+                POWDER_LOOP {
+                    reduceArray(dataV.getPowder(powderClass), dataV.pix_nn, MPI_DOUBLE, accumulator);
+                    reduceArray(dataV.getPowderSquared(powderClass), dataV.pix_nn, MPI_DOUBLE, accumulator);
+                }
+            }
+        }
+        POWDER_LOOP {
+            reduceArray(detector->powderPeaks[powderClass], detector->pix_nn, MPI_DOUBLE, 1);
+        }
+
+        // Pixel value histogram
+        if (detector->histogram) {
+            reduceArray(detector->histogramData, (long) detector->histogram_nnn, MPI_UINT32_T, 1);
+        }
+
+        // Hot pixels
+        if (detector->useAutoHotPixel)
+            combineHotPixels(global, detIndex);
+    }
+}
+
+
+/*
+ *  Start handing out the events of a run (collective)
+ */
+void cheetahMPIScheduleStart(cheetahMPISchedule_t *s, cGlobal *global, long nEvents, int dynamic) {
+    s->global = global;
+    s->nEvents = nEvents;
+    s->saveInterval = global->saveInterval;
+    s->nSaves = 0;
+    s->dynamic = dynamic;
+    s->next = cheetahRank;
+    s->counter = NULL;
+
+    if (dynamic) {
+        MPI_Win_allocate((cheetahRank == 0) ? sizeof(long) : 0, sizeof(long), MPI_INFO_NULL, cheetahComm, &s->counter, &s->counterWin);
+        if (cheetahRank == 0) {
+            MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, s->counterWin);
+            *s->counter = 0;
+            MPI_Win_unlock(0, s->counterWin);
+        }
+        MPI_Barrier(cheetahComm);
+    }
+}
+
+
+/*
+ *  Next event of the run for this rank (-1: none left)
+ *  Events come out in increasing order, and may be fetched ahead of processing them (to read them ahead):
+ *  the saves due go with processing, see cheetahMPISaveBefore.
+ */
+long cheetahMPIFetchEvent(cheetahMPISchedule_t *s) {
+    long    event;
+    if (s->dynamic) {
+        long    one = 1;
+        MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, s->counterWin);
+        MPI_Fetch_and_op(&one, &event, MPI_LONG, 0, 0, MPI_SUM, s->counterWin);
+        MPI_Win_unlock(0, s->counterWin);
+    }
+    else {
+        event = s->next;
+        s->next += cheetahSize;
+    }
+    if (event >= s->nEvents)
+        event = -1;
+    return event;
+}
+
+
+/*
+ *  About to process event (-1: the end of the run) of this rank, after all its events before
+ *  Every saveInterval events of the run, all ranks wait for their workers, reduce and save
+ *  (rank 0 for all of them) before going on, so the saved sums are those of exactly the events before.
+ *  The saves due before event are done here (all of them at the end of the run, so every rank passes each one),
+ *  except in the first frames, as for workers saving on their own.
+ */
+void cheetahMPISaveBefore(cheetahMPISchedule_t *s, long event) {
+    if (s->saveInterval > 0 && s->nEvents > 0) {
+        long nSaves = ((event >= 0) ? event : s->nEvents-1) / s->saveInterval;
+        while (s->nSaves < nSaves) {
+            s->nSaves++;
+            if (s->nSaves*s->saveInterval <= s->global->detector[0].startFrames+50)
+                continue;
+            cheetahWaitForWorkers(s->global);
+            cheetahSaveInterval(s->global);
+        }
+    }
+}
+
+
+/*
+ *  Done with the events of a run (collective)
+ */
+void cheetahMPIScheduleEnd(cheetahMPISchedule_t *s) {
+    if (s->dynamic)
+        MPI_Win_free(&s->counterWin);
+    s->counter = NULL;
+}
+
+
+/*
+ *  CXI index: a file under the whole-run name with the contents of the first part,
+ *  except that event stacks are virtual datasets over the stacks of all parts, in part order.
+ *  (Running sums, geometry and the like are taken from the first part: rank 0 holds those of the run.)
+ */
+typedef struct {
+    hid_t   out;
+    std::vector<hid_t>  parts;
+    std::vector<std::string> partNames;
+    int     errors;
+} tCXIIndex;
+
+static herr_t copyAttribute(hid_t from, const char *name, const H5A_info_t *, void *arg) {
+    hid_t   to = *(hid_t *) arg;
+    hid_t   a = H5Aopen(from, name, H5P_DEFAULT);
+    hid_t   type = H5Aget_type(a);
+    hid_t   space = H5Aget_space(a);
+    size_t  size = H5Tget_size(type) * H5Sget_simple_extent_npoints(space);
+    void    *buffer = calloc(size > 0 ? size : 1, 1);
+    H5Aread(a, type, buffer);
+    hid_t   b = H5Acreate(to, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(b, type, buffer);
+    H5Aclose(b);
+    free(buffer);
+    H5Sclose(space);
+    H5Tclose(type);
+    H5Aclose(a);
+    return 0;
+}
+
+static void copyAttributes(hid_t from, hid_t to) {
+    H5Aiterate(from, H5_INDEX_NAME, H5_ITER_INC, NULL, copyAttribute, &to);
+}
+
+static const char *baseName(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash == NULL ? path : slash+1;
+}
+
+static int indexStack(tCXIIndex *x, const char *path, hid_t first) {
+    hid_t   space = H5Dget_space(first);
+    int     rank = H5Sget_simple_extent_ndims(space);
+    hsize_t dims[H5S_MAX_RANK];
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+
+    // Rows of this stack in each part
+    std::vector<hsize_t> rows(x->parts.size(), 0);
+    hsize_t total = 0;
+    for (size_t p=0; p<x->parts.size(); p++) {
+        if (H5LTpath_valid(x->parts[p], path, 1) <= 0)
+            continue;
+        hid_t   d = H5Dopen(x->parts[p], path, H5P_DEFAULT);
+        hid_t   s = H5Dget_space(d);
+        hsize_t pdims[H5S_MAX_RANK];
+        int     same = (H5Sget_simple_extent_ndims(s) == rank);
+        if (same) {
+            H5Sget_simple_extent_dims(s, pdims, NULL);
+            for (int i=1; i<rank; i++)
+                same &= (pdims[i] == dims[i]);
+        }
+        if (same)
+            rows[p] = pdims[0];
+        else
+            printf("Warning: %s in %s does not match the first part, left out of the index\n", path, x->partNames[p].c_str());
+        H5Sclose(s);
+        H5Dclose(d);
+        total += rows[p];
+    }
+
+    hsize_t vdims[H5S_MAX_RANK];
+    memcpy(vdims, dims, sizeof(vdims));
+    vdims[0] = total;
+    hid_t   vspace = H5Screate_simple(rank, vdims, NULL);
+    hid_t   dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    hsize_t offset = 0;
+    for (size_t p=0; p<x->parts.size(); p++) {
+        if (rows[p] == 0)
+            continue;
+        hsize_t pdims[H5S_MAX_RANK];
+        memcpy(pdims, dims, sizeof(pdims));
+        pdims[0] = rows[p];
+        hsize_t start[H5S_MAX_RANK] = {0};
+        start[0] = offset;
+        hid_t   srcspace = H5Screate_simple(rank, pdims, NULL);
+        H5Sselect_hyperslab(vspace, H5S_SELECT_SET, start, NULL, pdims, NULL);
+        // The parts are next to the index, so name them relative to it
+        H5Pset_virtual(dcpl, vspace, baseName(x->partNames[p].c_str()), path, srcspace);
+        H5Sclose(srcspace);
+        offset += rows[p];
+    }
+    H5Sselect_all(vspace);
+
+    hid_t   type = H5Dget_type(first);
+    hid_t   d = H5Dcreate(x->out, path, type, vspace, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    H5Tclose(type);
+    H5Pclose(dcpl);
+    H5Sclose(vspace);
+    if (d < 0) {
+        printf("Error: could not create the index of %s\n", path);
+        return 1;
+    }
+    copyAttributes(first, d);
+    if (H5Aexists(d, "numEvents") > 0) {
+        int32_t n = (int32_t) total;
+        hid_t   a = H5Aopen(d, "numEvents", H5P_DEFAULT);
+        H5Awrite(a, H5T_NATIVE_INT32, &n);
+        H5Aclose(a);
+    }
+    H5Dclose(d);
+    return 0;
+}
+
+static herr_t indexLink(hid_t group, const char *path, const H5L_info_t *info, void *arg) {
+    tCXIIndex *x = (tCXIIndex *) arg;
+
+    if (info->type == H5L_TYPE_SOFT) {
+        char    *target = (char *) calloc(info->u.val_size+1, 1);
+        H5Lget_val(group, path, target, info->u.val_size, H5P_DEFAULT);
+        H5Lcreate_soft(target, x->out, path, H5P_DEFAULT, H5P_DEFAULT);
+        free(target);
+        return 0;
+    }
+    if (info->type != H5L_TYPE_HARD)
+        return 0;
+
+    hid_t   obj = H5Oopen(group, path, H5P_DEFAULT);
+    if (obj < 0)
+        return 0;
+    if (H5Iget_type(obj) == H5I_GROUP) {
+        hid_t g = H5Gcreate(x->out, path, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        copyAttributes(obj, g);
+        H5Gclose(g);
+    }
+    else if (H5Iget_type(obj) == H5I_DATASET) {
+        // Event stacks are the datasets that grow with the events (CXI::Node::createStack)
+        hid_t   space = H5Dget_space(obj);
+        hsize_t maxdims[H5S_MAX_RANK];
+        int     rank = H5Sget_simple_extent_dims(space, NULL, maxdims);
+        H5Sclose(space);
+        if (rank > 0 && maxdims[0] == H5S_UNLIMITED)
+            x->errors += indexStack(x, path, obj);
+        else if (H5Ocopy(group, path, x->out, path, H5P_DEFAULT, H5P_DEFAULT) < 0) {
+            printf("Error: could not copy %s\n", path);
+            x->errors++;
+        }
+    }
+    H5Oclose(obj);
+    return 0;
+}
+
+/*
+ *  Index the parts name-shard0.cxi ... name-shard<n-1>.cxi of name.cxi (parts that do not exist,
+ *  i.e. ranks that wrote no events, are left out)
+ */
+int cheetahMPIWriteCXIIndexFile(const char *filename, long nParts) {
+    std::string name(filename);
+    size_t  dot = name.rfind(".cxi");
+    std::string stem = (dot == std::string::npos) ? name : name.substr(0, dot);
+
+    tCXIIndex x;
+    x.errors = 0;
+    H5E_auto2_t errorFunc;
+    void    *errorData;
+    H5Eget_auto2(H5E_DEFAULT, &errorFunc, &errorData);
+    H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+    for (long i=0; i<nParts; i++) {
+        char    suffix[64];
+        sprintf(suffix, "-shard%ld.cxi", i);
+        std::string part = stem + suffix;
+        hid_t   fh = (access(part.c_str(), R_OK) == 0) ? H5Fopen(part.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT) : -1;
+        if (fh >= 0) {
+            x.parts.push_back(fh);
+            x.partNames.push_back(part);
+        }
+    }
+    H5Eset_auto2(H5E_DEFAULT, errorFunc, errorData);
+    if (x.parts.empty())
+        return 0;
+
+    printf("Writing CXI index of %lu parts: %s\n", (unsigned long) x.parts.size(), filename);
+    x.out = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (x.out < 0) {
+        printf("Error: could not create %s\n", filename);
+        x.errors++;
+    }
+    else {
+        H5Lvisit(x.parts[0], H5_INDEX_NAME, H5_ITER_INC, indexLink, &x);
+        H5Fclose(x.out);
+    }
+    for (size_t p=0; p<x.parts.size(); p++)
+        H5Fclose(x.parts[p]);
+    return x.errors;
+}
+
+/*
+ *  CXI index of each CXI file of the run (collective, after cheetahExit has closed the files of all ranks)
+ */
+void cheetahMPIWriteCXIIndex(cGlobal *global) {
+    MPI_Barrier(cheetahComm);
+    if (cheetahRank != 0 || !global->saveCXI || cheetahSize <= 1)
+        return;
+
+    char    filename[MAX_FILENAME_LENGTH];
+    if (global->saveByPowderClass) {
+        for (long powderClass=0; powderClass < global->nPowderClasses; powderClass++) {
+            if (snprintf(filename, sizeof(filename), "%s-r%04d-class%ld.cxi", global->experimentID, global->runNumber, powderClass) >= (int) sizeof(filename))
+                ERROR("File name too long: %s\n", filename);
+            cheetahMPIWriteCXIIndexFile(filename, cheetahSize);
+        }
+    }
+    else {
+        if (snprintf(filename, sizeof(filename), "%s-r%04d.cxi", global->experimentID, global->runNumber) >= (int) sizeof(filename))
+            ERROR("File name too long: %s\n", filename);
+        cheetahMPIWriteCXIIndexFile(filename, cheetahSize);
+    }
+}
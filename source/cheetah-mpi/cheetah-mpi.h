@@ -0,0 +1,52 @@
+//
+//  cheetah-mpi.h
+//  cheetah-mpi
+//
+//  Running one Cheetah per MPI rank on the events of the same run.
+//  Each rank is one part of the run (nRunShards = number of ranks, runShard = rank),
+//  and writes its own log and CXI files with a -shard<rank> suffix.
+//  Every saveInterval events of the run all ranks stop, and the running sums (powder, peak powder,
+//  histograms), hit counters and photon energy sums of all ranks are added into rank 0, which saves
+//  them under the whole-run names; the hot pixel maps of all ranks are combined into one that every
+//  rank continues with. At the end rank 0 writes an index file under the whole-run CXI name whose
+//  event stacks are virtual datasets over the CXI files of all ranks.
+//
+
+#ifndef __cheetah_mpi__
+#define __cheetah_mpi__
+
+#include <mpi.h>
+#include "cheetah.h"
+
+
+/*
+ *  Handing the events of one run out to the ranks
+ *  Static: rank r processes events r, r+size, r+2*size, ...
+ *  Dynamic: ranks take the next unprocessed event from a counter held by rank 0 whenever they are ready
+ *  for one, so that ranks that are slower (or have more hits) simply process fewer events.
+ */
+typedef struct {
+    cGlobal *global;
+    long    nEvents;            // Events in this run
+    long    saveInterval;       // Events of the run between saves (0: only at the end)
+    long    nSaves;             // Saves passed so far
+    int     dynamic;
+    long    next;               // Static: next event of this rank
+    long    *counter;           // Dynamic: next event of the run (on rank 0)
+    MPI_Win counterWin;
+} cheetahMPISchedule_t;
+
+
+/*
+ *  Prototypes
+ */
+void cheetahMPIInit(cGlobal*, MPI_Comm);
+void cheetahMPIReduceRunShards(cGlobal*);
+void cheetahMPIScheduleStart(cheetahMPISchedule_t*, cGlobal*, long, int);
+long cheetahMPIFetchEvent(cheetahMPISchedule_t*);
+void cheetahMPISaveBefore(cheetahMPISchedule_t*, long);
+void cheetahMPIScheduleEnd(cheetahMPISchedule_t*);
+void cheetahMPIWriteCXIIndex(cGlobal*);
+int cheetahMPIWriteCXIIndexFile(const char*, long);
+
+#endif /* defined(__cheetah_mpi__) */
@@ -0,0 +1,213 @@
+//
+//  main-sacla-mpi.cpp
+//  cheetah-mpi
+//
+//  SACLA HDF5 files processed by several MPI ranks (on one or more nodes) at once:
+//  the same as cheetah-sacla, with the events of each run spread over the ranks
+//  and the running sums of all ranks saved together by rank 0 (see cheetah-mpi.h).
+//
+//  mpirun -np 4 cheetah-sacla-mpi input.h5 setting.ini [static|dynamic]
+//
+
+#include <iostream>
+#include <hdf5.h>
+#include <hdf5_hl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "cheetah.h"
+#include "cheetah-mpi.h"
+#include "sacla-hdf5-reader.h"
+
+int main(int argc, char * argv[])
+{
+	// Only the main thread makes MPI calls, Cheetah's workers never do
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	int rank, size;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+	// Input data file and Cheetah configuration file
+	char	filename[1024];
+	char	cheetahini[1024];
+
+	// Static: every size-th event for each rank; dynamic: ranks take the next event when ready for one
+	int		dynamic = 1;
+
+	if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "static") != 0 && strcmp(argv[3], "dynamic") != 0)) {
+		if (rank == 0)
+			printf("Usage: mpirun -np N %s input.h5 setting.ini [static|dynamic]\n", argv[0]);
+		MPI_Finalize();
+		return -1;
+	}
+	strcpy(filename,argv[1]);
+	strcpy(cheetahini,argv[2]);
+	if (argc > 3)
+		dynamic = (strcmp(argv[3], "dynamic") == 0);
+
+	if (rank == 0) {
+		printf("SACLA HDF5 file parser on %d MPI ranks (%s scheduling)\n", size, dynamic ? "dynamic" : "static");
+		printf("Input data file: %s\n", filename);
+		printf("Cheetah .ini file: %s\n", cheetahini);
+	}
+
+	/*
+	 *	Initialise Cheetah: this rank is one part of the run
+	 */
+	static long frameNumber = 0;
+	long runNumber = 0;
+	static cGlobal cheetahGlobal;
+	static time_t startT = 0;
+	time(&startT);
+	strcpy(cheetahGlobal.configFile, cheetahini);
+	strncpy(cheetahGlobal.cxiFilename, "output.h5", MAX_FILENAME_LENGTH);
+	cheetahMPIInit(&cheetahGlobal, MPI_COMM_WORLD);
+	cheetahInit(&cheetahGlobal);
+
+	/*
+	 *	Open SACLA HDF5 file
+	 *	Read file header and information
+	 */
+	SACLA_h5_info_t SACLA_header = {};
+	SACLA_HDF5_ReadHeader(filename, &SACLA_header);
+
+	// Image size (8 panels of 1024 x 512)
+	long	fs_one = 512;
+	long	ss_one = 1024;
+	long	nn_one = fs_one*ss_one;
+	long	nn = 8*nn_one;
+	if (cheetahGlobal.detector[0].pix_nn > nn) {
+		printf("Error: detector 0 has %li pixels, SACLA images only %li\n", cheetahGlobal.detector[0].pix_nn, nn);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// Image buffers, filled ahead of processing by the prefetch I/O threads (as in cheetah-sacla)
+	SACLA_prefetch_t prefetch = {};
+	long	prefetchDepth = cheetahGlobal.nThreads + 4;
+	long	prefetchThreads = 2;
+	long	*ahead = (long *) calloc(prefetchDepth, sizeof(long));
+
+	// Loop through runs in this HDF5 file
+	for(long runID=0; runID<SACLA_header.nruns; runID++) {
+		if (rank == 0)
+			printf("Processing run: %s\n", SACLA_header.run_string[runID]);
+		runNumber = SACLA_header.run_number[runID];
+
+		// Gather detector fields and event tags for this run
+		SACLA_HDF5_Read2dDetectorFields(&SACLA_header, runID);
+		SACLA_HDF5_ReadRunInfo(&SACLA_header, runID);
+
+		// Loop through the events this rank gets, queueing them for the prefetch as they are handed out
+		cheetahMPISchedule_t schedule;
+		cheetahMPIScheduleStart(&schedule, &cheetahGlobal, SACLA_header.nevents, dynamic);
+		SACLA_HDF5_PrefetchStartQueued(&prefetch, &SACLA_header, runID, nn, nn_one, prefetchDepth, prefetchThreads);
+		long	nAhead = 0;
+		long	nextAhead = 0;
+		int		more = 1;
+		while (1) {
+			while (more && nAhead < prefetch.depth) {
+				long next = cheetahMPIFetchEvent(&schedule);
+				if (next < 0) {
+					more = 0;
+					SACLA_HDF5_PrefetchQueueEnd(&prefetch);
+					break;
+				}
+				SACLA_HDF5_PrefetchQueue(&prefetch, next);
+				ahead[(nextAhead+nAhead) % prefetch.depth] = next;
+				nAhead++;
+			}
+			long eventID = (nAhead > 0) ? ahead[nextAhead] : -1;
+			cheetahMPISaveBefore(&schedule, eventID);
+			if (eventID < 0)
+				break;
+			nextAhead = (nextAhead+1) % prefetch.depth;
+			nAhead--;
+
+			int tagID = atoi(SACLA_header.event_name[eventID] + 4); // "tag_######"
+			printf("Rank %d processing event: tag = %d energy = %f eV\n", rank, tagID, SACLA_header.actual_photon_energy_in_eV[eventID]);
+			frameNumber++;
+
+			/*
+			 *  Cheetah: Calculate time beteeen processing of data frames
+			 */
+			time_t	tnow;
+			double	dtime, datarate;
+			time(&tnow);
+
+			dtime = difftime(tnow, cheetahGlobal.tlast);
+			if(dtime > 1.) {
+				datarate = (frameNumber - cheetahGlobal.lastTimingFrame)/dtime;
+				cheetahGlobal.lastTimingFrame = frameNumber;
+				time(&cheetahGlobal.tlast);
+				cheetahGlobal.datarate = datarate;
+			}
+
+			/*
+			 *	SACLA: Next image (read and gain-corrected by the prefetch stage)
+			 */
+			SACLA_prefetch_slot_t *image = SACLA_HDF5_PrefetchNext(&prefetch, eventID);
+			if (image->status < 0) {
+				SACLA_HDF5_PrefetchRelease(image);
+				continue;
+			}
+
+			/*
+			 *	Cheetah: Create a new eventData structure in which to place all information
+			 */
+			cEventData	*eventData;
+			eventData = cheetahNewEvent(&cheetahGlobal);
+
+			/*
+			 *  Cheetah: Populate event structure with meta-data
+			 */
+			eventData->frameNumber = tagID;
+			eventData->runNumber = runNumber;
+			eventData->nPeaks = 0;
+			eventData->pumpLaserCode = 0;
+			eventData->pumpLaserDelay = 0;
+			eventData->photonEnergyeV = SACLA_header.actual_photon_energy_in_eV[eventID];        // in eV
+			eventData->wavelengthA = 12398 / eventData->photonEnergyeV; // 4.1357E-15 * 2.9979E8 * 1E10 / eV (A)
+			eventData->pGlobal = &cheetahGlobal;
+			eventData->fiducial = tagID; // must be unique
+
+			/*
+			 *  Cheetah: Hand over the image buffer as float raw data
+			 *  (the buffer goes back to the prefetch pool when Cheetah is done with this event)
+			 */
+			long    detID = 0;
+			cheetahAdoptRawData(eventData, detID, RAW_TYPE_FLOAT, image->buffer, SACLA_HDF5_PrefetchRelease, image);
+
+			/*
+			 *	Cheetah: Process this event
+			 */
+			cheetahProcessEventMultithreaded(&cheetahGlobal, eventData);
+		}
+		// Wait for the buffers of this run to come back from Cheetah before reusing them for the next one
+		SACLA_HDF5_PrefetchStop(&prefetch);
+		cheetahMPIScheduleEnd(&schedule);
+	}
+	SACLA_HDF5_PrefetchFree(&prefetch);
+	free(ahead);
+
+	// Clean up stale IDs and exit
+	SACLA_HDF5_cleanup(&SACLA_header);
+
+	/*
+	 *	Cheetah: Cleanly exit by closing all files, releasing memory, etc.
+	 *	(adding up the running sums of all ranks on the way), then index the CXI files of all ranks
+	 */
+	cheetahExit(&cheetahGlobal);
+	cheetahMPIWriteCXIIndex(&cheetahGlobal);
+
+	time_t endT;
+	time(&endT);
+	double dif = difftime(endT,startT);
+	if (rank == 0)
+		std::cout << "time taken: " << dif << " seconds\n";
+
+	MPI_Finalize();
+	return 0;
+}
@@ -22,7 +22,7 @@ import wx
 import wx.grid
 import wx.lib.newevent
 
-PARALLEL_SIZE = 3 # MUST match hard-coded value in Cheetah
+PARALLEL_SIZE = 3 # Number of jobs a run is split into (cheetah-sacla-api2 --shard=i/N)
 
 re_filename = re.compile("^[0-9]+(-dark[0-9]?|-light|-\d)?$")
 re_status = re.compile("^Status:")
@@ -656,7 +656,7 @@ class MainWindow(wx.Frame):
                     subjobs.append("dark%d" % i)
 
         else:
-            master_arguments = arguments + " --type=0 "
+            master_arguments = arguments + " --shard=0/%d " % PARALLEL_SIZE
             run_dir += "-0"
             for i in range(1, PARALLEL_SIZE):
                 subjobs.append("%d" % i)
@@ -679,7 +679,10 @@ class MainWindow(wx.Frame):
         # Children
         for subjob in subjobs:
             run_dir = runid + "-" + subjob
-            child_arguments = arguments + "--type=" + subjob
+            if subjob.isdigit():
+                child_arguments = arguments + "--shard=%s/%d" % (subjob, PARALLEL_SIZE)
+            else:
+                child_arguments = arguments + "--type=" + subjob
             
             if os.path.exists(run_dir):
                 self.showError("You told me to process run %s, but a directory for the run already exists. Please remove it before re-processing." % run_dir)
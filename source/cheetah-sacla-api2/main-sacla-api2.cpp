@@ -23,7 +23,6 @@
 #include "hdf5.h"
 
 const int NDET = 8;
-const int parallel_size = 3; // MUST match dispatcher
 int bl = 3;
 const int xsize = 512;
 const int ysize = 1024; 
@@ -33,7 +32,7 @@ const int buffersize = blocksize * NDET;
 const int PD_DARK_ANY = -2, PD_ANY = -1, PD_LIGHT = 0; // PD_DARKn = n afterwards
 
 // FIXME: make these local. Is Cheetah's main portion reentrant?
-double buffer[buffersize] = {};
+float buffer[buffersize] = {};
 unsigned short averaged[buffersize] = {};
 int det_temp_idx = -1;
 float gains[9] = {};
@@ -62,7 +61,7 @@ int myReadSyncDataList(std::vector<std::string>* buffer, char* equip_id, int tag
 }
 
 // photon enery in eV
-static bool get_image(double *buffer, int tag, double photon_energy) {
+static bool get_image(float *buffer, int tag, double photon_energy) {
   int retno = 0;
   float buf_panel[xsize * ydatasize];
   float gain;
@@ -115,7 +114,7 @@ int main(int argc, char *argv[]) {
 	char *pd1_sensor_name = "xfel_bl_3_st_4_pd_laser_fitting_peak/voltage";
 	char *pd2_sensor_name = "xfel_bl_3_st_4_pd_user_10_fitting_peak/voltage";
 	char *pd3_sensor_name = "xfel_bl_3_st_4_pd_user_10_fitting_peak/voltage"; // same as pd2 (dummy)
-	int parallel_block = -1;
+	long parallel_block = -1, parallel_size = 1;
 	int light_dark = PD_ANY;
 	
 	char outputH5[4096] = {};
@@ -137,6 +136,7 @@ int main(int argc, char *argv[]) {
 		{"pd3_thresh", 1, NULL, 19},
 		{"pd3_name", 1, NULL, 20},
                 {"bl", 1, NULL, 21},
+		{"shard", 1, NULL, 22},
 		{0, 0, NULL, 0}
 	};
 
@@ -183,7 +183,10 @@ int main(int argc, char *argv[]) {
 					return -1;
 				}
 			} else {
-				parallel_block = atoi(optarg);
+				// Old spelling of --shard=N/3
+				printf("WARNING: --type=N is deprecated; use --shard=N/3.\n");
+				parallel_block = atol(optarg);
+				parallel_size = 3;
 				if (parallel_block < -1 || parallel_block >= parallel_size) {
 					printf("ERROR: wrong type or parallel_block.\n");
 					return -1;
@@ -215,8 +218,16 @@ int main(int argc, char *argv[]) {
 				return -1;
 			}
                         break;
+		case 22: // shard
+			if (sscanf(optarg, "%ld/%ld", &parallel_block, &parallel_size) != 2 ||
+				parallel_size < 1 || parallel_block < 0 || parallel_block >= parallel_size) {
+				printf("ERROR: shard must be given as i/N with 0 <= i < N.\n");
+				return -1;
+			}
+			break;
 		}
 	}
+	// With --shard, cheetahInit marks the name as this part's (run%d-shard<i>.h5) for cheetah-merge
 	if (strnlen(outputH5, 4096) == 0) {
 		snprintf(outputH5, 4096, "run%d.h5", runNumber);
 	}
@@ -233,7 +244,7 @@ int main(int argc, char *argv[]) {
 	printf(" PD2 sensor name (--pd2_name): %s)\n", pd2_sensor_name);
 	printf(" PD3 sensor name (--pd3_name): %s)\n", pd3_sensor_name);
 	printf(" nFrame after light:           %d (default = -1; accept all image. -2; accept all dark images)\n", light_dark);
-	printf(" parallel_block:               %d (default = -1; no parallelization)\n", parallel_block);
+	printf(" shard (--shard=i/N):          %ld/%ld (default = -1; no parallelization)\n", parallel_block, parallel_size);
 
 	if (runNumber < 0 || strlen(cheetahIni) == 0) {
 		printf("Wrong argument! \nUsage: cheetah-sacla-api -i cheetah.ini -r runNumber\n");
@@ -251,9 +262,17 @@ int main(int argc, char *argv[]) {
 	static time_t startT = 0;
 	time(&startT);
 	strcpy(cheetahGlobal.configFile, cheetahIni);
+	if (parallel_block != -1) {
+		cheetahGlobal.nRunShards = parallel_size;
+		cheetahGlobal.runShard = parallel_block;
+	}
+	strncpy(cheetahGlobal.cxiFilename, outputH5, MAX_FILENAME_LENGTH);
 	cheetahInit(&cheetahGlobal);
 	cheetahGlobal.runNumber = runNumber;
-	strncpy(cheetahGlobal.cxiFilename, outputH5, MAX_FILENAME_LENGTH);
+	if (cheetahGlobal.detector[0].pix_nn > buffersize) {
+		printf("Error: detector 0 has %ld pixels, SACLA images only %d\n", cheetahGlobal.detector[0].pix_nn, buffersize);
+		exit(-1);
+	}
 	printf("\n");
 
 	hsize_t dims[2];
@@ -330,15 +349,10 @@ int main(int argc, char *argv[]) {
 	int parallel_cnt = 0;
 	std::vector<int> tagList;
 	if (tagList_file == NULL) {
-		int blockstart = numDark, blockend = numAll - 1; // inclusive
-		if (parallel_block != -1) { // block division
-			int width = (numAll - numDark + 1) / parallel_size;
-			blockstart = numDark + width * parallel_block;
-			blockend = numDark + width * (parallel_block + 1) - 1;
-			if (parallel_block == parallel_size - 1) { // last block
-				blockend = numAll - 1;
-			}
-		}
+		// Block division (the whole run unless sharded)
+		long first, end;
+		cheetahRunShardRange(&cheetahGlobal, numAll - numDark, &first, &end);
+		int blockstart = numDark + first, blockend = numDark + end - 1; // inclusive
 		printf("parallel: start %d end %d blockstart %d blockend %d\n", tagAll[0], tagAll[numAll - 1], tagAll[blockstart], tagAll[blockend]);
 		for (int i = blockstart; i <= blockend; i++) {
 			tagList.push_back(tagAll[i]);
@@ -360,9 +374,8 @@ int main(int argc, char *argv[]) {
 				continue;
 			}
  
-			parallel_cnt++; // TODO: refactor and merge above, use block parallelization
-			if (parallel_block == -1 || // no parallelization
-				parallel_cnt % parallel_size == parallel_block) {
+			// The list may be in any order, so share it out round robin
+			if (cheetahRunShardOwnsEvent(&cheetahGlobal, parallel_cnt++)) {
 				tagList.push_back(i);
 			}
 		}
@@ -604,22 +617,9 @@ int main(int argc, char *argv[]) {
 		eventData->pGlobal = &cheetahGlobal;
 		eventData->fiducial = tagID; // must be unique
 		
+		// Float raw data, no rounding or clipping to uint16 (copied, the buffer is refilled for the next tag)
 		int detID = 0;
-		long pix_nn = cheetahGlobal.detector[detID].pix_nn;
-
-//        int underflow = 0, overflow = 0;
-		for(long ii = 0; ii < pix_nn; ii++) {
-			long tmp = lrint(buffer[ii]);
-			if (tmp < 0) {
-//				underflow++; printf("%ld ", tmp);
-				tmp = 0; 
-			} else if (tmp > USHRT_MAX) {
-//				overflow++;
-				tmp = USHRT_MAX; 
-			}
-			eventData->detector[detID].data_raw16[ii] = (uint16_t)tmp;
-		}
-//		printf("#underflow = %d, #overflow = %d\n", underflow, overflow);
+		cheetahSetRawData(eventData, detID, RAW_TYPE_FLOAT, buffer);
 		
 		cheetahProcessEventMultithreaded(&cheetahGlobal, eventData);
 	}
@@ -31,14 +31,33 @@ int main(int argc, const char * argv[])
 	char	filename[1024];
 	char	cheetahini[1024];
 
-	if (argc != 3) {
-		printf("Usage: %s input.h5 setting.ini\n", argv[0]);
+	// Image buffers shared by events read ahead and events Cheetah is still working on
+	// (0: four more than Cheetah has worker threads), and I/O threads reading them (0: read on the main thread)
+	long	prefetchDepth = 0;
+	long	prefetchThreads = 2;
+
+	// Part i of N of each run (see cheetahRunShardRange), for splitting a run between jobs
+	long	runShard = 0;
+	long	nRunShards = 1;
+
+	if (argc < 3 || argc > 6) {
+		printf("Usage: %s input.h5 setting.ini [prefetch depth] [I/O threads] [shard i/N]\n", argv[0]);
 		return -1;
 	}
 
 	// Take configuration from command line arguments
 	strcpy(filename,argv[1]);
 	strcpy(cheetahini,argv[2]);
+	if (argc > 3)
+		prefetchDepth = atol(argv[3]);
+	if (argc > 4)
+		prefetchThreads = atol(argv[4]);
+	if (argc > 5) {
+		if (sscanf(argv[5], "%ld/%ld", &runShard, &nRunShards) != 2 || nRunShards < 1 || runShard < 0 || runShard >= nRunShards) {
+			printf("Shard must be given as i/N with 0 <= i < N: %s\n", argv[5]);
+			return -1;
+		}
+	}
     
     // Also for testing
     printf("Program name: %s\n",argv[0]);
@@ -57,7 +76,11 @@ int main(int argc, const char * argv[])
 	time(&startT);
     strcpy(cheetahGlobal.configFile, cheetahini);
 	strncpy(cheetahGlobal.cxiFilename, "output.h5", MAX_FILENAME_LENGTH);
+	cheetahGlobal.nRunShards = nRunShards;
+	cheetahGlobal.runShard = runShard;
 	cheetahInit(&cheetahGlobal);
+	if (prefetchDepth <= 0)
+		prefetchDepth = cheetahGlobal.nThreads + 4;
     
     /*
 	 *	Open SACLA HDF5 file
@@ -67,7 +90,8 @@ int main(int argc, const char * argv[])
     SACLA_HDF5_ReadHeader(filename, &SACLA_header);
     
     /*
-     * Create a buffer for holding the detector image data from all 8 panels
+     * Image buffers for holding the detector image data from all 8 panels,
+     * filled ahead of processing by the prefetch I/O threads
      */
     long    fs_one = 512;
     long    ss_one = 1024;
@@ -75,7 +99,11 @@ int main(int argc, const char * argv[])
     long    fs = fs_one;
     long    ss = 8*ss_one;
     long    nn = fs*ss;
-    float   *buffer = (float*) calloc(nn, sizeof(float));
+    SACLA_prefetch_t prefetch = {};
+    if (cheetahGlobal.detector[0].pix_nn > nn) {
+        printf("Error: detector 0 has %li pixels, SACLA images only %li\n", cheetahGlobal.detector[0].pix_nn, nn);
+        exit(1);
+    }
     hsize_t dims[2];
     dims[0] = ss;
     dims[1] = fs;
@@ -89,8 +117,11 @@ int main(int argc, const char * argv[])
         SACLA_HDF5_Read2dDetectorFields(&SACLA_header, runID);
         SACLA_HDF5_ReadRunInfo(&SACLA_header, runID);
         
-        // Loop through all events found in this run
-        for(long eventID=0; eventID<SACLA_header.nevents; eventID++) {
+        // Loop through the events of this run (all of them unless the run is split between jobs)
+        long firstEvent, endEvent;
+        cheetahRunShardRange(&cheetahGlobal, SACLA_header.nevents, &firstEvent, &endEvent);
+        SACLA_HDF5_PrefetchStart(&prefetch, &SACLA_header, runID, firstEvent, endEvent, nn, nn_one, prefetchDepth, prefetchThreads);
+        for(long eventID=firstEvent; eventID<endEvent; eventID++) {
             int tagID = atoi(SACLA_header.event_name[eventID] + 4); // "tag_######"
             printf("Processing event: tag = %d energy = %f eV\n", tagID, SACLA_header.actual_photon_energy_in_eV[eventID]);
 			frameNumber++;
@@ -111,9 +142,11 @@ int main(int argc, const char * argv[])
 			}
             
 			/*
-			 *	SACLA: Read next image
+			 *	SACLA: Next image (read and gain-corrected by the prefetch stage)
 			 */
-            if (SACLA_HDF5_ReadImageRaw(&SACLA_header, runID, eventID, buffer, nn_one) < 0) {
+            SACLA_prefetch_slot_t *image = SACLA_HDF5_PrefetchNext(&prefetch, eventID);
+            if (image->status < 0) {
+                SACLA_HDF5_PrefetchRelease(image);
 				continue;
 			}
 			
@@ -140,15 +173,11 @@ int main(int argc, const char * argv[])
             
             
             /*
-             *  Cheetah: Copy image data into
-             *  Raw data is currently hard-coded as UINT16_t, SACLA provides as float, so we have to loose precision :-(
+             *  Cheetah: Hand over the image buffer as float raw data, without copying or rounding it to uint16
+             *  (the buffer goes back to the prefetch pool when Cheetah is done with this event)
              */
             long    detID = 0;
-            long    pix_nn = cheetahGlobal.detector[detID].pix_nn;
-            
-            for(long ii=0; ii<pix_nn; ii++) {
-                eventData->detector[detID].data_raw16[ii] = (uint16_t) lrint(buffer[ii]);
-            }
+            cheetahAdoptRawData(eventData, detID, RAW_TYPE_FLOAT, image->buffer, SACLA_HDF5_PrefetchRelease, image);
             
 			/*
 			 *	Cheetah: Process this event
@@ -165,12 +194,16 @@ int main(int argc, const char * argv[])
 			  sprintf(outfile,"/data/scratch/sacla/%s.h5", SACLA_header.event_name[eventID]);
 			  printf("Writing to temporary file: %s\n",outfile);
 			  outfile_id = H5Fcreate(outfile,  H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
-			  H5LTmake_dataset_float(outfile_id, "data", 2, dims, buffer );
+			  H5LTmake_dataset_float(outfile_id, "data", 2, dims, image->buffer );
 			  H5Fclose(outfile_id);
 			*/
             
         }
+        
+        // Wait for the buffers of this run to come back from Cheetah before reusing them for the next one
+        SACLA_HDF5_PrefetchStop(&prefetch);
     }
+    SACLA_HDF5_PrefetchFree(&prefetch);
     
 	
 	// Clean up stale IDs and exit
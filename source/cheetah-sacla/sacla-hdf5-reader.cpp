@@ -12,11 +12,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 
 #include "sacla-hdf5-reader.h"
 
 
+/*
+ *  HDF5 calls of the prefetch I/O threads go through this lock:
+ *  the library need not be built thread-safe (and if it is, it serialises calls anyway)
+ */
+static pthread_mutex_t SACLA_h5_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
 /*
  *  Function for parsing SACLA HDF5 metadata
  */
@@ -246,11 +254,14 @@ int SACLA_HDF5_ReadImageRaw(SACLA_h5_info_t *header, long runID, long eventID, f
     printf("Reading event: %s\n",header->event_name[eventID]);
 
     for(long moduleID=0; moduleID < header->ndetectors; moduleID++) {
+        pthread_mutex_lock(&SACLA_h5_lock);
+
         // Open the run group
         sprintf(h5group, "%s/%s/%s",header->run_string[runID],header->detector_name[moduleID], header->event_name[eventID]);
         group = H5Gopen(header->file_id, h5group, NULL);
 		if (group < 0) {
 			printf("%s : H5Gopen failed\n",h5group);
+			pthread_mutex_unlock(&SACLA_h5_lock);
 			return -1;
 		}
                 
@@ -264,18 +275,20 @@ int SACLA_HDF5_ReadImageRaw(SACLA_h5_info_t *header, long runID, long eventID, f
 		if(herr!=1) {
             printf("%s/%s : H5LTfind_dataset=false\n",h5group, h5field);
             H5Gclose(group);
+            pthread_mutex_unlock(&SACLA_h5_lock);
             return -1;
 		}
 		          
         // Read the data set
         herr = H5LTread_dataset_float(group, h5field, buffer + offset * moduleID);
+        H5Gclose(group);
+        pthread_mutex_unlock(&SACLA_h5_lock);
 		if (herr < 0) {
             printf("%s/%s : H5LTread_dataset=false\n",h5group, h5field);
-            H5Gclose(group);
             return -1;
 		}
 
-		// Correct gains
+		// Correct gains (outside the HDF5 lock, so that other I/O threads can read meanwhile)
 		float gain = header->detector_gain[moduleID] / header->detector_gain[0];
 
 		// Keitaro's 0.1 photon discretization. Comment out to disable.
@@ -284,7 +297,6 @@ int SACLA_HDF5_ReadImageRaw(SACLA_h5_info_t *header, long runID, long eventID, f
 		for (int i = 0; i < offset; i++) {
 			buffer[offset * moduleID + i] *= gain;
 		}
-        H5Gclose(group);
 
 		// DEBUG: mark origin
 		if (false) {
@@ -299,6 +311,213 @@ int SACLA_HDF5_ReadImageRaw(SACLA_h5_info_t *header, long runID, long eventID, f
     return 1;
 }
 
+/*
+ *  The k-th event to read
+ */
+static long SACLA_HDF5_PrefetchEvent(SACLA_prefetch_t *pf, long k) {
+    if(pf->queue)
+        return pf->queued[k % pf->depth];
+    return pf->first + k;
+}
+
+/*
+ *  I/O thread: claim the next event once its buffer is free, read it, mark the buffer ready
+ *  (with queued events, wait for the next one to be queued until the queue is closed)
+ */
+static void *SACLA_HDF5_PrefetchThread(void *arg) {
+    SACLA_prefetch_t *pf = (SACLA_prefetch_t *) arg;
+    
+    pthread_mutex_lock(&pf->lock);
+    while(1) {
+        while(!pf->stop && ((pf->next_read < pf->end_read) ? pf->slot[pf->next_read % pf->depth].busy : pf->open))
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        if(pf->stop || pf->next_read >= pf->end_read)
+            break;
+        SACLA_prefetch_slot_t *slot = &pf->slot[pf->next_read % pf->depth];
+        slot->eventID = SACLA_HDF5_PrefetchEvent(pf, pf->next_read++);
+        slot->busy = 1;
+        slot->ready = 0;
+        pthread_mutex_unlock(&pf->lock);
+        
+        int status = SACLA_HDF5_ReadImageRaw(pf->header, pf->runID, slot->eventID, slot->buffer, pf->module_nn);
+        
+        pthread_mutex_lock(&pf->lock);
+        slot->status = status;
+        slot->ready = 1;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+/*
+ *  Start reading ahead through events first to end-1 of run runID into <depth> buffers of buffer_nn pixels
+ *  (queue: the events are queued by SACLA_HDF5_PrefetchQueue instead).
+ *  The buffers are kept from one run to the next.
+ */
+static void SACLA_HDF5_PrefetchInit(SACLA_prefetch_t *pf, SACLA_h5_info_t *header, long runID, long first, long end, int queue, long buffer_nn, long module_nn, long depth, long nthreads) {
+    
+    if(nthreads < 0)
+        nthreads = 0;
+    if(depth < 1)
+        depth = 1;
+    if(nthreads > depth)
+        nthreads = depth;
+    
+    // Buffer pool
+    if(depth > pf->nallocated || buffer_nn != pf->buffer_nn) {
+        SACLA_HDF5_PrefetchFree(pf);
+        pf->slot = (SACLA_prefetch_slot_t*) calloc(depth, sizeof(SACLA_prefetch_slot_t));
+        for(long i=0; i<depth; i++)
+            pf->slot[i].buffer = (float*) calloc(buffer_nn, sizeof(float));
+        pf->queued = (long*) calloc(depth, sizeof(long));
+        pf->nallocated = depth;
+    }
+    for(long i=0; i<depth; i++) {
+        pf->slot[i].pf = pf;
+        pf->slot[i].index = i;
+        pf->slot[i].busy = 0;
+        pf->slot[i].ready = 0;
+    }
+    
+    pf->header = header;
+    pf->runID = runID;
+    pf->buffer_nn = buffer_nn;
+    pf->module_nn = module_nn;
+    pf->depth = depth;
+    pf->first = first;
+    pf->queue = queue;
+    pf->open = queue;
+    pf->next_read = 0;
+    pf->end_read = queue ? 0 : end-first;
+    pf->next_out = 0;
+    pf->nheld = 0;
+    pf->stop = 0;
+    
+    // I/O threads
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    pf->threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+    long started = 0;
+    for(long i=0; i<nthreads; i++) {
+        if(pthread_create(&pf->threads[started], NULL, SACLA_HDF5_PrefetchThread, (void*) pf) == 0)
+            started++;
+        else
+            printf("Could not start prefetch thread %li\n", i);
+    }
+    pf->nthreads = started;
+    printf("Reading ahead into %li buffers with %li I/O threads\n", pf->depth, pf->nthreads);
+}
+
+void SACLA_HDF5_PrefetchStart(SACLA_prefetch_t *pf, SACLA_h5_info_t *header, long runID, long first, long end, long buffer_nn, long module_nn, long depth, long nthreads) {
+    SACLA_HDF5_PrefetchInit(pf, header, runID, first, end, 0, buffer_nn, module_nn, depth, nthreads);
+}
+
+void SACLA_HDF5_PrefetchStartQueued(SACLA_prefetch_t *pf, SACLA_h5_info_t *header, long runID, long buffer_nn, long module_nn, long depth, long nthreads) {
+    SACLA_HDF5_PrefetchInit(pf, header, runID, 0, 0, 1, buffer_nn, module_nn, depth, nthreads);
+}
+
+/*
+ *  Queue eventID as the next event to read
+ *  The caller keeps at most pf->depth events queued that SACLA_HDF5_PrefetchNext has not handed out yet.
+ */
+void SACLA_HDF5_PrefetchQueue(SACLA_prefetch_t *pf, long eventID) {
+    pthread_mutex_lock(&pf->lock);
+    if(pf->end_read - pf->next_out >= pf->depth) {
+        printf("Error: more than %li events queued ahead of the prefetch\n", pf->depth);
+        exit(1);
+    }
+    pf->queued[pf->end_read % pf->depth] = eventID;
+    pf->end_read++;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ *  No more events will be queued (the I/O threads finish once the queued ones are read)
+ */
+void SACLA_HDF5_PrefetchQueueEnd(SACLA_prefetch_t *pf) {
+    pthread_mutex_lock(&pf->lock);
+    pf->open = 0;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ *  Wait for event eventID (the next one in order) and return its buffer, with the status of the read.
+ *  Without I/O threads the event is read here.
+ */
+SACLA_prefetch_slot_t *SACLA_HDF5_PrefetchNext(SACLA_prefetch_t *pf, long eventID) {
+    pthread_mutex_lock(&pf->lock);
+    SACLA_prefetch_slot_t *slot = &pf->slot[pf->next_out % pf->depth];
+    pf->next_out++;
+    if(pf->nthreads == 0) {
+        while(slot->busy)
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        slot->eventID = eventID;
+        slot->busy = 1;
+        pthread_mutex_unlock(&pf->lock);
+        slot->status = SACLA_HDF5_ReadImageRaw(pf->header, pf->runID, eventID, slot->buffer, pf->module_nn);
+        pthread_mutex_lock(&pf->lock);
+        slot->ready = 1;
+    }
+    while(!(slot->ready && slot->eventID == eventID))
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    pf->nheld++;
+    pthread_mutex_unlock(&pf->lock);
+    return slot;
+}
+
+/*
+ *  Done with a buffer returned by SACLA_HDF5_PrefetchNext: it may be refilled
+ *  (void* so that it can be Cheetah's release function for an adopted buffer; safe from any thread)
+ */
+void SACLA_HDF5_PrefetchRelease(void *arg) {
+    SACLA_prefetch_slot_t *slot = (SACLA_prefetch_slot_t *) arg;
+    SACLA_prefetch_t *pf = slot->pf;
+    
+    pthread_mutex_lock(&pf->lock);
+    slot->busy = 0;
+    slot->ready = 0;
+    pf->nheld--;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ *  Stop reading ahead (at the end of a run): wait for the I/O threads and for all buffers handed out to come back
+ */
+void SACLA_HDF5_PrefetchStop(SACLA_prefetch_t *pf) {
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    
+    for(long i=0; i<pf->nthreads; i++)
+        pthread_join(pf->threads[i], NULL);
+    free(pf->threads);
+    pf->threads = NULL;
+    pf->nthreads = 0;
+    
+    pthread_mutex_lock(&pf->lock);
+    while(pf->nheld > 0)
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+}
+
+void SACLA_HDF5_PrefetchFree(SACLA_prefetch_t *pf) {
+    for(long i=0; i<pf->nallocated; i++)
+        free(pf->slot[i].buffer);
+    free(pf->slot);
+    free(pf->queued);
+    pf->slot = NULL;
+    pf->queued = NULL;
+    pf->nallocated = 0;
+}
+
+
 /*
  *  Cleanup stale HDF5 references and close the file
  */
@@ -10,6 +10,7 @@
 #define __cheetah_ab__sacla_hdf5_reader__
 
 #include <iostream>
+#include <pthread.h>
 #include <hdf5.h>
 #include <hdf5_hl.h>
 //#include <stdlib.h>
@@ -47,6 +48,51 @@ typedef struct {
     
 } SACLA_h5_info_t;
 
+/*
+ *  Read-ahead of the events of one run: I/O threads read (and gain-correct) the next events
+ *  into a pool of <depth> image buffers while the main thread hands earlier ones to Cheetah.
+ *  The events are a range (SACLA_HDF5_PrefetchStart) or a list the caller queues as it goes
+ *  (SACLA_HDF5_PrefetchStartQueued, at most <depth> events ahead of SACLA_HDF5_PrefetchNext).
+ *  The k-th event goes into buffer k % depth once that buffer has been released, so events come out in order.
+ *  A buffer stays with its event until released, which may be after Cheetah is done with it
+ *  (SACLA_HDF5_PrefetchRelease can be passed to cheetahAdoptRawData).
+ */
+typedef struct SACLA_prefetch SACLA_prefetch_t;
+
+typedef struct {
+    SACLA_prefetch_t *pf;
+    long    index;
+    long    eventID;            // Event in this buffer
+    int     busy;               // Claimed for eventID and not released yet
+    int     ready;              // eventID has been read into it
+    int     status;             // Return value of SACLA_HDF5_ReadImageRaw for that event
+    float   *buffer;
+} SACLA_prefetch_slot_t;
+
+struct SACLA_prefetch {
+    SACLA_h5_info_t *header;
+    long    runID;
+    long    module_nn;          // Pixels per module
+    long    buffer_nn;          // Pixels per image buffer
+    long    depth;              // Number of pooled image buffers
+    long    nthreads;           // I/O threads (0: read in SACLA_HDF5_PrefetchNext instead)
+    long    nallocated;
+    SACLA_prefetch_slot_t *slot;
+    long    first;              // Range: the k-th event is first+k
+    long    *queued;            // Queued: the k-th event is queued[k % depth]
+    int     queue;              // Events are queued rather than a range
+    int     open;               // More events may still be queued
+    long    next_read;          // Next event (k) to be claimed by an I/O thread
+    long    end_read;           // Events (k) known so far
+    long    next_out;           // Next event (k) to be handed out by SACLA_HDF5_PrefetchNext
+    long    nheld;              // Buffers handed out and not released yet
+    int     stop;
+    pthread_t   *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+};
+
+
 /*
  *  Prototypes for functions written to read SACLA HDF5 data
  */
@@ -56,4 +102,13 @@ int SACLA_HDF5_ReadRunInfo(SACLA_h5_info_t*, long);
 int SACLA_HDF5_ReadImageRaw(SACLA_h5_info_t*, long, long, float*, long);
 int SACLA_HDF5_cleanup(SACLA_h5_info_t*);
 
+void SACLA_HDF5_PrefetchStart(SACLA_prefetch_t*, SACLA_h5_info_t*, long, long, long, long, long, long, long);
+void SACLA_HDF5_PrefetchStartQueued(SACLA_prefetch_t*, SACLA_h5_info_t*, long, long, long, long, long);
+void SACLA_HDF5_PrefetchQueue(SACLA_prefetch_t*, long);
+void SACLA_HDF5_PrefetchQueueEnd(SACLA_prefetch_t*);
+SACLA_prefetch_slot_t *SACLA_HDF5_PrefetchNext(SACLA_prefetch_t*, long);
+void SACLA_HDF5_PrefetchRelease(void*);
+void SACLA_HDF5_PrefetchStop(SACLA_prefetch_t*);
+void SACLA_HDF5_PrefetchFree(SACLA_prefetch_t*);
+
 #endif /* defined(__cheetah_ab__sacla_hdf5_reader__) */
@@ -86,6 +86,7 @@ namespace cheetah_ana_pkg {
 				usleep(500000);
 			}
 			printf("Attempting to close CXIs cleanly\n");
+			mergePowderShards(&cheetahGlobal);
 			writeAccumulatedCXI(&cheetahGlobal);
 			closeCXIFiles(&cheetahGlobal);
 			signal(SIGINT,SIG_DFL);
@@ -423,6 +424,7 @@ namespace cheetah_ana_pkg {
 		
 		if(cheetahGlobal.saveCXI) {
 			printf("Writing accumulated CXIDB file\n");
+			mergePowderShards(&cheetahGlobal);
 			writeAccumulatedCXI(&cheetahGlobal);
 			closeCXIFiles(&cheetahGlobal);
 		}
@@ -0,0 +1,35 @@
+//
+//  assemble2DImage.h
+//  cheetah
+//
+//  Assembly of raw detector data into the 2D image as a precomputed gather
+//
+
+#ifndef cheetah_assemble2DImage_h
+#define cheetah_assemble2DImage_h
+
+
+/*
+ *	Sparse matrix mapping raw pixels onto the assembled image, one row per image pixel (CSR).
+ *	Image pixel j is the sum of weight[k]*data[pixel[k]] for k = rowStart[j] .. rowStart[j+1]-1.
+ *	Linear interpolation: every raw pixel overlapping j (in increasing order, including those
+ *	with zero overlap, so masks are united over them) with weights divided by their total,
+ *	or all zero where the total is below 0.05.
+ *	Nearest neighbour: at most one entry, the last raw pixel rounding onto j, with weight 1.
+ *	Image pixels without entries are missing.
+ */
+typedef struct {
+	int		interpolation;		// ASSEMBLE_INTERPOLATION_LINEAR or ASSEMBLE_INTERPOLATION_NEAREST
+	long	pix_nn;
+	long	image_nn;
+	long	nEntries;
+	long	*rowStart;			// image_nn+1
+	int		*pixel;
+	float	*weight;
+} tAssemblyMatrix;
+
+
+void buildAssemblyMatrix(tAssemblyMatrix *matrix, float *pix_x, float *pix_y, long pix_nn, long image_nx, long image_nn, int assembleInterpolation);
+void freeAssemblyMatrix(tAssemblyMatrix *matrix);
+
+#endif
@@ -17,10 +17,16 @@
 
 int cheetahInit(cGlobal *);
 void cheetahNewRun(cGlobal *);
+void cheetahWaitForWorkers(cGlobal *);
+void cheetahSaveInterval(cGlobal *);
+int cheetahRunShardOwnsEvent(cGlobal *, long);
+void cheetahRunShardRange(cGlobal *, long, long *, long *);
 cEventData* cheetahNewEvent(cGlobal	*global);
 void cheetahProcessEvent(cGlobal *, cEventData *);
 void cheetahProcessEventMultithreaded(cGlobal *, cEventData *);
 void cheetahDestroyEvent(cEventData *);
+void cheetahSetRawData(cEventData *, long, int, void *);
+void cheetahAdoptRawData(cEventData *, long, int, void *, void (*)(void *), void *);
 void cheetahExit(cGlobal *);
 void cheetahUpdateGlobal(cGlobal *, cEventData *);
 #endif
@@ -20,6 +20,20 @@
 //typedef tPeakList;
 
 
+/*
+ *	One frame of an event compressed by the worker into a CXI chunk
+ *	(already in the file datatype, shuffled and deflated, see compressCXIFrames in saveCXI.cpp)
+ */
+typedef struct {
+	const void	*source;		// Event array the frame was compressed from
+	long		nn;				// Elements in the frame
+	size_t		elementSize;	// Bytes per element in the file
+	char		*buffer;		// Compressed chunk
+	size_t		size;			// Bytes used in buffer
+	size_t		capacity;		// Bytes allocated for buffer (kept when the event is recycled)
+} tCXIChunk;
+
+
 /*
  *	Structure used for passing information to worker threads
  */
@@ -35,6 +49,11 @@ public:
 	long        frameNum;
 	uint stackSlice;
 	bool writeFlag;
+	// Set when the event is to be passed on to the CXI writer thread once the worker is done
+	bool cxiWritePending;
+	// Frames compressed for direct chunk writes to the CXI file (the first nCXIChunks are in use)
+	std::vector<tCXIChunk> cxiChunks;
+	long nCXIChunks;
 	
 	// Detector data
 	cPixelDetectorEvent		detector[MAX_DETECTORS];
@@ -144,9 +163,18 @@ public:
 	double		phaseCavityCharge1;
 	double		phaseCavityCharge2;
 	
-	// Thread management
+	// Thread management (threadID: index of the pool worker running this event)
 	int	threadID;
 	int     useThreads;
+
+	// Event pool management (see eventPool.cpp)
+	long    poolGeneration;
+
+	// Order in which the event was queued for the workers, whether it has had its turn at its powder shard,
+	// and whether it came to the powder before its turn (and is added in its turn instead, see powder.cpp)
+	long    powderSequence;
+	bool    powderTurnDone;
+	bool    powderAddPending;
 	
 } ;
 
@@ -19,12 +19,27 @@
 #include "tofDetector.h"
 #include "peakDetect.h"
 #include "processRateMonitor.h"
+#include "workerPool.h"
+#include "cxiWriter.h"
 #define MAX_POWDER_CLASSES 16
 #define MAX_DETECTORS 2
 #define MAX_FILENAME_LENGTH 1024
 #define MAX_EPICS_PVS 100
 #define MAX_EPICS_PV_NAME_LENGTH 512
 
+// Stages of the detector correction chain timed with profilerDiagnostics
+#define CORRECTION_STAGE_RAW 0
+#define CORRECTION_STAGE_SATURATION 1
+#define CORRECTION_STAGE_DARKCAL 2
+#define CORRECTION_STAGE_COMMON_MODE 3
+#define CORRECTION_STAGE_GAIN 4
+#define CORRECTION_STAGE_BAD_PIXELS 5
+#define CORRECTION_STAGE_GEOMETRY 6
+#define CORRECTION_STAGE_FUSED_OFFSET 7
+#define CORRECTION_STAGE_FUSED_GAIN 8
+#define N_CORRECTION_STAGES 9
+#include "eventPool.h"
+
 /** @brief Global variables.
  *
  * Configuration parameters, and things that don't change often.
@@ -99,6 +114,8 @@ public:
 	long     hitfinderDetIndex;
 	/** @brief Specify the hitfinder algorithm. */
 	int      hitfinderAlgorithm;
+	/** @brief How peakfinders 3 and 8 collect the pixels of each peak (PEAK_SEARCH_REGION_GROWING or PEAK_SEARCH_UNION_FIND). */
+	int      hitfinderPeakSearch;
 	/** @brief Intensity threshold for hitfinder algorithm. */
 	float      hitfinderADC;
 	/** @brief What's this? */
@@ -295,6 +312,19 @@ public:
 	    The default is 1.
 	 */
 	int cxiFlushPeriod;
+	/** @brief Hand hits to a dedicated CXI writer thread instead of writing them from the workers. */
+	int cxiWriterThread;
+	/** @brief Number of hits that may wait for the CXI writer before the workers block (0: nThreads). */
+	long cxiWriterQueueDepth;
+	/** @brief Frames buffered per CXI dataset and written with one H5Dwrite (only with cxiWriterThread).
+	    Slabs are capped at one 2D chunk (16 MB), so full detector images are still written frame by frame.
+	 */
+	int cxiSlabFrames;
+	/** @brief Deflate level (1-9) for the CXI image stacks, 0 leaves them uncompressed.
+	    Stacks are then stored one frame per chunk (shuffle + deflate); with cxiWriterThread the workers
+	    compress the frames and the writer only hands the finished chunks to HDF5.
+	 */
+	int cxiCompression;
 
 	/** @brief  Only one thread during calibration */
 	int useSingleThreadCalibration;
@@ -308,10 +338,24 @@ public:
 	char     cleanedfile[MAX_FILENAME_LENGTH];
 	char     peaksfile[MAX_FILENAME_LENGTH];
 
+	/** @brief Number of independent jobs the run is split into (see cheetahRunShardRange). Output files of each get a -shard<i> suffix, to be combined by cheetah-merge. */
+	long     nRunShards;
+	/** @brief Which of the nRunShards parts of the run this job processes (0 to nRunShards-1). */
+	long     runShard;
+	/** @brief Set by front ends that run the parts of a run side by side (MPI): called on every part, with the workers idle and the powder shards merged, just before running sums are saved. It adds the running sums and counters of all parts into part 0, which then saves them under the whole-run names; the other parts save none. The front end then also calls cheetahSaveInterval on all parts every saveInterval events of the run (the workers do not). NULL: each part saves its own. */
+	void     (*reduceRunShards)(cGlobal *);
+
 	int      ioSpeedTest;
 	
 	/** @brief Time different sections of the code. */
 	bool     profilerDiagnostics;
+	/** @brief Seconds spent in each detector correction stage (CORRECTION_STAGE_*), summed over correctionTimedFrames frames. */
+	double   correctionStageSeconds[N_CORRECTION_STAGES];
+	long     correctionTimedFrames;
+	pthread_mutex_t  correctionTiming_mutex;
+
+	/** @brief Apply darkcal, gain, bad pixel mask and geometric corrections in one blocked pass instead of one sweep each. */
+	int      fusedDetectorCorrection;
 
 	/*
 	 *	Stuff used for managing the program execution
@@ -338,16 +382,42 @@ public:
 	// Thread management
 	int      useHelperThreads;
 	long     nThreads;
+	/** @brief Number of events that may wait for a free worker before cheetahProcessEvent() blocks (0: nThreads). */
+	long     workerQueueDepth;
+	/** @brief Number of recycled events kept by cheetahDestroyEvent() (-1: enough for all events in flight, 0: no recycling). */
+	long     eventPoolSize;
+	/** @brief Allocate assembled, downsampled and radial average event buffers when first materialized rather than up front. */
+	int      lazyImageBuffers;
+	/** @brief Number of events handed to the worker pool and not yet finished. */
 	long     nActiveCheetahThreads;
 	long     threadCounter;
 	long     threadPurge;
 	int      threadTimeoutInSeconds;
 	int      threadSafetyLevel;
+	/** @brief Threads used to recalculate frame buffer statistics (mean, std, hot pixel counts). */
+	long     frameBufferThreads;
+	/** @brief Threads each worker uses within one frame for peakfinder8: per-radius noise statistics and the peak search, split by ASIC (1: none beyond the worker itself). */
+	long     peakfinderThreads;
+	/** @brief Threads each worker uses within one frame for the CSPAD per-ASIC common mode (cmModule), split by ASIC (1: none beyond the worker itself). */
+	long     commonModeThreads;
+	/** @brief Number of powder accumulators shared out between the workers (-1: one per worker thread, 0: sum straight into the shared powder under its mutex). Each shard can hold a full copy of the summed powder arrays. */
+	long     powderShards;
+	/** @brief Events are numbered in the order they are queued for the workers (by the worker pool; here in single-threaded mode),
+	    and each powder shard adds its events (powderSequence % powderShards) in that order, so the powder sums do not depend
+	    on thread scheduling. Events done before their turn are parked rather than waited for (see powder.cpp). */
+	long     powderSequence;
+	long     nPowderTurns;
+	long     *powderTurn;
+	std::vector<cEventData*> powderTurnParked;
+	pthread_mutex_t  powderTurn_mutex;
 
 	// Number of threads in cheetah_ana_mod
 	int      anaModThreads;
 
 	pthread_t  *threadID;
+	cWorkerPool  *workerPool;
+	cCXIWriter  *cxiWriter;
+	cEventPool  *eventPool;
 	pthread_mutex_t  hitclass_mutex;
 	pthread_mutex_t  process_mutex;
 	pthread_mutex_t  nActiveThreads_mutex;
@@ -365,7 +435,6 @@ public:
 	//pthread_mutex_t  hitVector_mutex;
 	pthread_mutex_t  gmd_mutex;
 	pthread_mutex_t  swmr_mutex;
-	sem_t availableCheetahThreads;
 
 	/*
 	 *	Common variables
@@ -477,6 +546,10 @@ public:
     void writeStatus(const char *);
 	void writeFinalLog(void);
 	void writeConfigurationLog(void);
+	void addRunShardSuffix(char *);
+	void addRunShardSumSuffix(char *);
+	bool savesRunningSums(void);
+	bool keepsRunShardSums(void);
 	void unlockMutexes(void);
 	void freeMemory();
 	
@@ -13,6 +13,7 @@
  *	Function prototypes
  */
 void *worker(void *);
+void releaseEvent(cEventData*, cGlobal*);
 
 // detectorCorrection.cpp
 void initDetectorCorrection(cEventData *eventData, cGlobal *global);
@@ -20,8 +21,7 @@ void initRaw(cEventData *eventData, cGlobal *global);
 void initPixelmask(cEventData *eventData, cGlobal *global);
 void subtractDarkcal(cEventData*, cGlobal*);
 void applyGainCorrection(cEventData*, cGlobal*);
-void applyPolarizationCorrection(cEventData*, cGlobal*);
-void applySolidAngleCorrection(cEventData*, cGlobal*);
+void applyGeometricCorrection(cEventData*, cGlobal*);
 void setBadPixelsToZero(cEventData*, cGlobal*);
 void cspadModuleSubtract(cEventData*, cGlobal*);
 void cspadModuleSubtract2(cEventData*, cGlobal*);
@@ -30,6 +30,12 @@ void cspadSubtractUnbondedPixels(cEventData*, cGlobal*);
 void cspadSubtractBehindWires(cEventData*, cGlobal*);
 void updateHotPixelBuffer(cEventData*, cGlobal*);
 void setHotPixelsToZero(cEventData*, cGlobal*);
+void applyDetectorOffsetCorrections(cEventData*, cGlobal*);
+void applyDetectorGainCorrections(cEventData*, cGlobal*);
+double correctionTimer();
+void correctionTimerLap(cGlobal*, double*, int, double*);
+void addCorrectionTiming(cGlobal*, double*);
+void printCorrectionTiming(cGlobal*);
 
 void subtractDarkcal(float*, float*, long);
 void applyGainCorrection(float*, float*, long);
@@ -38,7 +44,7 @@ void applyAzimuthallySymmetricSolidAngleCorrection(float*, float*, float*, float
 void applyRigorousSolidAngleCorrection(float*, float*, float*, float*, float, double, float, double, long);
 void setBadPixelsToZero(float*, uint16_t*, long);
 void cspadModuleSubtract(float*, uint16_t*, float, long, long, long, long);
-void cspadSubtractUnbondedPixels(float*, long, long, long, long);
+void cspadSubtractUnbondedPixels(float*, long, long, long, long, int);
 void cspadSubtractBehindWires(float*, uint16_t*, float, long, long, long, long);
 long calculateHotPixelMask(uint16_t*, int16_t*, long, long, long);
 
@@ -57,11 +63,16 @@ void initPhotonCorrection(cEventData *eventData, cGlobal *global);
 void subtractLocalBackground(cEventData*, cGlobal*);
 void subtractRadialBackground(cEventData*, cGlobal*);
 void checkSaturatedPixels(cEventData*, cGlobal*);
-void checkSaturatedPixels(uint16_t*, uint16_t*, long, long);
-void checkSaturatedPixelsPnccd(uint16_t*, uint16_t*);
+template <class T>
+void checkSaturatedPixels(T*, uint16_t*, long, long);
+template <class T>
+void checkSaturatedPixelsPnccd(T*, uint16_t*);
 void updateBackgroundBuffer(cEventData*, cGlobal*, int);
 void subtractPersistentBackground(cEventData*, cGlobal*);
 void subtractLocalBackground(float*, long, long, long, long, long);
+void subtractLocalBackground(float*, long, long, long, long, long, int, float);
+void subtractLocalBackground(float*, long, long, long, long, long, int, float, int);
+void subtractLocalBackground(float*, long, long, long, long, long, int, float, int, tLocalBackgroundWorkspace*);
 void subtractRadialBackground(float*, float*, char*, long, float);
 void subtractPersistentBackground(float*, float*, int, long);
 void updateNoisyPixelBuffer(cEventData*, cGlobal*,int);
@@ -83,19 +94,20 @@ void writeCXIHitstats(cEventData*, cGlobal*);
 void writeAccumulatedCXI(cGlobal*);
 void closeCXIFiles(cGlobal*);
 void flushCXIFiles(cGlobal*);
+void compressCXIFrames(cEventData*, cGlobal*);
 herr_t cheetahHDF5ErrorHandler(hid_t,void*);
 
 // assemble2DImage.cpp
 void assemble2D(cEventData*, cGlobal*);
 void assemble2DPowder(cGlobal*);
-void assemble2DImage(float*, float*, float*, float*, long, long, long, int);
-void assemble2DImage(int16_t*, float*, float*, float*, long, long, long, int);
-void assemble2DMask(uint16_t*, uint16_t*, float*, float*, long, long, long, int);
+void assemble2DImage(float*, float*, tAssemblyMatrix*);
+void assemble2DImage(double*, double*, tAssemblyMatrix*);
+void assemble2DMask(uint16_t*, uint16_t*, tAssemblyMatrix*);
 
 // modularDetector.cpp
 int moduleCornerIndex(int, int, int);
-void stackModulesMask(uint16_t*, uint16_t*, int, int, int, int);
-void stackModulesData(float*, float*, int, int, int, int);
+void stackModulesMask(uint16_t*, uint16_t*, int, int, int, int, int);
+void stackModulesData(float*, float*, int, int, int, int, int);
 void moduleIdentifier(char *, int, int); 
 void cornerPositions(float*, float*, float*, float*, float, int, int, int, int);
 void basisVectors(float*, float*, float*, float*, int, int, int, int);
@@ -116,9 +128,9 @@ void sortPowderClass(cEventData*, cGlobal*);
 
 // peakfinders.cpp
 int peakfinder(cGlobal*, cEventData*, int);
-int peakfinder3(tPeakList*, float*, char*, long, long, long, long, float, float, long, long, long);
-int peakfinder6(tPeakList*, float*, char*, long, long, long, long, float, float, long, long, long, float);
-int peakfinder8(tPeakList*, float*, char*, float*, long, long, long, long, float, float, long, long, long);
+int peakfinder3(tPeakList*, tPeakfinderWorkspace*, float*, char*, long, long, long, long, float, float, long, long, long);
+int peakfinder6(tPeakList*, tPeakfinderWorkspace*, float*, char*, long, long, long, long, float, float, long, long, long, float);
+int peakfinder8(tPeakList*, tPeakfinderWorkspace*, float*, char*, tRadialBinIndex*, long, long, long, long, float, float, long, long, long);
 int peakfinder8old(tPeakList*, float*, char*, float*, long, long, long, long, float, float, long, long, long);
 int killNearbyPeaks(tPeakList*, float );
 
@@ -145,6 +157,8 @@ void saveTimeToolStacks(cGlobal*);
 // powder.cpp
 void addToPowder(cEventData*, cGlobal*);
 void addToPowder(cEventData*, cGlobal*, int, long);
+bool finishPowderTurn(cEventData*, cGlobal*);
+void mergePowderShards(cGlobal*);
 void saveRunningSums(cGlobal*);
 void saveDarkcal(cGlobal*, int);
 void saveGaincal(cGlobal*, int);
@@ -153,14 +167,18 @@ void writePowderData(char*, void*, int, int, void*, void*, long, long, int);
 
 // histogram.cpp
 void addToHistogram(cEventData*, cGlobal*, int);
+void histogramBins(const float*, long, long, float, long, int32_t*);
+void flushHistogramShards(cGlobal*, int);
 void saveHistograms(cGlobal*);
 void saveHistogram(cGlobal*, int);
+void histogramStatistics(uint32_t*, long, long, float*, float*, float*, float*, float*, float*);
+void writeHistogramFile(const char*, uint32_t*, float*, long, long, long, long, float, long, int);
 void calculateHistogramScale(long histMin, long histNBins, float histBinSize, float * scaleTarget);
 
 // RadialAverage.cpp
 void calculateRadialAverage(cEventData*, cGlobal*);
 template <class T>
-void calculateRadialAverage(T *data2d, uint16_t *pixelmask2d, T *dataRadial, uint16_t *pixelmaskRadial, float * pix_r, long radial_nn, long pix_nn);
+void calculateRadialAverage(T *data2d, uint16_t *pixelmask2d, T *dataRadial, uint16_t *pixelmaskRadial, tRadialBinIndex *rbins, long radial_nn);
 void addToRadialAverageStack(cEventData*, cGlobal*);
 void addToRadialAverageStack(cEventData*, cGlobal*, int, int);
 void saveRadialAverageStack(cGlobal*, int, int);
@@ -184,5 +202,9 @@ void calculateGmd(cEventData *eventData);
 bool gmdBelowThreshold(cEventData *eventData, cGlobal *global);
 void updateAvgGmd(cEventData *eventData, cGlobal *global);
 
+// event.cpp
+cEventData* allocateEventData(cGlobal *global);
+void freeEventData(cEventData *eventData);
+
 // log.cpp
 void writeLog(cEventData * eventData, cGlobal * global);
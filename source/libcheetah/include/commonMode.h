@@ -0,0 +1,44 @@
+//
+//  commonMode.h
+//  cheetah
+//
+//  Per-ASIC common mode (k-th lowest pixel value of each ASIC) for cmModule
+//
+
+#ifndef cheetah_commonMode_h
+#define cheetah_commonMode_h
+
+#include <stdint.h>
+
+#include "threadTeam.h"
+
+// How the k-th lowest value of each ASIC is found (cmEstimator)
+#define CM_ESTIMATOR_SELECT 0			// Copy the good pixels and run kth_smallest on all of them
+#define CM_ESTIMATOR_HISTOGRAM 1		// 1 ADU histogram around a sampled estimate, kth_smallest only within the bin holding k
+
+// Histogram of CM_ESTIMATOR_HISTOGRAM: CM_HISTOGRAM_BINS bins of 1 ADU, plus one underflow and one overflow bin
+#define CM_HISTOGRAM_BINS 1024
+
+
+/*
+ *	Scratch of one worker: per thread an ASIC-sized value buffer and a histogram, and the helper threads.
+ *	Allocated on first use (see prepareCommonModeWorkspace), reused for every frame.
+ */
+typedef struct {
+	int		estimator;			// CM_ESTIMATOR_SELECT or CM_ESTIMATOR_HISTOGRAM
+	long	nThreads;			// Threads the ASICs are shared out over (1: none beyond the worker itself)
+	int		layout;				// DETECTOR_LAYOUT_* of the detector (see detectorLayout.h)
+	long	asic_nn;
+	long	nBuffers;
+	float	*buffer;			// nBuffers x asic_nn
+	int32_t	*histogram;			// nBuffers x 4 x (CM_HISTOGRAM_BINS+2)
+	tThreadTeam	team;			// Threads 1 .. nThreads-1 (kept from one frame to the next)
+} tCommonModeWorkspace;
+
+
+void prepareCommonModeWorkspace(tCommonModeWorkspace*, long, long);
+void freeCommonModeWorkspace(tCommonModeWorkspace*);
+float commonModeKthSmallest(float*, long, long, int, int32_t*);
+void cspadModuleSubtract(float*, uint16_t*, float, long, long, long, long, tCommonModeWorkspace*);
+
+#endif
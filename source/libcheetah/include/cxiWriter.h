@@ -0,0 +1,43 @@
+/*
+ *  cxiWriter.h
+ *  cheetah
+ */
+
+#ifndef CXIWRITER_H
+#define CXIWRITER_H
+
+#include <pthread.h>
+
+class cEventData;
+
+/*
+ *	Single thread that writes finished hits into the CXI files.
+ *	Workers hand their event over through a bounded queue instead of calling
+ *	writeCXI() themselves, so HDF5 never stalls the compute pool; the writer
+ *	frees the event as soon as its data has been copied into the per-dataset slabs.
+ */
+class cCXIWriter {
+ public:
+	cCXIWriter(long queueDepth0);
+	~cCXIWriter();
+	int push(cEventData *eventData);
+	void shutdown();
+	void lockWrites();
+	void unlockWrites();
+	long queueDepth;
+ private:
+	static void *writerLoop(void *threadarg);
+	cEventData *pop();
+	cEventData **queue;
+	long queueHead;
+	long queueCount;
+	bool stopping;
+	pthread_t thread;
+	pthread_mutex_t queue_mutex;
+	// Held while the writer writes an event (and its slabs)
+	pthread_mutex_t write_mutex;
+	pthread_cond_t queueNotEmpty;
+	pthread_cond_t queueNotFull;
+};
+
+#endif
@@ -39,6 +39,10 @@ class cDataVersion {
 	double * getPowder(long powderClass);
 	double * getPowderSquared(long powderClass);
 	pthread_mutex_t * getPowderMutex(long powderClass);
+	bool hasPowderShard(long shard, long powderClass);
+	double * getPowderShard(long shard, long powderClass);
+	double * getPowderSquaredShard(long shard, long powderClass);
+	pthread_mutex_t * getPowderShardMutex(long shard);
 	char name[1024];
 	char name_format[1024];
 	char name_version[1024];
@@ -76,8 +80,17 @@ class cDataVersion {
 	dataVersion_t dataVersionMain;
 	dataVersion_t powderVersionMain;
 
+	// Event formats other than non-assembled are computed on first use (see materialize())
+	static const uint16_t PIXELMASK_READY = 8;
+	uint16_t *ready;
+	float **eventBuffer(int versionIndex);
+	uint16_t **eventPixelmask();
+	float *materialize(int versionIndex);
+	uint16_t *materializePixelmask();
+
 	int get();
 	void clear();
+	long powderShardSlot(long powderClass, int squared);
 };
 
 
@@ -85,4 +98,7 @@ class cDataVersion {
 
 const int DATA_VERSION_N = 3;
 
+// Number of (format, version, class, sum/squared) powder arrays a powder shard may hold
+const int POWDER_SHARD_SLOTS = 4*DATA_VERSION_N*MAX_POWDER_CLASSES*2;
+
 #endif
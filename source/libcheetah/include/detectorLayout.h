@@ -0,0 +1,88 @@
+//
+//  detectorLayout.h
+//  cheetah
+//
+//  Compile-time ASIC layouts for the kernels that loop over ASICs
+//  (included from detectorObject.h after the detector geometry constants)
+//
+
+#ifndef cheetah_detectorLayout_h
+#define cheetah_detectorLayout_h
+
+
+// Layouts with specialised kernels (cPixelDetectorCommon::detectorLayout)
+#define DETECTOR_LAYOUT_GENERIC 0		// Any other layout: dimensions at run time
+#define DETECTOR_LAYOUT_CSPAD 1			// 194 x 185 ASICs, 8 across
+#define DETECTOR_LAYOUT_CSPAD2x2 2		// 194 x 185 ASICs, 2 across
+#define DETECTOR_LAYOUT_PNCCD 3			// 512 x 512 ASICs, 2 across
+#define DETECTOR_LAYOUT_MPCCD 4			// 512 x 1024 ASICs, 1 across
+
+
+/*
+ *	A kernel written as template <class L> reads asic_nx, asic_ny and nasics_x through L.
+ *	For a known layout these are compile-time constants, so the loops over an ASIC have fixed trip counts
+ *	and strides; cDetectorLayout<0,0,0> passes the run-time values through.
+ *	nasics_y always stays a run-time value: the hitfinders run kernels on a few ASIC rows only.
+ */
+template <long ASIC_NX, long ASIC_NY, long NASICS_X>
+struct cDetectorLayout {
+	static inline long asicNx(long n) {return ASIC_NX ? ASIC_NX : n;}
+	static inline long asicNy(long n) {return ASIC_NY ? ASIC_NY : n;}
+	static inline long nasicsX(long n) {return NASICS_X ? NASICS_X : n;}
+};
+
+typedef cDetectorLayout<0, 0, 0> tGenericLayout;
+typedef cDetectorLayout<CSPAD_ASIC_NX, CSPAD_ASIC_NY, CSPAD_nASICS_X> tCspadLayout;
+typedef cDetectorLayout<CSPAD_ASIC_NX, CSPAD_ASIC_NY, CSPAD2x2_nASICS_X> tCspad2x2Layout;
+typedef cDetectorLayout<PNCCD_ASIC_NX, PNCCD_ASIC_NY, PNCCD_nASICS_X> tPnccdLayout;
+typedef cDetectorLayout<mpCCD_ASIC_NX, mpCCD_ASIC_NY, mpCCD_nASICS_X> tMpccdLayout;
+
+
+/*
+ *	Layout with these ASIC dimensions (DETECTOR_LAYOUT_GENERIC if none has them)
+ */
+static inline int detectorLayout(long asic_nx, long asic_ny, long nasics_x) {
+	if(asic_nx == CSPAD_ASIC_NX && asic_ny == CSPAD_ASIC_NY && nasics_x == CSPAD_nASICS_X)
+		return DETECTOR_LAYOUT_CSPAD;
+	if(asic_nx == CSPAD_ASIC_NX && asic_ny == CSPAD_ASIC_NY && nasics_x == CSPAD2x2_nASICS_X)
+		return DETECTOR_LAYOUT_CSPAD2x2;
+	if(asic_nx == PNCCD_ASIC_NX && asic_ny == PNCCD_ASIC_NY && nasics_x == PNCCD_nASICS_X)
+		return DETECTOR_LAYOUT_PNCCD;
+	if(asic_nx == mpCCD_ASIC_NX && asic_ny == mpCCD_ASIC_NY && nasics_x == mpCCD_nASICS_X)
+		return DETECTOR_LAYOUT_MPCCD;
+	return DETECTOR_LAYOUT_GENERIC;
+}
+
+/*
+ *	The layout chosen at configure() time if the kernel was really handed those dimensions, otherwise the generic one
+ */
+static inline int detectorLayout(int layout, long asic_nx, long asic_ny, long nasics_x) {
+	return (layout == detectorLayout(asic_nx, asic_ny, nasics_x)) ? layout : DETECTOR_LAYOUT_GENERIC;
+}
+
+static inline const char *detectorLayoutName(int layout) {
+	switch(layout) {
+		case DETECTOR_LAYOUT_CSPAD: return "CSPAD";
+		case DETECTOR_LAYOUT_CSPAD2x2: return "CSPAD 2x2";
+		case DETECTOR_LAYOUT_PNCCD: return "pnCCD";
+		case DETECTOR_LAYOUT_MPCCD: return "MPCCD";
+		default: return "generic";
+	}
+}
+
+
+/*
+ *	fn = kernel<L> for the layout's L, e.g.
+ *		void (*fn)(float*, long) = NULL;
+ *		DETECTOR_LAYOUT_SELECT(layout, fn, myKernel);
+ */
+#define DETECTOR_LAYOUT_SELECT(layout, fn, kernel) \
+	switch(layout) { \
+		case DETECTOR_LAYOUT_CSPAD: fn = kernel<tCspadLayout>; break; \
+		case DETECTOR_LAYOUT_CSPAD2x2: fn = kernel<tCspad2x2Layout>; break; \
+		case DETECTOR_LAYOUT_PNCCD: fn = kernel<tPnccdLayout>; break; \
+		case DETECTOR_LAYOUT_MPCCD: fn = kernel<tMpccdLayout>; break; \
+		default: fn = kernel<tGenericLayout>; break; \
+	}
+
+#endif
@@ -19,10 +19,18 @@
 #include <stdint.h>
 #include "dataVersion.h"
 #include "frameBuffer.h"
+#include "peakfinders.h"
+#include "assemble2DImage.h"
+#include "commonMode.h"
+#include "localBackground.h"
 
 #define MAX_DETECTORS 2
 #define MAX_FILENAME_LENGTH 1024
 
+// Local background estimators (localBackgroundMode)
+#define LOCAL_BACKGROUND_MEDIAN 0
+#define LOCAL_BACKGROUND_MEAN 1
+
 /*
  * Detector geometries
  */
@@ -57,6 +65,8 @@ static const unsigned  MX170HS_nASICS_Y = 1;		// 2 ASICs down in raw data stresm
 
 static const unsigned int cbufsize = 1024;
 
+#include "detectorLayout.h"
+
 /*
  * Pixelmasks
  */
@@ -187,8 +197,14 @@ public:
 	float   radial_max;
 	long    radial_nn;
 	float   *pix_r;
+	tRadialBinIndex pix_rbins;		// Pixels grouped by lrint(pix_r), for peakfinder8
+	// Assembled image as a gather over raw pixels (built only when assembled data is saved)
+	int     assembleInterpolation;
+	tAssemblyMatrix pix_assembly;
 	float   *pix_kr;
 	float   *pix_res;
+	// Polarization and solid angle corrections as one multiplier per pixel (rebuilt when the detector moves)
+	float   *pix_geometricCorrection;
 
 
 	// Detector position
@@ -208,6 +224,7 @@ public:
     
     // Solid angle
     double  solidAngleConst; // constant term of the solid angle for each pixel
+
     
 	/*
 	 *  Flags for detector processing options
@@ -222,6 +239,7 @@ public:
 	int    cspadSubtractUnbondedPixels;
 	int    cspadSubtractBehindWires;
 	float  cmFloor;         // CSPAD: use lowest x% of values to estimate DC offset
+	int    cmEstimator;     // CSPAD: CM_ESTIMATOR_SELECT or CM_ESTIMATOR_HISTOGRAM (same result, see commonMode.h)
     int    cmStart;         // pnCCD: intensity (ADU) from which the peakfinding should start in the histogram
     int    cmStop;          // pnCCD: intensity (ADU) at which the peakfinding should stop in the histogram
     float  cmThreshold;     // pnCCD: noise threshold intensity (ADU) over which the peakfinding should consider as true peaks in the histogram
@@ -244,6 +262,9 @@ public:
 	int    useLocalBackgroundSubtraction;
 	int    useRadialBackgroundSubtraction;
 	long   localBackgroundRadius;
+	// Window statistic: LOCAL_BACKGROUND_MEDIAN (value at localBackgroundPercentile) or LOCAL_BACKGROUND_MEAN
+	int    localBackgroundMode;
+	float  localBackgroundPercentile;
 	// Running background subtraction
 	int    useSubtractPersistentBackground;
 	int    subtractPersistentBackgroundMean;
@@ -252,6 +273,7 @@ public:
 	int    scaleBackground;
 	int    useBackgroundBufferMutex;
 	float  bgMedian;
+	int    bgIncrementalMedian;
 	long   bgMemory;
 	long   bgRecalc;
 	long   bgCounter;
@@ -301,6 +323,11 @@ public:
 	cFrameBuffer *frameBufferNoisyPix;
 
 	int threadSafetyLevel;
+	long frameBufferThreads;
+	long peakfinderThreads;
+	long commonModeThreads;
+	// Layout of the specialised kernels (DETECTOR_LAYOUT_*, from the ASIC dimensions in configure())
+	int  kernelLayout;
 
 	// Saving options
 	// Data versions
@@ -394,6 +421,19 @@ public:
 	pthread_mutex_t powderImageXxX_mutex[MAX_POWDER_CLASSES];
 	pthread_mutex_t powderRadialAverage_mutex[MAX_POWDER_CLASSES];
 	pthread_mutex_t powderPeaks_mutex[MAX_POWDER_CLASSES];
+	// Per-worker powder accumulators, folded into the arrays above by mergePowderShards() (0: sum directly into the arrays above)
+	long     nPowderShards;
+	double   **powderShards;
+	pthread_mutex_t *powderShards_mutex;
+	// Per-worker peakfinder scratch arrays (see getPeakfinderWorkspace)
+	long     nPeakfinderWorkspaces;
+	tPeakfinderWorkspace *peakfinderWorkspaces;
+	// Per-worker common mode scratch arrays (see getCommonModeWorkspace)
+	long     nCommonModeWorkspaces;
+	tCommonModeWorkspace *commonModeWorkspaces;
+	// Per-worker local background scratch arrays (see getLocalBackgroundWorkspace)
+	long     nLocalBackgroundWorkspaces;
+	tLocalBackgroundWorkspace *localBackgroundWorkspaces;
 	long            radialStackSize;
 	long     radialStackCounter[MAX_POWDER_CLASSES];
 	float    *radialAverageStack[MAX_POWDER_CLASSES];
@@ -415,9 +455,15 @@ public:
 	long	histogram_count;
 	float	histogramMaxMemoryGb;
 	uint64_t	histogram_nnn;
-	uint16_t	*histogramData;
+	uint32_t	*histogramData;
 	float       *histogramScale;
 	pthread_mutex_t histogram_mutex;
+	// Per-worker 16-bit histogram shards, added into histogramData every histogramFlushInterval frames (0 shards: bin straight into histogramData)
+	long	histogramShards;
+	long	histogramFlushInterval;
+	uint16_t	**histogramShardData;
+	long	*histogramShardCount;
+	pthread_mutex_t *histogramShard_mutex;
 	//long	histogram_depth;
 
 	/*
@@ -434,8 +480,13 @@ public:
 	void allocateMemory();
 	void freeMemory();
 	void unlockMutexes();
+	double * getPowderShard(long shard, long slot, long n);
+	tPeakfinderWorkspace * getPeakfinderWorkspace(long worker, long maxPixCount);
+	tCommonModeWorkspace * getCommonModeWorkspace(long worker);
+	tLocalBackgroundWorkspace * getLocalBackgroundWorkspace(long worker);
 	void readDetectorGeometry(char *);
 	void updateKspace(cGlobal*, float);
+	void updateGeometricCorrections();
 	void readDarkcal(char *);
 	void readGaincal(char *);
 	void readPeakmask(cGlobal*, char *);
@@ -451,6 +502,11 @@ public:
 };
 
 
+// Types of raw data a front end can hand over (cPixelDetectorEvent::rawType)
+#define RAW_TYPE_UINT16 0		// data_raw16, the default
+#define RAW_TYPE_INT32 1
+#define RAW_TYPE_FLOAT 2
+
 class cPixelDetectorEvent {
 
 public:
@@ -464,6 +520,16 @@ public:
 	/* DATA NON-ASSEMBLED */
 	// Raw data as read from the XTC file
 	uint16_t  *data_raw16;
+	// Raw data of another type (see cheetahSetRawData/cheetahAdoptRawData): rawType says what rawInput points at,
+	// which is data_raw16 for RAW_TYPE_UINT16 unless the front end's own buffer was adopted
+	int       rawType;
+	void      *rawInput;
+	int32_t   *data_raw32;
+	// Adopted buffer: handed back with rawRelease(rawReleaseArg) when the event is done;
+	// an adopted float buffer is used as data_raw itself, data_rawOwn keeps the event's own array meanwhile
+	void      (*rawRelease)(void*);
+	void      *rawReleaseArg;
+	float     *data_rawOwn;
 	// Raw data as read from the XTC file but converted to float
 	float     *data_raw;
 	// Data after detector corrections applied (common-mode, detector artefacts...)
@@ -498,6 +564,11 @@ public:
 	float     *radialAverage_detCorr;
 	float     *radialAverage_detPhotCorr;
 	uint16_t  *radialAverage_pixelmask;
+	/* Derived formats computed so far for this event, as data version bits (plus 8 for the pixelmask)
+	 * Set by cDataVersion when they are first asked for, cleared when the event is reused */
+	uint16_t  imageReady;
+	uint16_t  imageXxXReady;
+	uint16_t  radialAverageReady;
 	//float     *radialAverage;
 	//float     *radialAverageCounter;
 	double    detectorZ;
@@ -0,0 +1,55 @@
+/*
+ *  eventPool.h
+ *  cheetah
+ */
+
+#ifndef EVENTPOOL_H
+#define EVENTPOOL_H
+
+#include <pthread.h>
+
+class cGlobal;
+class cEventData;
+
+/*
+ *	Everything that determines the size of the arrays hanging off a cEventData.
+ *	Events are only recycled while the key they were allocated under is still current.
+ */
+typedef struct {
+	long	nDetectors;
+	long	pix_nn[MAX_DETECTORS];
+	long	image_nn[MAX_DETECTORS];
+	long	imageXxX_nn[MAX_DETECTORS];
+	long	radial_nn[MAX_DETECTORS];
+	long	saveFormat[MAX_DETECTORS];
+	long	powderFormat[MAX_DETECTORS];
+	int		lazyImageBuffers;
+	long	NpeaksMax;
+	long	espectrumLength;
+} tEventPoolKey;
+
+/*
+ *	Free-list of fully allocated events.
+ *	cheetahNewEvent() takes events from here and cheetahDestroyEvent() hands them back,
+ *	so that the pixel and image arrays are allocated (and paged in) once per pool slot
+ *	rather than once per frame.
+ */
+class cEventPool {
+ public:
+	cEventPool(cGlobal *global0, long poolSize0);
+	~cEventPool();
+	cEventData *get();
+	void put(cEventData *eventData);
+	long poolSize;
+ private:
+	void makeKey(tEventPoolKey *key);
+	void drain();
+	cGlobal *global;
+	tEventPoolKey key;
+	long generation;
+	cEventData **events;
+	long nEvents;
+	pthread_mutex_t pool_mutex;
+};
+
+#endif
@@ -22,22 +22,43 @@ class cFrameBuffer {
 	void subtractMedian(float * data, uint16_t * mask, int scale, float minAbsMedianOverStdRatio);
 	void subtractMean(float * data, uint16_t * mask, int scale, float minAbsMeanOverStdRatio);
 	void updateMedian(float point);
+	void enableIncrementalMedian();
 	void updateMean();
 	void copyStd(float * target);
 	void updateStd();
 	void copyAbsAboveThresh(float * target);
 	void updateAbsAboveThresh(float threshold);
+	void updateStatistics(bool doMean, bool doStd, bool doAbsAboveThresh, float threshold);
 	long pix_nn;
 	long depth;
 	int threadSafetyLevel;
 	long counter;
+	bool incrementalMedian;
+	long nThreads;
  private:
+	// One pixel range of a fused statistics update
+	typedef struct {
+		float	*frames;
+		long	pix_nn, depth;
+		long	i0, i1;
+		bool	doMean, doStd, doAbsAboveThresh;
+		float	threshold;
+		float	*mean, *std, *absAboveThresh;
+	} tStatisticsJob;
+	static void *statisticsWorker(void *threadarg);
+	static void updateStatisticsRange(tStatisticsJob *job);
 	float * frames;
 	float * median;
 	float * mean;
 	float * std;
 	float * absAboveThresh;
 	bool filled,median_updated,mean_updated,std_updated,absAboveThresh_updated;
+	// Incremental median: per-pixel sorted copy of the ring buffer (pixel-major, depth values per pixel),
+	// guarded by one mutex per stripe of pixels instead of by the frame locks
+	float * sorted;
+	long nStripes,stripeSize;
+	pthread_mutex_t * stripe_mutexes;
+	void updateSorted(long frameID, float * data);
 	pthread_mutex_t * frame_mutexes;
 	pthread_mutex_t median_mutex,mean_mutex,std_mutex,absAboveThresh_mutex;
 	long n_std_readers,n_median_readers,n_mean_readers,n_absAboveThresh_readers;
@@ -0,0 +1,53 @@
+//
+//  localBackground.h
+//  cheetah
+//
+//  Scratch space of the local background subtraction (subtractLocalBackground)
+//
+
+#ifndef cheetah_localBackground_h
+#define cheetah_localBackground_h
+
+#include <stdint.h>
+
+
+/*
+ *	Set of distinct ranks (the pixels inside the current window)
+ *	One bit per rank plus a count per block of 512 ranks (see backgroundCorrection.cpp)
+ */
+typedef struct {
+	uint64_t	*bits;
+	int32_t		*blockCount;
+	long		nWords;
+	long		nBlocks;
+	long		block;		// block searched last
+	long		below;		// number of window ranks in blocks below 'block'
+} tRankWindow;
+
+
+/*
+ *	Scratch of one worker: the ASIC copy and its background, the rank filter's sort and window,
+ *	and the summed-area table of the window mean.
+ *	Allocated on first use (see prepareLocalBackgroundWorkspace), reused for every frame.
+ */
+typedef struct {
+	long		asic_nn;
+	float		*asic_buffer;
+	float		*localBg;
+	long		rank_nn;
+	uint32_t	*key;
+	uint32_t	*keyTmp;
+	int32_t		*index;
+	int32_t		*indexTmp;
+	int32_t		*rank;
+	float		*sortedValue;
+	tRankWindow	window;
+	long		sat_nn;
+	double		*sat;			// (asic_nx+1) x (asic_ny+1)
+} tLocalBackgroundWorkspace;
+
+
+void prepareLocalBackgroundWorkspace(tLocalBackgroundWorkspace*, long, long, int);
+void freeLocalBackgroundWorkspace(tLocalBackgroundWorkspace*);
+
+#endif
@@ -9,6 +9,11 @@
 #ifndef cheetah_peakfinders_h
 #define cheetah_peakfinders_h
 
+#include "threadTeam.h"
+
+// How peakfinder3 and peakfinder8 find the pixels of each peak (hitfinderPeakSearch)
+#define PEAK_SEARCH_REGION_GROWING 0	// Grow each peak from its first pixel through the 8 neighbours
+#define PEAK_SEARCH_UNION_FIND 1		// Label all connected regions first (two raster passes per ASIC)
 
 
 typedef struct {
@@ -47,8 +52,82 @@ public:
 //	free();
 //}
 
+/*
+ *	Scratch of one extra thread searching part of a frame's ASICs in peakfinder8
+ */
+typedef struct {
+	long	stackSize;
+	long	maxPixCount;
+	long	*inx;				// Region-growing stacks
+	long	*iny;
+	long	*peakpixels;
+	tPeakList	peaks;			// Peaks found in this thread's ASICs
+} tPeakfinderHelper;
+
+/*
+ *	Scratch arrays for the peakfinders, kept by each worker thread from one frame to the next
+ *	(see cPixelDetectorCommon::getPeakfinderWorkspace).
+ *	Only peakpixel must be zero on entry: the peakfinders log every pixel they flag in touched[]
+ *	and clear just those before returning; everything else is overwritten before it is read.
+ */
+typedef struct {
+	long	pix_nn;
+	long	nRadialBins;
+	long	maxPixCount;
+	float	*temp;				// Masked copy of the data
+	char	*mask;				// Good-pixel mask handed to the peakfinders
+	long	*inx;				// Pixels found so far in the current peak
+	long	*iny;
+	char	*peakpixel;			// Pixels already assigned to a peak
+	long	*touched;			// Where peakpixel has been set
+	long	nTouched;
+	long	*peakpixels;		// Raw-layout index of the pixels in the current peak
+	int		*nexte;				// peakfinder6: pixels waiting to be searched
+	int		*natmask;			// peakfinder6: pixels not yet counted in a peak
+	float	*rsigma;			// peakfinder8: noise, offset and threshold as a function of radius
+	float	*roffset;
+	float	*rthreshold;
+	long	*rcount;
+	float	*rvalues;			// peakfinder8: data gathered four radius bins at a time (see radialGroupStatistics)
+	long	nThreads;			// peakfinder8: threads for the per-radius statistics and the search over ASICs
+	long	nHelpers;			// peakfinder8: scratch of threads 1 .. nThreads-1
+	tPeakfinderHelper	*helpers;
+	tThreadTeam	team;			// peakfinder8 and its radial statistics: the threads themselves (kept from one frame to the next)
+	int		layout;				// peakfinder8: DETECTOR_LAYOUT_* of the search (see detectorLayout.h)
+	int		peakSearch;			// PEAK_SEARCH_REGION_GROWING or PEAK_SEARCH_UNION_FIND
+	long	labels_nn;			// Union-find labelling (allocated on first use, see labelPeakRegions)
+	char	*above;				// Pixels above threshold
+	int		*labels;			// Region of each pixel above threshold
+	int		*parent;			// Provisional label -> parent label
+	int		*regionStart;		// Pixels of region c are regionPixels[regionStart[c]] ... [regionStart[c+1]-1]
+	int		*regionPixels;
+} tPeakfinderWorkspace;
+
+/*
+ *	Pixels grouped by integer radius lrint(pix_r), built once per detector geometry.
+ *	The pixels of bin r are pixels[start[r]] ... pixels[start[r+1]-1], in increasing order,
+ *	so the pixels below any pix_nn are a prefix of each bin.
+ */
+typedef struct {
+	long	pix_nn;
+	long	nBins;
+	int		*bin;				// lrint(pix_r) of each pixel
+	long	*start;				// nBins+1 offsets into pixels
+	long	*pixels;
+} tRadialBinIndex;
+
+
 void allocatePeakList(tPeakList*, long);
+void resetPeakList(tPeakList*);
 void freePeakList(tPeakList);
+void preparePeakfinderWorkspace(tPeakfinderWorkspace*, long, long, long);
+void clearPeakfinderWorkspace(tPeakfinderWorkspace*);
+void freePeakfinderWorkspace(tPeakfinderWorkspace*);
+void preparePeakfinderHelpers(tPeakfinderWorkspace*, long, long, long, long);
+long labelPeakRegions(tPeakfinderWorkspace*, long, long, long, long);
+void buildRadialBinIndex(tRadialBinIndex*, float*, long);
+void freeRadialBinIndex(tRadialBinIndex*);
+void peakfinder8RadialStatistics(tPeakfinderWorkspace*, tRadialBinIndex*, float*, char*, long, float, float);
 
 
 #endif
@@ -49,6 +49,9 @@ namespace CXI{
 			id = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, fapl_id);
 			if( id<0 ) {ERROR("Cannot create file.\n");}
 			stackCounter = 0;
+			deflateLevel = 0;
+			frameChunks = false;
+			initSlab();
 		}
 		Node(std::string s, hid_t oid, Node * p, Type t,  int _ignore_flags){
 			name = s;
@@ -56,6 +59,9 @@ namespace CXI{
 			id = oid;
 			type = t;
 			ignoreConversionExceptions = _ignore_flags;
+			deflateLevel = 0;
+			frameChunks = false;
+			initSlab();
 		}
 		Node & operator [](std::string s){
 			if(children.find(s) != children.end()){
@@ -74,6 +80,10 @@ namespace CXI{
 			for(Iter it = children.begin(); it != children.end(); it++) {
 				delete it->second;
 			}
+			free(slab);
+			if(slabType >= 0){
+				H5Tclose(slabType);
+			}
 		}
 		/*
 		  The base name of the class should be used.
@@ -107,12 +117,34 @@ namespace CXI{
 		Node & child(std::string prefix, int n);
 		void trimAll(int stackSize = -1);
 		uint getStackSlice();
+		/*
+		  Buffer up to n stacked slices per dataset and write them with a single H5Dwrite.
+		  Only safe when one thread at a time writes stack slices, in increasing order;
+		  buffered slices reach the file with flushSlabs().
+		*/
+		void setSlabFrames(int n);
+		void flushSlabs();
+		/*
+		  Store the image stacks (3D and 4D) created from now on below this node one frame per chunk,
+		  compressed with shuffle + deflate at the given level (0: uncompressed, the default).
+		*/
+		void setDeflateLevel(int level);
+		/*
+		  Write one stack slice that is already a finished chunk (file datatype, shuffled and deflated).
+		  Returns false if this dataset does not take such chunks, in which case the caller uses write().
+		*/
+		bool writeChunk(const char * chunk, size_t size, size_t elementSize, int stackSlice);
 
 		std::string name;
 	private:
 		Node * addNode(const char * s, hid_t oid, Type t);
 		void addStackAttributes(hid_t dataset, int ndims, const char * userAxis);
 		hid_t writeNumEvents(hid_t dataset, int stackSlice);
+		void initSlab();
+		template <class T>
+			bool bufferSlice(T * data, int stackSlice, int sliceSize);
+		void flushSlab();
+		void writeSlabRun(long first, long n);
 		std::string nextKey(const char * s);
 		template <class T>
 			hid_t get_datatype(const T * foo);
@@ -126,6 +158,17 @@ namespace CXI{
 		 *  It is atomically incremented by each thread */
 		uint stackCounter;
 		int ignoreConversionExceptions;
+		/*  Slab of consecutive stack slices [slabStart, slabStart+slabFrames) waiting to be written */
+		int slabFrames;
+		char * slab;
+		long slabStart;
+		long slabCount;
+		size_t slabSliceBytes;
+		hid_t slabType;
+		std::vector<bool> slabFilled;
+		/*  Deflate level for new image stacks, and whether this dataset is stored one compressed frame per chunk */
+		int deflateLevel;
+		bool frameChunks;
 	};
 
 	const int version = 140;
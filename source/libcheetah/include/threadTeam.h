@@ -0,0 +1,53 @@
+//
+//  threadTeam.h
+//  cheetah
+//
+//  Helper threads a worker keeps for splitting one frame's work (peakfinder8, CSPAD common mode)
+//
+
+#ifndef cheetah_threadTeam_h
+#define cheetah_threadTeam_h
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct tThreadTeam;
+
+typedef struct {
+	struct tThreadTeam	*team;
+	long	task;				// Task this helper runs in each round (1 .. nHelpers)
+	long	round;				// Last round it has seen
+} tThreadTeamHelper;
+
+/*
+ *	Team of one worker: tasks 1 .. nTasks-1 of a round run on long-lived helper threads, task 0 on the worker itself.
+ *	Starts zeroed (a workspace is calloc'd); the helpers are started by the first round that needs them
+ *	and sleep between rounds, so no thread is created or joined per frame.
+ *	Only the owning worker calls threadTeamTasks and threadTeamRun.
+ */
+typedef struct tThreadTeam {
+	bool	initialised;
+	long	nRequested;			// Helper threads asked for
+	long	nHelpers;			// Helper threads running (fewer if some failed to start: the worker runs their tasks)
+	pthread_t	*threads;
+	tThreadTeamHelper	*helpers;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	roundStart;
+	pthread_cond_t	roundDone;
+	long	round;				// Rounds started so far
+	long	roundTasks;			// Tasks of the current round the helpers take part in (helper task < roundTasks)
+	long	nPending;			// Helper tasks of this round not yet done
+	bool	stopping;
+	void	*(*func)(void *);
+	long	nTasks;				// Tasks set up for the next round (see threadTeamTasks)
+	size_t	taskSize;
+	char	*tasks;				// nTasks x taskSize, kept from one round to the next
+	size_t	tasksAllocated;
+} tThreadTeam;
+
+
+void *threadTeamTasks(tThreadTeam*, long, size_t);
+void threadTeamRun(tThreadTeam*, void *(*)(void *));
+void freeThreadTeam(tThreadTeam*);
+
+#endif
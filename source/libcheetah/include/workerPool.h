@@ -0,0 +1,49 @@
+/*
+ *  workerPool.h
+ *  cheetah
+ */
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <pthread.h>
+
+class cEventData;
+class cWorkerPool;
+
+typedef struct {
+	cWorkerPool *pool;
+	long workerID;
+} tWorkerArg;
+
+/*
+ *	Fixed pool of long-lived worker threads fed by a bounded event queue.
+ *	push() blocks while the queue is full, which throttles the caller
+ *	to the rate at which the workers can digest events.
+ *	Events are numbered (eventData->powderSequence) in the order they are queued.
+ */
+class cWorkerPool {
+ public:
+	cWorkerPool(long nWorkers0, long queueDepth0);
+	~cWorkerPool();
+	int push(cEventData *eventData, int timeoutInSeconds);
+	void shutdown();
+	long nWorkers;
+	long queueDepth;
+ private:
+	static void *workerLoop(void *threadarg);
+	cEventData *pop();
+	cEventData **queue;
+	long queueHead;
+	long queueCount;
+	long nQueued;
+	bool stopping;
+	pthread_t *threads;
+	bool *threadStarted;
+	tWorkerArg *workerArgs;
+	pthread_mutex_t queue_mutex;
+	pthread_cond_t queueNotEmpty;
+	pthread_cond_t queueNotFull;
+};
+
+#endif
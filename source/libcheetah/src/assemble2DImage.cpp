@@ -21,130 +21,186 @@
 
 
 /*
- *  Assemble data into a realistic 2d image using raw data and geometry
+ *	Image pixels that raw pixel i at (px,py) contributes to, in the order of the original scatter loops:
+ *	the 4 overlapped pixels for linear interpolation (weighted by fractional overlap, skipping those off
+ *	the image) or the one it rounds onto for nearest neighbour. Returns the number of targets.
  */
-void assemble2DImage(cEventData *eventData, cGlobal *global) {
-	DETECTOR_LOOP {
-		if (isAnyOfBitOptionsSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)) {
-			long		pix_nn = global->detector[detIndex].pix_nn;
-			long		image_nx = global->detector[detIndex].image_nx;
-			long		image_nn = global->detector[detIndex].image_nn;
-			float		*pix_x = global->detector[detIndex].pix_x;
-			float		*pix_y = global->detector[detIndex].pix_y;
-			cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_NON_ASSEMBLED);
-			cDataVersion imageV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_ASSEMBLED);
-			while (dataV.next() && imageV.next()) {
-				float		*data = dataV.getData();
-				float		*image = imageV.getData();
-				int         assembleInterpolation = global->assembleInterpolation;
-				assemble2DImage(image, data, pix_x, pix_y, pix_nn, image_nx, image_nn, assembleInterpolation);
+static int assemblyTargets(float px, float py, long image_nx, long image_nn, int assembleInterpolation, long *index, float *w) {
+	float	x, y;
+	long	ix, iy;
+	float	fx, fy;
+	int		n = 0;
+
+	// Pixel location with (0,0) at array element (0,0) in bottom left corner
+	x = px + image_nx/2.;
+	y = py + image_nx/2.;
+
+	if(assembleInterpolation == ASSEMBLE_INTERPOLATION_NEAREST){
+		// round to nearest neighbor
+		ix = (long) (x+0.5);
+		iy = (long) (y+0.5);
+		index[0] = ix + image_nx*iy;
+		w[0] = 1;
+		return (index[0] >= 0 && index[0] < image_nn) ? 1 : 0;
+	}
+
+	// Split coordinate into integer and fractional parts
+	ix = (long) floor(x);
+	iy = (long) floor(y);
+	fx = x - ix;
+	fy = y - iy;
+	for(long dy=0; dy<=1; dy++) {
+		for(long dx=0; dx<=1; dx++) {
+			if((ix+dx)>=0 && (iy+dy)>=0 && (ix+dx)<image_nx && (iy+dy)<image_nx) {
+				index[n] = (ix+dx) + image_nx*(iy+dy);
+				w[n] = (dx ? fx : 1-fx)*(dy ? fy : 1-fy);
+				n++;
 			}
 		}
 	}
-} 
-    
-void assemble2DImage(float *image, float *data, float *pix_x, float *pix_y, long pix_nn, long image_nx, long image_nn,int assembleInterpolation) {
- 
-    if(assembleInterpolation == ASSEMBLE_INTERPOLATION_NEAREST){
-        // Loop through all pixels and interpolate onto regular grid
-        float	x, y;
-        long	ix, iy;
-        long	image_index;
-        
-        for(long i=0;i<pix_nn;i++){
-            x = pix_x[i] + image_nx/2.;
-            y = pix_y[i] + image_nx/2.;
-            // round to nearest neighbor
-            ix = (long) (x+0.5);
-            iy = (long) (y+0.5);
-            
-            image_index = ix + image_nx*iy;
-            image[image_index]= data[i];
-        }
-    }
-
-    else if(assembleInterpolation == ASSEMBLE_INTERPOLATION_LINEAR){
-		// Allocate temporary arrays for pixel interpolation (needs to be floating point)
-		float	*data = (float*) calloc(image_nn,sizeof(float));
-		float	*weight = (float*) calloc(image_nn,sizeof(float));
-		for(long i=0; i<image_nn; i++){
-			data[i] = 0;
-			weight[i]= 0;
+	return n;
+}
+
+
+/*
+ *	Build the gather matrix of the assembled image from the (beam-centred) pixel coordinates.
+ *	Done once per geometry so that assembling a frame needs no temporaries or scatter.
+ */
+void buildAssemblyMatrix(tAssemblyMatrix *matrix, float *pix_x, float *pix_y, long pix_nn, long image_nx, long image_nn, int assembleInterpolation) {
+	long	index[4];
+	float	w[4];
+	int		n;
+
+	freeAssemblyMatrix(matrix);
+	matrix->interpolation = assembleInterpolation;
+	matrix->pix_nn = pix_nn;
+	matrix->image_nn = image_nn;
+	matrix->rowStart = (long*) calloc(image_nn+1, sizeof(long));
+
+	if(assembleInterpolation == ASSEMBLE_INTERPOLATION_NEAREST){
+		// Last raw pixel landing on each image pixel wins
+		long	*source = (long*) malloc(image_nn*sizeof(long));
+		for(long j=0; j<image_nn; j++)
+			source[j] = -1;
+		for(long i=0; i<pix_nn; i++) {
+			if(assemblyTargets(pix_x[i], pix_y[i], image_nx, image_nn, assembleInterpolation, index, w))
+				source[index[0]] = i;
 		}
-	
-	
-		// Loop through all pixels and interpolate onto regular grid
-		float	x, y;
-		float	pixel_value, w;
-		long	ix, iy;
-		float	fx, fy;
-		long	image_index;
-    
-		for(long i=0;i<pix_nn;i++){
-			// Pixel location with (0,0) at array element (0,0) in bottom left corner
-			x = pix_x[i] + image_nx/2.;
-			y = pix_y[i] + image_nx/2.;
-			pixel_value = data[i];
-		
-			// Split coordinate into integer and fractional parts
-			ix = (long) floor(x);
-			iy = (long) floor(y);
-			fx = x - ix;
-			fy = y - iy;
-		
-			// Interpolate intensity over adjacent 4 pixels using fractional overlap as the weighting factor
-			// (0,0)
-			if(ix>=0 && iy>=0 && ix<image_nx && iy<image_nx) {
-				w = (1-fx)*(1-fy);
-				image_index = ix + image_nx*iy;
-				data[image_index] += w*pixel_value;
-				weight[image_index] += w;
-			}
-			// (+1,0)
-			if((ix+1)>=0 && iy>=0 && (ix+1)<image_nx && iy<image_nx) {
-				w = (fx)*(1-fy);
-				image_index = (ix+1) + image_nx*iy;
-				data[image_index] += w*pixel_value;
-				weight[image_index] += w;
-			}
-			// (0,+1)
-			if(ix>=0 && (iy+1)>=0 && ix<image_nx && (iy+1)<image_nx) {
-				w = (1-fx)*(fy);
-				image_index = ix + image_nx*(iy+1);
-				data[image_index] += w*pixel_value;
-				weight[image_index] += w;
-			}
-			// (+1,+1)
-			if((ix+1)>=0 && (iy+1)>=0 && (ix+1)<image_nx && (iy+1)<image_nx) {
-				w = (fx)*(fy);
-				image_index = (ix+1) + image_nx*(iy+1);
-				data[image_index] += w*pixel_value;
-				weight[image_index] += w;
+		long	nEntries = 0;
+		for(long j=0; j<image_nn; j++)
+			if(source[j] >= 0)
+				nEntries++;
+		matrix->nEntries = nEntries;
+		matrix->pixel = (int*) malloc((nEntries+1)*sizeof(int));
+		matrix->weight = (float*) malloc((nEntries+1)*sizeof(float));
+		nEntries = 0;
+		for(long j=0; j<image_nn; j++) {
+			matrix->rowStart[j] = nEntries;
+			if(source[j] >= 0) {
+				matrix->pixel[nEntries] = (int) source[j];
+				matrix->weight[nEntries] = 1;
+				nEntries++;
 			}
 		}
-	
-	
-		// Reweight pixel interpolation
-		for(long i=0; i<image_nn; i++){
-			if(weight[i] < 0.05)
-				data[i] = 0;
+		matrix->rowStart[image_nn] = nEntries;
+		free(source);
+		return;
+	}
+
+	// Count the entries of each row, then fill them in increasing raw pixel order
+	long	*fill = (long*) calloc(image_nn+1, sizeof(long));
+	for(long i=0; i<pix_nn; i++) {
+		n = assemblyTargets(pix_x[i], pix_y[i], image_nx, image_nn, assembleInterpolation, index, w);
+		for(int k=0; k<n; k++)
+			fill[index[k]+1]++;
+	}
+	for(long j=0; j<image_nn; j++)
+		fill[j+1] += fill[j];
+	memcpy(matrix->rowStart, fill, (image_nn+1)*sizeof(long));
+	matrix->nEntries = fill[image_nn];
+	matrix->pixel = (int*) malloc((matrix->nEntries+1)*sizeof(int));
+	matrix->weight = (float*) malloc((matrix->nEntries+1)*sizeof(float));
+
+	float	*weightSum = (float*) calloc(image_nn, sizeof(float));
+	for(long i=0; i<pix_nn; i++) {
+		n = assemblyTargets(pix_x[i], pix_y[i], image_nx, image_nn, assembleInterpolation, index, w);
+		for(int k=0; k<n; k++) {
+			matrix->pixel[fill[index[k]]] = (int) i;
+			matrix->weight[fill[index[k]]] = w[k];
+			fill[index[k]]++;
+			weightSum[index[k]] += w[k];
+		}
+	}
+
+	// Reweight pixel interpolation
+	for(long j=0; j<image_nn; j++) {
+		for(long k=matrix->rowStart[j]; k<matrix->rowStart[j+1]; k++) {
+			if(weightSum[j] < 0.05)
+				matrix->weight[k] = 0;
 			else
-				data[i] /= weight[i];
+				matrix->weight[k] /= weightSum[j];
 		}
-    
-        // Copy to output array
-        for(long i=0; i<image_nn; i++){
-            image[i] = data[i];
+	}
+	free(weightSum);
+	free(fill);
+}
+
+
+void freeAssemblyMatrix(tAssemblyMatrix *matrix) {
+	free(matrix->rowStart);
+	free(matrix->pixel);
+	free(matrix->weight);
+	memset(matrix, 0, sizeof(tAssemblyMatrix));
+}
+
+
+/*
+ *  Assemble data into a realistic 2d image using raw data and geometry
+ *	(cDataVersion assembles each version when it is first asked for; this does it up front for the saved versions)
+ */
+void assemble2DImage(cEventData *eventData, cGlobal *global) {
+	DETECTOR_LOOP {
+		if (isAnyOfBitOptionsSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)) {
+			cDataVersion imageV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_ASSEMBLED);
+			while (imageV.next()) {
+				imageV.getData();
+			}
 		}
-	
-	
-		// Free temporary arrays
-		free(data);
-		free(weight);
+	}
+} 
+
+
+/*
+ *	Gather each image pixel from the raw pixels listed in its row of the assembly matrix
+ */
+void assemble2DImage(float *image, float *data, tAssemblyMatrix *assembly) {
+	long	*rowStart = assembly->rowStart;
+	int		*pixel = assembly->pixel;
+	float	*weight = assembly->weight;
+
+	for(long j=0; j<assembly->image_nn; j++) {
+		float	sum = 0;
+		for(long k=rowStart[j]; k<rowStart[j+1]; k++)
+			sum += weight[k]*data[pixel[k]];
+		image[j] = sum;
+	}
+}
+
+// Powder data is double
+void assemble2DImage(double *image, double *data, tAssemblyMatrix *assembly) {
+	long	*rowStart = assembly->rowStart;
+	int		*pixel = assembly->pixel;
+	float	*weight = assembly->weight;
+
+	for(long j=0; j<assembly->image_nn; j++) {
+		double	sum = 0;
+		for(long k=rowStart[j]; k<rowStart[j+1]; k++)
+			sum += weight[k]*data[pixel[k]];
+		image[j] = sum;
 	}
 }
 
-    
+
 
 
 /*
@@ -153,15 +209,8 @@ void assemble2DImage(float *image, float *data, float *pix_x, float *pix_y, long
 void assemble2DMask(cEventData *eventData, cGlobal *global) {   
 	DETECTOR_LOOP {
 		if (isAnyOfBitOptionsSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)) {
-			long		pix_nn = global->detector[detIndex].pix_nn;
-			long		image_nx = global->detector[detIndex].image_nx;
-			long		image_nn = global->detector[detIndex].image_nn;
-			float		*pix_x = global->detector[detIndex].pix_x;
-			float		*pix_y = global->detector[detIndex].pix_y;
-			uint16_t  *pixelmask = eventData->detector[detIndex].pixelmask;
-			uint16_t	*image_pixelmask = eventData->detector[detIndex].image_pixelmask;
-			int       assembleInterpolation = global->assembleInterpolation;
-			assemble2DMask(image_pixelmask,pixelmask, pix_x, pix_y, pix_nn, image_nx, image_nn, assembleInterpolation);
+			cDataVersion imageV(&eventData->detector[detIndex], &global->detector[detIndex], cDataVersion::DATA_VERSION_NONE, cDataVersion::DATA_FORMAT_ASSEMBLED);
+			imageV.getPixelmask();
 		}
 	}	
 }
@@ -172,69 +221,26 @@ void assemble2DMask(cEventData *eventData, cGlobal *global) {
 /*
  *	Interpolate binary mask using pre-defined pixel mapping (as loaded from .h5 file)
  *      Options are dominant in united pixels
+ *	Image pixels no raw pixel lands on are PIXEL_IS_MISSING
  *	input data: uint16_t
  *	output data: uint16_t
  */
-void assemble2DMask(uint16_t *assembled_mask, uint16_t *original_mask, float *pix_x, float *pix_y, long pix_nn, long image_nx, long image_nn,int assembleInterpolation) {
-  
-	float	x, y;
-	long	ix, iy;
-	long	image_index;
-  
-	for(long i=0;i<image_nn;i++){
-		assembled_mask[i] = PIXEL_IS_MISSING;
-	}
-       		
-	if(assembleInterpolation == ASSEMBLE_INTERPOLATION_LINEAR){
-		// Loop through all pixels and interpolate onto regular grid
-  
-		for(long i=0;i<pix_nn;i++){
-			// Pixel location with (0,0) at array element (0,0) in bottom left corner
-			x = pix_x[i] + image_nx/2;
-			y = pix_y[i] + image_nx/2;
-		
-			// Split coordinate into integer and fractional parts
-			ix = (long) floor(x);
-			iy = (long) floor(y);
-
-			// Unite over adjacent 4 pixels
-			// (0,0)
-			if(ix>=0 && iy>=0 && ix<image_nx && iy<image_nx) {
-				image_index = ix + image_nx*iy;
-				assembled_mask[image_index] |= original_mask[i];
-				assembled_mask[image_index] &= ~PIXEL_IS_MISSING;
-			}
-			// (+1,0)
-			if((ix+1)>=0 && iy>=0 && (ix+1)<image_nx && iy<image_nx) {
-				image_index = (ix+1) + image_nx*iy;
-				assembled_mask[image_index] |= original_mask[i];
-				assembled_mask[image_index] &= ~PIXEL_IS_MISSING;
-			}
-			// (0,+1)
-			if(ix>=0 && (iy+1)>=0 && ix<image_nx && (iy+1)<image_nx) {
-				image_index = ix + image_nx*(iy+1);
-				assembled_mask[image_index] |= original_mask[i];
-				assembled_mask[image_index] &= ~PIXEL_IS_MISSING;
-			}
-			// (+1,+1)
-			if((ix+1)>=0 && (iy+1)>=0 && (ix+1)<image_nx && (iy+1)<image_nx) {
-				image_index = (ix+1) + image_nx*(iy+1);
-				assembled_mask[image_index] |= original_mask[i];
-				assembled_mask[image_index] &= ~PIXEL_IS_MISSING;
-			}
-		}
+void assemble2DMask(uint16_t *assembled_mask, uint16_t *original_mask, tAssemblyMatrix *assembly) {
+	long	*rowStart = assembly->rowStart;
+	int		*pixel = assembly->pixel;
+
+	if(assembly->interpolation == ASSEMBLE_INTERPOLATION_NEAREST){
+		for(long j=0; j<assembly->image_nn; j++)
+			assembled_mask[j] = (rowStart[j] == rowStart[j+1]) ? PIXEL_IS_MISSING : original_mask[pixel[rowStart[j]]];
+		return;
 	}
-	else if(assembleInterpolation == ASSEMBLE_INTERPOLATION_NEAREST){
-    
-		for(long i=0;i<pix_nn;i++){
-			x = pix_x[i] + image_nx/2.;
-			y = pix_y[i] + image_nx/2.;
-			ix = (long) (x+0.5);
-			iy = (long) (y+0.5);
-
-			image_index = ix + image_nx*iy;
-			assembled_mask[image_index] = original_mask[i];
-		}
+
+	// Unite over the raw pixels overlapping each image pixel
+	for(long j=0; j<assembly->image_nn; j++) {
+		uint16_t	united = 0;
+		for(long k=rowStart[j]; k<rowStart[j+1]; k++)
+			united |= original_mask[pixel[k]];
+		assembled_mask[j] = (rowStart[j] == rowStart[j+1]) ? PIXEL_IS_MISSING : (united & ~PIXEL_IS_MISSING);
 	}
 }
 
@@ -253,12 +259,7 @@ void assemble2DPowder(cGlobal *global) {
 
     DETECTOR_LOOP {
 		if (isAnyOfBitOptionsSet(global->detector[detIndex].powderFormat, cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)) {
-			long		pix_nn = global->detector[detIndex].pix_nn;
-			long		image_nx = global->detector[detIndex].image_nx;
-			long		image_nn = global->detector[detIndex].image_nn;
-			float		*pix_x = global->detector[detIndex].pix_x;
-			float		*pix_y = global->detector[detIndex].pix_y;
-			int             assembleInterpolation = global->assembleInterpolation;
+			tAssemblyMatrix	*assembly = &global->detector[detIndex].pix_assembly;
         
 			// Assemble each powder type
 			for(long powderClass=0; powderClass < global->nPowderClasses; powderClass++) {
@@ -266,28 +267,9 @@ void assemble2DPowder(cGlobal *global) {
 				cDataVersion dataV(NULL, &global->detector[detIndex], global->detector[detIndex].powderVersion, cDataVersion::DATA_FORMAT_NON_ASSEMBLED);
 				cDataVersion imageV(NULL, &global->detector[detIndex], global->detector[detIndex].powderVersion, cDataVersion::DATA_FORMAT_ASSEMBLED);
 				while (dataV.next() && imageV.next()) {
-
 					double * data = dataV.getPowder(powderClass);
 					double * image = imageV.getPowder(powderClass);
-
-					// Floating point buffer
-					float   *fdata = (float*) calloc(pix_nn,sizeof(float));
-					float   *fimage = (float*) calloc(image_nn,sizeof(float));
-
-					// Assembly is done using float; powder data is double (!!)	
-					for(long i=0; i<pix_nn; i++)
-						fdata[i] = (float) data[i];
-
-					// Assemble image
-					assemble2DImage(fimage, fdata, pix_x, pix_y, pix_nn, image_nx, image_nn, assembleInterpolation);
-
-					// Assembly is done using float; powder data is double (!!)
-					for(long i=0; i<image_nn; i++)
-						image[i] = (double) fimage[i];
-				
-					// Cleanup
-					free(fdata);
-					free(fimage);
+					assemble2DImage(image, data, assembly);
 				}
 			}
 		}
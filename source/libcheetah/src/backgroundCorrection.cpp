@@ -261,16 +261,303 @@ void subtractLocalBackground(cEventData *eventData, cGlobal *global){
 			long		nasics_x = global->detector[detIndex].nasics_x;
 			long		nasics_y = global->detector[detIndex].nasics_y;
 			long		radius = global->detector[detIndex].localBackgroundRadius;
+			int			mode = global->detector[detIndex].localBackgroundMode;
+			float		percentile = global->detector[detIndex].localBackgroundPercentile;
 			float		*data = eventData->detector[detIndex].data_detPhotCorr;
 			
-			subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, nasics_y);
+			int			layout = global->detector[detIndex].kernelLayout;
+			tLocalBackgroundWorkspace	*ws = global->detector[detIndex].getLocalBackgroundWorkspace(eventData->threadID);
+			
+			subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, nasics_y, mode, percentile, layout, ws);
+		}
+	}
+	
+}
+
+
+/*
+ *	Map a float onto an unsigned key with the same ordering (negative values have all bits flipped)
+ */
+static inline uint32_t localBackgroundKey(float value) {
+	uint32_t	u;
+	memcpy(&u, &value, sizeof(u));
+	return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+
+/*
+ *	Sort the n values of one ASIC (LSD radix sort, 3 passes of 11 bits)
+ *	On return sortedValue[r] is the r-th smallest value and rank[e] the position of element e in that order
+ */
+static void rankLocalBackgroundASIC(const float *asic, long n, uint32_t *key, uint32_t *keyTmp, int32_t *index, int32_t *indexTmp, float *sortedValue, int32_t *rank) {
+	long	count[2048];
+	
+	for(long e=0; e<n; e++) {
+		key[e] = localBackgroundKey(asic[e]);
+		index[e] = (int32_t) e;
+	}
+	for(int pass=0; pass<3; pass++) {
+		int		shift = 11*pass;
+		memset(count, 0, sizeof(count));
+		for(long e=0; e<n; e++)
+			count[(key[e] >> shift) & 2047] += 1;
+		long	offset = 0;
+		for(long b=0; b<2048; b++) {
+			long	c = count[b];
+			count[b] = offset;
+			offset += c;
+		}
+		for(long e=0; e<n; e++) {
+			long	dest = count[(key[e] >> shift) & 2047]++;
+			keyTmp[dest] = key[e];
+			indexTmp[dest] = index[e];
+		}
+		uint32_t	*swapKey = key; key = keyTmp; keyTmp = swapKey;
+		int32_t		*swapIndex = index; index = indexTmp; indexTmp = swapIndex;
+	}
+	for(long r=0; r<n; r++) {
+		sortedValue[r] = asic[index[r]];
+		rank[index[r]] = (int32_t) r;
+	}
+}
+
+
+/*
+ *	Set of distinct ranks (tRankWindow, the pixels inside the current window)
+ *	One bit per rank plus a count per block of 512 ranks; select() walks the block counts from the
+ *	block of the previous answer, which is rarely more than a block or two away
+ */
+static void rankWindowClear(tRankWindow *w) {
+	memset(w->bits, 0, w->nWords*sizeof(uint64_t));
+	memset(w->blockCount, 0, w->nBlocks*sizeof(int32_t));
+	w->block = 0;
+	w->below = 0;
+}
+
+static inline void rankWindowAdd(tRankWindow *w, int32_t r) {
+	w->bits[r >> 6] |= ((uint64_t) 1) << (r & 63);
+	w->blockCount[r >> 9] += 1;
+	if((r >> 9) < w->block)
+		w->below += 1;
+}
+
+static inline void rankWindowRemove(tRankWindow *w, int32_t r) {
+	w->bits[r >> 6] &= ~(((uint64_t) 1) << (r & 63));
+	w->blockCount[r >> 9] -= 1;
+	if((r >> 9) < w->block)
+		w->below -= 1;
+}
+
+// Rank of the k-th smallest (0-based) member of the window
+static inline long rankWindowSelect(tRankWindow *w, long k) {
+	while(w->below > k) {
+		w->block -= 1;
+		w->below -= w->blockCount[w->block];
+	}
+	while(w->below + w->blockCount[w->block] <= k) {
+		w->below += w->blockCount[w->block];
+		w->block += 1;
+	}
+	k -= w->below;
+	long	word = w->block*8;
+	long	c;
+	while(k >= (c = __builtin_popcountll(w->bits[word]))) {
+		k -= c;
+		word++;
+	}
+	uint64_t	bits = w->bits[word];
+	while(k > 0) {
+		bits &= bits-1;
+		k--;
+	}
+	return word*64 + __builtin_ctzll(bits);
+}
+
+
+/*
+ *	Local background of one ASIC: k-th smallest value within the (2r+1)x(2r+1) window, clipped at the
+ *	ASIC edges, with k = percentile*count (count/2 for the median, as kth_smallest was called before)
+ *	Moving the window along a row only adds and removes one column of ranks.
+ */
+static void localBackgroundRankFilter(float *localBg, long asic_nx, long asic_ny, long radius, float percentile, float *sortedValue, int32_t *rank, tRankWindow *w) {
+	for(long j=0; j<asic_ny; j++) {
+		long	j0 = (j-radius < 0) ? 0 : j-radius;
+		long	j1 = (j+radius >= asic_ny) ? asic_ny-1 : j+radius;
+		long	nrows = j1-j0+1;
+
+		rankWindowClear(w);
+		for(long i=0; i<=radius && i<asic_nx; i++)
+			for(long jj=j0; jj<=j1; jj++)
+				rankWindowAdd(w, rank[i+jj*asic_nx]);
+
+		for(long i=0; i<asic_nx; i++) {
+			if(i > 0) {
+				if(i+radius < asic_nx)
+					for(long jj=j0; jj<=j1; jj++)
+						rankWindowAdd(w, rank[i+radius+jj*asic_nx]);
+				if(i-radius-1 >= 0)
+					for(long jj=j0; jj<=j1; jj++)
+						rankWindowRemove(w, rank[i-radius-1+jj*asic_nx]);
+			}
+			long	i0 = (i-radius < 0) ? 0 : i-radius;
+			long	i1 = (i+radius >= asic_nx) ? asic_nx-1 : i+radius;
+			long	counter = nrows*(i1-i0+1);
+			long	k = (long) (percentile*counter);
+			if(k < 0) k = 0;
+			if(k >= counter) k = counter-1;
+			localBg[i+j*asic_nx] = sortedValue[rankWindowSelect(w, k)];
 		}
 	}
+}
+
+
+/*
+ *	Local background of one ASIC: mean over the clipped window, from a summed-area table
+ */
+static void localBackgroundMean(const float *asic, float *localBg, long asic_nx, long asic_ny, long radius, double *sat) {
+	long	sat_nx = asic_nx+1;
 	
+	for(long i=0; i<sat_nx; i++)
+		sat[i] = 0;
+	for(long j=0; j<asic_ny; j++) {
+		double	rowSum = 0;
+		sat[(j+1)*sat_nx] = 0;
+		for(long i=0; i<asic_nx; i++) {
+			rowSum += asic[i+j*asic_nx];
+			sat[(i+1)+(j+1)*sat_nx] = sat[(i+1)+j*sat_nx] + rowSum;
+		}
+	}
+	for(long j=0; j<asic_ny; j++) {
+		long	j0 = (j-radius < 0) ? 0 : j-radius;
+		long	j1 = (j+radius >= asic_ny) ? asic_ny : j+radius+1;
+		for(long i=0; i<asic_nx; i++) {
+			long	i0 = (i-radius < 0) ? 0 : i-radius;
+			long	i1 = (i+radius >= asic_nx) ? asic_nx : i+radius+1;
+			double	sum = sat[i1+j1*sat_nx] - sat[i0+j1*sat_nx] - sat[i1+j0*sat_nx] + sat[i0+j0*sat_nx];
+			localBg[i+j*asic_nx] = (float) (sum / ((j1-j0)*(i1-i0)));
+		}
+	}
 }
 
 
+/*
+ *	Subtract the median of the (2r+1)x(2r+1) neighbourhood (clipped to the ASIC) from every pixel
+ */
 void subtractLocalBackground(float *data, long radius, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
+	subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, nasics_y, LOCAL_BACKGROUND_MEDIAN, 0.5);
+}
+
+
+/*
+ *	mode LOCAL_BACKGROUND_MEDIAN: subtract the given percentile of the window (0.5: median)
+ *	mode LOCAL_BACKGROUND_MEAN: subtract the window mean
+ */
+void subtractLocalBackground(float *data, long radius, long asic_nx, long asic_ny, long nasics_x, long nasics_y, int mode, float percentile) {
+	subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, nasics_y, mode, percentile, detectorLayout(asic_nx, asic_ny, nasics_x));
+}
+
+/*
+ *	Copy one ASIC out of the frame, and subtract its local background in place
+ */
+template <class L>
+static void extractASIC(float *asic_buffer, const float *asic_data, long asic_nx, long asic_ny, long nasics_x) {
+	asic_nx = L::asicNx(asic_nx);
+	asic_ny = L::asicNy(asic_ny);
+	long	pix_nx = asic_nx*L::nasicsX(nasics_x);
+	for(long j=0; j<asic_ny; j++)
+		memcpy(asic_buffer+j*asic_nx, asic_data+j*pix_nx, asic_nx*sizeof(float));
+}
+
+template <class L>
+static void subtractASIC(float *asic_data, const float *localBg, long asic_nx, long asic_ny, long nasics_x) {
+	asic_nx = L::asicNx(asic_nx);
+	asic_ny = L::asicNy(asic_ny);
+	long	pix_nx = asic_nx*L::nasicsX(nasics_x);
+	for(long j=0; j<asic_ny; j++)
+		for(long i=0; i<asic_nx; i++)
+			asic_data[i+j*pix_nx] -= localBg[i+j*asic_nx];
+}
+
+static void freeLocalBackgroundRankFilter(tLocalBackgroundWorkspace *ws) {
+	free(ws->key);
+	free(ws->keyTmp);
+	free(ws->index);
+	free(ws->indexTmp);
+	free(ws->rank);
+	free(ws->sortedValue);
+	free(ws->window.bits);
+	free(ws->window.blockCount);
+	memset(&ws->window, 0, sizeof(tRankWindow));
+	ws->key = ws->keyTmp = NULL;
+	ws->index = ws->indexTmp = ws->rank = NULL;
+	ws->sortedValue = NULL;
+	ws->rank_nn = 0;
+}
+
+/*
+ *	Scratch arrays for ASICs of asic_nx x asic_ny in the given mode, kept from one frame to the next
+ *	(grown when needed, never shrunk; the rank window is sized for the current ASIC)
+ */
+void prepareLocalBackgroundWorkspace(tLocalBackgroundWorkspace *ws, long asic_nx, long asic_ny, int mode) {
+	long	asic_nn = asic_nx*asic_ny;
+	
+	if(asic_nn > ws->asic_nn) {
+		free(ws->asic_buffer);
+		free(ws->localBg);
+		ws->asic_buffer = (float*) calloc(asic_nn, sizeof(float));
+		ws->localBg = (float*) calloc(asic_nn, sizeof(float));
+		ws->asic_nn = asic_nn;
+	}
+	if(mode == LOCAL_BACKGROUND_MEAN) {
+		long	sat_nn = (asic_nx+1)*(asic_ny+1);
+		if(sat_nn > ws->sat_nn) {
+			free(ws->sat);
+			ws->sat = (double*) calloc(sat_nn, sizeof(double));
+			ws->sat_nn = sat_nn;
+		}
+		return;
+	}
+	if(asic_nn > ws->rank_nn) {
+		freeLocalBackgroundRankFilter(ws);
+		long	nBlocks = (asic_nn+511)/512;
+		ws->key = (uint32_t*) calloc(asic_nn, sizeof(uint32_t));
+		ws->keyTmp = (uint32_t*) calloc(asic_nn, sizeof(uint32_t));
+		ws->index = (int32_t*) calloc(asic_nn, sizeof(int32_t));
+		ws->indexTmp = (int32_t*) calloc(asic_nn, sizeof(int32_t));
+		ws->rank = (int32_t*) calloc(asic_nn, sizeof(int32_t));
+		ws->sortedValue = (float*) calloc(asic_nn, sizeof(float));
+		ws->window.bits = (uint64_t*) calloc(nBlocks*8, sizeof(uint64_t));
+		ws->window.blockCount = (int32_t*) calloc(nBlocks+1, sizeof(int32_t));
+		ws->rank_nn = asic_nn;
+	}
+	ws->window.nBlocks = (asic_nn+511)/512;
+	ws->window.nWords = ws->window.nBlocks*8;
+}
+
+void freeLocalBackgroundWorkspace(tLocalBackgroundWorkspace *ws) {
+	free(ws->asic_buffer);
+	free(ws->localBg);
+	free(ws->sat);
+	freeLocalBackgroundRankFilter(ws);
+	ws->asic_buffer = NULL;
+	ws->localBg = NULL;
+	ws->sat = NULL;
+	ws->asic_nn = 0;
+	ws->sat_nn = 0;
+}
+
+
+/*
+ *	As above, with the copy and subtraction specialised for the detector's layout (cPixelDetectorCommon::kernelLayout)
+ *	(scratch space for this call only: workers pass their own workspace, see getLocalBackgroundWorkspace)
+ */
+void subtractLocalBackground(float *data, long radius, long asic_nx, long asic_ny, long nasics_x, long nasics_y, int mode, float percentile, int layout) {
+	tLocalBackgroundWorkspace	ws = {};
+	subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, nasics_y, mode, percentile, layout, &ws);
+	freeLocalBackgroundWorkspace(&ws);
+}
+
+void subtractLocalBackground(float *data, long radius, long asic_nx, long asic_ny, long nasics_x, long nasics_y, int mode, float percentile, int layout, tLocalBackgroundWorkspace *ws) {
 	
 	// Tank for silly radius values
 	if(radius <= 0 || radius >= asic_ny/2 )
@@ -278,116 +565,42 @@ void subtractLocalBackground(float *data, long radius, long asic_nx, long asic_n
 	
 	// Raw data array size can be calculated from asic modules
 	long	pix_nx = asic_nx*nasics_x;
-	long	pix_ny = asic_ny*nasics_y;
-	long	pix_nn = pix_nx*pix_ny;
 	long	asic_nn = asic_nx*asic_ny;
 	
+	// Copy in and subtract with the layout's tile shape
+	// (only these: the sort and the rank window are data-bound and are kept as one copy the compiler inlines)
+	void	(*extract)(float*, const float*, long, long, long) = NULL;
+	void	(*subtract)(float*, const float*, long, long, long) = NULL;
+	layout = detectorLayout(layout, asic_nx, asic_ny, nasics_x);
+	DETECTOR_LAYOUT_SELECT(layout, extract, extractASIC);
+	DETECTOR_LAYOUT_SELECT(layout, subtract, subtractASIC);
 	
-	// Median window size
-	long nn = (2*radius+1);
-	nn=nn*nn;
-	
-	float	*asic_buffer = (float*) calloc(asic_nn, sizeof(float));
-	float	*median_buffer = (float*) calloc(nn, sizeof(float));
-	float	*localBg = (float*) calloc(pix_nn, sizeof(float)); 
-	
-	
-	/*
-	 *	Determine local background
-	 *	(median over window width either side of current pixel)
-	 */
-	long		e = 0;
-	long        ee;
-	long		counter;
-	
+	prepareLocalBackgroundWorkspace(ws, asic_nx, asic_ny, mode);
+	float	*asic_buffer = ws->asic_buffer;
+	float	*localBg = ws->localBg;
 	
 	// Loop over ASIC modules 
 	for(long mj=0; mj<nasics_y; mj++){
 		for(long mi=0; mi<nasics_x; mi++){
 			
 			// Extract buffer of ASIC values (small array is cache friendly)
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					
-					// Element in ASIC buffer
-					e = i+j*asic_nx;
-					
-					// Element in data array
-					ee = (j+mj*asic_ny)*pix_nx;
-					ee += i+mi*asic_nx;
-					
-					asic_buffer[e] = data[ee];
-				}
-			}
+			float	*asic_data = data + mj*asic_ny*pix_nx + mi*asic_nx;
+			extract(asic_buffer, asic_data, asic_nx, asic_ny, nasics_x);
 			
-			// Loop over pixels within a module
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					
-					counter = 0;
-					
-					// Loop over median window
-					for(long jj=-radius; jj<=radius; jj++){
-						for(long ii=-radius; ii<=radius; ii++){
-							
-							// Quick array bounds check
-							if((i+ii) < 0)
-								continue;
-							if((i+ii) >= asic_nx)
-								continue;
-							if((j+jj) < 0)
-								continue;
-							if((j+jj) >= asic_ny)
-								continue;
-							
-							// Element in asic buffer
-							e = (j+jj)*asic_nx;
-							e += i+ii;
-							if(e < 0 || e >= asic_nn){
-								printf("Error: Array bounds error: e = %li > %li\n",e,asic_nn);
-								continue;
-							}
-							median_buffer[counter] = asic_buffer[e];
-							
-							counter++;
-						}
-					}
-					
-					// Element in data array
-					ee = (j+mj*asic_ny)*pix_nx;
-					ee += i+mi*asic_nx;
-
-					// No elements -> trap an error
-					if(counter == 0) {
-						printf("Error: Local background counter == 0\n");
-						localBg[e] = 0;
-						continue;
-					}
-					if(counter > nn) {
-						printf("Error: counter == %li > %li\n",counter,nn);
-						continue;
-					}
-					
-					// Find median value
-					localBg[ee] = kth_smallest(median_buffer, counter, counter/2);
-				}
+			// Determine local background
+			if(mode == LOCAL_BACKGROUND_MEAN) {
+				localBackgroundMean(asic_buffer, localBg, asic_nx, asic_ny, radius, ws->sat);
+			}
+			else {
+				rankLocalBackgroundASIC(asic_buffer, asic_nn, ws->key, ws->keyTmp, ws->index, ws->indexTmp, ws->sortedValue, ws->rank);
+				localBackgroundRankFilter(localBg, asic_nx, asic_ny, radius, percentile, ws->sortedValue, ws->rank, &ws->window);
 			}
+			
+			// Do the background subtraction
+			subtract(asic_data, localBg, asic_nx, asic_ny, nasics_x);
 		}
 	}
-	
-	
-	/*
-	 *	Do the background subtraction
-	 */
-	for(long i=0;i<pix_nn;i++) {
-		data[i] -= localBg[i];	
-	}	
-	
-	
-	// Cleanup
-	free(localBg);
-	free(asic_buffer);
-	free(median_buffer);
 }
 
 
+
@@ -0,0 +1,212 @@
+//
+//  commonMode.cpp
+//  cheetah
+//
+//  Per-ASIC common mode (k-th lowest pixel value of each ASIC) for cmModule
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "detectorObject.h"
+#include "commonMode.h"
+#include "median.h"
+
+
+/*
+ *	Make sure the workspace has nBuffers value buffers and histograms for ASICs of asic_nn pixels
+ */
+void prepareCommonModeWorkspace(tCommonModeWorkspace *ws, long asic_nn, long nBuffers) {
+	if(asic_nn > ws->asic_nn || nBuffers > ws->nBuffers) {
+		if(asic_nn < ws->asic_nn)
+			asic_nn = ws->asic_nn;
+		if(nBuffers < ws->nBuffers)
+			nBuffers = ws->nBuffers;
+		free(ws->buffer);
+		free(ws->histogram);
+		ws->buffer = (float *) calloc(nBuffers*asic_nn, sizeof(float));
+		ws->histogram = (int32_t *) calloc(nBuffers*4*(CM_HISTOGRAM_BINS+2), sizeof(int32_t));
+		ws->asic_nn = asic_nn;
+		ws->nBuffers = nBuffers;
+	}
+}
+
+void freeCommonModeWorkspace(tCommonModeWorkspace *ws) {
+	freeThreadTeam(&ws->team);
+	free(ws->buffer);
+	free(ws->histogram);
+	ws->buffer = NULL;
+	ws->histogram = NULL;
+	ws->asic_nn = 0;
+	ws->nBuffers = 0;
+}
+
+
+/*
+ *	Histogram bin of value v for a histogram starting at lo: 0 below lo, CM_HISTOGRAM_BINS+1 from lo+CM_HISTOGRAM_BINS on.
+ *	Monotonic in v, so all values of a lower bin are smaller than those of any higher bin (NaN goes to the underflow bin).
+ */
+static inline long commonModeBin(float v, float lo) {
+	float	x = v - lo + 1;
+	if(!(x >= 0))
+		x = 0;
+	if(x > CM_HISTOGRAM_BINS+1)
+		x = CM_HISTOGRAM_BINS+1;
+	return (long) x;
+}
+
+
+/*
+ *	k-th smallest of values[0 .. n-1] (0 <= k < n), the same value kth_smallest returns; values are reordered.
+ *	CM_ESTIMATOR_HISTOGRAM centres a 1 ADU histogram on the k-th smallest of a sample of the values,
+ *	finds the bin holding rank k and runs kth_smallest only on the values of that bin
+ *	(the whole under- or overflow bin if the sample missed, which is still exact, just slower).
+ */
+float commonModeKthSmallest(float *values, long n, long k, int estimator, int32_t *histogram) {
+	const long	nSample = 256;
+
+	if(estimator != CM_ESTIMATOR_HISTOGRAM || n < 4*nSample)
+		return kth_smallest(values, n, k);
+
+	// Estimate from every stride-th value
+	float	sample[nSample];
+	long	stride = n/nSample;
+	for(long i=0; i<nSample; i++)
+		sample[i] = values[i*stride];
+	float	estimate = kth_smallest(sample, nSample, k*nSample/n);
+	float	lo = floorf(estimate) - CM_HISTOGRAM_BINS/2;
+
+	// Histogram, then the bin holding rank k
+	// (counted into four interleaved copies so that runs of equal bins do not wait on each other's increments)
+	const long	nh = CM_HISTOGRAM_BINS+2;
+	memset(histogram, 0, 4*nh*sizeof(int32_t));
+	long	n4 = n & ~3L;
+	for(long i=0; i<n4; i+=4) {
+		histogram[commonModeBin(values[i], lo)]++;
+		histogram[nh + commonModeBin(values[i+1], lo)]++;
+		histogram[2*nh + commonModeBin(values[i+2], lo)]++;
+		histogram[3*nh + commonModeBin(values[i+3], lo)]++;
+	}
+	for(long i=n4; i<n; i++)
+		histogram[commonModeBin(values[i], lo)]++;
+	for(long b=0; b<nh; b++)
+		histogram[b] += histogram[nh+b] + histogram[2*nh+b] + histogram[3*nh+b];
+	long	bin = 0;
+	long	below = 0;
+	while(below + histogram[bin] <= k) {
+		below += histogram[bin];
+		bin++;
+	}
+
+	// Select within that bin
+	long	m = 0;
+	for(long i=0; i<n; i++) {
+		float	v = values[i];
+		values[m] = v;
+		m += (commonModeBin(v, lo) == bin);
+	}
+	return kth_smallest(values, m, k-below);
+}
+
+
+
+/*
+ *	Common mode of the ASICs asic0 .. asic1-1 (row by row over the nasics_x x nasics_y array)
+ */
+typedef struct {
+	float		*data;
+	uint16_t	*mask;
+	float		threshold;
+	long		asic_nx;
+	long		asic_ny;
+	long		nasics_x;
+	long		asic0;
+	long		asic1;
+	int			estimator;
+	float		*buffer;
+	int32_t		*histogram;
+} tCommonModeTask;
+
+template <class L>
+static void *cspadModuleSubtractASICs(void *arg) {
+	tCommonModeTask	*task = (tCommonModeTask *) arg;
+	float		*data = task->data;
+	uint16_t	*mask = task->mask;
+	float		*buffer = task->buffer;
+	const long	asic_nx = L::asicNx(task->asic_nx);
+	const long	asic_ny = L::asicNy(task->asic_ny);
+	const long	nasics_x = L::nasicsX(task->nasics_x);
+	const long	pix_nx = asic_nx*nasics_x;
+
+	for(long asic=task->asic0; asic<task->asic1; asic++) {
+		long	mi = asic % nasics_x;
+		long	mj = asic / nasics_x;
+		long	e0 = mj*asic_ny*pix_nx + mi*asic_nx;
+
+		// Good pixels of this ASIC
+		long	counter = 0;
+		for(long j=0; j<asic_ny; j++) {
+			long	e = e0 + j*pix_nx;
+			for(long i=0; i<asic_nx; i++) {
+				buffer[counter] = data[e+i];
+				counter += isBitOptionUnset(mask[e+i], PIXEL_IS_BAD);
+			}
+		}
+
+		// k-th lowest value
+		float	median = 0;
+		if(counter > 0) {
+			long	mval = lrint(counter*task->threshold);
+			if(mval < 0)
+				mval = 1;
+			if(mval >= counter)
+				mval = counter-1;
+			median = commonModeKthSmallest(buffer, counter, mval, task->estimator, task->histogram);
+		}
+
+		// Subtract it
+		for(long j=0; j<asic_ny; j++) {
+			long	e = e0 + j*pix_nx;
+			for(long i=0; i<asic_nx; i++)
+				data[e+i] -= median;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ *	Subtract the common mode of each ASIC, with ws->estimator and the kernel specialised for ws->layout.
+ *	With ws->nThreads > 1 the ASICs are split into contiguous ranges done in parallel.
+ */
+void cspadModuleSubtract(float *data, uint16_t *mask, float threshold, long asic_nx, long asic_ny, long nasics_x, long nasics_y, tCommonModeWorkspace *ws) {
+	long	nasics = nasics_x*nasics_y;
+	long	nt = ws->nThreads;
+	if(nt < 1)
+		nt = 1;
+	if(nt > nasics)
+		nt = nasics;
+	prepareCommonModeWorkspace(ws, asic_nx*asic_ny, nt);
+	void	*(*subtractASICs)(void *) = NULL;
+	DETECTOR_LAYOUT_SELECT(detectorLayout(ws->layout, asic_nx, asic_ny, nasics_x), subtractASICs, cspadModuleSubtractASICs);
+
+	tCommonModeTask	*tasks = (tCommonModeTask *) threadTeamTasks(&ws->team, nt, sizeof(tCommonModeTask));
+	for(long t=0; t<nt; t++) {
+		tasks[t].data = data;
+		tasks[t].mask = mask;
+		tasks[t].threshold = threshold;
+		tasks[t].asic_nx = asic_nx;
+		tasks[t].asic_ny = asic_ny;
+		tasks[t].nasics_x = nasics_x;
+		tasks[t].asic0 = nasics*t/nt;
+		tasks[t].asic1 = nasics*(t+1)/nt;
+		tasks[t].estimator = ws->estimator;
+		tasks[t].buffer = ws->buffer + t*ws->asic_nn;
+		tasks[t].histogram = ws->histogram + t*4*(CM_HISTOGRAM_BINS+2);
+	}
+
+	// Run ranges 1..nt-1 on the worker's team and range 0 here
+	threadTeamRun(&ws->team, subtractASICs);
+}
@@ -0,0 +1,127 @@
+/*
+ *  cxiWriter.cpp
+ *  cheetah
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "cheetah.h"
+#include "cxiWriter.h"
+
+cCXIWriter::cCXIWriter(long queueDepth0) {
+	queueDepth = queueDepth0;
+	if (queueDepth < 1) queueDepth = 1;
+
+	// Ring buffer of events waiting to be written
+	queue = (cEventData **) calloc(queueDepth, sizeof(cEventData *));
+	queueHead = 0;
+	queueCount = 0;
+	stopping = false;
+	pthread_mutex_init(&queue_mutex, NULL);
+	pthread_mutex_init(&write_mutex, NULL);
+	pthread_cond_init(&queueNotEmpty, NULL);
+	pthread_cond_init(&queueNotFull, NULL);
+
+	if (pthread_create(&thread, NULL, writerLoop, (void *) this) != 0) {
+		ERROR("Failed to create CXI writer thread");
+	}
+}
+
+cCXIWriter::~cCXIWriter() {
+	shutdown();
+	free(queue);
+	pthread_cond_destroy(&queueNotFull);
+	pthread_cond_destroy(&queueNotEmpty);
+	pthread_mutex_destroy(&write_mutex);
+	pthread_mutex_destroy(&queue_mutex);
+}
+
+/*
+ *	Queue a finished event for writing (blocks while the writer is queueDepth events behind)
+ *	The writer owns the event from here on: it destroys it and decrements nActiveCheetahThreads
+ */
+int cCXIWriter::push(cEventData *eventData) {
+	pthread_mutex_lock(&queue_mutex);
+	while (queueCount == queueDepth && !stopping) {
+		pthread_cond_wait(&queueNotFull, &queue_mutex);
+	}
+	if (stopping) {
+		pthread_mutex_unlock(&queue_mutex);
+		return -1;
+	}
+	queue[(queueHead + queueCount) % queueDepth] = eventData;
+	queueCount += 1;
+	pthread_cond_signal(&queueNotEmpty);
+	pthread_mutex_unlock(&queue_mutex);
+	return 0;
+}
+
+/*
+ *	Take the next event off the queue (NULL once the writer is shutting down and the queue is empty)
+ */
+cEventData *cCXIWriter::pop() {
+	cEventData *eventData = NULL;
+	pthread_mutex_lock(&queue_mutex);
+	while (queueCount == 0 && !stopping) {
+		pthread_cond_wait(&queueNotEmpty, &queue_mutex);
+	}
+	if (queueCount > 0) {
+		eventData = queue[queueHead];
+		queueHead = (queueHead + 1) % queueDepth;
+		queueCount -= 1;
+		pthread_cond_signal(&queueNotFull);
+	}
+	pthread_mutex_unlock(&queue_mutex);
+	return eventData;
+}
+
+/*
+ *	Write whatever is still queued, then join the writer
+ */
+void cCXIWriter::shutdown() {
+	pthread_mutex_lock(&queue_mutex);
+	if (stopping) {
+		pthread_mutex_unlock(&queue_mutex);
+		return;
+	}
+	stopping = true;
+	pthread_cond_broadcast(&queueNotEmpty);
+	pthread_cond_broadcast(&queueNotFull);
+	pthread_mutex_unlock(&queue_mutex);
+
+	pthread_join(thread, NULL);
+}
+
+/*
+ *	Keep the writer out of the CXI files (between two events), e.g. while another thread flushes the slabs
+ */
+void cCXIWriter::lockWrites() {
+	pthread_mutex_lock(&write_mutex);
+}
+
+void cCXIWriter::unlockWrites() {
+	pthread_mutex_unlock(&write_mutex);
+}
+
+/*
+ *	Events are written in queue order, so stack slices grow monotonically
+ *	and the slabs in each dataset fill up front to back
+ */
+void *cCXIWriter::writerLoop(void *threadarg) {
+	cCXIWriter *writer = (cCXIWriter *) threadarg;
+	cEventData *eventData;
+	while ((eventData = writer->pop()) != NULL) {
+		cGlobal *global = eventData->pGlobal;
+		pthread_mutex_lock(&writer->write_mutex);
+		writeCXI(eventData, global);
+		pthread_mutex_unlock(&writer->write_mutex);
+		cheetahDestroyEvent(eventData);
+
+		pthread_mutex_lock(&global->nActiveThreads_mutex);
+		global->nActiveCheetahThreads -= 1;
+		pthread_mutex_unlock(&global->nActiveThreads_mutex);
+	}
+	return NULL;
+}
@@ -23,13 +23,32 @@
 #include "cheetahGlobal.h"
 #include "cheetahEvent.h"
 #include "detectorObject.h"
+#include "cheetahmodules.h"
+
+template <class T>
+static void initRaw(T *raw_input, float *data_raw, long pix_nn) {
+	for(long i=0;i<pix_nn;i++){
+		data_raw[i] = raw_input[i];
+	}
+}
 
 void initRaw(cEventData *eventData, cGlobal *global){
-	// Copy raw detector data into float array
+	// Copy raw detector data into float array (float raw data is in it already)
 	DETECTOR_LOOP {
 		DEBUG3("Initializing raw data array (float). (detectorID=%ld)",global->detector[detIndex].detectorID);
-		for(long i=0;i<global->detector[detIndex].pix_nn;i++){
-			eventData->detector[detIndex].data_raw[i] = eventData->detector[detIndex].data_raw16[i];
+		cPixelDetectorEvent *detectorEvent = &eventData->detector[detIndex];
+		long	pix_nn = global->detector[detIndex].pix_nn;
+		switch(detectorEvent->rawType) {
+			case RAW_TYPE_INT32:
+				initRaw((int32_t*) detectorEvent->rawInput, detectorEvent->data_raw, pix_nn);
+				break;
+			case RAW_TYPE_FLOAT:
+				if(detectorEvent->rawInput != detectorEvent->data_raw)
+					memcpy(detectorEvent->data_raw, detectorEvent->rawInput, pix_nn*sizeof(float));
+				break;
+			default:
+				initRaw((uint16_t*) detectorEvent->rawInput, detectorEvent->data_raw, pix_nn);
+				break;
 		}
 	}
 }
@@ -69,6 +88,7 @@ cDataVersion::cDataVersion(cPixelDetectorEvent * detectorEvent0, cPixelDetectorC
 	dataVersionMain = detectorCommon->dataVersionMain;
 	powderVersionMain = detectorCommon->powderVersionMain;
 	dataVersionIndex = -1;
+	ready = NULL;
 
 	clear();
 	pixelmask = NULL;
@@ -114,6 +134,7 @@ cDataVersion::cDataVersion(cPixelDetectorEvent * detectorEvent0, cPixelDetectorC
 			detCorr               = detectorEvent->image_detCorr;
 			detPhotCorr           = detectorEvent->image_detPhotCorr;
 			pixelmask             = detectorEvent->image_pixelmask;
+			ready                 = &detectorEvent->imageReady;
 		}
 		// Global
 		memcpy(&(powder_raw[0]), &(detectorCommon->powderImage_raw[0]), sizeof(double*)*detectorCommon->nPowderClasses);
@@ -138,6 +159,7 @@ cDataVersion::cDataVersion(cPixelDetectorEvent * detectorEvent0, cPixelDetectorC
 			detCorr               = detectorEvent->imageXxX_detCorr;
 			detPhotCorr           = detectorEvent->imageXxX_detPhotCorr;
 			pixelmask             = detectorEvent->imageXxX_pixelmask;
+			ready                 = &detectorEvent->imageXxXReady;
 		}
 		// Global
 		memcpy(&(powder_raw[0]), &(detectorCommon->powderImageXxX_raw[0]), sizeof(double*)*detectorCommon->nPowderClasses);
@@ -162,6 +184,7 @@ cDataVersion::cDataVersion(cPixelDetectorEvent * detectorEvent0, cPixelDetectorC
 			detCorr                 = detectorEvent->radialAverage_detCorr;
 			detPhotCorr             = detectorEvent->radialAverage_detPhotCorr;
 			pixelmask               = detectorEvent->radialAverage_pixelmask;
+			ready                   = &detectorEvent->radialAverageReady;
 		}
 		// Global
 		memcpy(&(powder_raw[0]), &(detectorCommon->powderRadialAverage_raw[0]), sizeof(double*)*detectorCommon->nPowderClasses);
@@ -272,6 +295,9 @@ bool cDataVersion::next(){
 
 
 float * cDataVersion::getData() {
+	if (ready != NULL && dataVersionIndex >= 0 && dataVersionIndex < DATA_VERSION_N) {
+		data = materialize(dataVersionIndex);
+	}
 	if (data == NULL) {
 		ERROR("Trying to access data that does not exist!");
 	} 
@@ -279,6 +305,9 @@ float * cDataVersion::getData() {
 }
 
 uint16_t * cDataVersion::getPixelmask() {
+	if (ready != NULL) {
+		pixelmask = materializePixelmask();
+	}
 	if (pixelmask == NULL) {
 		ERROR("Trying to access pixelmask that does not exist!");
 	}
@@ -306,3 +335,133 @@ pthread_mutex_t * cDataVersion::getPowderMutex(long powderClass) {
 	return powder_mutex[powderClass];
 }
 
+
+/*
+ *	Event arrays of the derived formats (assembled, downsampled, radial average) are only computed
+ *	when a consumer first asks for them, once per event and data version, and kept until the event
+ *	is reused (resetEventData clears the ready bits). Frames that are never saved or summed in a
+ *	derived format therefore cost nothing here. Buffers not allocated up front (lazyImageBuffers)
+ *	are allocated on first use and stay with the (pooled) event.
+ */
+float ** cDataVersion::eventBuffer(int versionIndex) {
+	if (dataFormat == DATA_FORMAT_ASSEMBLED)
+		return (versionIndex == 0) ? &detectorEvent->image_raw : (versionIndex == 1) ? &detectorEvent->image_detCorr : &detectorEvent->image_detPhotCorr;
+	else if (dataFormat == DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)
+		return (versionIndex == 0) ? &detectorEvent->imageXxX_raw : (versionIndex == 1) ? &detectorEvent->imageXxX_detCorr : &detectorEvent->imageXxX_detPhotCorr;
+	else
+		return (versionIndex == 0) ? &detectorEvent->radialAverage_raw : (versionIndex == 1) ? &detectorEvent->radialAverage_detCorr : &detectorEvent->radialAverage_detPhotCorr;
+}
+
+uint16_t ** cDataVersion::eventPixelmask() {
+	if (dataFormat == DATA_FORMAT_ASSEMBLED)
+		return &detectorEvent->image_pixelmask;
+	else if (dataFormat == DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)
+		return &detectorEvent->imageXxX_pixelmask;
+	else
+		return &detectorEvent->radialAverage_pixelmask;
+}
+
+float * cDataVersion::materialize(int versionIndex) {
+	float		**buffer = eventBuffer(versionIndex);
+	uint16_t	versionBit = 1 << versionIndex;
+
+	if (*buffer == NULL) {
+		*buffer = (float*) calloc(pix_nn, sizeof(float));
+	}
+	if (isBitOptionSet(*ready, versionBit)) {
+		return *buffer;
+	}
+
+	float	*data2d = (versionIndex == 0) ? detectorEvent->data_raw : (versionIndex == 1) ? detectorEvent->data_detCorr : detectorEvent->data_detPhotCorr;
+	if (dataFormat == DATA_FORMAT_ASSEMBLED) {
+		assemble2DImage(*buffer, data2d, &detectorCommon->pix_assembly);
+	}
+	else if (dataFormat == DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED) {
+		// Downsampled from the assembled image of the same version (assembled first if need be)
+		cDataVersion imageV(detectorEvent, detectorCommon, (dataVersion_t) versionBit, DATA_FORMAT_ASSEMBLED);
+		imageV.next();
+		float	*image = imageV.getData();
+		if (detectorCommon->downsamplingConservative == 1)
+			downsampleImageConservative(image, *buffer, imageV.pix_nn, imageV.pix_nx, pix_nn, pix_nx, detectorCommon->downsampling, 0);
+		else
+			downsampleImageNonConservative(image, *buffer, imageV.pix_nn, imageV.pix_nx, pix_nn, pix_nx, imageV.getPixelmask(), detectorCommon->downsampling, 0);
+	}
+	else if (dataFormat == DATA_FORMAT_RADIAL_AVERAGE) {
+		// The radial pixelmask comes out of the same pass
+		uint16_t	**pixelmaskRadial = eventPixelmask();
+		if (*pixelmaskRadial == NULL)
+			*pixelmaskRadial = (uint16_t*) calloc(pix_nn, sizeof(uint16_t));
+		calculateRadialAverage(data2d, detectorEvent->pixelmask, *buffer, *pixelmaskRadial, &detectorCommon->pix_rbins, detectorCommon->radial_nn);
+		*ready |= PIXELMASK_READY;
+	}
+	*ready |= versionBit;
+	return *buffer;
+}
+
+uint16_t * cDataVersion::materializePixelmask() {
+	uint16_t	**buffer = eventPixelmask();
+
+	if (dataFormat == DATA_FORMAT_RADIAL_AVERAGE && isBitOptionUnset(*ready, PIXELMASK_READY)) {
+		materialize((dataVersionIndex >= 0 && dataVersionIndex < DATA_VERSION_N) ? dataVersionIndex : 0);
+	}
+	if (*buffer == NULL) {
+		*buffer = (uint16_t*) calloc(pix_nn, sizeof(uint16_t));
+	}
+	if (isBitOptionSet(*ready, PIXELMASK_READY)) {
+		return *buffer;
+	}
+
+	if (dataFormat == DATA_FORMAT_ASSEMBLED) {
+		assemble2DMask(*buffer, detectorEvent->pixelmask, &detectorCommon->pix_assembly);
+	}
+	else if (dataFormat == DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED) {
+		cDataVersion imageV(detectorEvent, detectorCommon, DATA_VERSION_NONE, DATA_FORMAT_ASSEMBLED);
+		uint16_t	*imageMask = imageV.getPixelmask();
+		if (detectorCommon->downsamplingConservative == 1)
+			downsampleMaskConservative(imageMask, *buffer, imageV.pix_nn, imageV.pix_nx, pix_nn, pix_nx, detectorCommon->downsampling, 0);
+		else
+			downsampleMaskNonConservative(imageMask, *buffer, imageV.pix_nn, imageV.pix_nx, pix_nn, pix_nx, detectorCommon->downsampling, 0);
+	}
+	*ready |= PIXELMASK_READY;
+	return *buffer;
+}
+
+
+/*
+ *	Per-worker powder shards (see addToPowder() and mergePowderShards())
+ *	Shard buffers are allocated on first use, so only the arrays a worker actually sums into take memory
+ */
+long cDataVersion::powderShardSlot(long powderClass, int squared) {
+	long formatIndex = 0;
+	while (formatIndex < 3 && DATA_FORMATS[formatIndex] != dataFormat)
+		formatIndex++;
+	return ((formatIndex*DATA_VERSION_N + dataVersionIndex)*MAX_POWDER_CLASSES + powderClass)*2 + squared;
+}
+
+bool cDataVersion::hasPowderShard(long shard, long powderClass) {
+	if (shard < 0 || shard >= detectorCommon->nPowderShards) {
+		return false;
+	}
+	return detectorCommon->powderShards[shard*POWDER_SHARD_SLOTS + powderShardSlot(powderClass, 0)] != NULL;
+}
+
+double * cDataVersion::getPowderShard(long shard, long powderClass) {
+	if (shard < 0 || shard >= detectorCommon->nPowderShards) {
+		ERROR("Trying to access powder shard that does not exist!");
+	}
+	return detectorCommon->getPowderShard(shard, powderShardSlot(powderClass, 0), pix_nn);
+}
+
+double * cDataVersion::getPowderSquaredShard(long shard, long powderClass) {
+	if (shard < 0 || shard >= detectorCommon->nPowderShards) {
+		ERROR("Trying to access squared powder shard that does not exist!");
+	}
+	return detectorCommon->getPowderShard(shard, powderShardSlot(powderClass, 1), pix_nn);
+}
+
+pthread_mutex_t * cDataVersion::getPowderShardMutex(long shard) {
+	if (shard < 0 || shard >= detectorCommon->nPowderShards) {
+		ERROR("Trying to access powder shard mutex that does not exist!");
+	}
+	return &detectorCommon->powderShards_mutex[shard];
+}
@@ -13,6 +13,8 @@
 #include <math.h>
 #include <hdf5.h>
 #include <stdlib.h>
+#include <time.h>
+#include <algorithm>
 
 #include <mmintrin.h>
 #include <emmintrin.h>
@@ -103,9 +105,227 @@ void setBadPixelsToZero(float *data, uint16_t *mask, long pix_nn) {
 
 
 
+/*
+ *	Fused detector correction
+ *	Raw to float conversion, saturated pixel check, darkcal, gain, bad pixel mask, polarization and solid angle
+ *	corrections are applied in blocks of pixels that stay in cache, rather than sweeping the whole frame once per correction.
+ *	Common mode corrections need the darkcal-subtracted ASIC before gain is applied, so for detectors that use one
+ *	the chain is split into an offset pass and a gain pass with the common mode corrections in between.
+ *	Polarization and solid angle use the map precomputed by cPixelDetectorCommon::updateGeometricCorrections().
+ */
+static const long correctionBlockSize = 1024;
+
+static int hasCommonModeCorrection(cPixelDetectorCommon *detector) {
+	if((strcmp(detector->detectorType, "cspad") == 0) || (strcmp(detector->detectorType, "cspad2x2") == 0))
+		return detector->cmModule == 1 || detector->cspadSubtractUnbondedPixels || detector->cspadSubtractBehindWires;
+	if(strcmp(detector->detectorType, "pnccd") == 0)
+		return detector->cmModule == 1 || detector->usePnccdOffsetCorrection == 1 || detector->usePnccdFixWiringError == 1 ||
+			detector->usePnccdLineInterpolation == 1 || detector->usePnccdLineMasking == 1;
+	return 0;
+}
+
+/*
+ *	Raw data types the offset pass reads, and the type their saturation check compares in
+ */
+template <class T> struct cRawSaturation;
+template <> struct cRawSaturation<uint16_t> {
+	typedef int32_t compare_t;
+	// 16-bit data never reaches a threshold above 65535
+	static inline compare_t threshold(long saturationADC) {return (int32_t) std::min(saturationADC, 65536L);}
+};
+template <> struct cRawSaturation<int32_t> {
+	typedef int64_t compare_t;
+	static inline compare_t threshold(long saturationADC) {return saturationADC;}
+};
+template <> struct cRawSaturation<float> {
+	typedef float compare_t;
+	static inline compare_t threshold(long saturationADC) {return (float) saturationADC;}
+};
+
+template <class T>
+static void detectorOffsetCorrectionBlock(T *rawInput, float *raw, float *data, uint16_t *mask, long saturationADC, float *darkcal, long n) {
+	// Float raw data adopted as data_raw needs no conversion
+	if((void *) rawInput != (void *) raw) {
+		for(long i=0; i<n; i++) {
+			raw[i] = rawInput[i];
+			data[i] = raw[i];
+		}
+	}
+	else {
+		for(long i=0; i<n; i++)
+			data[i] = raw[i];
+	}
+	if(saturationADC >= 0) {
+		typedef typename cRawSaturation<T>::compare_t compare_t;
+		compare_t	threshold = cRawSaturation<T>::threshold(saturationADC);
+		for(long i=0; i<n; i++)
+			mask[i] = (mask[i] & ~PIXEL_IS_SATURATED) | (((compare_t) rawInput[i] >= threshold) ? PIXEL_IS_SATURATED : 0);
+	}
+	if(darkcal) {
+		for(long i=0; i<n; i++)
+			data[i] -= darkcal[i];
+	}
+}
+
+static void detectorGainCorrectionBlock(float *data, uint16_t *mask, float *gaincal, int applyBadPixelMask, float *geometry, long n) {
+	if(gaincal) {
+		for(long i=0; i<n; i++)
+			data[i] *= gaincal[i];
+	}
+	if(applyBadPixelMask) {
+		for(long i=0; i<n; i++)
+			data[i] *= isBitOptionUnset(mask[i],PIXEL_IS_BAD);
+	}
+	if(geometry) {
+		for(long i=0; i<n; i++)
+			data[i] *= geometry[i];
+	}
+}
+
+static float *geometricCorrectionMap(cPixelDetectorCommon *detector) {
+	if(detector->usePolarizationCorrection || detector->useSolidAngleCorrection)
+		return detector->pix_geometricCorrection;
+	return NULL;
+}
+
+/*
+ *	Offset pass: initRaw, initDetectorCorrection, checkSaturatedPixels and subtractDarkcal in one sweep
+ *	(plus the gain pass for detectors without common mode correction), for raw data of type T
+ */
+template <class T>
+static void applyDetectorOffsetCorrections(T *rawInput, cEventData *eventData, cGlobal *global, long detIndex) {
+	cPixelDetectorCommon *detector = &global->detector[detIndex];
+	long		pix_nn = detector->pix_nn;
+	float		*raw = eventData->detector[detIndex].data_raw;
+	float		*data = eventData->detector[detIndex].data_detCorr;
+	uint16_t	*mask = eventData->detector[detIndex].pixelmask;
+	float		*darkcal = detector->useDarkcalSubtraction ? detector->darkcal : NULL;
+	long		saturationADC = -1;
+	if(detector->maskSaturatedPixels) {
+		if((strcmp(detector->detectorType, "pnccd") == 0) && (detector->maskPnccdSaturatedPixels))
+			checkSaturatedPixelsPnccd(rawInput, mask);
+		else
+			saturationADC = detector->pixelSaturationADC;
+	}
+
+	int		fuseGain = !hasCommonModeCorrection(detector);
+	float	*gaincal = detector->useGaincal ? detector->gaincal : NULL;
+	float	*geometry = geometricCorrectionMap(detector);
+
+	for(long i0=0; i0<pix_nn; i0+=correctionBlockSize) {
+		long n = std::min(correctionBlockSize, pix_nn-i0);
+		detectorOffsetCorrectionBlock(rawInput+i0, raw+i0, data+i0, mask+i0, saturationADC, darkcal ? darkcal+i0 : NULL, n);
+		if(fuseGain)
+			detectorGainCorrectionBlock(data+i0, mask+i0, gaincal ? gaincal+i0 : NULL, detector->applyBadPixelMask, geometry ? geometry+i0 : NULL, n);
+	}
+	if(darkcal)
+		eventData->detector[detIndex].pedSubtracted = 1;
+}
+
+void applyDetectorOffsetCorrections(cEventData *eventData, cGlobal *global) {
+	DETECTOR_LOOP {
+		DEBUG3("Fused detector offset correction. (detectorID=%ld)",global->detector[detIndex].detectorID);
+		void	*rawInput = eventData->detector[detIndex].rawInput;
+		switch(eventData->detector[detIndex].rawType) {
+			case RAW_TYPE_INT32:
+				applyDetectorOffsetCorrections((int32_t*) rawInput, eventData, global, detIndex);
+				break;
+			case RAW_TYPE_FLOAT:
+				applyDetectorOffsetCorrections((float*) rawInput, eventData, global, detIndex);
+				break;
+			default:
+				applyDetectorOffsetCorrections((uint16_t*) rawInput, eventData, global, detIndex);
+				break;
+		}
+	}
+}
+
+/*
+ *	Gain pass: applyGainCorrection, setBadPixelsToZero, applyGeometricCorrection in one sweep
+ *	(only for detectors with common mode correction, the others were done in the offset pass)
+ */
+void applyDetectorGainCorrections(cEventData *eventData, cGlobal *global) {
+	DETECTOR_LOOP {
+		cPixelDetectorCommon *detector = &global->detector[detIndex];
+		if(hasCommonModeCorrection(detector)) {
+			DEBUG3("Fused detector gain correction. (detectorID=%ld)",global->detector[detIndex].detectorID);
+			long		pix_nn = detector->pix_nn;
+			float		*data = eventData->detector[detIndex].data_detCorr;
+			uint16_t	*mask = eventData->detector[detIndex].pixelmask;
+			float		*gaincal = detector->useGaincal ? detector->gaincal : NULL;
+			float		*geometry = geometricCorrectionMap(detector);
+
+			for(long i0=0; i0<pix_nn; i0+=correctionBlockSize) {
+				long n = std::min(correctionBlockSize, pix_nn-i0);
+				detectorGainCorrectionBlock(data+i0, mask+i0, gaincal ? gaincal+i0 : NULL, detector->applyBadPixelMask, geometry ? geometry+i0 : NULL, n);
+			}
+		}
+	}
+}
+
+
+
+/*
+ *	Per-stage timing of the detector correction chain (profilerDiagnostics)
+ *	The worker adds the time since the last lap to the given stage, and hands its totals over once per frame.
+ */
+static const char *correctionStageNames[N_CORRECTION_STAGES] = {
+	"Raw to float conversion",
+	"Saturated pixel check",
+	"Darkcal subtraction",
+	"Common mode correction",
+	"Gain correction",
+	"Bad pixel mask",
+	"Polarization and solid angle",
+	"Fused offset pass",
+	"Fused gain pass"
+};
+
+double correctionTimer() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void correctionTimerLap(cGlobal *global, double *stageSeconds, int stage, double *t) {
+	if(!global->profilerDiagnostics)
+		return;
+	double now = correctionTimer();
+	stageSeconds[stage] += now - *t;
+	*t = now;
+}
+
+void addCorrectionTiming(cGlobal *global, double *stageSeconds) {
+	if(!global->profilerDiagnostics)
+		return;
+	pthread_mutex_lock(&global->correctionTiming_mutex);
+	for(long i=0; i<N_CORRECTION_STAGES; i++)
+		global->correctionStageSeconds[i] += stageSeconds[i];
+	global->correctionTimedFrames += 1;
+	pthread_mutex_unlock(&global->correctionTiming_mutex);
+}
+
+void printCorrectionTiming(cGlobal *global) {
+	if(!global->profilerDiagnostics || global->correctionTimedFrames == 0)
+		return;
+	long	nFrames = global->correctionTimedFrames;
+	double	total = 0;
+	printf("Detector correction timing (%s chain, %li frames):\n", global->fusedDetectorCorrection ? "fused" : "per-pass", nFrames);
+	for(long i=0; i<N_CORRECTION_STAGES; i++) {
+		if(global->correctionStageSeconds[i] == 0)
+			continue;
+		total += global->correctionStageSeconds[i];
+		printf("\t%-30s %9.3f ms/frame\n", correctionStageNames[i], 1e3*global->correctionStageSeconds[i]/nFrames);
+	}
+	printf("\t%-30s %9.3f ms/frame\n", "Total", 1e3*total/nFrames);
+}
+
+
+
 /*
  *	Subtract common mode on each module
- *	Common mode is the kth lowest pixel value in the whole ASIC (similar to a median calculation)
+ *	Common mode is the kth lowest pixel value in the whole ASIC (similar to a median calculation),
+ *	found with the detector's cmEstimator in the worker's common mode workspace
  */
 void cspadModuleSubtract(cEventData *eventData, cGlobal *global){
     cspadModuleSubtract(eventData, global, 1);
@@ -129,69 +349,29 @@ void cspadModuleSubtract(cEventData *eventData, cGlobal *global, int flag){
 				long		asic_ny = global->detector[detIndex].asic_ny;
 				long		nasics_x = global->detector[detIndex].nasics_x;
 				long		nasics_y = global->detector[detIndex].nasics_y;
+				tCommonModeWorkspace	*ws = global->detector[detIndex].getCommonModeWorkspace(eventData->threadID);
 			
-				cspadModuleSubtract(data, mask, threshold, asic_nx, asic_ny, nasics_x, nasics_y);
-			
+				cspadModuleSubtract(data, mask, threshold, asic_nx, asic_ny, nasics_x, nasics_y, ws);
+
+				// Residual common mode runs after the bad pixels were zeroed, put them back to zero
+				if(flag == 2 && global->detector[detIndex].applyBadPixelMask)
+					setBadPixelsToZero(data, mask, global->detector[detIndex].pix_nn);
 			}
 		}
 	}
 }
 
+/*
+ *	Exact selection on every ASIC, serially (see commonMode.cpp for the estimators and the parallel split)
+ */
 void cspadModuleSubtract(float *data, uint16_t *mask, float threshold, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
-	
-	long		e;
-	long		mval;
-	long		counter;
-	float		median;
-					  
-	// Create median buffer
-	float	*buffer; 
-	buffer = (float*) calloc(asic_nx*asic_ny, sizeof(float));
-	
-	
-	// Loop over modules (8x8 array)
-	for(long mi=0; mi<nasics_x; mi++){
-		for(long mj=0; mj<nasics_y; mj++){
-			
-			// Zero array
-			for(long i=0; i<asic_nx*asic_ny; i++)
-				buffer[i] = 0;
-			
-			// Loop over pixels within a module
-            counter = 0;
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					if( isBitOptionUnset(mask[e],PIXEL_IS_BAD) ) {
-						buffer[counter++] = data[e];
-					}
-				}
-			}
-			
-			
-            // Calculate background using median value 
-			//median = kth_smallest(buffer, global->asic_nx*global->asic_ny, mval);
-			if(counter>0) {
-				mval = lrint(counter*threshold);
-                if(mval < 0) 
-                    mval = 1;
-				median = kth_smallest(buffer, counter, mval);
-			}
-			else 
-				median = 0;
-
-			// Subtract median value
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					data[e] -= median;
-				}
-			}
-		}
-	}
-	free(buffer);
+	tCommonModeWorkspace	ws;
+	memset(&ws, 0, sizeof(tCommonModeWorkspace));
+	ws.estimator = CM_ESTIMATOR_SELECT;
+	ws.nThreads = 1;
+	ws.layout = DETECTOR_LAYOUT_GENERIC;
+	cspadModuleSubtract(data, mask, threshold, asic_nx, asic_ny, nasics_x, nasics_y, &ws);
+	freeCommonModeWorkspace(&ws);
 }
 
 
@@ -214,15 +394,21 @@ void cspadSubtractUnbondedPixels(cEventData *eventData, cGlobal *global){
 				long		nasics_x = global->detector[detIndex].nasics_x;
 				long		nasics_y = global->detector[detIndex].nasics_y;
 				
-				cspadSubtractUnbondedPixels(data, asic_nx, asic_ny, nasics_x, nasics_y);
+				int			layout = global->detector[detIndex].kernelLayout;
+				
+				cspadSubtractUnbondedPixels(data, asic_nx, asic_ny, nasics_x, nasics_y, layout);
 				
 			}
 		}
 	}
 }
 
-void cspadSubtractUnbondedPixels(float *data, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
+template <class L>
+static void subtractUnbondedPixels(float *data, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
 	
+	asic_nx = L::asicNx(asic_nx);
+	asic_ny = L::asicNy(asic_ny);
+	nasics_x = L::nasicsX(nasics_x);
 	long		e;
 	float		counter;
 	float		background;
@@ -259,6 +445,12 @@ void cspadSubtractUnbondedPixels(float *data, long asic_nx, long asic_ny, long n
 	
 }
 
+void cspadSubtractUnbondedPixels(float *data, long asic_nx, long asic_ny, long nasics_x, long nasics_y, int layout) {
+	void	(*subtract)(float*, long, long, long, long) = NULL;
+	DETECTOR_LAYOUT_SELECT(detectorLayout(layout, asic_nx, asic_ny, nasics_x), subtract, subtractUnbondedPixels);
+	subtract(data, asic_nx, asic_ny, nasics_x, nasics_y);
+}
+
 
 /*
  *	Subtract common mode estimated from signal behind wires
@@ -436,29 +628,28 @@ void updateHotPixelBuffer(cEventData *eventData, cGlobal *global) {
 
 
 /*
- *	Apply polarization correction
- *	The polarization correction is calculated using classical electrodynamics (expression from Hura et al JCP 2000)
+ *	Apply polarization and solid angle corrections
+ *	Both are folded into pix_geometricCorrection by cPixelDetectorCommon::updateGeometricCorrections()
+ *	whenever the detector moves, so per frame this is one multiplication per pixel.
  */
-void applyPolarizationCorrection(cEventData *eventData, cGlobal *global) {
+void applyGeometricCorrection(cEventData *eventData, cGlobal *global) {
 	DETECTOR_LOOP {
-		if (global->detector[detIndex].usePolarizationCorrection) {
-			DEBUG3("Apply polarization correction. (detectorID=%ld)",global->detector[detIndex].detectorID);										
+		if (global->detector[detIndex].usePolarizationCorrection || global->detector[detIndex].useSolidAngleCorrection) {
+			DEBUG3("Apply polarization and solid angle correction. (detectorID=%ld)",global->detector[detIndex].detectorID);
 			float	*data = eventData->detector[detIndex].data_detCorr;
-            float   *pix_x = global->detector[detIndex].pix_x;
-            float   *pix_y = global->detector[detIndex].pix_y;
-            float   *pix_z = global->detector[detIndex].pix_z;
+			float	*geometry = global->detector[detIndex].pix_geometricCorrection;
 			long	pix_nn = global->detector[detIndex].pix_nn;
-            float   pixelSize = global->detector[detIndex].pixelSize;
-            double  detectorZ = global->detector[detIndex].detectorZ;
-            float   cameraLengthScale = global->detector[detIndex].cameraLengthScale;
-            double  horizontalFraction = global->detector[detIndex].horizontalFractionOfPolarization;
-            
-			applyPolarizationCorrection(data, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, horizontalFraction, pix_nn);
+			for (long i=0; i<pix_nn; i++)
+				data[i] *= geometry[i];
 		}
 	}
 }
 
 
+/*
+ *	Polarization correction
+ *	The polarization correction is calculated using classical electrodynamics (expression from Hura et al JCP 2000)
+ */
 void applyPolarizationCorrection(float *data, float *pix_x, float *pix_y, float *pix_z, float pixelSize, double detectorZ, float detectorZScale, double horizontalFraction, long pix_nn) {
 	for (long i=0; i<pix_nn; i++) {
         double pix_dist = sqrt(pix_x[i]*pix_x[i]*pixelSize*pixelSize + pix_y[i]*pix_y[i]*pixelSize*pixelSize + (pix_z[i]*pixelSize + detectorZ*detectorZScale)*(pix_z[i]*pixelSize + detectorZ*detectorZScale));
@@ -469,37 +660,13 @@ void applyPolarizationCorrection(float *data, float *pix_x, float *pix_y, float
 
 
 /*
- *	Apply solid angle correction, two algorithms are available:
+ *	Solid angle correction, two algorithms are available:
  *  1. Assume pixels are azimuthally symmetric
  *  2. Rigorous correction from solid angle of a plane triangle
  *  Both algorithms divides by the constant term of the solid angle so that
  *  the pixel scale is still comparable to ADU for hitfinding. The constant
  *  term of the solid angle is saved as an individual value in the HDF5 files.
  */
-void applySolidAngleCorrection(cEventData *eventData, cGlobal *global) {
-	DETECTOR_LOOP {
-		if (global->detector[detIndex].useSolidAngleCorrection) {
-			DEBUG3("Apply solid angle correction. (detectorID=%ld)",global->detector[detIndex].detectorID);										
-            float	*data = eventData->detector[detIndex].data_detCorr;
-            float   *pix_x = global->detector[detIndex].pix_x;
-            float   *pix_y = global->detector[detIndex].pix_y;
-            float   *pix_z = global->detector[detIndex].pix_z;
-            long	pix_nn = global->detector[detIndex].pix_nn;
-            float   pixelSize = global->detector[detIndex].pixelSize;
-            double  detectorZ = global->detector[detIndex].detectorZ;
-            float   cameraLengthScale = global->detector[detIndex].cameraLengthScale;
-            double  solidAngleConst = global->detector[detIndex].solidAngleConst;
-            
-            if (global->detector[detIndex].solidAngleAlgorithm == 1) {
-                applyAzimuthallySymmetricSolidAngleCorrection(data, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, solidAngleConst, pix_nn);
-            } else {                
-                applyRigorousSolidAngleCorrection(data, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, solidAngleConst, pix_nn);
-            }
-        }
-	}
-}
-
-
 void applyAzimuthallySymmetricSolidAngleCorrection(float *data, float *pix_x, float *pix_y, float *pix_z, float pixelSize, double detectorZ, float detectorZScale, double solidAngleConst, long pix_nn) {
     
     // Azimuthally symmetrical (cos(theta)^3) correction
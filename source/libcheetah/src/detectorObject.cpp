@@ -87,6 +87,7 @@ cPixelDetectorCommon::cPixelDetectorCommon() {
 	// Common mode subtraction from each ASIC
 	cmModule = 0;
 	cmFloor = 0.1;
+	cmEstimator = CM_ESTIMATOR_HISTOGRAM;
     cmStart = -100;
     cmStop = 100;
     cmThreshold = 10;
@@ -105,6 +106,8 @@ cPixelDetectorCommon::cPixelDetectorCommon() {
 	// Solid angle correction
 	useSolidAngleCorrection = 0;
 	solidAngleAlgorithm = 1;
+	solidAngleConst = 0;
+	pix_geometricCorrection = NULL;
     
 	// Subtraction of running background (persistent photon background) 
 	useSubtractPersistentBackground = 0;
@@ -115,6 +118,7 @@ cPixelDetectorCommon::cPixelDetectorCommon() {
 	scaleBackground = 0;
 	useBackgroundBufferMutex = 0;
 	bgMedian = 0.5;
+	bgIncrementalMedian = 0;
 	bgRecalc = bgMemory;
 	bgIncludeHits = 0;
 	bgNoBeamReset = 0;
@@ -123,6 +127,8 @@ cPixelDetectorCommon::cPixelDetectorCommon() {
 	// Local background subtraction
 	useLocalBackgroundSubtraction = 0;
 	localBackgroundRadius = 3;
+	localBackgroundMode = LOCAL_BACKGROUND_MEDIAN;
+	localBackgroundPercentile = 0.5;
 	
 	// Radial background subtraction
 	useRadialBackgroundSubtraction = 0;
@@ -163,6 +169,17 @@ cPixelDetectorCommon::cPixelDetectorCommon() {
 	histogramMaxMemoryGb = 4;
 	histogram_count = 0;
 	histogramDataVersion = 2; // 0: raw; 1: detector corrected; 2: detector and photon corrected
+	histogramShards = -1;
+	histogramFlushInterval = 1000;
+	nPeakfinderWorkspaces = 0;
+	peakfinderWorkspaces = NULL;
+	nCommonModeWorkspaces = 0;
+	commonModeWorkspaces = NULL;
+	nLocalBackgroundWorkspaces = 0;
+	localBackgroundWorkspaces = NULL;
+	kernelLayout = DETECTOR_LAYOUT_GENERIC;
+	memset(&pix_rbins, 0, sizeof(tRadialBinIndex));
+	memset(&pix_assembly, 0, sizeof(tAssemblyMatrix));
 
 	// correction for PNCCD read out artifacts 
 	usePnccdOffsetCorrection = 0;
@@ -289,6 +306,8 @@ void cPixelDetectorCommon::configure(cGlobal * global) {
 	printf("\tASIC geometry: %lix%li\n",nasics_x,nasics_y);
 	printf("\tASIC size: %lix%li\n",asic_nx,asic_ny);
 	printf("\tPixel size: %g (m)\n",pixelSize);
+	kernelLayout = detectorLayout(asic_nx, asic_ny, nasics_x);
+	printf("\tKernel layout: %s\n",detectorLayoutName(kernelLayout));
 
 	if ((downsampling <= 1) && (saveAssembledAndDownsampled == 1)) {
 		fprintf(stderr,"Error: downsampling = %ld and saveAssembledAndDownsampled = 1.\n",downsampling);
@@ -311,6 +330,23 @@ void cPixelDetectorCommon::configure(cGlobal * global) {
 	
 	// Thread safety
 	threadSafetyLevel = global->threadSafetyLevel;
+	frameBufferThreads = global->frameBufferThreads;
+	peakfinderThreads = global->peakfinderThreads;
+	commonModeThreads = global->commonModeThreads;
+	assembleInterpolation = global->assembleInterpolation;
+	nPowderShards = global->powderShards;
+	if (nPowderShards < 0)
+		nPowderShards = global->nThreads;
+	if (histogramShards < 0)
+		histogramShards = global->nThreads;
+	nPeakfinderWorkspaces = global->nThreads;
+	if (nPeakfinderWorkspaces < 1)
+		nPeakfinderWorkspaces = 1;
+	nCommonModeWorkspaces = nPeakfinderWorkspaces;
+	nLocalBackgroundWorkspaces = nPeakfinderWorkspaces;
+	// A 16-bit shard cell can count at most 65535 frames
+	if (histogramFlushInterval < 1 || histogramFlushInterval > 65535)
+		histogramFlushInterval = 65535;
 
     // Set modes in accordance to configuration
 	// S-A-V-E
@@ -584,6 +620,9 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "cmfloor")) {
 		cmFloor = atof(value);
 	}
+	else if (!strcmp(tag, "cmestimator")) {
+		cmEstimator = atoi(value);
+	}
     else if (!strcmp(tag, "cmstart")) {
         cmStart = atoi(value);
     }
@@ -603,6 +642,12 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "localbackgroundradius")) {
 		localBackgroundRadius = atoi(value);
 	}
+	else if (!strcmp(tag, "localbackgroundmode")) {
+		localBackgroundMode = atoi(value);
+	}
+	else if (!strcmp(tag, "localbackgroundpercentile")) {
+		localBackgroundPercentile = atof(value);
+	}
 	else if (!strcmp(tag, "useradialbackgroundsubtraction")) {
 		useRadialBackgroundSubtraction = atoi(value);
 	}
@@ -670,6 +715,9 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "bgmedian")) {
 		bgMedian = atof(value);
 	}
+	else if (!strcmp(tag, "bgincrementalmedian")) {
+		bgIncrementalMedian = atoi(value);
+	}
 	else if (!strcmp(tag, "bgincludehits")) {
 		bgIncludeHits = atoi(value);
 	}
@@ -701,6 +749,12 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "histogramdataversion")) {
 		histogramDataVersion = atoi(value);
 	}
+	else if (!strcmp(tag, "histogramshards")) {
+		histogramShards = atoi(value);
+	}
+	else if (!strcmp(tag, "histogramflushinterval")) {
+		histogramFlushInterval = atoi(value);
+	}
 	else if (!strcmp(tag, "histogramonlyblanks")) {
 		histogramOnlyBlanks = atoi(value);
 	}
@@ -772,14 +826,19 @@ void cPixelDetectorCommon::allocateMemory() {
 	// Hot pixel map
 	pthread_mutex_init(&hotPix_update_mutex, NULL);
 	frameBufferHotPix = new cFrameBuffer(pix_nn,hotPixMemory,threadSafetyLevel);
+	frameBufferHotPix->nThreads = frameBufferThreads;
 	// Noisy pixel map
 	
 	pthread_mutex_init(&noisyPix_update_mutex, NULL);
 	frameBufferNoisyPix = new cFrameBuffer(pix_nn,noisyPixMemory,threadSafetyLevel);
+	frameBufferNoisyPix->nThreads = frameBufferThreads;
 	// Persistent background
 	
 	pthread_mutex_init(&bg_update_mutex, NULL);
 	frameBufferBlanks = new cFrameBuffer(pix_nn,bgMemory,threadSafetyLevel);
+	frameBufferBlanks->nThreads = frameBufferThreads;
+	if (useSubtractPersistentBackground && bgIncrementalMedian && !subtractPersistentBackgroundMean)
+		frameBufferBlanks->enableIncrementalMedian();
 	
 	// Powder data (accumulated sums and sums of squared values)  
 	for(long powderClass=0; powderClass<nPowderClasses; powderClass++) {
@@ -820,6 +879,21 @@ void cPixelDetectorCommon::allocateMemory() {
 		radialAverageStack[powderClass] = (float *) calloc(radial_nn*radialStackSize, sizeof(float));
 		pthread_mutex_init(&radialStack_mutex[powderClass], NULL);
 	}
+	// Powder shards (buffers themselves are allocated on first use)
+	powderShards = NULL;
+	powderShards_mutex = NULL;
+	if (nPowderShards > 0) {
+		powderShards = (double **) calloc(nPowderShards*POWDER_SHARD_SLOTS, sizeof(double *));
+		powderShards_mutex = (pthread_mutex_t *) calloc(nPowderShards, sizeof(pthread_mutex_t));
+		for(long shard=0; shard<nPowderShards; shard++)
+			pthread_mutex_init(&powderShards_mutex[shard], NULL);
+	}
+	// Peakfinder workspaces (arrays are allocated by the first frame each worker searches)
+	peakfinderWorkspaces = (tPeakfinderWorkspace *) calloc(nPeakfinderWorkspaces, sizeof(tPeakfinderWorkspace));
+	// Common mode workspaces (likewise)
+	commonModeWorkspaces = (tCommonModeWorkspace *) calloc(nCommonModeWorkspaces, sizeof(tCommonModeWorkspace));
+	// Local background workspaces (likewise)
+	localBackgroundWorkspaces = (tLocalBackgroundWorkspace *) calloc(nLocalBackgroundWorkspaces, sizeof(tLocalBackgroundWorkspace));
 	// Histogram memory
 	if(histogram) {
 		printf("Allocating histogram memory\n");
@@ -829,7 +903,7 @@ void cPixelDetectorCommon::allocateMemory() {
 		histogram_nnn = (uint64_t) histogramNbins * (uint64_t)(histogram_nn);
 		float	histogramMemory;
 		float	histogramMemoryGb;
-		histogramMemory = (histogram_nnn * sizeof(uint16_t));
+		histogramMemory = (histogram_nnn * sizeof(uint32_t));
 		histogramMemoryGb = histogramMemory / (1024LL*1024LL*1024LL);
 		if (histogramMemoryGb > histogramMaxMemoryGb) {
 			printf("Size of histogram buffer would exceed allowed size:\n");
@@ -840,8 +914,23 @@ void cPixelDetectorCommon::allocateMemory() {
 			exit(1);
 		}
 		printf("Histogram buffer size (GB): %f\n", histogramMemoryGb);
-		histogramData = (uint16_t*) calloc(histogram_nnn, sizeof(uint16_t));
+		histogramData = (uint32_t*) calloc(histogram_nnn, sizeof(uint32_t));
 		pthread_mutex_init(&histogram_mutex, NULL);
+		// Shards are allocated by the first frame a worker bins; use fewer of them if they would not fit in histogramMaxMemoryGb
+		float	shardMemoryGb = (histogram_nnn * sizeof(uint16_t)) / (1024.*1024.*1024.);
+		while (histogramShards > 0 && histogramMemoryGb + histogramShards*shardMemoryGb > histogramMaxMemoryGb)
+			histogramShards -= 1;
+		printf("Histogram shards: %li (up to %f GB)\n", histogramShards, histogramShards*shardMemoryGb);
+		histogramShardData = NULL;
+		histogramShardCount = NULL;
+		histogramShard_mutex = NULL;
+		if (histogramShards > 0) {
+			histogramShardData = (uint16_t **) calloc(histogramShards, sizeof(uint16_t *));
+			histogramShardCount = (long *) calloc(histogramShards, sizeof(long));
+			histogramShard_mutex = (pthread_mutex_t *) calloc(histogramShards, sizeof(pthread_mutex_t));
+			for(long shard=0; shard<histogramShards; shard++)
+				pthread_mutex_init(&histogramShard_mutex[shard], NULL);
+		}
 		histogramScale = (float *) malloc(histogramNbins*sizeof(float));
 		calculateHistogramScale(histogramMin, histogramNbins, histogramBinSize, histogramScale);
 	}	
@@ -856,6 +945,7 @@ void cPixelDetectorCommon::freeMemory() {
 	 */
 	free(gaincal);
 	free(darkcal);
+	free(pix_geometricCorrection);
 	/*
 	 *  Shared dynamic data
 	 */
@@ -909,12 +999,45 @@ void cPixelDetectorCommon::freeMemory() {
 		pthread_mutex_destroy(&radialStack_mutex[powderClass]);
 		free(radialAverageStack[powderClass]);
 	}
+	// Powder shards
+	if (nPowderShards > 0) {
+		for(long i=0; i<nPowderShards*POWDER_SHARD_SLOTS; i++)
+			free(powderShards[i]);
+		for(long shard=0; shard<nPowderShards; shard++)
+			pthread_mutex_destroy(&powderShards_mutex[shard]);
+		free(powderShards);
+		free(powderShards_mutex);
+	}
+	// Peakfinder workspaces
+	for(long i=0; i<nPeakfinderWorkspaces && peakfinderWorkspaces; i++)
+		freePeakfinderWorkspace(&peakfinderWorkspaces[i]);
+	free(peakfinderWorkspaces);
+	peakfinderWorkspaces = NULL;
+	// Common mode workspaces
+	for(long i=0; i<nCommonModeWorkspaces && commonModeWorkspaces; i++)
+		freeCommonModeWorkspace(&commonModeWorkspaces[i]);
+	free(commonModeWorkspaces);
+	commonModeWorkspaces = NULL;
+	// Local background workspaces
+	for(long i=0; i<nLocalBackgroundWorkspaces && localBackgroundWorkspaces; i++)
+		freeLocalBackgroundWorkspace(&localBackgroundWorkspaces[i]);
+	free(localBackgroundWorkspaces);
+	localBackgroundWorkspaces = NULL;
+	freeRadialBinIndex(&pix_rbins);
+	freeAssemblyMatrix(&pix_assembly);
 	pthread_mutex_destroy(&null_mutex);
 	// Pixel histograms
 	if(histogram) {
 		free(histogramData);
 		free(histogramScale);
 		pthread_mutex_destroy(&histogram_mutex);
+		for(long shard=0; shard<histogramShards; shard++) {
+			free(histogramShardData[shard]);
+			pthread_mutex_destroy(&histogramShard_mutex[shard]);
+		}
+		free(histogramShardData);
+		free(histogramShardCount);
+		free(histogramShard_mutex);
 	}
 }
 
@@ -948,15 +1071,62 @@ void cPixelDetectorCommon::unlockMutexes() {
 		// Radial stacks
 		pthread_mutex_unlock(&radialStack_mutex[powderClass]);
 	}
+	// Powder shards
+	for(long shard=0; shard<nPowderShards; shard++)
+		pthread_mutex_unlock(&powderShards_mutex[shard]);
 	pthread_mutex_unlock(&null_mutex);
 	// Pixel histograms
 	if(histogram) {
 		pthread_mutex_unlock(&histogram_mutex);
+		for(long shard=0; shard<histogramShards; shard++)
+			pthread_mutex_unlock(&histogramShard_mutex[shard]);
 	}
 }
 
 
 
+/*
+ *	Powder shard buffer for one (format, version, class, sum/squared) slot
+ *	Allocated on first use; the caller holds powderShards_mutex[shard]
+ */
+double * cPixelDetectorCommon::getPowderShard(long shard, long slot, long n) {
+	double **p = &powderShards[shard*POWDER_SHARD_SLOTS + slot];
+	if (*p == NULL)
+		*p = (double *) calloc(n, sizeof(double));
+	return *p;
+}
+
+/*
+ *	Peakfinder scratch arrays of one worker (eventData->threadID), sized for the whole detector on first use
+ */
+tPeakfinderWorkspace * cPixelDetectorCommon::getPeakfinderWorkspace(long worker, long maxPixCount) {
+	tPeakfinderWorkspace *ws = &peakfinderWorkspaces[worker % nPeakfinderWorkspaces];
+	preparePeakfinderWorkspace(ws, pix_nn, radial_nn, maxPixCount);
+	ws->nThreads = peakfinderThreads;
+	ws->layout = kernelLayout;
+	return ws;
+}
+
+/*
+ *	Common mode scratch arrays of one worker (eventData->threadID), allocated by the first frame it corrects
+ */
+tCommonModeWorkspace * cPixelDetectorCommon::getCommonModeWorkspace(long worker) {
+	tCommonModeWorkspace *ws = &commonModeWorkspaces[worker % nCommonModeWorkspaces];
+	ws->estimator = cmEstimator;
+	ws->nThreads = commonModeThreads;
+	ws->layout = kernelLayout;
+	return ws;
+}
+
+/*
+ *	Local background scratch arrays of one worker (eventData->threadID), allocated by the first frame it subtracts
+ */
+tLocalBackgroundWorkspace * cPixelDetectorCommon::getLocalBackgroundWorkspace(long worker) {
+	return &localBackgroundWorkspaces[worker % nLocalBackgroundWorkspaces];
+}
+
+
+
 /*
  *	Read in detector pixel layout
  */
@@ -1112,6 +1282,14 @@ bounds:
 			radial_max = pix_r[i];
 	}	
 	radial_nn = (long int) ceil(radial_max)+1;
+	buildRadialBinIndex(&pix_rbins, pix_r, nn);
+
+	// Assembly matrix for the assembled image, mask and powder
+	if (isAnyOfBitOptionsSet(saveFormat | powderFormat, cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED))
+		buildAssemblyMatrix(&pix_assembly, pix_x, pix_y, nn, image_nx, image_nn, assembleInterpolation);
+
+	// Geometric correction map for the current camera length (updated again by updateKspace)
+	updateGeometricCorrections();
 
 	// How big must we make the output downsampled image?
 	imageXxX_nx = (long)ceil(image_nx/(double)downsampling);
@@ -1196,6 +1374,32 @@ void cPixelDetectorCommon::updateKspace(cGlobal *global, float wavelengthA) {
 	// also update constant term of solid angle when detector has moved
 	solidAngleConst = pixelSize*pixelSize/(detectorZ*cameraLengthScale*detectorZ*cameraLengthScale);
     
+	// ... and the geometric correction map that depends on it
+	updateGeometricCorrections();
+}
+
+
+/*
+ *	Precompute the polarization and solid angle corrections as one multiplier per pixel
+ *	(called whenever detector has moved), so that applying both costs a single multiplication per pixel and frame.
+ *	The map is obtained by running the per-pixel corrections on a frame of ones.
+ *	Neither correction depends on the photon energy, so only a change of camera length needs a rebuild.
+ */
+void cPixelDetectorCommon::updateGeometricCorrections() {
+	if (!usePolarizationCorrection && !useSolidAngleCorrection)
+		return;
+	if (pix_geometricCorrection == NULL)
+		pix_geometricCorrection = (float *) calloc(pix_nn, sizeof(float));
+	for (long i=0; i<pix_nn; i++)
+		pix_geometricCorrection[i] = 1;
+	if (usePolarizationCorrection)
+		applyPolarizationCorrection(pix_geometricCorrection, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, horizontalFractionOfPolarization, pix_nn);
+	if (useSolidAngleCorrection) {
+		if (solidAngleAlgorithm == 1)
+			applyAzimuthallySymmetricSolidAngleCorrection(pix_geometricCorrection, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, solidAngleConst, pix_nn);
+		else
+			applyRigorousSolidAngleCorrection(pix_geometricCorrection, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, solidAngleConst, pix_nn);
+	}
 }
 
 
@@ -1579,5 +1783,14 @@ void cPixelDetectorCommon::readWireMask(char *filename){
 cPixelDetectorEvent::cPixelDetectorEvent() {
 	/* FM: Warning. This is not run when malloc'ed*/
 	detectorZ=0;
+	imageReady = 0;
+	imageXxXReady = 0;
+	radialAverageReady = 0;
+	rawType = RAW_TYPE_UINT16;
+	rawInput = NULL;
+	data_raw32 = NULL;
+	rawRelease = NULL;
+	rawReleaseArg = NULL;
+	data_rawOwn = NULL;
 
 }
@@ -2,16 +2,29 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 
 #include "cheetah.h"
 
 /*
- *  libCheetah function to create structure for holding new event information
- *  Currently only a malloc() but set up as a function so that we have the option of 
- *  initialising variables without needing to change any top level code
+ *	Allocate zeroed memory for an event array and touch every page of it, so that
+ *	the page faults are taken here rather than in the first worker that uses the event
  */
-cEventData* cheetahNewEvent(cGlobal	*global) {
+static void *eventCalloc(long n, size_t size) {
+	if (n <= 0)
+		return NULL;
+	void *p = calloc(n, size);
+	if (p != NULL)
+		memset(p, 0, n*size);
+	return p;
+}
+
+
+/*
+ *	Create an event and all of its arrays (called directly when there is no event pool)
+ */
+cEventData* allocateEventData(cGlobal *global) {
 
 	/*
 	 *	Create new event structure
@@ -19,22 +32,7 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 	cEventData	*eventData;
 	eventData = new cEventData();
 	eventData->pGlobal = global;
-
-	/*
-	 *	Initialise any common default values
-	 */
-	eventData->useThreads = 0;
-	eventData->hit = 0;
-	eventData->powderClass = 0;
-	eventData->pumpLaserOn = 0;
-	eventData->peakResolution=0.;
-	eventData->nPeaks=0;
-	eventData->peakNpix=0.;
-	eventData->peakTotal=0.;
-	eventData->stackSlice=0;
-
-	eventData->gmd = eventData->gmd1 = eventData->gmd2 =
-		eventData->gmd11 = eventData->gmd12 = eventData->gmd21 = eventData->gmd22 = 0;
+	eventData->poolGeneration = -1;
 
 	//long		pix_nn1 = global->detector[0].pix_nn;
 	//long		asic_nx = global->detector[0].asic_nx;
@@ -43,6 +41,8 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 
 	/*
 	 *	Create arrays for intermediate detector data, etc 
+	 *	(with lazyImageBuffers set, the assembled, downsampled and radial average arrays stay NULL
+	 *	until cDataVersion first materializes them for this event)
 	 */
 	DETECTOR_LOOP {
 		long	pix_nn = global->detector[detIndex].pix_nn;
@@ -50,31 +50,33 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 		long	imageXxX_nn = global->detector[detIndex].imageXxX_nn;
 		long	radial_nn = global->detector[detIndex].radial_nn;
 
-		eventData->detector[detIndex].data_raw16 = (uint16_t*) calloc(pix_nn,sizeof(uint16_t));
-		eventData->detector[detIndex].data_raw = (float*) calloc(pix_nn,sizeof(float));
-		eventData->detector[detIndex].data_detCorr = (float*) calloc(pix_nn,sizeof(float));
-		eventData->detector[detIndex].data_detPhotCorr = (float*) calloc(pix_nn,sizeof(float));
-		eventData->detector[detIndex].data_forPersistentBackgroundBuffer = (float*) calloc(pix_nn,sizeof(float));
-		eventData->detector[detIndex].pixelmask = (uint16_t*) calloc(pix_nn,sizeof(uint16_t));
+		if (global->lazyImageBuffers) {
+			image_nn = 0;
+			imageXxX_nn = 0;
+			radial_nn = 0;
+		}
 
-		eventData->detector[detIndex].image_raw = (float*) calloc(image_nn,sizeof(float));
-		eventData->detector[detIndex].image_detCorr = (float*) calloc(image_nn,sizeof(float));
-		eventData->detector[detIndex].image_detPhotCorr = (float*) calloc(image_nn,sizeof(float));
-		eventData->detector[detIndex].image_pixelmask = (uint16_t*) calloc(image_nn,sizeof(uint16_t));
+		eventData->detector[detIndex].data_raw16 = (uint16_t*) eventCalloc(pix_nn,sizeof(uint16_t));
+		eventData->detector[detIndex].data_raw = (float*) eventCalloc(pix_nn,sizeof(float));
+		eventData->detector[detIndex].data_detCorr = (float*) eventCalloc(pix_nn,sizeof(float));
+		eventData->detector[detIndex].data_detPhotCorr = (float*) eventCalloc(pix_nn,sizeof(float));
+		eventData->detector[detIndex].data_forPersistentBackgroundBuffer = (float*) eventCalloc(pix_nn,sizeof(float));
+		eventData->detector[detIndex].pixelmask = (uint16_t*) eventCalloc(pix_nn,sizeof(uint16_t));
 
-		eventData->detector[detIndex].imageXxX_raw = (float*) calloc(imageXxX_nn,sizeof(float));
-		eventData->detector[detIndex].imageXxX_detCorr = (float*) calloc(imageXxX_nn,sizeof(float));
-		eventData->detector[detIndex].imageXxX_detPhotCorr = (float*) calloc(imageXxX_nn,sizeof(float));
-		eventData->detector[detIndex].imageXxX_pixelmask = (uint16_t*) calloc(imageXxX_nn,sizeof(uint16_t));
+		eventData->detector[detIndex].image_raw = (float*) eventCalloc(image_nn,sizeof(float));
+		eventData->detector[detIndex].image_detCorr = (float*) eventCalloc(image_nn,sizeof(float));
+		eventData->detector[detIndex].image_detPhotCorr = (float*) eventCalloc(image_nn,sizeof(float));
+		eventData->detector[detIndex].image_pixelmask = (uint16_t*) eventCalloc(image_nn,sizeof(uint16_t));
 
-		eventData->detector[detIndex].radialAverage_raw = (float *) calloc(radial_nn, sizeof(float));
-		eventData->detector[detIndex].radialAverage_detCorr = (float *) calloc(radial_nn, sizeof(float));
-		eventData->detector[detIndex].radialAverage_detPhotCorr = (float *) calloc(radial_nn, sizeof(float));
-		eventData->detector[detIndex].radialAverage_pixelmask = (uint16_t*) calloc(radial_nn,sizeof(uint16_t));
+		eventData->detector[detIndex].imageXxX_raw = (float*) eventCalloc(imageXxX_nn,sizeof(float));
+		eventData->detector[detIndex].imageXxX_detCorr = (float*) eventCalloc(imageXxX_nn,sizeof(float));
+		eventData->detector[detIndex].imageXxX_detPhotCorr = (float*) eventCalloc(imageXxX_nn,sizeof(float));
+		eventData->detector[detIndex].imageXxX_pixelmask = (uint16_t*) eventCalloc(imageXxX_nn,sizeof(uint16_t));
 
-		eventData->detector[detIndex].pedSubtracted=0;
-		eventData->detector[detIndex].sum=0.;		
-		
+		eventData->detector[detIndex].radialAverage_raw = (float *) eventCalloc(radial_nn, sizeof(float));
+		eventData->detector[detIndex].radialAverage_detCorr = (float *) eventCalloc(radial_nn, sizeof(float));
+		eventData->detector[detIndex].radialAverage_detPhotCorr = (float *) eventCalloc(radial_nn, sizeof(float));
+		eventData->detector[detIndex].radialAverage_pixelmask = (uint16_t*) eventCalloc(radial_nn,sizeof(uint16_t));
 	}
 
 	/*
@@ -92,35 +94,139 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 	 */
 	int spectrumLength = global->espectrumLength;
 	eventData->energySpectrum1D = (double *) calloc(spectrumLength, sizeof(double));
-	eventData->energySpectrumExist = 0;
 	eventData->FEEspec_hproj = NULL;
 	eventData->FEEspec_vproj = NULL;
 	eventData->pulnixImage = NULL;
 	eventData->specImage = NULL;
-	
 	eventData->pulnixFail=1;
 	eventData->specFail=1;
 	eventData->FEEspec_present=0;
-
 	eventData->TimeTool_present = 0;
-		
-	// Return
+
 	return eventData;
 }
 
 
+/*
+ *	Put an event back into the state cheetahNewEvent() has always handed out.
+ *	The large pixel/image arrays are not cleared: every stage overwrites what it uses,
+ *	and pixels never touched by the assembly geometry stay zero from the initial allocation.
+ */
+static void resetEventData(cEventData *eventData, cGlobal *global) {
+
+	/*
+	 *	Initialise any common default values
+	 */
+	eventData->useThreads = 0;
+	eventData->threadID = 0;
+	eventData->hit = 0;
+	eventData->powderClass = 0;
+	eventData->pumpLaserOn = 0;
+	eventData->peakResolution=0.;
+	eventData->nPeaks=0;
+	eventData->peakNpix=0.;
+	eventData->peakTotal=0.;
+	eventData->stackSlice=0;
+	eventData->cxiWritePending = false;
+	eventData->nCXIChunks = 0;
+	eventData->powderSequence = -1;
+	eventData->powderTurnDone = false;
+	eventData->powderAddPending = false;
+
+	eventData->gmd = eventData->gmd1 = eventData->gmd2 =
+		eventData->gmd11 = eventData->gmd12 = eventData->gmd21 = eventData->gmd22 = 0;
+
+	DETECTOR_LOOP {
+		eventData->detector[detIndex].cspad_fail=0;
+		eventData->detector[detIndex].pedSubtracted=0;
+		eventData->detector[detIndex].sum=0.;		
+		eventData->detector[detIndex].imageReady = 0;
+		eventData->detector[detIndex].imageXxXReady = 0;
+		eventData->detector[detIndex].radialAverageReady = 0;
+		eventData->detector[detIndex].rawType = RAW_TYPE_UINT16;
+		eventData->detector[detIndex].rawInput = eventData->detector[detIndex].data_raw16;
+	}
+	for(long i=0; i<MAX_TOF_DETECTORS; i++) {
+		eventData->tofDetector[i].time.clear();
+		eventData->tofDetector[i].voltage.clear();
+	}
+	eventData->TOFPresent = 0;
+
+	resetPeakList(&(eventData->peaklist));
+
+	for(long i=0; i<global->espectrumLength; i++)
+		eventData->energySpectrum1D[i] = 0;
+	eventData->energySpectrumExist = 0;
+}
 
 
 /*
- *  libCheetah function to clean up all memory allocated in event struture
+ *	Free the per-event camera buffers attached by the front end, and hand back adopted raw data buffers
  */
-void cheetahDestroyEvent(cEventData *eventData) {
+static void freeEventAttachments(cEventData *eventData) {
+
+	cGlobal	*global = eventData->pGlobal;
+
+	// Adopted raw data
+	DETECTOR_LOOP {
+		cPixelDetectorEvent *detectorEvent = &eventData->detector[detIndex];
+		if(detectorEvent->data_rawOwn != NULL) {
+			detectorEvent->data_raw = detectorEvent->data_rawOwn;
+			detectorEvent->data_rawOwn = NULL;
+		}
+		if(detectorEvent->rawRelease != NULL)
+			detectorEvent->rawRelease(detectorEvent->rawReleaseArg);
+		detectorEvent->rawRelease = NULL;
+		detectorEvent->rawReleaseArg = NULL;
+		detectorEvent->rawInput = NULL;
+	}
+
+	// Pulnix external camera
+	if(eventData->pulnixFail == 0){
+		if(eventData->pulnixImage != NULL)
+			free(eventData->pulnixImage);
+	}
+	eventData->pulnixImage = NULL;
+	eventData->pulnixFail = 1;
+
+	// Opal spectrum camera
+	if(eventData->specFail == 0){
+		if(eventData->specImage != NULL)
+			free(eventData->specImage);
+	}
+	eventData->specImage = NULL;
+	eventData->specFail = 1;
+
+	if(eventData->FEEspec_present == 1) {
+		free(eventData->FEEspec_hproj);
+		free(eventData->FEEspec_vproj);
+	}
+	eventData->FEEspec_hproj = NULL;
+	eventData->FEEspec_vproj = NULL;
+	eventData->FEEspec_present = 0;
+
+	if(eventData->TimeTool_present == 1) {
+		free(eventData->TimeTool_hproj);
+		free(eventData->TimeTool_vproj);
+	}
+	eventData->TimeTool_present = 0;
+}
+
+
+/*
+ *	Free an event and all of its arrays
+ */
+void freeEventData(cEventData *eventData) {
     
     cGlobal	*global = eventData->pGlobal;;
     
+	// Hand back front end buffers first (data_raw may be an adopted one)
+	freeEventAttachments(eventData);
+
     // Free memory
 	DETECTOR_LOOP {
 		free(eventData->detector[detIndex].data_raw16);
+		free(eventData->detector[detIndex].data_raw32);
 		free(eventData->detector[detIndex].data_raw);
 		free(eventData->detector[detIndex].data_detCorr);
 		free(eventData->detector[detIndex].data_detPhotCorr);
@@ -144,31 +250,110 @@ void cheetahDestroyEvent(cEventData *eventData) {
 	}
 	
 	freePeakList(eventData->peaklist);
+	for(size_t i=0; i<eventData->cxiChunks.size(); i++)
+		free(eventData->cxiChunks[i].buffer);
 	//free(eventData->good_peaks);
-	
-	
-	// Pulnix external camera
-	if(eventData->pulnixFail == 0){
-		if(eventData->pulnixImage != NULL)
-			free(eventData->pulnixImage);
+
+    free(eventData->energySpectrum1D);
+   
+	delete eventData;
+}
+
+
+/*
+ *  libCheetah function to create structure for holding new event information
+ *  Events come out of global->eventPool when there is one, so the arrays are usually recycled
+ *  from an earlier frame rather than freshly allocated
+ */
+cEventData* cheetahNewEvent(cGlobal	*global) {
+
+	cEventData	*eventData;
+	if(global->eventPool != NULL)
+		eventData = global->eventPool->get();
+	else
+		eventData = allocateEventData(global);
+
+	resetEventData(eventData, global);
+	return eventData;
+}
+
+
+
+
+/*
+ *  libCheetah function to clean up all memory allocated in event struture
+ *  (with an event pool, the event is handed back to the pool for the next frame instead)
+ */
+void cheetahDestroyEvent(cEventData *eventData) {
+    
+    cGlobal	*global = eventData->pGlobal;
+
+	if(global->eventPool != NULL) {
+		freeEventAttachments(eventData);
+		global->eventPool->put(eventData);
 	}
-	// Opal spectrum camera
-	if(eventData->specFail == 0){
-		if(eventData->specImage != NULL)
-			free(eventData->specImage);
+	else {
+		freeEventData(eventData);
 	}
+}
 
-	if(eventData->FEEspec_present == 1) {
-		free(eventData->FEEspec_hproj);
-		free(eventData->FEEspec_vproj);
+
+/*
+ *  libCheetah function to hand over raw data of detector detIndex as uint16, int32 or float (RAW_TYPE_*)
+ *  instead of filling data_raw16. The data is copied; float data goes straight into data_raw.
+ */
+void cheetahSetRawData(cEventData *eventData, long detIndex, int rawType, void *data) {
+
+	cGlobal	*global = eventData->pGlobal;
+	cPixelDetectorEvent *detectorEvent = &eventData->detector[detIndex];
+	long	pix_nn = global->detector[detIndex].pix_nn;
+
+	switch(rawType) {
+		case RAW_TYPE_UINT16:
+			memcpy(detectorEvent->data_raw16, data, pix_nn*sizeof(uint16_t));
+			detectorEvent->rawInput = detectorEvent->data_raw16;
+			break;
+		case RAW_TYPE_INT32:
+			// Kept with the (pooled) event once allocated
+			if(detectorEvent->data_raw32 == NULL)
+				detectorEvent->data_raw32 = (int32_t*) eventCalloc(pix_nn, sizeof(int32_t));
+			memcpy(detectorEvent->data_raw32, data, pix_nn*sizeof(int32_t));
+			detectorEvent->rawInput = detectorEvent->data_raw32;
+			break;
+		case RAW_TYPE_FLOAT:
+			memcpy(detectorEvent->data_raw, data, pix_nn*sizeof(float));
+			detectorEvent->rawInput = detectorEvent->data_raw;
+			break;
+		default:
+			printf("cheetahSetRawData: unknown raw data type %i\n", rawType);
+			exit(1);
 	}
+	detectorEvent->rawType = rawType;
+}
 
-	if(eventData->TimeTool_present == 1) {
-		free(eventData->TimeTool_hproj);
-		free(eventData->TimeTool_vproj);
+
+/*
+ *  libCheetah function to hand over the front end's own raw data buffer without copying it.
+ *  The buffer must stay valid and unchanged until the event is done with it, which is when release(releaseArg)
+ *  is called (from whichever thread destroys the event; release may be NULL).
+ */
+void cheetahAdoptRawData(cEventData *eventData, long detIndex, int rawType, void *data, void (*release)(void*), void *releaseArg) {
+
+	cPixelDetectorEvent *detectorEvent = &eventData->detector[detIndex];
+
+	if(rawType != RAW_TYPE_UINT16 && rawType != RAW_TYPE_INT32 && rawType != RAW_TYPE_FLOAT) {
+		printf("cheetahAdoptRawData: unknown raw data type %i\n", rawType);
+		exit(1);
 	}
+	detectorEvent->rawType = rawType;
+	detectorEvent->rawInput = data;
+	detectorEvent->rawRelease = release;
+	detectorEvent->rawReleaseArg = releaseArg;
 
-    free(eventData->energySpectrum1D);
-   
-	delete eventData;
+	// Float data needs no conversion, so it is the raw float array
+	if(rawType == RAW_TYPE_FLOAT) {
+		if(detectorEvent->data_rawOwn == NULL)
+			detectorEvent->data_rawOwn = detectorEvent->data_raw;
+		detectorEvent->data_raw = (float*) data;
+	}
 }
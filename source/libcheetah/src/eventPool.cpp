@@ -0,0 +1,103 @@
+/*
+ *  eventPool.cpp
+ *  cheetah
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cheetah.h"
+#include "eventPool.h"
+
+cEventPool::cEventPool(cGlobal *global0, long poolSize0) {
+	global = global0;
+	poolSize = poolSize0;
+	if (poolSize < 1) poolSize = 1;
+
+	events = (cEventData **) calloc(poolSize, sizeof(cEventData *));
+	nEvents = 0;
+	generation = 0;
+	makeKey(&key);
+	pthread_mutex_init(&pool_mutex, NULL);
+
+	// Slots are filled as events come back from the workers, so a pool never holds
+	// more events than were actually in flight at the same time
+}
+
+cEventPool::~cEventPool() {
+	drain();
+	free(events);
+	pthread_mutex_destroy(&pool_mutex);
+}
+
+void cEventPool::makeKey(tEventPoolKey *k) {
+	memset(k, 0, sizeof(tEventPoolKey));
+	k->nDetectors = global->nDetectors;
+	for (long detIndex=0; detIndex<global->nDetectors; detIndex++) {
+		k->pix_nn[detIndex] = global->detector[detIndex].pix_nn;
+		k->image_nn[detIndex] = global->detector[detIndex].image_nn;
+		k->imageXxX_nn[detIndex] = global->detector[detIndex].imageXxX_nn;
+		k->radial_nn[detIndex] = global->detector[detIndex].radial_nn;
+		k->saveFormat[detIndex] = global->detector[detIndex].saveFormat;
+		k->powderFormat[detIndex] = global->detector[detIndex].powderFormat;
+	}
+	k->lazyImageBuffers = global->lazyImageBuffers;
+	k->NpeaksMax = global->hitfinderNpeaksMax;
+	k->espectrumLength = global->espectrumLength;
+}
+
+/*
+ *	Free all pooled events (pool_mutex held or pool no longer shared)
+ */
+void cEventPool::drain() {
+	for (long i=0; i<nEvents; i++) {
+		freeEventData(events[i]);
+	}
+	nEvents = 0;
+}
+
+/*
+ *	Hand out a recycled event, or a new one if the pool is empty.
+ *	If the detector configuration changed since the pooled events were allocated they are dropped.
+ */
+cEventData *cEventPool::get() {
+	cEventData *eventData = NULL;
+	tEventPoolKey current;
+	makeKey(&current);
+
+	pthread_mutex_lock(&pool_mutex);
+	if (memcmp(&current, &key, sizeof(tEventPoolKey)) != 0) {
+		DEBUG2("Detector configuration changed: dropping %li pooled events", nEvents);
+		drain();
+		key = current;
+		generation += 1;
+	}
+	if (nEvents > 0) {
+		eventData = events[--nEvents];
+	}
+	long gen = generation;
+	pthread_mutex_unlock(&pool_mutex);
+
+	if (eventData == NULL) {
+		eventData = allocateEventData(global);
+		eventData->poolGeneration = gen;
+	}
+	return eventData;
+}
+
+/*
+ *	Take an event back; it is freed instead if the pool is full or it was allocated under an old key
+ */
+void cEventPool::put(cEventData *eventData) {
+	pthread_mutex_lock(&pool_mutex);
+	if (eventData->poolGeneration == generation && nEvents < poolSize) {
+		events[nEvents++] = eventData;
+		eventData = NULL;
+	}
+	pthread_mutex_unlock(&pool_mutex);
+
+	if (eventData != NULL)
+		freeEventData(eventData);
+}
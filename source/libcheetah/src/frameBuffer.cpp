@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <iostream>
+#include <algorithm>
 #include "detectorObject.h"
 #include "frameBuffer.h"
 #include "median.h"
@@ -53,6 +54,14 @@ cFrameBuffer::cFrameBuffer(long pix_nn0, long depth0, int threadSafetyLevel0) {
 	n_absAboveThresh_readers = 0;
 	pthread_mutex_init(&absAboveThresh_mutex, NULL);
 	absAboveThresh_updated = false;	
+	// Threads used by updateStatistics()
+	nThreads = 1;
+	// Incremental median (off unless enableIncrementalMedian() is called)
+	incrementalMedian = false;
+	sorted = NULL;
+	stripe_mutexes = NULL;
+	nStripes = 0;
+	stripeSize = 0;
 }
 
 cFrameBuffer::~cFrameBuffer() {
@@ -65,6 +74,13 @@ cFrameBuffer::~cFrameBuffer() {
 	}
 	free(frame_mutexes);
 	free(n_frame_readers);
+	if (incrementalMedian) {
+		for (long s=0; s<nStripes; s++) {
+			pthread_mutex_destroy(&stripe_mutexes[s]);
+		}
+		free(stripe_mutexes);
+		free(sorted);
+	}
 	pthread_mutex_destroy(&std_mutex);
 	pthread_mutex_destroy(&median_mutex);
 	pthread_mutex_destroy(&absAboveThresh_mutex);
@@ -211,10 +227,71 @@ void cFrameBuffer::unlockAbsAboveThreshReadersAndWriters() {
 }
 //.........................................//
 
+/*
+ *	Keep a sorted copy of every pixel's history so that the median can be read off instead of re-sorted.
+ *	The sorted windows start out as depth zeros, just like the (calloc'ed) ring buffer itself.
+ */
+void cFrameBuffer::enableIncrementalMedian() {
+	if (incrementalMedian)
+		return;
+	sorted = (float *) calloc(pix_nn*depth, sizeof(float));
+	nStripes = 64;
+	if (nStripes > pix_nn) nStripes = pix_nn;
+	stripeSize = (pix_nn + nStripes - 1) / nStripes;
+	stripe_mutexes = (pthread_mutex_t*) calloc(nStripes, sizeof(pthread_mutex_t));
+	for (long s=0; s<nStripes; s++) {
+		pthread_mutex_init(&stripe_mutexes[s], NULL);
+	}
+	incrementalMedian = true;
+}
+
+/*
+ *	Replace the values of ring buffer slot frameID by data in the sorted windows
+ *	(caller holds the lock on frame frameID, which still contains the outgoing frame)
+ *	Cost per pixel is one pass over the window to rank both values and a shift of at most depth values.
+ *	Stripe locks are always taken: unlike a stale median, a corrupted window would never recover.
+ */
+void cFrameBuffer::updateSorted(long frameID, float * data) {
+	float * old = frames+frameID*pix_nn;
+	for (long s=0; s<nStripes; s++) {
+		long i0 = s*stripeSize;
+		long i1 = std::min(i0+stripeSize, pix_nn);
+		pthread_mutex_lock(&stripe_mutexes[s]);
+		for (long i=i0; i<i1; i++) {
+			float * w = sorted+i*depth;
+			float vOld = old[i];
+			float vNew = data[i];
+			if (vNew == vOld)
+				continue;
+			// Ranks of the outgoing and incoming value (branch-free counts vectorise well for typical depths)
+			long p = 0, q = 0;
+			for (long j=0; j<depth; j++) {
+				p += (w[j] < vOld);
+				q += (w[j] < vNew);
+			}
+			// (clamps only matter if the window no longer holds vOld, e.g. after NaNs or unlocked writers)
+			if (p >= depth) p = depth-1;
+			if (vNew > vOld) {
+				if (q <= p) q = p+1;
+				// Shift the values in between down by one and put the new value on top of them
+				memmove(w+p, w+p+1, (q-p-1)*sizeof(float));
+				w[q-1] = vNew;
+			}
+			else {
+				if (q > p) q = p;
+				memmove(w+q+1, w+q, (p-q)*sizeof(float));
+				w[q] = vNew;
+			}
+		}
+		pthread_mutex_unlock(&stripe_mutexes[s]);
+	}
+}
+
 long cFrameBuffer::writeNextFrame(float * data) {
 	long counter_last = __sync_fetch_and_add(&counter,1);
 	long frameID = counter_last % depth;
 	if (threadSafetyLevel > 0) lockFrameReadersAndWriters(frameID);
+	if (incrementalMedian) updateSorted(frameID, data);
 	memcpy(frames+frameID*pix_nn,data,pix_nn*sizeof(float));
 	if (threadSafetyLevel > 0) unlockFrameReadersAndWriters(frameID);
 	filled = counter >= (depth-1);
@@ -274,7 +351,31 @@ void cFrameBuffer::subtractMedian(float * data, uint16_t * mask, int scale,float
 	if (threadSafetyLevel > 0) unlockMedianWriters();
 }
 
+/*
+ *	Recalculate the persistent background as the given quantile (0.5 = median) of each pixel's history
+ */
 void cFrameBuffer::updateMedian(float point) {
+	long k = lrint(point*depth);
+	if (k < 0) k = 0;
+	if (k > depth-1) k = depth-1;
+
+	// Incremental mode: windows are already sorted, so only the frame slots being written are ever locked
+	if (incrementalMedian) {
+		if (threadSafetyLevel > 0) lockMedianReadersAndWriters();
+		for (long s=0; s<nStripes; s++) {
+			long i0 = s*stripeSize;
+			long i1 = std::min(i0+stripeSize, pix_nn);
+			pthread_mutex_lock(&stripe_mutexes[s]);
+			for (long i=i0; i<i1; i++) {
+				median[i] = sorted[i*depth+k];
+			}
+			pthread_mutex_unlock(&stripe_mutexes[s]);
+		}
+		if (threadSafetyLevel > 0) unlockMedianReadersAndWriters();
+		median_updated = true;
+		return;
+	}
+
 	float * buffer = (float *) calloc(depth, sizeof(float));
 	if (threadSafetyLevel > 0) {
 		lockAllFramesReadersAndWriters();
@@ -287,7 +388,7 @@ void cFrameBuffer::updateMedian(float point) {
 			buffer[j] = frames[j*pix_nn+i];
 		}
 		// Find median value of the temporary array
-		median[i] = (float) kth_smallest(buffer, depth, point);
+		median[i] = (float) kth_smallest(buffer, depth, k);
 	}
 	if (threadSafetyLevel > 0) {
 		unlockAllFramesReadersAndWriters();
@@ -304,20 +405,7 @@ void cFrameBuffer::copyAbsAboveThresh(float * target) {
 }
 
 void cFrameBuffer::updateAbsAboveThresh(float threshold) {
-	if (threadSafetyLevel > 0) lockAllFramesReadersAndWriters();
-	long * n = (long *) calloc(pix_nn,sizeof(long));
-	for (long j=0; j<depth; j++) {
-		for (long i=0; i<pix_nn; i++) {
-			n[i] += (fabs(frames[j*pix_nn+i])>threshold)?(1):(0);
-		}
-	}
-	if (threadSafetyLevel > 0) unlockAllFramesReadersAndWriters();
-	if (threadSafetyLevel > 0) lockAbsAboveThreshReadersAndWriters();
-	for (long i=0; i<pix_nn; i++) {
-		absAboveThresh[i] = ((float) n[i])/((float) depth);
-	}
-	if (threadSafetyLevel > 0) unlockAbsAboveThreshReadersAndWriters();
-	absAboveThresh_updated = true;
+	updateStatistics(false, false, true, threshold);
 }
 
 void cFrameBuffer::copyStd(float * target) {
@@ -328,32 +416,7 @@ void cFrameBuffer::copyStd(float * target) {
 
 
 void cFrameBuffer::updateStd() {
-	double v;
-	double * sum = (double *) calloc(pix_nn,sizeof(double));
-	double * sumsq = (double *) calloc(pix_nn,sizeof(double));
-	if (threadSafetyLevel > 0) {
-		lockAllFramesReadersAndWriters();
-		lockStdReadersAndWriters();
-	}
-	// Loop over all pixels and frames and sum up
-	for(long j=0; j< depth; j++) {
-		for(long i=0; i<pix_nn; i++) {
-			v = frames[j*pix_nn+i];
-			sum[i] += v;
-			sumsq[i] += v*v;
-		}
-	}
-	// Calculate standard deviation for all pixels
-	for(long i=0; i<pix_nn; i++) {
-		std[i] = sqrt(sumsq[i]/depth - (sum[i]/depth)*(sum[i]/depth));
-	}
-	if (threadSafetyLevel > 0) {
-		unlockAllFramesReadersAndWriters();
-		unlockStdReadersAndWriters();
-	}
-	std_updated = true;
-	free(sum);
-	free(sumsq);
+	updateStatistics(false, true, false, 0);
 }
 
 void cFrameBuffer::copyMean(float * target) {
@@ -364,27 +427,7 @@ void cFrameBuffer::copyMean(float * target) {
 
 
 void cFrameBuffer::updateMean() {
-	double * sum = (double *) calloc(pix_nn,sizeof(double));
-	if (threadSafetyLevel > 0) {
-		lockAllFramesReadersAndWriters();
-		lockMeanReadersAndWriters();
-	}
-	// Loop over all pixels and frames and sum up
-	for(long j=0; j< depth; j++) {
-		for(long i=0; i<pix_nn; i++) {
-			sum[i] += frames[j*pix_nn+i];
-		}
-	}
-	// Calculate mean value for every pixel
-	for(long i=0; i<pix_nn; i++) {
-		mean[i] = sum[i]/depth;
-	}
-	if (threadSafetyLevel > 0) {
-		unlockAllFramesReadersAndWriters();
-		unlockMeanReadersAndWriters();
-	}
-	mean_updated = true;
-	free(sum);
+	updateStatistics(true, false, false, 0);
 }
 
 void cFrameBuffer::subtractMean(float * data, uint16_t * mask, int scale,float minAbsMeanOverStdRatio) {
@@ -429,3 +472,126 @@ void cFrameBuffer::subtractMean(float * data, uint16_t * mask, int scale,float m
 	}
 	if (threadSafetyLevel > 0) unlockMeanWriters();
 }
+
+
+/*
+ *	Fused recalculation of mean, standard deviation and fraction of frames above threshold
+ *	One pass over the ring buffer, done in blocks of pixels that stay in cache for all depth frames.
+ *	Pixel ranges are shared out over nThreads threads; accumulation order per pixel is the same
+ *	as in a plain frame-by-frame sweep, so the results do not depend on the number of threads.
+ */
+void *cFrameBuffer::statisticsWorker(void *threadarg) {
+	tStatisticsJob *job = (tStatisticsJob *) threadarg;
+	updateStatisticsRange(job);
+	return NULL;
+}
+
+void cFrameBuffer::updateStatisticsRange(tStatisticsJob *job) {
+	const long	blockSize = 1024;
+	double	sum[blockSize];
+	double	sumsq[blockSize];
+	long	n[blockSize];
+	long	pix_nn = job->pix_nn;
+	long	depth = job->depth;
+	float	threshold = job->threshold;
+
+	for (long b0=job->i0; b0<job->i1; b0+=blockSize) {
+		long nb = std::min(blockSize, job->i1-b0);
+		for (long b=0; b<nb; b++) {
+			sum[b] = 0;
+			sumsq[b] = 0;
+			n[b] = 0;
+		}
+		for (long j=0; j<depth; j++) {
+			const float * f = job->frames + j*pix_nn + b0;
+			if (job->doStd) {
+				for (long b=0; b<nb; b++) {
+					double v = f[b];
+					sum[b] += v;
+					sumsq[b] += v*v;
+				}
+			}
+			else if (job->doMean) {
+				for (long b=0; b<nb; b++) {
+					sum[b] += f[b];
+				}
+			}
+			if (job->doAbsAboveThresh) {
+				for (long b=0; b<nb; b++) {
+					n[b] += (fabsf(f[b]) > threshold);
+				}
+			}
+		}
+		for (long b=0; b<nb; b++) {
+			if (job->doMean)
+				job->mean[b0+b] = sum[b]/depth;
+			if (job->doStd)
+				job->std[b0+b] = sqrt(sumsq[b]/depth - (sum[b]/depth)*(sum[b]/depth));
+			if (job->doAbsAboveThresh)
+				job->absAboveThresh[b0+b] = ((float) n[b])/((float) depth);
+		}
+	}
+}
+
+void cFrameBuffer::updateStatistics(bool doMean, bool doStd, bool doAbsAboveThresh, float threshold) {
+	tStatisticsJob job;
+	job.frames = frames;
+	job.pix_nn = pix_nn;
+	job.depth = depth;
+	job.doMean = doMean;
+	job.doStd = doStd;
+	job.doAbsAboveThresh = doAbsAboveThresh;
+	job.threshold = threshold;
+	job.mean = mean;
+	job.std = std;
+	job.absAboveThresh = absAboveThresh;
+
+	if (threadSafetyLevel > 0) {
+		lockAllFramesReadersAndWriters();
+		if (doMean) lockMeanReadersAndWriters();
+		if (doStd) lockStdReadersAndWriters();
+		if (doAbsAboveThresh) lockAbsAboveThreshReadersAndWriters();
+	}
+
+	// Split the pixels into contiguous ranges, one per thread
+	long nt = nThreads;
+	if (nt < 1) nt = 1;
+	if (nt > pix_nn/4096 + 1) nt = pix_nn/4096 + 1;
+	job.i0 = 0;
+	job.i1 = pix_nn;
+	if (nt == 1) {
+		updateStatisticsRange(&job);
+	}
+	else {
+		pthread_t *threads = (pthread_t *) calloc(nt, sizeof(pthread_t));
+		bool *started = (bool *) calloc(nt, sizeof(bool));
+		tStatisticsJob *jobs = (tStatisticsJob *) calloc(nt, sizeof(tStatisticsJob));
+		long chunk = (pix_nn + nt - 1) / nt;
+		for (long t=0; t<nt; t++) {
+			jobs[t] = job;
+			jobs[t].i0 = std::min(t*chunk, pix_nn);
+			jobs[t].i1 = std::min((t+1)*chunk, pix_nn);
+			started[t] = (pthread_create(&threads[t], NULL, statisticsWorker, (void *) &jobs[t]) == 0);
+			// Do it ourselves if no thread is available
+			if (!started[t])
+				updateStatisticsRange(&jobs[t]);
+		}
+		for (long t=0; t<nt; t++) {
+			if (started[t])
+				pthread_join(threads[t], NULL);
+		}
+		free(jobs);
+		free(started);
+		free(threads);
+	}
+
+	if (threadSafetyLevel > 0) {
+		unlockAllFramesReadersAndWriters();
+		if (doMean) unlockMeanReadersAndWriters();
+		if (doStd) unlockStdReadersAndWriters();
+		if (doAbsAboveThresh) unlockAbsAboveThreshReadersAndWriters();
+	}
+	if (doMean) mean_updated = true;
+	if (doStd) std_updated = true;
+	if (doAbsAboveThresh) absAboveThresh_updated = true;
+}
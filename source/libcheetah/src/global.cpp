@@ -103,6 +103,7 @@ cGlobal::cGlobal(void) {
 	hitfinderNpeaksMax = 100000;
 	saveHitsMinNPeaks = 0;
 	hitfinderAlgorithm = 8;
+	hitfinderPeakSearch = PEAK_SEARCH_REGION_GROWING;
 	hitfinderMinPixCount = 3;
 	// hitfinderMaxPixCount is a new feature. For backwards compatibility it should be neutral by default, therefore hitfinderMaxPixCount = 0
 	hitfinderMaxPixCount = 0;
@@ -190,6 +191,13 @@ cGlobal::cGlobal(void) {
 	
 	// Flush after every image by default
 	cxiFlushPeriod = 1;
+
+	// Write hits from a dedicated thread, in slabs of up to 32 frames per dataset
+	cxiWriterThread = 1;
+	cxiWriterQueueDepth = 0;
+	cxiSlabFrames = 32;
+	cxiCompression = 0;
+	cxiWriter = NULL;
 	
 	// Save data in modular stack (see CXI version 1.4)
 	saveModular=0;
@@ -223,9 +231,18 @@ cGlobal::cGlobal(void) {
 
 	// Thread safety level
 	threadSafetyLevel = 1;
+	frameBufferThreads = 4;
+	peakfinderThreads = 1;
+	commonModeThreads = 1;
+	powderShards = 4;
 
 	// Default to only a few threads
 	nThreads = 16;
+	workerQueueDepth = 0;
+	workerPool = NULL;
+	eventPoolSize = -1;
+	lazyImageBuffers = 0;
+	eventPool = NULL;
 	// deprecated?
 	useHelperThreads = 0;
 	// deprecated?
@@ -247,12 +264,23 @@ cGlobal::cGlobal(void) {
 	strcpy(cleanedfile, "cleaned.txt");
 	strcpy(peaksfile, "peaks.txt");
 
+	// Whole run in one job
+	nRunShards = 1;
+	runShard = 0;
+	reduceRunShards = NULL;
+
 	// Fudge EVR41 (modify EVR41 according to the Acqiris trace)...
 	fudgeevr41 = 0; // this means no fudge by default
 	lasttime = 0;
 
 	// By default do not profile code
 	profilerDiagnostics = false;
+	for(long i=0; i<N_CORRECTION_STAGES; i++)
+		correctionStageSeconds[i] = 0;
+	correctionTimedFrames = 0;
+
+	// Fused detector correction pass
+	fusedDetectorCorrection = 1;
 
 	// Only one thread during calibration
 	useSingleThreadCalibration = 0;
@@ -375,6 +403,7 @@ void cGlobal::setup() {
 	// Set up thread management
 	nActiveCheetahThreads = 0;
 	threadCounter = 0;
+	powderSequence = 0;
 	pthread_mutex_init(&hitclass_mutex, NULL);
 	for(int powderClass = 0; powderClass<nPowderClasses; powderClass++){
 		pthread_mutex_init(&nPeaksMin_mutex[powderClass], NULL);
@@ -391,11 +420,32 @@ void cGlobal::setup() {
 	pthread_mutex_init(&espectrumRun_mutex, NULL);
 	pthread_mutex_init(&espectrumBuffer_mutex, NULL);
 	pthread_mutex_init(&datarateWorker_mutex, NULL);  
+	pthread_mutex_init(&correctionTiming_mutex, NULL);
 	pthread_mutex_init(&saveCXI_mutex, NULL);  
 	threadID = (pthread_t*) calloc(nThreads, sizeof(pthread_t));
 	pthread_mutex_init(&gmd_mutex, NULL);  
 
-	sem_init(&availableCheetahThreads, 0, nThreads);
+	// Each powder shard adds its events in the order they were handed to Cheetah (see powder.cpp)
+	nPowderTurns = (nDetectors > 0) ? detector[0].nPowderShards : 0;
+	if (nPowderTurns > 0) {
+		powderTurn = (long *) calloc(nPowderTurns, sizeof(long));
+		for(long shard=0; shard<nPowderTurns; shard++)
+			powderTurn[shard] = shard;
+	}
+	pthread_mutex_init(&powderTurn_mutex, NULL);
+
+	// Long-lived workers fed through a bounded queue (see workerPool.cpp)
+	workerPool = new cWorkerPool(nThreads, workerQueueDepth);
+
+	// Workers hand their hits on to the CXI writer (see cxiWriter.cpp)
+	if (saveCXI && cxiWriterThread) {
+		if (cxiWriterQueueDepth < 1)
+			cxiWriterQueueDepth = nThreads;
+		cxiWriter = new cCXIWriter(cxiWriterQueueDepth);
+	}
+	// zlib levels
+	if (cxiCompression > 9)
+		cxiCompression = 9;
 
 	/*
 	 *  INITIAL CALIBRATION
@@ -585,6 +635,11 @@ void cGlobal::setup() {
 		}
 	}
 
+	// Each part of a run split between jobs keeps its own log, and its own SACLA output file
+	// (cxiFilename, when the front end names it before cheetahInit)
+	addRunShardSuffix(logfile);
+	addRunShardSuffix(cxiFilename);
+
 	/*
 	 * Set up arrays for powder classes and radial stacks
 	 * Currently only tracked for detector[0]  (generalise this later)
@@ -597,15 +652,27 @@ void cGlobal::setup() {
 		TimeToolLogfp[i] = NULL;
 		if(runNumber > 0) {
 			sprintf(filename,"r%04u-class%ld-log.txt",runNumber,i);
+			addRunShardSuffix(filename);
 			powderlogfp[i] = fopen(filename, "w");
             sprintf(filename,"r%04u-FEEspectrum-class%ld-index.txt",runNumber,i);
+			addRunShardSuffix(filename);
 			FEElogfp[i] = fopen(filename, "w");
 			sprintf(filename,"r%04u-TimeTool-class%ld-index.txt",runNumber,i);
+			addRunShardSuffix(filename);
 			TimeToolLogfp[i] = fopen(filename, "w");
 		}
 	}
     pthread_mutex_unlock(&powderfp_mutex);
 
+	/*
+	 *  EVENT POOL
+	 */
+	// Recycle event structures: by default keep one per worker, one per queue slot and one being filled by the caller
+	// (created last, once the detector sizes and save formats are final)
+	if (eventPoolSize < 0)
+		eventPoolSize = workerPool->nWorkers + workerPool->queueDepth + 1 + (cxiWriter ? cxiWriter->queueDepth + 1 : 0);
+	if (eventPoolSize > 0)
+		eventPool = new cEventPool(self, eventPoolSize);
 
 }
 
@@ -626,6 +693,7 @@ void cGlobal::unlockMutexes(void) {
 	pthread_mutex_unlock(&espectrumRun_mutex);
 	pthread_mutex_unlock(&espectrumBuffer_mutex);
 	pthread_mutex_unlock(&datarateWorker_mutex);
+	pthread_mutex_unlock(&correctionTiming_mutex);
 	pthread_mutex_unlock(&saveCXI_mutex);
 
 	for(long detIndex=0; detIndex<nDetectors; detIndex++) {
@@ -915,9 +983,36 @@ int cGlobal::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "threadsafetylevel")) {
 		threadSafetyLevel = atoi(value);
 	}
+	else if (!strcmp(tag, "framebufferthreads")) {
+		frameBufferThreads = atoi(value);
+	}
+	else if (!strcmp(tag, "peakfinderthreads")) {
+		peakfinderThreads = atoi(value);
+	}
+	else if (!strcmp(tag, "commonmodethreads")) {
+		commonModeThreads = atoi(value);
+	}
+	else if (!strcmp(tag, "powdershards")) {
+		powderShards = atoi(value);
+	}
 	else if (!strcmp(tag, "nthreads")) {
 		nThreads = atoi(value);
 	}
+	else if (!strcmp(tag, "workerqueuedepth")) {
+		workerQueueDepth = atoi(value);
+	}
+	else if (!strcmp(tag, "eventpoolsize")) {
+		eventPoolSize = atoi(value);
+	}
+	else if (!strcmp(tag, "lazyimagebuffers")) {
+		lazyImageBuffers = atoi(value);
+	}
+	else if (!strcmp(tag, "nrunshards")) {
+		nRunShards = atol(value);
+	}
+	else if (!strcmp(tag, "runshard")) {
+		runShard = atol(value);
+	}
 	else if (!strcmp(tag, "threadtimeoutinseconds")) {
 		threadTimeoutInSeconds = atof(value);
 	}
@@ -933,6 +1028,9 @@ int cGlobal::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "profilerdiagnostics")) {
 		profilerDiagnostics = atoi(value);
 	}
+	else if (!strcmp(tag, "fuseddetectorcorrection")) {
+		fusedDetectorCorrection = atoi(value);
+	}
 	else if (!strcmp(tag, "threadpurge")) {
 		threadPurge = atoi(value);
 	}
@@ -1152,6 +1250,9 @@ int cGlobal::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "hitfinderalgorithm")) {
 		hitfinderAlgorithm = atoi(value);
 	}
+	else if (!strcmp(tag, "hitfinderpeaksearch")) {
+		hitfinderPeakSearch = atoi(value);
+	}
 	else if (!strcmp(tag, "hitfinderminpixcount")) {
 		hitfinderMinPixCount = atoi(value);
 	}
@@ -1218,6 +1319,14 @@ int cGlobal::parseConfigTag(char *tag, char *value) {
 		cxiFlushPeriod = atoi(value);
 	} else if (!strcmp(tag, "cxiswmr")) {
 		cxiSWMR = atoi(value);
+	} else if (!strcmp(tag, "cxiwriterthread")) {
+		cxiWriterThread = atoi(value);
+	} else if (!strcmp(tag, "cxiwriterqueuedepth")) {
+		cxiWriterQueueDepth = atoi(value);
+	} else if (!strcmp(tag, "cxislabframes")) {
+		cxiSlabFrames = atoi(value);
+	} else if (!strcmp(tag, "cxicompression")) {
+		cxiCompression = atoi(value);
 	} else if (!strcmp(tag, "ignoreconversionoverflow")) {
 		ignoreConversionOverflow = atoi(value);
 	} else if (!strcmp(tag, "ignoreconversiontruncate")) {
@@ -1278,6 +1387,11 @@ int cGlobal::validateConfiguration(void){
 		ERROR("You cannot output in CXIDB format (saveCXI = 1) and SACLA format (saveSACLA = 1) simultaneously.");
 		fail = 1;
 	}
+
+	if (nRunShards < 1 || runShard < 0 || runShard >= nRunShards) {
+		ERROR("runShard=%ld does not name one of nRunShards=%ld parts of the run (0 to nRunShards-1).", runShard, nRunShards);
+		fail = 1;
+	}
     
 	return fail;
 }
@@ -1323,6 +1437,7 @@ void cGlobal::writeConfigurationLog(void){
     fprintf(fp, "hitfinderMinGradient=%f\n",hitfinderMinGradient);
     fprintf(fp, "hitfinderNPeaks=%d\n",hitfinderNpeaks);
     fprintf(fp, "hitfinderNPeaksMax=%d\n",hitfinderNpeaksMax);
+    fprintf(fp, "hitfinderPeakSearch=%d\n",hitfinderPeakSearch);
     fprintf(fp, "hitfinderMinPixCount=%d\n",hitfinderMinPixCount);
     fprintf(fp, "hitfinderMaxPixCount=%d\n",hitfinderMaxPixCount);
     fprintf(fp, "hitfinderMinPeakSeparation=%f\n",hitfinderMinPeakSeparation);
@@ -1348,15 +1463,30 @@ void cGlobal::writeConfigurationLog(void){
     fprintf(fp, "assembleInterpolation=%d\n",assembleInterpolation);
     fprintf(fp, "saveCXI=%d\n",saveCXI);
     fprintf(fp, "saveSACLA=%d\n",saveSACLA);
+    fprintf(fp, "cxiWriterThread=%d\n",cxiWriterThread);
+    fprintf(fp, "cxiWriterQueueDepth=%ld\n",cxiWriterQueueDepth);
+    fprintf(fp, "cxiSlabFrames=%d\n",cxiSlabFrames);
+    fprintf(fp, "cxiCompression=%d\n",cxiCompression);
     fprintf(fp, "hdf5dump=%d\n",hdf5dump);
     fprintf(fp, "pythonfile=%s\n",pythonFile);
     fprintf(fp, "debugLevel=%d\n",debugLevel);
     fprintf(fp, "threadSafetyLevel=%d\n",threadSafetyLevel);
+    fprintf(fp, "frameBufferThreads=%ld\n",frameBufferThreads);
+    fprintf(fp, "peakfinderThreads=%ld\n",peakfinderThreads);
+    fprintf(fp, "commonModeThreads=%ld\n",commonModeThreads);
+    fprintf(fp, "powderShards=%ld\n",powderShards);
     fprintf(fp, "nThreads=%ld\n",nThreads);
+    fprintf(fp, "workerQueueDepth=%ld\n",workerQueueDepth);
+    fprintf(fp, "eventPoolSize=%ld\n",eventPoolSize);
+    fprintf(fp, "lazyImageBuffers=%d\n",lazyImageBuffers);
+    fprintf(fp, "nRunShards=%ld\n",nRunShards);
+    fprintf(fp, "runShard=%ld\n",runShard);
     fprintf(fp, "threadTimeoutInSeconds=%d\n",threadTimeoutInSeconds);
     fprintf(fp, "useHelperThreads=%d\n",useHelperThreads);
     fprintf(fp, "threadPurge=%ld\n",threadPurge);
     fprintf(fp, "ioSpeedTest=%d\n",ioSpeedTest);
+    fprintf(fp, "profilerDiagnostics=%d\n",profilerDiagnostics);
+    fprintf(fp, "fusedDetectorCorrection=%d\n",fusedDetectorCorrection);
     //fprintf(fp, "tofName=%s\n",tofName);
     //fprintf(fp, "tofChannel=%d\n",TOFchannel);
     fprintf(fp, "hitfinderUseTOF=%d\n",hitfinderUseTOF);
@@ -1399,6 +1529,7 @@ void cGlobal::writeConfigurationLog(void){
         fprintf(fp, "darkcal=%s\n",detector[i].darkcalFile);
         fprintf(fp, "cmModule=%d\n",detector[i].cmModule);
         fprintf(fp, "cmFloor=%f\n",detector[i].cmFloor);
+        fprintf(fp, "cmEstimator=%d\n",detector[i].cmEstimator);
         fprintf(fp, "cmStart=%d\n",detector[i].cmStart);
         fprintf(fp, "cmStop=%d\n",detector[i].cmStop);
         fprintf(fp, "cmThreshold=%f\n",detector[i].cmThreshold);
@@ -1417,12 +1548,15 @@ void cGlobal::writeConfigurationLog(void){
         fprintf(fp, "bgMemory=%li\n",detector[i].bgMemory);
         fprintf(fp, "bgRecalc=%ld\n",detector[i].bgRecalc);
         fprintf(fp, "bgMedian=%f\n",detector[i].bgMedian);
+        fprintf(fp, "bgIncrementalMedian=%d\n",detector[i].bgIncrementalMedian);
         fprintf(fp, "bgIncludeHits=%d\n",detector[i].bgIncludeHits);
         fprintf(fp, "bgNoBeamReset=%d\n",detector[i].bgNoBeamReset);
         fprintf(fp, "bgFiducialGlitchReset=%d\n",detector[i].bgFiducialGlitchReset);
         fprintf(fp, "startFrames=%d\n",detector[i].startFrames);
         fprintf(fp, "useLocalBackgroundSubtraction=%d\n",detector[i].useLocalBackgroundSubtraction);
         fprintf(fp, "localBackgroundRadius=%ld\n",detector[i].localBackgroundRadius);
+        fprintf(fp, "localBackgroundMode=%d\n",detector[i].localBackgroundMode);
+        fprintf(fp, "localBackgroundPercentile=%f\n",detector[i].localBackgroundPercentile);
         fprintf(fp, "useAutoHotPixel=%d\n",detector[i].useAutoHotPixel);
         fprintf(fp, "applyAutoHotPixel=%d\n",detector[i].applyAutoHotPixel);
         fprintf(fp, "hotPixFreq=%f\n",detector[i].hotPixFreq);
@@ -1445,6 +1579,8 @@ void cGlobal::writeConfigurationLog(void){
         fprintf(fp, "histogram_ss_min=%ld\n",detector[i].histogram_ss_min);
         fprintf(fp, "histogram_ss_max=%ld\n",detector[i].histogram_ss_max);
         fprintf(fp, "histogramMaxMemoryGb=%f\n",detector[i].histogramMaxMemoryGb);
+        fprintf(fp, "histogramShards=%ld\n",detector[i].histogramShards);
+        fprintf(fp, "histogramFlushInterval=%ld\n",detector[i].histogramFlushInterval);
         fprintf(fp, "downsampling=%ld\n",detector[i].downsampling);
         fprintf(fp, "saveDetectorRaw=%d\n",detector[i].saveDetectorRaw);
         fprintf(fp, "saveDetectorCorrected=%d\n",detector[i].saveDetectorCorrected);
@@ -1468,6 +1604,53 @@ void cGlobal::writeConfigurationLog(void){
 	
 }
 
+/*
+ *	Mark an output file name as belonging to this part of a run split into shards
+ *	("frames.txt" -> "frames-shard2.txt"), so that the jobs working on one run can share a directory.
+ *	Does nothing when the whole run is processed by one job. The name must have room for the suffix.
+ */
+void cGlobal::addRunShardSuffix(char *filename) {
+	if (nRunShards <= 1)
+		return;
+
+	char	suffix[64];
+	int		n = sprintf(suffix, "-shard%ld", runShard);
+
+	// Insert before the extension, if the last path component has one
+	char	*slash = strrchr(filename, '/');
+	char	*dot = strrchr(filename, '.');
+	if (dot == NULL || (slash != NULL && dot < slash))
+		dot = filename + strlen(filename);
+	memmove(dot+n, dot, strlen(dot)+1);
+	memcpy(dot, suffix, n);
+}
+
+/*
+ *	The same for files holding running sums (powder, histograms, calibrations): when the front end
+ *	reduces the sums of all parts into part 0 (reduceRunShards), part 0 writes them for the whole run.
+ */
+void cGlobal::addRunShardSumSuffix(char *filename) {
+	if (reduceRunShards == NULL)
+		addRunShardSuffix(filename);
+}
+
+/*
+ *	Whether this part of the run writes running sums and the run status at all
+ *	(not the parts whose sums are reduced into part 0)
+ */
+bool cGlobal::savesRunningSums(void) {
+	return reduceRunShards == NULL || runShard == 0;
+}
+
+/*
+ *	Whether the files of this part keep the raw sums (and sums of squares) that cheetah-merge needs
+ *	to combine the parts afterwards
+ */
+bool cGlobal::keepsRunShardSums(void) {
+	return nRunShards > 1 && reduceRunShards == NULL;
+}
+
+
 /*
  *	Write initial log file
  */
@@ -1507,6 +1690,7 @@ void cGlobal::writeInitialLog(bool withRunNumber){
 	} else {
 		sprintf(framefile,"frames-run%d.txt", runNumber);
 	}
+	addRunShardSuffix(framefile);
 	if (framefp != NULL) fclose(framefp);
 	framefp = fopen (framefile,"w");
 	if(framefp == NULL) {
@@ -1522,6 +1706,7 @@ void cGlobal::writeInitialLog(bool withRunNumber){
 	} else {
 		sprintf(cleanedfile,"cleaned-run%d.txt",runNumber);
 	}
+	addRunShardSuffix(cleanedfile);
 	if (cleanedfp != NULL) fclose(cleanedfp);
 	cleanedfp = fopen (cleanedfile,"w");
 	if(cleanedfp == NULL) {
@@ -1538,6 +1723,7 @@ void cGlobal::writeInitialLog(bool withRunNumber){
 	} else {
 		sprintf(peaksfile,"peaks-run%d.txt", runNumber);
 	}
+	addRunShardSuffix(peaksfile);
 	if (peaksfp != NULL)fclose(peaksfp);
 	peaksfp = fopen (peaksfile,"w");
 	if(peaksfp == NULL) {
@@ -1635,6 +1821,10 @@ void cGlobal::updateLogfile(void){
  *	Write (and keep over-writing) a little status file
  */
 void cGlobal::writeStatus(const char* message) {
+
+	// Parts of a run reduced into part 0 share its status
+	if (!savesRunningSums())
+		return;
 	
 	// Current time
 	char	timestr[1024];
@@ -1811,6 +2001,19 @@ void cGlobal::splitList(char * values, std::vector<T> & elems) {
 }
 
 void cGlobal::freeMemory() {
+	// Joining the workers would hang if some of them are stuck, so only tear the pool down once they are idle
+	if (workerPool != NULL && nActiveCheetahThreads == 0) {
+		delete workerPool;
+		workerPool = NULL;
+	}
+	if (cxiWriter != NULL && nActiveCheetahThreads == 0) {
+		delete cxiWriter;
+		cxiWriter = NULL;
+	}
+	if (eventPool != NULL && nActiveCheetahThreads == 0) {
+		delete eventPool;
+		eventPool = NULL;
+	}
     for(long i=0; i<nDetectors; i++) {
 		detector[i].freeMemory();
     }
@@ -12,6 +12,9 @@
 #include <math.h>
 #include <hdf5.h>
 #include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "detectorObject.h"
 #include "cheetahGlobal.h"
@@ -19,27 +22,86 @@
 #include "cheetahmodules.h"
 #include "median.h"
 
+/*
+ *	Bin index for each of n pixel values: lrint((value-histMin)/histBinSize), clamped to [0, histNbins-1]
+ *	(NaN goes to bin 0). The SSE2 path clamps before rounding, which gives the same bins as rounding first.
+ */
+void histogramBins(const float *data, long n, long histMin, float histBinSize, long histNbins, int32_t *bin) {
+	long	i = 0;
+#ifdef __SSE2__
+	const __m128	vmin = _mm_set1_ps((float) histMin);
+	const __m128	vsize = _mm_set1_ps(histBinSize);
+	const __m128	vzero = _mm_setzero_ps();
+	const __m128	vtop = _mm_set1_ps((float) (histNbins-1));
+	for(; i+4<=n; i+=4) {
+		__m128	binf = _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(data+i), vmin), vsize);
+		binf = _mm_max_ps(binf, vzero);		// maxps returns the second operand for NaN
+		binf = _mm_min_ps(binf, vtop);
+		_mm_storeu_si128((__m128i *) (bin+i), _mm_cvtps_epi32(binf));
+	}
+#endif
+	for(; i<n; i++) {
+		long	b = (long) lrint((data[i]-histMin)/histBinSize);
+		if(b < 0) b = 0;
+		if(b >= histNbins) b = histNbins-1;
+		bin[i] = (int32_t) b;
+	}
+}
+
+
+/*
+ *	Add a shard into the detector histogram and clear it (caller holds histogramShard_mutex[shard])
+ */
+static void flushHistogramShard(cPixelDetectorCommon *detector, long shard) {
+	uint16_t	*shardData = detector->histogramShardData[shard];
+	if(shardData == NULL || detector->histogramShardCount[shard] == 0)
+		return;
+	pthread_mutex_lock(&detector->histogram_mutex);
+	uint32_t	*histData = detector->histogramData;
+	for(uint64_t i=0; i<detector->histogram_nnn; i++)
+		histData[i] += shardData[i];
+	detector->histogram_count += detector->histogramShardCount[shard];
+	pthread_mutex_unlock(&detector->histogram_mutex);
+	memset(shardData, 0, detector->histogram_nnn*sizeof(uint16_t));
+	detector->histogramShardCount[shard] = 0;
+}
+
+
+/*
+ *	Bring histogramData up to date with every frame binned so far (before saving it)
+ */
+void flushHistogramShards(cGlobal *global, int detIndex) {
+	cPixelDetectorCommon	*detector = &global->detector[detIndex];
+	for(long shard=0; shard<detector->histogramShards; shard++) {
+		pthread_mutex_lock(&detector->histogramShard_mutex[shard]);
+		flushHistogramShard(detector, shard);
+		pthread_mutex_unlock(&detector->histogramShard_mutex[shard]);
+	}
+}
+
+
 /*
  *	Maintain histogram buffer
+ *	Each worker counts into its own 16-bit shard, which is added into the shared histogram every
+ *	histogramFlushInterval frames, so the shared histogram is only locked once per flush
  */
 void addToHistogram(cEventData *eventData, cGlobal *global, int hit) {
 	   
 	DETECTOR_LOOP {
 		if (global->detector[detIndex].histogram && (!(global->detector[detIndex].histogramOnlyBlanks && hit))) {
 			// Dereference common variables
-			long		pix_nx = global->detector[detIndex].pix_nx;
-
-			long		histMin = global->detector[detIndex].histogramMin;
-			long		histNbins = global->detector[detIndex].histogramNbins;
-			float       histBinSize = global->detector[detIndex].histogramBinSize;
-			long		hist_fs_min = global->detector[detIndex].histogram_fs_min;
-			long		hist_fs_max = global->detector[detIndex].histogram_fs_max;
-			long		hist_ss_min = global->detector[detIndex].histogram_ss_min;
-			long		hist_ss_max = global->detector[detIndex].histogram_ss_max;
-			long		hist_nfs = global->detector[detIndex].histogram_nfs;
-			long		hist_nn = global->detector[detIndex].histogram_nn;
-			uint16_t	*histData = global->detector[detIndex].histogramData;
-			int         dataVersion = global->detector[detIndex].histogramDataVersion;
+			cPixelDetectorCommon	*detector = &global->detector[detIndex];
+			long		pix_nx = detector->pix_nx;
+
+			long		histMin = detector->histogramMin;
+			long		histNbins = detector->histogramNbins;
+			float       histBinSize = detector->histogramBinSize;
+			long		hist_fs_min = detector->histogram_fs_min;
+			long		hist_ss_min = detector->histogram_ss_min;
+			long		hist_ss_max = detector->histogram_ss_max;
+			long		hist_nfs = detector->histogram_nfs;
+			long		hist_nn = detector->histogram_nn;
+			int         dataVersion = detector->histogramDataVersion;
 			float       *frameData;
 			if (dataVersion <= 0) {
 				frameData = eventData->detector[detIndex].data_raw;
@@ -49,49 +111,49 @@ void addToHistogram(cEventData *eventData, cGlobal *global, int hit) {
 				frameData = eventData->detector[detIndex].data_detPhotCorr;				
 			}
 
-			// Figure out which bin should be filled
-			// (done outside of mutex lock)
-			long	bin;
-			float	binf;
-			long	i_hist, i_buffer;
-			float	value;
-			
-			long	*buffer;
-			buffer = (long *) calloc(hist_nn, sizeof(long));
-	
-			//printf("histMin=%li, histBinSize=%f, histNbins=%li\n",histMin,histBinSize,histNbins);
-
-			for(long ss=hist_ss_min; ss<hist_ss_max; ss++) {
-				for(long fs=hist_fs_min; fs<hist_fs_max; fs++) {
-			
-					i_hist = fs + ss*pix_nx;
-					i_buffer = (fs-hist_fs_min) + (ss-hist_ss_min)*hist_nfs;
-			
-					value = frameData[i_hist];
-					binf = (value-histMin)/histBinSize;
-					bin = (long) lrint(binf);
-			
-					if(bin < 0) bin = 0;
-					if(bin >= histNbins) bin=histNbins-1;
-			
-					buffer[i_buffer] = bin;
+			if (detector->histogramShards > 0) {
+				long		shard = eventData->threadID % detector->histogramShards;
+				int32_t		*bin = (int32_t *) calloc(hist_nfs, sizeof(int32_t));
+				pthread_mutex_lock(&detector->histogramShard_mutex[shard]);
+				if (detector->histogramShardData[shard] == NULL)
+					detector->histogramShardData[shard] = (uint16_t *) calloc(detector->histogram_nnn, sizeof(uint16_t));
+				uint16_t	*shardData = detector->histogramShardData[shard];
+
+				// Bin one row at a time, so the row of bins is still in cache for the scatter
+				for(long ss=hist_ss_min; ss<hist_ss_max; ss++) {
+					histogramBins(frameData + hist_fs_min + ss*pix_nx, hist_nfs, histMin, histBinSize, histNbins, bin);
+					uint16_t	*cell = shardData + (uint64_t) (ss-hist_ss_min)*hist_nfs*histNbins;
+					for(long fs=0; fs<hist_nfs; fs++, cell+=histNbins)
+						cell[bin[fs]] += 1;
 				}
+				detector->histogramShardCount[shard] += 1;
+				if (detector->histogramShardCount[shard] >= detector->histogramFlushInterval)
+					flushHistogramShard(detector, shard);
+				pthread_mutex_unlock(&detector->histogramShard_mutex[shard]);
+				free(bin);
 			}
-	
-	
-			// Update histogram
-			// This could be a little slow due to sparse memory access conflicting with predictive memory caching
-			pthread_mutex_lock(&global->detector[detIndex].histogram_mutex);
-			uint64_t	cell;
-			for(long i=0; i<hist_nn; i++) {
-				cell = i*histNbins;
-				histData[cell+buffer[i]] += 1;
-			}
-			global->detector[detIndex].histogram_count += 1;
-			pthread_mutex_unlock(&global->detector[detIndex].histogram_mutex);
+			else {
+				// Figure out which bin should be filled
+				// (done outside of mutex lock)
+				int32_t		*buffer = (int32_t *) calloc(hist_nn, sizeof(int32_t));
+				for(long ss=hist_ss_min; ss<hist_ss_max; ss++)
+					histogramBins(frameData + hist_fs_min + ss*pix_nx, hist_nfs, histMin, histBinSize, histNbins, buffer + (ss-hist_ss_min)*hist_nfs);
+
+				// Update histogram
+				// This could be a little slow due to sparse memory access conflicting with predictive memory caching
+				pthread_mutex_lock(&detector->histogram_mutex);
+				uint32_t	*histData = detector->histogramData;
+				uint64_t	cell;
+				for(long i=0; i<hist_nn; i++) {
+					cell = i*histNbins;
+					histData[cell+buffer[i]] += 1;
+				}
+				detector->histogram_count += 1;
+				pthread_mutex_unlock(&detector->histogram_mutex);
 			
-			// Free temporary memory
-			free(buffer);
+				// Free temporary memory
+				free(buffer);
+			}
 		}
 	}
 }
@@ -106,6 +168,8 @@ void calculateHistogramScale(long histMin, long histNbins, float histBinSize, fl
  *	Save histograms
  */
 void saveHistograms(cGlobal *global) {
+    if(!global->savesRunningSums())
+        return;
     
     DEBUGL2_ONLY {
         DEBUG("Writing histogram data \n");
@@ -129,9 +193,8 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	float		histBinSize = global->detector[detIndex].histogramBinSize;
 	long		hist_nfs = global->detector[detIndex].histogram_nfs;
 	long		hist_nss = global->detector[detIndex].histogram_nss;
-	long		hist_nn = global->detector[detIndex].histogram_nn;
 	uint64_t	hist_nnn = global->detector[detIndex].histogram_nnn;
-	uint16_t	*histData = global->detector[detIndex].histogramData;
+	uint32_t	*histData = global->detector[detIndex].histogramData;
 	float		*darkcal = global->detector[detIndex].darkcal;
 	
 	long		hist_count;
@@ -145,33 +208,51 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	 */
 	
     // Create and allocate the buffer outside of mutex lock (memset forces allocation)
-    uint16_t *histogramBuffer = (uint16_t*) calloc(hist_nnn, sizeof(uint16_t));
-    memset(histogramBuffer, 0, hist_nnn*sizeof(uint16_t));
+    uint32_t *histogramBuffer = (uint32_t*) calloc(hist_nnn, sizeof(uint32_t));
+    memset(histogramBuffer, 0, hist_nnn*sizeof(uint32_t));
     
-    // Copy histogram data inside mutex lock
+    // Fold in what the workers have binned since their last flush, then copy histogram data inside mutex lock
+	flushHistogramShards(global, detIndex);
 	pthread_mutex_lock(&global->detector[detIndex].histogram_mutex);
-	memcpy(histogramBuffer, histData, hist_nnn*sizeof(uint16_t));
+	memcpy(histogramBuffer, histData, hist_nnn*sizeof(uint32_t));
 	hist_count = global->detector[detIndex].histogram_count;
     pthread_mutex_unlock(&global->detector[detIndex].histogram_mutex);
     
     
 	
 
+	char	filename[1024];
+	sprintf(filename,"r%04u-detector%d-histogram.h5", global->runNumber, detIndex);
+	global->addRunShardSumSuffix(filename);
+	printf("Writing histogram data to file: %s\n",filename);
+	writeHistogramFile(filename, histogramBuffer, darkcal, hist_nfs, hist_nss, histNbins, histMin, histBinSize, hist_count, global->h5compress);
+
+	/*
+	 *	Release memory (very important because the histogram array is big!)
+	 */
+    free(histogramBuffer);
+}
+
+
+/*
+ *	Write a histogram file: the histogram of each pixel (hist_nss x hist_nfs x histNbins), the per-pixel
+ *	statistics derived from it, the darkcal it was taken against and the binning.
+ *	(Also used by cheetah-merge to write the histogram of several parts of a run.)
+ */
+void writeHistogramFile(const char *filename, uint32_t *histogramBuffer, float *darkcal, long hist_nfs, long hist_nss, long histNbins, long histMin, float histBinSize, long hist_count, int h5compress) {
+
+	long		hist_nn = hist_nfs*hist_nss;
+
     /*
 	 *	Mess of stuff for writing the HDF5 file
      *  (OK to open HDF5 file outside the mutex lock)
 	 */
-	char	filename[1024];
 	hid_t fh, gh, sh, dh;	/* File, group, dataspace and data handles */
 	hsize_t		size[3];
 	hsize_t		max_size[3];
 	hsize_t		chunk[3];
 	hid_t		h5compression;
 
-    
-	sprintf(filename,"r%04u-detector%d-histogram.h5", global->runNumber, detIndex);
-	printf("Writing histogram data to file: %s\n",filename);
-	
 	fh = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
 	if ( fh < 0 ) {
 		ERROR("Couldn't create HDF5 file: %s\n", filename);
@@ -182,7 +263,7 @@ void saveHistogram(cGlobal *global, int detIndex) {
 		H5Fclose(fh);
 	}
 	
-	if (global->h5compress) {
+	if (h5compress) {
 		h5compression = H5Pcreate(H5P_DATASET_CREATE);
 		//H5Pset_chunk(h5compression, 2, chunksize);
 		//H5Pset_deflate(h5compression, 3);		// Compression levels are 0 (none) to 9 (max)
@@ -207,16 +288,16 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	chunk[0] = 1;
 	chunk[1] = hist_nfs;
 	chunk[2] = histNbins;
-	if (global->h5compress) {
+	if (h5compress) {
 		H5Pset_chunk(h5compression, 3, chunk);
 		//H5Pset_shuffle(h5compression);			// De-interlace bytes
 		H5Pset_deflate(h5compression, 1);		// Compression levels are 0 (none) to 9 (max)
 	}
 
 	
-	dh = H5Dcreate(gh, "histogram", H5T_NATIVE_UINT16, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
+	dh = H5Dcreate(gh, "histogram", H5T_NATIVE_UINT32, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
 	if (dh < 0) ERROR("Could not create dataset.\n");
-	H5Dwrite(dh, H5T_NATIVE_UINT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, histogramBuffer);
+	H5Dwrite(dh, H5T_NATIVE_UINT32, H5S_ALL, H5S_ALL, H5P_DEFAULT, histogramBuffer);
 	H5Dclose(dh);
     
     // Create link from /data/histogram to /data/data (the default data locations)
@@ -226,93 +307,14 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	/*
 	 *	Perform some statistical analysis
 	 */
-	float	n;
-	float	mean;
-	float	var;
-	float	rVar;
-	float	cSq;
-	float	kld;
-	float	count;
-	float	temp1, temp2, temp3, temp4;
 	float	*mean_arr = (float*) calloc(hist_nn, sizeof(float));
 	float	*var_arr = (float*) calloc(hist_nn, sizeof(float));
 	float	*rVar_arr = (float*) calloc(hist_nn, sizeof(float));
 	float	*cSq_arr = (float*) calloc(hist_nn, sizeof(float));
 	float	*kld_arr = (float*) calloc(hist_nn, sizeof(float));
 	float	*count_arr = (float*) calloc(hist_nn, sizeof(float));
-	float	*hist = (float*) calloc(histNbins, sizeof(float));
-	uint64_t	offset;
-	
-	
-	for(long i=0; i<hist_nn; i++) {
-		offset = i*histNbins;
-
-		// Extract a temporary copy of the histogram for this pixel
-		count = 0;
-		for(long j=0; j<histNbins; j++) {
-			hist[j] = (float) histogramBuffer[offset+j];
-			count += hist[j];
-		}
-
-		
-		// Normalise the histogram to total count of 1
-		for(long j=0; j<histNbins; j++)
-			hist[j] /= count;
-
-
-		// Calculate mean and variance
-		count = 0;
-		mean = 0;
-		var = 0;
-		for(long j=0; j<histNbins; j++) {
-			count += hist[j];
-			mean += j*hist[j];
-			var += j*j*hist[j];
-		}
-		var -= (mean*mean);
-		
-		
-		// Calculate Chi-Squared and KL-divergence
-		rVar = 0;
-		cSq = 0;
-		kld = 0;
-		n = 0;
-		for(long j=0; j<histNbins; j++) {
-			if(hist[j] > 1e-10 && var > 1e-10) {
-				temp1 = (j - mean);
-				temp2 = temp1*temp1;
-				temp3 = expf(-0.5 * temp2 / var);
-                temp2 *= hist[j];
-				rVar += temp2;
-				cSq += temp2;
-				if(temp3 > 1e-10 && hist[j] > 1e-10) {
-					temp4 = hist[j] / temp3;
-					if (temp4 > 1e-10) {
-						kld += hist[j] * logf(temp4);
-						n += temp3;
-					}
-				}
-			}
-		}
-		if(var > 1e-7)
-			rVar /= var;
-		if(mean > 1e-7)
-			cSq /= (mean*mean);
-		if(n > 1e-10)
-			kld += logf(n);
-		
-		mean_arr[i] = mean;
-		var_arr[i] = var;
-		rVar_arr[i] = rVar;
-		cSq_arr[i] = cSq;
-		kld_arr[i] = kld;
-		count_arr[i] = n;
-	}
-	
-    
-    
+	histogramStatistics(histogramBuffer, hist_nn, histNbins, mean_arr, var_arr, rVar_arr, cSq_arr, kld_arr, count_arr);
 
-	
 	// Write offsets for each pixel (darkcal)
 	size[0] = hist_nss;
 	size[1] = hist_nfs;
@@ -320,7 +322,7 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	max_size[1] = hist_nfs;
 	sh = H5Screate_simple(2, size, max_size);
 
-	if (global->h5compress) {
+	if (h5compress) {
 		H5Pset_chunk(h5compression, 2, size);
 		//H5Pset_shuffle(h5compression);			// De-interlace bytes
 		H5Pset_deflate(h5compression, 3);		// Compression levels are 0 (none) to 9 (max)
@@ -407,16 +409,100 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	
 	
 	/*
-	 *	Release memory (very important because the histogram array is big!)
+	 *	Release memory
 	 */
-    free(histogramBuffer);
 	free(mean_arr);
 	free(var_arr);
 	free(rVar_arr);
 	free(cSq_arr);
 	free(kld_arr);
 	free(count_arr);
-	free(hist);
 
 	
 }
+
+
+/*
+ *	Per-pixel statistics of the histograms of nPixels pixels (histogramBuffer: histNbins bins per pixel):
+ *	mean and variance in bins, reduced variance, chi-squared and KL-divergence against a Gaussian
+ *	of the same mean and variance, and the normalisation n of that Gaussian.
+ *	(cheetah-merge calls this on blocks of pixels.)
+ */
+void histogramStatistics(uint32_t *histogramBuffer, long nPixels, long histNbins, float *mean_arr, float *var_arr, float *rVar_arr, float *cSq_arr, float *kld_arr, float *count_arr) {
+	float	n;
+	float	mean;
+	float	var;
+	float	rVar;
+	float	cSq;
+	float	kld;
+	float	count;
+	float	temp1, temp2, temp3, temp4;
+	float	*hist = (float*) calloc(histNbins, sizeof(float));
+	uint64_t	offset;
+	
+	for(long i=0; i<nPixels; i++) {
+		offset = i*histNbins;
+
+		// Extract a temporary copy of the histogram for this pixel
+		count = 0;
+		for(long j=0; j<histNbins; j++) {
+			hist[j] = (float) histogramBuffer[offset+j];
+			count += hist[j];
+		}
+
+		
+		// Normalise the histogram to total count of 1
+		for(long j=0; j<histNbins; j++)
+			hist[j] /= count;
+
+
+		// Calculate mean and variance
+		count = 0;
+		mean = 0;
+		var = 0;
+		for(long j=0; j<histNbins; j++) {
+			count += hist[j];
+			mean += j*hist[j];
+			var += j*j*hist[j];
+		}
+		var -= (mean*mean);
+		
+		
+		// Calculate Chi-Squared and KL-divergence
+		rVar = 0;
+		cSq = 0;
+		kld = 0;
+		n = 0;
+		for(long j=0; j<histNbins; j++) {
+			if(hist[j] > 1e-10 && var > 1e-10) {
+				temp1 = (j - mean);
+				temp2 = temp1*temp1;
+				temp3 = expf(-0.5 * temp2 / var);
+                temp2 *= hist[j];
+				rVar += temp2;
+				cSq += temp2;
+				if(temp3 > 1e-10 && hist[j] > 1e-10) {
+					temp4 = hist[j] / temp3;
+					if (temp4 > 1e-10) {
+						kld += hist[j] * logf(temp4);
+						n += temp3;
+					}
+				}
+			}
+		}
+		if(var > 1e-7)
+			rVar /= var;
+		if(mean > 1e-7)
+			cSq /= (mean*mean);
+		if(n > 1e-10)
+			kld += logf(n);
+		
+		mean_arr[i] = mean;
+		var_arr[i] = var;
+		rVar_arr[i] = rVar;
+		cSq_arr[i] = cSq;
+		kld_arr[i] = kld;
+		count_arr[i] = n;
+	}
+	free(hist);
+}
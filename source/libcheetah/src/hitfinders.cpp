@@ -201,7 +201,10 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global){
 	long	asic_ny = global->detector[detIndex].asic_ny;
 	long	nasics_x = global->detector[detIndex].nasics_x;
 	long	radius = global->detector[detIndex].localBackgroundRadius;
-	float	*pix_r = global->detector[detIndex].pix_r;
+	int		bgMode = global->detector[detIndex].localBackgroundMode;
+	float	bgPercentile = global->detector[detIndex].localBackgroundPercentile;
+	int		layout = global->detector[detIndex].kernelLayout;
+	tRadialBinIndex	*rbins = &global->detector[detIndex].pix_rbins;
 	float	*data = eventData->detector[detIndex].data_detCorr;
 
 	float	hitfinderADCthresh = global->hitfinderADC;
@@ -211,8 +214,10 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global){
 	long	hitfinderLocalBGRadius = global->hitfinderLocalBGRadius;
 	float	hitfinderMinPeakSeparation = global->hitfinderMinPeakSeparation;
 	tPeakList	*peaklist = &eventData->peaklist;
+	tPeakfinderWorkspace	*ws = global->detector[detIndex].getPeakfinderWorkspace(eventData->threadID, hitfinderMaxPixCount);
+	ws->peakSearch = global->hitfinderPeakSearch;
 
-	char	*mask = (char*) calloc(pix_nn, sizeof(char));
+	char	*mask = ws->mask;
 	
 	//	Bad region masks  (data=0 to ignore regions)
 	uint16_t	combined_pixel_options = PIXEL_IS_IN_PEAKMASK|PIXEL_IS_BAD|PIXEL_IS_HOT|PIXEL_IS_BAD|PIXEL_IS_OUT_OF_RESOLUTION_LIMITS;
@@ -220,7 +225,8 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global){
 		mask[i] = isNoneOfBitOptionsSet(eventData->detector[detIndex].pixelmask[i], combined_pixel_options);
 	
 
-	subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, 2);
+	tLocalBackgroundWorkspace	*bgWs = global->detector[detIndex].getLocalBackgroundWorkspace(eventData->threadID);
+	subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, 2, bgMode, bgPercentile, layout, bgWs);
 	
 
 	/*
@@ -230,15 +236,15 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global){
 	switch(global->hitfinderAlgorithm) {
 	
 	case 3 : 	// Count number of Bragg peaks
-		nPeaks = peakfinder3(peaklist, data, mask, asic_nx, asic_ny, nasics_x, 2, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius);
+		nPeaks = peakfinder3(peaklist, ws, data, mask, asic_nx, asic_ny, nasics_x, 2, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius);
 		break;
 
 	case 6 : 	// Count number of Bragg peaks
-		nPeaks = peakfinder6(peaklist, data, mask, asic_nx, asic_ny, nasics_x, 2, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius, hitfinderMinPeakSeparation);
+		nPeaks = peakfinder6(peaklist, ws, data, mask, asic_nx, asic_ny, nasics_x, 2, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius, hitfinderMinPeakSeparation);
 		break;
 	   
 	case 8 : 	// Count number of Bragg peaks
-		nPeaks = peakfinder8(peaklist, data, mask, pix_r, asic_nx, asic_ny, nasics_x, 2, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius);
+		nPeaks = peakfinder8(peaklist, ws, data, mask, rbins, asic_nx, asic_ny, nasics_x, 2, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius);
 		break;
 	
 	default :
@@ -260,11 +266,9 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global){
 	
 		// Do the rest of the local background subtraction
 		long offset = (2*asic_ny)*pix_nx;
-		subtractLocalBackground(data+offset, radius, asic_nx, asic_ny, nasics_x, 6);
+		subtractLocalBackground(data+offset, radius, asic_nx, asic_ny, nasics_x, 6, bgMode, bgPercentile, layout, bgWs);
 	}
 	
-	free(mask);
-	
 	return hit;
 }
 
@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <fenv.h>
+#include <errno.h>
 #include <unistd.h>
 #include <vector>
 
@@ -81,10 +82,7 @@ int cheetahInit(cGlobal *global) {
  */
 void cheetahNewRun(cGlobal *global) {
 	// Wait for all workers to finish
-	while(global->nActiveCheetahThreads > 0) {
-		printf("Waiting for %li worker threads to terminate\n", global->nActiveCheetahThreads);
-		usleep(500000);
-	}
+	cheetahWaitForWorkers(global);
     
 	// Reset the powder log files
     pthread_mutex_lock(&global->powderfp_mutex);
@@ -94,6 +92,7 @@ void cheetahNewRun(cGlobal *global) {
             char	filename[1024];
 
 			sprintf(filename,"r%04u-class%ld-log.txt",global->runNumber,i);
+			global->addRunShardSuffix(filename);
             if(global->powderlogfp[i] != NULL)
                 fclose(global->powderlogfp[i]);
 			global->powderlogfp[i] = fopen(filename, "w");
@@ -101,6 +100,7 @@ void cheetahNewRun(cGlobal *global) {
 
 			if(global->useFEEspectrum) {
 				sprintf(filename,"r%04u-FEEspectrum-class%ld-index.txt",global->runNumber,i);
+				global->addRunShardSuffix(filename);
 				if(global->FEElogfp[i] != NULL)
 					fclose(global->FEElogfp[i]);
 				global->FEElogfp[i] = fopen(filename, "w");
@@ -109,6 +109,7 @@ void cheetahNewRun(cGlobal *global) {
 
 			if(global->useTimeTool) {
 				sprintf(filename,"r%04u-TimeTool-class%ld-index.txt",global->runNumber,i);
+				global->addRunShardSuffix(filename);
 				if(global->TimeToolLogfp[i] != NULL)
 					fclose(global->TimeToolLogfp[i]);
 				global->TimeToolLogfp[i] = fopen(filename, "w");
@@ -119,6 +120,76 @@ void cheetahNewRun(cGlobal *global) {
     pthread_mutex_unlock(&global->powderfp_mutex);
 }
 
+
+/*
+ *	Wait until every event handed to Cheetah so far has been processed (and written by the CXI writer)
+ */
+void cheetahWaitForWorkers(cGlobal *global) {
+	while(global->nActiveCheetahThreads > 0) {
+		printf("Waiting for %li worker threads to terminate\n", global->nActiveCheetahThreads);
+		usleep(500000);
+	}
+}
+
+
+/*
+ *	Save the running sums and update the logs part way through a run (every saveInterval frames).
+ *	Workers call this themselves; front ends that reduce the parts of a run (reduceRunShards) call it
+ *	on every part at the same point instead, with the workers idle.
+ */
+void cheetahSaveInterval(cGlobal *global) {
+	// Fold per-worker sums into the powder (and the other parts of the run into part 0),
+	// then assemble, downsample and radially average it
+	mergePowderShards(global);
+	if(global->reduceRunShards != NULL)
+		global->reduceRunShards(global);
+	assemble2DPowder(global);
+	downsamplePowder(global);
+	calculateRadialAveragePowder(global);
+	// Save accumulated data
+	if(global->saveCXI){
+		writeAccumulatedCXI(global);
+	} 
+	if(global->writeRunningSumsFiles){
+		saveRunningSums(global);
+		saveHistograms(global);
+		saveSpectrumStacks(global);
+		if (global->useTimeTool) {
+			saveTimeToolStacks(global);
+		}
+	}
+	global->updateLogfile();
+	global->writeStatus("Not finished");
+
+	// try this - periodically flush the H5 file to let us to see data as it's being saved 
+	if(global->saveCXI) {
+		flushCXIFiles(global);
+	}
+}
+
+
+/*
+ *	Splitting a run between nRunShards independent jobs.
+ *	Front ends that can seek (file based) give each job a contiguous block of the run's events,
+ *	front ends that can only walk the event list keep every nRunShards-th event.
+ */
+int cheetahRunShardOwnsEvent(cGlobal *global, long eventIndex) {
+	if(global->nRunShards <= 1)
+		return 1;
+	return (eventIndex % global->nRunShards) == global->runShard;
+}
+
+void cheetahRunShardRange(cGlobal *global, long nEvents, long *first, long *end) {
+	if(global->nRunShards <= 1) {
+		*first = 0;
+		*end = nEvents;
+		return;
+	}
+	*first = (nEvents * global->runShard) / global->nRunShards;
+	*end = (nEvents * (global->runShard+1)) / global->nRunShards;
+}
+
+
 /*
  *  libCheetah function to update global variables where needed from new event data
  */
@@ -209,8 +280,7 @@ void cheetahUpdateGlobal(cGlobal *global, cEventData *eventData){
                 printf("MESSAGE: Bad wavelength data (NaN). Consider using defaultPhotonEnergyeV keyword.\n");
             }	
             global->detector[detIndex].detectorZprevious = global->detector[detIndex].detectorZ;
-            for(long i=0; i<global->nDetectors; i++) 
-                global->detector[detIndex].updateKspace(global, eventData->wavelengthA);
+            global->detector[detIndex].updateKspace(global, eventData->wavelengthA);
             
         }	
     }
@@ -292,8 +362,7 @@ void cheetahProcessEvent(cGlobal *global, cEventData *eventData){
 		pthread_mutex_unlock(&global->process_mutex);
 		return;
 	}
-	
-    
+
     /*
      *  Spawn worker in single-threaded mode
      *
@@ -304,63 +373,43 @@ void cheetahProcessEvent(cGlobal *global, cEventData *eventData){
      *      eventData remains available after the worker exits and must be explicitly freed by the user
      */
     if(eventData->useThreads == 0) {
+		// Events add to the powder in this order (see powder.cpp; the worker pool numbers the events it queues)
+		eventData->powderSequence = global->powderSequence;
+		global->powderSequence += 1;
         worker((void *)eventData);
     }
   	
 	/*
-	 *	Spawn worker in multithreaded mode 
-	 *	Threads are created detached so we don't have to wait for anything to happen before returning
-	 *		(each thread is responsible for cleaning up its own eventData structure when done)
+	 *	Hand the event to the worker pool in multithreaded mode
+	 *	Workers are long-lived threads fed through a bounded queue, so we return as soon as the event is queued
+	 *		(the worker is responsible for cleaning up the eventData structure when done)
 	 */
     if(eventData->useThreads == 1) {
 		pthread_mutex_unlock(&global->process_mutex);
-        pthread_t		thread;
-        pthread_attr_t	threadAttribute;
-        int				returnStatus;
-        
-        /*
-         *  Wait until we have a spare thread in the thread pool
-         *  If nothing happens for some time, assume we have some sort of thread lockup and keep going anyway
-         */
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += global->threadTimeoutInSeconds;
-		int sem_ret = sem_timedwait(&global->availableCheetahThreads, &ts);
-		if(sem_ret == ETIMEDOUT){
-			printf("\tApparent thread lock - no free thread for %d seconds.\n", global->threadTimeoutInSeconds);
-			printf("\tGiving up and resetting the thread counter\n");
-			global->unlockMutexes();
-			global->nActiveCheetahThreads = 0;
-			int semValue = 0;
-			while(semValue < global->nThreads){
-				sem_post(&global->availableCheetahThreads);
-				sem_getvalue(&global->availableCheetahThreads, &semValue);
-			}
-				
-		}
-        
-        // Set detached state
-        pthread_attr_init(&threadAttribute);
-        pthread_attr_setdetachstate(&threadAttribute, PTHREAD_CREATE_DETACHED);
 
-        // Create a new worker thread for this data frame
-		// Lock acquired before creation to avoid race condition where nActiveThreads decremented before incremented
+		// Count the event as active before queueing it so nActiveThreads can not be decremented before incremented
 		pthread_mutex_lock(&global->nActiveThreads_mutex);
         eventData->threadNum = global->threadCounter;
-        returnStatus = pthread_create(&thread, &threadAttribute, worker, (void *)eventData);
+		global->nActiveCheetahThreads += 1;
+		global->threadCounter += 1;
+		pthread_mutex_unlock(&global->nActiveThreads_mutex);
 
-		if (returnStatus == 0) { // creation successful
-			// Increment threadpool counter
-			global->nActiveCheetahThreads += 1;
-			global->threadCounter += 1;
+        /*
+         *  Wait until there is room in the queue
+         *  If nothing happens for some time, assume we have some sort of thread lockup and skip the frame
+         *  (the mutexes belong to workers that are still running, so they are left alone)
+         */
+		int returnStatus = global->workerPool->push(eventData, global->threadTimeoutInSeconds);
+		if(returnStatus == ETIMEDOUT){
+			printf("\tApparent thread lock - no free worker for %d seconds.\n", global->threadTimeoutInSeconds);
+		}
+		if(returnStatus != 0){
+			pthread_mutex_lock(&global->nActiveThreads_mutex);
+			global->nActiveCheetahThreads -= 1;
+			pthread_mutex_unlock(&global->nActiveThreads_mutex);
+			printf("Error: could not queue event for worker pool (frame skipped)\n");
+			cheetahDestroyEvent(eventData);
 		}
-		else{
-			sem_post(&global->availableCheetahThreads);
-			printf("Error: thread creation failed (frame skipped)\n");
-        }
-		pthread_mutex_unlock(&global->nActiveThreads_mutex);
-        pthread_attr_destroy(&threadAttribute);
-//		pthread_mutex_lock(&global->process_mutex);
     }
 }
 
@@ -393,7 +442,17 @@ void cheetahExit(cGlobal *global) {
 			break;
 		}
     }
+	if(global->nActiveCheetahThreads == 0) {
+		global->workerPool->shutdown();
+		if(global->cxiWriter != NULL)
+			global->cxiWriter->shutdown();
+	}
     
+    // Fold per-worker sums into the powder (and the other parts of the run into part 0)
+	mergePowderShards(global);
+	if(global->reduceRunShards != NULL)
+		global->reduceRunShards(global);
+
     // Calculate mean photon energy
     global->meanPhotonEnergyeV = global->summedPhotonEnergyeV/global->nhitsandblanks;
     global->photonEnergyeVSigma = sqrt(global->summedPhotonEnergyeVSquared/global->nhitsandblanks - global->meanPhotonEnergyeV * global->meanPhotonEnergyeV);
@@ -432,6 +491,7 @@ void cheetahExit(cGlobal *global) {
 		printf("%li hits (%2.2f%%)\n",global->nhits, 100.*( global->nhits / (float) global->nhitsandblanks));
     }
     printf("%li frames processed\n",global->nprocessedframes);
+    printCorrectionTiming(global);
 
     
     
@@ -30,9 +30,12 @@ int moduleCornerIndex(int module, int nasics_x, int asic_nx, int asic_ny){
 }
 
 
-template<typename T>
-void stackModules(T * data, T * stackedModules, int asic_nx, int asic_ny, int nasics_x, int nasics_y) {
+template<class L, typename T>
+static void stackModules(T * data, T * stackedModules, int asic_nx, int asic_ny, int nasics_x, int nasics_y) {
 	
+	asic_nx = L::asicNx(asic_nx);
+	asic_ny = L::asicNy(asic_ny);
+	nasics_x = L::nasicsX(nasics_x);
 	int nasics = nasics_x * nasics_y;
 	int asic_nn = asic_nx*asic_ny;
 
@@ -55,17 +58,21 @@ void stackModules(T * data, T * stackedModules, int asic_nx, int asic_ny, int na
 }
 
 /*
- *  Assemble data (floats) into a stack of detector modules
+ *  Assemble mask (uint16) into a stack of detector modules
  */
-void stackModulesMask(uint16_t * mask, uint16_t * stackedModules, int asic_nx, int asic_ny, int nasics_x, int nasics_y) {
-	stackModules(mask, stackedModules, asic_nx, asic_ny, nasics_x, nasics_y);
+void stackModulesMask(uint16_t * mask, uint16_t * stackedModules, int asic_nx, int asic_ny, int nasics_x, int nasics_y, int layout) {
+	void (*stack)(uint16_t*, uint16_t*, int, int, int, int) = NULL;
+	DETECTOR_LAYOUT_SELECT(detectorLayout(layout, asic_nx, asic_ny, nasics_x), stack, stackModules);
+	stack(mask, stackedModules, asic_nx, asic_ny, nasics_x, nasics_y);
 }
 
 /*
- *  Assemble mask (uint16) into a stack of detector modules
+ *  Assemble data (floats) into a stack of detector modules
  */
-void stackModulesData(float * data, float * stackedModules, int asic_nx, int asic_ny, int nasics_x, int nasics_y) {
-	stackModules(data, stackedModules, asic_nx, asic_ny, nasics_x, nasics_y);
+void stackModulesData(float * data, float * stackedModules, int asic_nx, int asic_ny, int nasics_x, int nasics_y, int layout) {
+	void (*stack)(float*, float*, int, int, int, int) = NULL;
+	DETECTOR_LAYOUT_SELECT(detectorLayout(layout, asic_nx, asic_ny, nasics_x), stack, stackModules);
+	stack(data, stackedModules, asic_nx, asic_ny, nasics_x, nasics_y);
 }
 
 /* 
@@ -12,6 +12,9 @@
 #include <math.h>
 #include <hdf5.h>
 #include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "detectorObject.h"
 #include "cheetahGlobal.h"
@@ -53,6 +56,19 @@ void allocatePeakList(tPeakList *peak, long NpeaksMax) {
 	peak->memoryAllocated = 1;
 }
 
+/*
+ *	Forget the peaks of a previous event (arrays are kept for reuse)
+ */
+void resetPeakList(tPeakList *peak) {
+	peak->nPeaks = 0;
+	peak->nHot = 0;
+	peak->peakResolution = 0;
+	peak->peakResolutionA = 0;
+	peak->peakDensity = 0;
+	peak->peakNpix = 0;
+	peak->peakTotal = 0;
+}
+
 /*
  *	Clean up Bragg peak arrays
  */
@@ -73,6 +89,491 @@ void freePeakList(tPeakList peak) {
 	peak.memoryAllocated = 0;
 }
 
+/*
+ *	Make room in a peakfinder workspace (start from a zeroed structure)
+ *	for pix_nn pixels, nRadialBins radii and peaks of up to maxPixCount pixels.
+ *	The union-find labelling arrays are added once ws->peakSearch asks for them.
+ *	Arrays are only reallocated when they have to grow, so after the first frame this does nothing.
+ */
+void preparePeakfinderWorkspace(tPeakfinderWorkspace *ws, long pix_nn, long nRadialBins, long maxPixCount) {
+	if (pix_nn > ws->pix_nn) {
+		free(ws->temp);
+		free(ws->mask);
+		free(ws->inx);
+		free(ws->iny);
+		free(ws->peakpixel);
+		free(ws->touched);
+		free(ws->nexte);
+		free(ws->natmask);
+		free(ws->rvalues);
+		ws->temp = (float *) malloc(pix_nn*sizeof(float));
+		ws->mask = (char *) malloc(pix_nn*sizeof(char));
+		ws->inx = (long *) malloc(pix_nn*sizeof(long));
+		ws->iny = (long *) malloc(pix_nn*sizeof(long));
+		ws->peakpixel = (char *) calloc(pix_nn, sizeof(char));
+		ws->touched = (long *) malloc(pix_nn*sizeof(long));
+		ws->nTouched = 0;
+		ws->nexte = (int *) malloc(pix_nn*sizeof(int));
+		ws->natmask = (int *) malloc(pix_nn*sizeof(int));
+		ws->rvalues = (float *) malloc(pix_nn*sizeof(float));
+		ws->pix_nn = pix_nn;
+	}
+	if (nRadialBins > ws->nRadialBins) {
+		free(ws->rsigma);
+		free(ws->roffset);
+		free(ws->rthreshold);
+		free(ws->rcount);
+		ws->rsigma = (float *) malloc(nRadialBins*sizeof(float));
+		ws->roffset = (float *) malloc(nRadialBins*sizeof(float));
+		ws->rthreshold = (float *) malloc(nRadialBins*sizeof(float));
+		ws->rcount = (long *) malloc(nRadialBins*sizeof(long));
+		ws->nRadialBins = nRadialBins;
+	}
+	if (maxPixCount+1 > ws->maxPixCount) {
+		free(ws->peakpixels);
+		ws->peakpixels = (long *) malloc((maxPixCount+1)*sizeof(long));
+		ws->maxPixCount = maxPixCount+1;
+	}
+	if (ws->peakSearch == PEAK_SEARCH_UNION_FIND && pix_nn > ws->labels_nn) {
+		free(ws->above);
+		free(ws->labels);
+		free(ws->parent);
+		free(ws->regionStart);
+		free(ws->regionPixels);
+		ws->above = (char *) malloc(pix_nn*sizeof(char));
+		ws->labels = (int *) malloc(pix_nn*sizeof(int));
+		ws->parent = (int *) malloc(pix_nn*sizeof(int));
+		ws->regionStart = (int *) malloc((pix_nn+1)*sizeof(int));
+		ws->regionPixels = (int *) malloc(pix_nn*sizeof(int));
+		ws->labels_nn = pix_nn;
+	}
+}
+
+/*
+ *	Unflag the pixels a peakfinder assigned to peaks, leaving peakpixel all zero for the next frame
+ */
+void clearPeakfinderWorkspace(tPeakfinderWorkspace *ws) {
+	for (long k=0; k<ws->nTouched; k++)
+		ws->peakpixel[ws->touched[k]] = 0;
+	ws->nTouched = 0;
+}
+
+void freePeakfinderWorkspace(tPeakfinderWorkspace *ws) {
+	freeThreadTeam(&ws->team);
+	free(ws->temp);
+	free(ws->mask);
+	free(ws->inx);
+	free(ws->iny);
+	free(ws->peakpixel);
+	free(ws->touched);
+	free(ws->peakpixels);
+	free(ws->nexte);
+	free(ws->natmask);
+	free(ws->rsigma);
+	free(ws->roffset);
+	free(ws->rthreshold);
+	free(ws->rcount);
+	free(ws->rvalues);
+	free(ws->above);
+	free(ws->labels);
+	free(ws->parent);
+	free(ws->regionStart);
+	free(ws->regionPixels);
+	for(long i=0; i<ws->nHelpers; i++) {
+		free(ws->helpers[i].inx);
+		free(ws->helpers[i].iny);
+		free(ws->helpers[i].peakpixels);
+		freePeakList(ws->helpers[i].peaks);
+	}
+	free(ws->helpers);
+	memset(ws, 0, sizeof(tPeakfinderWorkspace));
+}
+
+/*
+ *	Scratch for nHelpers extra peakfinder8 search threads: region-growing stacks of stackSize entries,
+ *	peaks of up to maxPixCount pixels and peak lists of nPeaksMax entries. Grows only.
+ */
+void preparePeakfinderHelpers(tPeakfinderWorkspace *ws, long nHelpers, long stackSize, long maxPixCount, long nPeaksMax) {
+	if (nHelpers > ws->nHelpers) {
+		ws->helpers = (tPeakfinderHelper *) realloc(ws->helpers, nHelpers*sizeof(tPeakfinderHelper));
+		memset(&ws->helpers[ws->nHelpers], 0, (nHelpers-ws->nHelpers)*sizeof(tPeakfinderHelper));
+		ws->nHelpers = nHelpers;
+	}
+	for(long i=0; i<nHelpers; i++) {
+		tPeakfinderHelper *helper = &ws->helpers[i];
+		if (stackSize > helper->stackSize) {
+			free(helper->inx);
+			free(helper->iny);
+			helper->inx = (long *) malloc(stackSize*sizeof(long));
+			helper->iny = (long *) malloc(stackSize*sizeof(long));
+			helper->stackSize = stackSize;
+		}
+		if (maxPixCount+1 > helper->maxPixCount) {
+			free(helper->peakpixels);
+			helper->peakpixels = (long *) malloc((maxPixCount+1)*sizeof(long));
+			helper->maxPixCount = maxPixCount+1;
+		}
+		if (helper->peaks.memoryAllocated == 0 || helper->peaks.nPeaks_max != nPeaksMax) {
+			if (helper->peaks.memoryAllocated)
+				freePeakList(helper->peaks);
+			allocatePeakList(&helper->peaks, nPeaksMax);
+		}
+	}
+}
+
+
+/*
+ *	Join the union-find trees of labels a and b (a < 0: no label yet) and return the joint root.
+ *	The smaller root always becomes the parent, so parent[l] <= l.
+ */
+static inline int unionLabels(int *parent, int a, int b) {
+	if(a < 0 || a == b)
+		return b;
+	while(parent[a] != a)
+		a = parent[a];
+	while(parent[b] != b)
+		b = parent[b];
+	if(a < b) {
+		parent[b] = a;
+		return a;
+	}
+	parent[a] = b;
+	return b;
+}
+
+/*
+ *	Connected regions (8 neighbours, not crossing ASIC edges) of the pixels flagged in ws->above.
+ *	Pass 1 gives each flagged pixel a provisional label, merging the labels of its W, NW, N and NE neighbours;
+ *	pass 2 resolves each pixel to its region and lists the pixels of every region in raster order.
+ *	The cost depends only on the number of pixels, not on how many are above threshold.
+ *	On return ws->labels[e] is the region of each flagged pixel (-1 elsewhere); returns the number of regions.
+ */
+long labelPeakRegions(tPeakfinderWorkspace *ws, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
+	long	pix_nx = asic_nx*nasics_x;
+	char	*above = ws->above;
+	int		*labels = ws->labels;
+	int		*parent = ws->parent;
+	long	*flagged = ws->inx;		// Flagged pixels in raster order (inx is only used when growing regions)
+	long	nFlagged = 0;
+	int		nLabels = 0;
+	
+	// Pass 1: provisional labels
+	for(long mj=0; mj<nasics_y; mj++){
+		for(long mi=0; mi<nasics_x; mi++){
+			for(long j=0; j<asic_ny; j++){
+				long e = (j+mj*asic_ny)*pix_nx + mi*asic_nx;
+				for(long i=0; i<asic_nx; i++, e++){
+					if(!above[e]) {
+						labels[e] = -1;
+						continue;
+					}
+					int l = -1;
+					if(i > 0 && labels[e-1] >= 0)
+						l = labels[e-1];
+					if(j > 0) {
+						if(i > 0 && labels[e-pix_nx-1] >= 0)
+							l = unionLabels(parent, l, labels[e-pix_nx-1]);
+						if(labels[e-pix_nx] >= 0)
+							l = unionLabels(parent, l, labels[e-pix_nx]);
+						if(i < asic_nx-1 && labels[e-pix_nx+1] >= 0)
+							l = unionLabels(parent, l, labels[e-pix_nx+1]);
+					}
+					if(l < 0) {
+						l = nLabels++;
+						parent[l] = l;
+					}
+					labels[e] = l;
+					flagged[nFlagged++] = e;
+				}
+			}
+		}
+	}
+	
+	// Number the regions: parent[l] <= l, so one ascending sweep maps every label to the region of its root
+	long	nRegions = 0;
+	for(int l=0; l<nLabels; l++) {
+		if(parent[l] == l)
+			parent[l] = nRegions++;
+		else
+			parent[l] = parent[parent[l]];
+	}
+	
+	// Pass 2: final labels, then the pixels of each region (counting sort, keeping raster order)
+	int		*regionStart = ws->regionStart;
+	for(long c=0; c<=nRegions; c++)
+		regionStart[c] = 0;
+	for(long k=0; k<nFlagged; k++) {
+		long e = flagged[k];
+		labels[e] = parent[labels[e]];
+		regionStart[labels[e]+1] += 1;
+	}
+	for(long c=0; c<nRegions; c++)
+		regionStart[c+1] += regionStart[c];
+	int		*fill = parent;			// Provisional labels are no longer needed
+	for(long c=0; c<nRegions; c++)
+		fill[c] = regionStart[c];
+	for(long k=0; k<nFlagged; k++) {
+		long e = flagged[k];
+		ws->regionPixels[fill[labels[e]]++] = e;
+	}
+	
+	return nRegions;
+}
+
+
+/*
+ *	Group the pixels by lrint(pix_r): a counting sort into CSR form (see tRadialBinIndex)
+ */
+void buildRadialBinIndex(tRadialBinIndex *rbins, float *pix_r, long pix_nn) {
+	freeRadialBinIndex(rbins);
+	
+	rbins->pix_nn = pix_nn;
+	rbins->bin = (int *) malloc(pix_nn*sizeof(int));
+	rbins->nBins = 1;
+	for(long i=0; i<pix_nn; i++) {
+		rbins->bin[i] = lrint(pix_r[i]);
+		if(rbins->bin[i] < 0) {
+			printf("buildRadialBinIndex: negative radius at pixel %li\n", i);
+			exit(1);
+		}
+		if(rbins->bin[i] >= rbins->nBins)
+			rbins->nBins = rbins->bin[i]+1;
+	}
+	
+	rbins->start = (long *) calloc(rbins->nBins+1, sizeof(long));
+	rbins->pixels = (long *) malloc(pix_nn*sizeof(long));
+	for(long i=0; i<pix_nn; i++)
+		rbins->start[rbins->bin[i]+1] += 1;
+	for(long r=0; r<rbins->nBins; r++)
+		rbins->start[r+1] += rbins->start[r];
+	
+	long *fill = (long *) malloc(rbins->nBins*sizeof(long));
+	memcpy(fill, rbins->start, rbins->nBins*sizeof(long));
+	for(long i=0; i<pix_nn; i++)
+		rbins->pixels[fill[rbins->bin[i]]++] = i;
+	free(fill);
+}
+
+void freeRadialBinIndex(tRadialBinIndex *rbins) {
+	free(rbins->bin);
+	free(rbins->start);
+	free(rbins->pixels);
+	memset(rbins, 0, sizeof(tRadialBinIndex));
+}
+
+
+/*
+ *	Per-radius statistics for peakfinder8, one thread's share of the radial bins
+ */
+typedef struct {
+	tRadialBinIndex	*rbins;
+	float	*temp;
+	char	*mask;
+	float	*values;
+	long	pix_nn;
+	float	ADCthresh;
+	float	minSNR;
+	float	*roffset;
+	float	*rsigma;
+	float	*rthreshold;
+	long	*rcount;
+	long	r0, r1;
+} tRadialStatisticsJob;
+
+/*
+ *	A rejected pixel adds exactly 0, which leaves the sums as they were
+ */
+static inline void radialAccumulate(float x, bool keep, float *sum, float *sumsq, long *count) {
+	float	y = keep ? x : 0.0f;
+	*sum += y;
+	*sumsq += (y*y);
+	*count += keep;
+}
+
+/*
+ *	One iteration over the first m pixels of four bins, stored interleaved (v[4*j+b]):
+ *	the pixels below threshold[b] are added to sum, sumsq and count of bin b, in order.
+ *	The SSE2 path keeps the four running sums in the lanes of one register.
+ */
+static void radialGroupSweep(float *v, long m, float *threshold, float *sum, float *sumsq, long *count) {
+	long	j = 0;
+#ifdef __SSE2__
+	const __m128	vthreshold = _mm_loadu_ps(threshold);
+	__m128	vsum = _mm_loadu_ps(sum);
+	__m128	vsumsq = _mm_loadu_ps(sumsq);
+	__m128i	vcount = _mm_setzero_si128();
+	for(; j<m; j++) {
+		__m128	x = _mm_loadu_ps(v+4*j);
+		__m128	keep = _mm_cmplt_ps(x, vthreshold);
+		__m128	y = _mm_and_ps(x, keep);
+		vsum = _mm_add_ps(vsum, y);
+		vsumsq = _mm_add_ps(vsumsq, _mm_mul_ps(y, y));
+		vcount = _mm_sub_epi32(vcount, _mm_castps_si128(keep));		// keep is -1 in each lane that passes
+	}
+	int32_t	n[4];
+	_mm_storeu_ps(sum, vsum);
+	_mm_storeu_ps(sumsq, vsumsq);
+	_mm_storeu_si128((__m128i *) n, vcount);
+	for(long b=0; b<4; b++)
+		count[b] += n[b];
+#endif
+	for(; j<m; j++) {
+		for(long b=0; b<4; b++)
+			radialAccumulate(v[4*j+b], v[4*j+b] < threshold[b], &sum[b], &sumsq[b], &count[b]);
+	}
+}
+
+/*
+ *	Statistics of four neighbouring bins, swept together; each bin is still accumulated
+ *	in pixel order, exactly as a sweep over the whole frame would.
+ *	The pixels of bin b (k0[b] ... k1[b]-1 of the index) are gathered once into v,
+ *	with bad pixels stored as +inf so that no threshold accepts them: the first mmin of each bin
+ *	interleaved, then the rest of each bin in turn. Unused slots have k0 = k1.
+ *	Iterate a few times over v to reduce the effect of positive outliers (ie: peaks).
+ */
+static void radialGroupStatistics(long *pixels, float *temp, char *mask, long *k0, long *k1, float *v, float ADCthresh, float minSNR, float *offset, float *sigma, float *threshold, long *count) {
+	float	sum[4], sumsq[4];
+	float	*tail[4];
+	long	ntail[4];
+	float	thisoffset, thissigma;
+	
+	long	mmin = k1[0]-k0[0];
+	for(long b=1; b<4; b++)
+		if(k1[b]-k0[b] < mmin)
+			mmin = k1[b]-k0[b];
+	for(long b=0; b<4; b++) {
+		ntail[b] = k1[b]-k0[b]-mmin;
+		tail[b] = (b == 0) ? v + 4*mmin : tail[b-1] + ntail[b-1];
+	}
+	
+	for(long j=0; j<mmin; j++) {
+		for(long b=0; b<4; b++) {
+			long i = pixels[k0[b]+j];
+			v[4*j+b] = (mask[i] != 0) ? temp[i] : INFINITY;
+		}
+	}
+	for(long b=0; b<4; b++) {
+		for(long j=0; j<ntail[b]; j++) {
+			long i = pixels[k0[b]+mmin+j];
+			tail[b][j] = (mask[i] != 0) ? temp[i] : INFINITY;
+		}
+	}
+	
+	for(long b=0; b<4; b++) {
+		offset[b] = 0;
+		sigma[b] = 0;
+		threshold[b] = 1e9;
+		count[b] = 0;
+	}
+	for(long counter=0; counter<5; counter++) {
+		for(long b=0; b<4; b++) {
+			sum[b] = 0;
+			sumsq[b] = 0;
+			count[b] = 0;
+		}
+		radialGroupSweep(v, mmin, threshold, sum, sumsq, count);
+		for(long b=0; b<4; b++) {
+			for(long j=0; j<ntail[b]; j++)
+				radialAccumulate(tail[b][j], tail[b][j] < threshold[b], &sum[b], &sumsq[b], &count[b]);
+		}
+		for(long b=0; b<4; b++) {
+			if(count[b] == 0) {
+				offset[b] = 0;
+				sigma[b] = 0;
+				threshold[b] = 1e9;
+			}
+			else {
+				thisoffset = sum[b]/count[b];
+				thissigma = sqrt(sumsq[b]/count[b] - ((sum[b]/count[b])*(sum[b]/count[b])));
+				offset[b] = thisoffset;
+				sigma[b] = thissigma;
+				threshold[b] = offset[b] + minSNR*sigma[b];
+				if(threshold[b] < ADCthresh)
+					threshold[b] = ADCthresh;
+			}
+		}
+	}
+}
+
+static void *radialStatisticsWorker(void *threadarg) {
+	tRadialStatisticsJob *job = (tRadialStatisticsJob *) threadarg;
+	long	*start = job->rbins->start;
+	long	*pixels = job->rbins->pixels;
+	long	k0[4], k1[4];
+	float	offset[4], sigma[4], threshold[4];
+	long	count[4];
+	
+	for(long r0=job->r0; r0<job->r1; r0+=4) {
+		
+		// Pixels of each bin below pix_nn (a prefix, since they are in increasing order)
+		for(long b=0; b<4; b++) {
+			long r = r0+b;
+			k0[b] = 0;
+			k1[b] = 0;
+			if(r >= job->r1)
+				continue;
+			k0[b] = start[r];
+			k1[b] = start[r+1];
+			while(k1[b] > k0[b] && pixels[k1[b]-1] >= job->pix_nn)
+				k1[b]--;
+		}
+		
+		radialGroupStatistics(pixels, job->temp, job->mask, k0, k1, job->values + start[r0], job->ADCthresh, job->minSNR, offset, sigma, threshold, count);
+		
+		for(long b=0; b<4 && r0+b<job->r1; b++) {
+			job->roffset[r0+b] = offset[b];
+			job->rsigma[r0+b] = sigma[b];
+			job->rthreshold[r0+b] = threshold[b];
+			job->rcount[r0+b] = count[b];
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Noise, offset and ADC threshold as a function of radius for peakfinder8,
+ *	using the good pixels (mask != 0) of temp[0 .. pix_nn-1].
+ *	Results go into ws->roffset, rsigma, rthreshold and rcount (rbins->nBins entries);
+ *	bins are shared out over ws->nThreads threads in contiguous ranges of roughly equal pixel count.
+ */
+void peakfinder8RadialStatistics(tPeakfinderWorkspace *ws, tRadialBinIndex *rbins, float *temp, char *mask, long pix_nn, float ADCthresh, float minSNR) {
+	
+	long	nBins = rbins->nBins;
+	long	nt = ws->nThreads;
+	if(nt < 1)
+		nt = 1;
+	if(nt > nBins)
+		nt = nBins;
+	
+	tRadialStatisticsJob	*jobs = (tRadialStatisticsJob *) threadTeamTasks(&ws->team, nt, sizeof(tRadialStatisticsJob));
+	
+	long	r = 0;
+	long	total = rbins->start[nBins];
+	for(long t=0; t<nt; t++) {
+		jobs[t].rbins = rbins;
+		jobs[t].temp = temp;
+		jobs[t].mask = mask;
+		jobs[t].values = ws->rvalues;
+		jobs[t].pix_nn = pix_nn;
+		jobs[t].ADCthresh = ADCthresh;
+		jobs[t].minSNR = minSNR;
+		jobs[t].roffset = ws->roffset;
+		jobs[t].rsigma = ws->rsigma;
+		jobs[t].rthreshold = ws->rthreshold;
+		jobs[t].rcount = ws->rcount;
+		jobs[t].r0 = r;
+		if(t == nt-1)
+			r = nBins;
+		else
+			while(r < nBins && rbins->start[r] < total*(t+1)/nt)
+				r++;
+		jobs[t].r1 = r;
+	}
+	
+	// Run ranges 1..nt-1 on the worker's team and range 0 here
+	threadTeamRun(&ws->team, radialStatisticsWorker);
+}
+
 
 
 /*
@@ -107,14 +608,17 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex) {
 	
 	// Data
 	float	*data = eventData->detector[detIndex].data_detPhotCorr;
-	float	*pix_r = global->detector[detIndex].pix_r;
+	tRadialBinIndex	*rbins = &global->detector[detIndex].pix_rbins;
 	
 	// Peak list
 	tPeakList	*peaklist = &eventData->peaklist;
 	
+	// Scratch arrays of the worker running this event
+	tPeakfinderWorkspace	*ws = global->detector[detIndex].getPeakfinderWorkspace(eventData->threadID, hitfinderMaxPixCount);
+	ws->peakSearch = global->hitfinderPeakSearch;
 
 	//	Masks for bad regions  (mask=0 to ignore regions)
-	char	*mask = (char*) calloc(pix_nn, sizeof(char));
+	char	*mask = ws->mask;
 	uint16_t	combined_pixel_options = PIXEL_IS_IN_PEAKMASK|PIXEL_IS_BAD|PIXEL_IS_HOT|PIXEL_IS_BAD|PIXEL_IS_SATURATED|PIXEL_IS_OUT_OF_RESOLUTION_LIMITS;
 	for(long i=0;i<pix_nn;i++)
 		mask[i] = isNoneOfBitOptionsSet(eventData->detector[detIndex].pixelmask[i], combined_pixel_options);
@@ -126,15 +630,15 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex) {
 	switch(global->hitfinderAlgorithm) {
 						
 	case 3 : 	// Count number of Bragg peaks (Anton's "number of connected peaks above threshold" algorithm)
-		nPeaks = peakfinder3(peaklist, data, mask, asic_nx, asic_ny, nasics_x, nasics_y, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius);
+		nPeaks = peakfinder3(peaklist, ws, data, mask, asic_nx, asic_ny, nasics_x, nasics_y, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius);
 		break;
 			
 	case 6 : 	// Count number of Bragg peaks (Rick's algorithm)
-		nPeaks = peakfinder6(peaklist, data, mask, asic_nx, asic_ny, nasics_x, nasics_y, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius, hitfinderMinPeakSeparation);
+		nPeaks = peakfinder6(peaklist, ws, data, mask, asic_nx, asic_ny, nasics_x, nasics_y, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius, hitfinderMinPeakSeparation);
 		break;
 
 	case 8 : 	// Count number of Bragg peaks (Anton's noise-varying algorithm)
-		nPeaks = peakfinder8(peaklist, data, mask, pix_r, asic_nx, asic_ny, nasics_x, nasics_y, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius);
+		nPeaks = peakfinder8(peaklist, ws, data, mask, rbins, asic_nx, asic_ny, nasics_x, nasics_y, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius);
 		break;
             
 	default :
@@ -223,10 +727,6 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex) {
 	
 	
 	
-	// Release memory
-	free(mask);
-	
-	
 	// Return number of peaks
 	return nPeaks;
 }
@@ -234,55 +734,122 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex) {
 
 /*
  *	Find peaks that are too close together and remove them
+ *
+ *	Of each pair closer than hitfinderMinPeakSeparation the weaker peak (lower peak_maxintensity) is killed.
+ *	Pairs used to be visited in order (p1 < p2), each visit setting the fate of both peaks, so a peak's fate
+ *	is decided by the last pair it belongs to: the one with its highest-numbered close neighbour.
+ *	Peaks are bucketed in a uniform grid of cells no smaller than the separation, so only the 3x3 cells
+ *	around each peak need searching for that neighbour.
  */
 int killNearbyPeaks(tPeakList *peaklist, float hitfinderMinPeakSeparation){
 	
-	int p, p1, p2;
-	int k = 0;
 	int n = peaklist->nPeaks;
-	float	x1, x2;
-	float	y1, y2;
-	float	d2;
 	float	min_dsq =  hitfinderMinPeakSeparation * hitfinderMinPeakSeparation;
-
 	
 	if(hitfinderMinPeakSeparation <= 0 ) {
 		return n;
 	}
 	
-	char *killpeak = (char *) calloc(n,sizeof(char));
-	for(long i=0; i<n; i++)
-		killpeak[i] = 0;
-	
 	if ( n > peaklist->nPeaks_max )
 		n = peaklist->nPeaks_max;
-//	printf("killNearByPeaks before %d \n", n);
-	for ( p1=0; p1 < n; p1++) {
-		x1 = peaklist->peak_com_x_assembled[p1];
-		y1 = peaklist->peak_com_y_assembled[p1];
-		for ( p2=p1+1; p2 < n; p2++) {
-			x2 = peaklist->peak_com_x_assembled[p2];
-			y2 = peaklist->peak_com_y_assembled[p2];
-			
-			d2 = (x1-x2)*(x1-x2) + (y1-y2)*(y1-y2);
-
-			if ( d2 <= min_dsq ) {
-				if ( peaklist->peak_maxintensity[p1] > peaklist->peak_maxintensity[p2]) {
-					killpeak[p1] = 0;
-					killpeak[p2] = 1;
-					k++;
-				} else {
-					killpeak[p1] = 1;
-					killpeak[p2] = 0;
-					k++;
+	
+	float	*x = peaklist->peak_com_x_assembled;
+	float	*y = peaklist->peak_com_y_assembled;
+	float	*maxI = peaklist->peak_maxintensity;
+	
+	// Grid bounds (peaks with non-finite coordinates are never close to anything)
+	float	xmin = 1e30, xmax = -1e30;
+	float	ymin = 1e30, ymax = -1e30;
+	for(long p=0; p<n; p++) {
+		if(!isfinite(x[p]) || !isfinite(y[p]))
+			continue;
+		if(x[p] < xmin) xmin = x[p];
+		if(x[p] > xmax) xmax = x[p];
+		if(y[p] < ymin) ymin = y[p];
+		if(y[p] > ymax) ymax = y[p];
+	}
+	
+	// Cells a little wider than hitfinderMinPeakSeparation (so rounding in d2 cannot reach past the next cell),
+	// coarsened until there are no more than ~4 per peak
+	double	cellSize = 1.01*hitfinderMinPeakSeparation;
+	long	gx = 1, gy = 1;
+	if(xmax >= xmin) {
+		while(1) {
+			gx = (long) ((xmax-xmin)/cellSize) + 1;
+			gy = (long) ((ymax-ymin)/cellSize) + 1;
+			if(gx*gy <= 4*(long)n + 16)
+				break;
+			cellSize *= 2;
+		}
+	}
+	
+	// Peaks of each cell in increasing order (counting sort)
+	long	*cell = (long *) malloc(n*sizeof(long));
+	long	*cellStart = (long *) calloc(gx*gy+1, sizeof(long));
+	long	*cellPeaks = (long *) malloc(n*sizeof(long));
+	for(long p=0; p<n; p++) {
+		cell[p] = -1;
+		if(!isfinite(x[p]) || !isfinite(y[p]))
+			continue;
+		cell[p] = (long) ((x[p]-xmin)/cellSize) + gx*(long) ((y[p]-ymin)/cellSize);
+		cellStart[cell[p]+1] += 1;
+	}
+	for(long c=0; c<gx*gy; c++)
+		cellStart[c+1] += cellStart[c];
+	long	*fill = (long *) malloc((gx*gy)*sizeof(long));
+	memcpy(fill, cellStart, (gx*gy)*sizeof(long));
+	for(long p=0; p<n; p++)
+		if(cell[p] >= 0)
+			cellPeaks[fill[cell[p]]++] = p;
+	free(fill);
+	
+	char *killpeak = (char *) calloc(n,sizeof(char));
+	for(long p=0; p<n; p++) {
+		if(cell[p] < 0)
+			continue;
+		long	cx = cell[p] % gx;
+		long	cy = cell[p] / gx;
+		long	last = -1;
+		
+		// Highest-numbered peak within the separation
+		for(long j=cy-1; j<=cy+1; j++) {
+			if(j < 0 || j >= gy)
+				continue;
+			for(long i=cx-1; i<=cx+1; i++) {
+				if(i < 0 || i >= gx)
+					continue;
+				long c = i + j*gx;
+				for(long k=cellStart[c+1]-1; k>=cellStart[c] && cellPeaks[k]>last; k--) {
+					long q = cellPeaks[k];
+					if(q == p)
+						continue;
+					long p1 = (p < q) ? p : q;
+					long p2 = (p < q) ? q : p;
+					float d2 = (x[p1]-x[p2])*(x[p1]-x[p2]) + (y[p1]-y[p2])*(y[p1]-y[p2]);
+					if(d2 <= min_dsq) {
+						last = q;
+						break;
+					}
 				}
 			}
 		}
+		
+		// Same comparison as in the pair (p1 < p2) that decided this peak
+		if(last > p)
+			killpeak[p] = !(maxI[p] > maxI[last]);
+		else if(last >= 0)
+			killpeak[p] = (maxI[last] > maxI[p]);
 	}
+	free(cell);
+	free(cellStart);
+	free(cellPeaks);
 	
+	// Compact the surviving peaks in one pass
 	long c=0;
-	for ( p=0; p < n; p++) {
-		if (killpeak[p] == 0) {
+	for(long p=0; p < n; p++) {
+		if (killpeak[p] != 0)
+			continue;
+		if (c != p) {
 			peaklist->peak_maxintensity[c] = peaklist->peak_maxintensity[p];
 			peaklist->peak_totalintensity[c] = peaklist->peak_totalintensity[p];
 			peaklist->peak_snr[c] = peaklist->peak_snr[p];
@@ -296,11 +863,10 @@ int killNearbyPeaks(tPeakList *peaklist, float hitfinderMinPeakSeparation){
 			peaklist->peak_com_r_assembled[c] = peaklist->peak_com_r_assembled[p];
 			peaklist->peak_com_q[c] = peaklist->peak_com_q[p];
 			peaklist->peak_com_res[c] = peaklist->peak_com_res[p];
-			c++;
 		}
+		c++;
 	}
 	free(killpeak);
-//	printf(" after %d \n", c);
 	peaklist->nPeaks = c;
 	return c;
 }
@@ -313,7 +879,7 @@ int killNearbyPeaks(tPeakList *peaklist, float hitfinderMinPeakSeparation){
  *	Count peaks by searching for connected pixels above threshold
  *	Anton Barty
  */
-int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR, long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius) {
+int peakfinder3(tPeakList *peaklist, tPeakfinderWorkspace *ws, float *data, char *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR, long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius) {
 	
 	
 	// Derived values
@@ -338,9 +904,10 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 	int		search_y[] = {0,-1,-1,-1,0,0,1,1,1};
 	int		search_n = 9;
 	long	e;
-	long	*inx = (long *) calloc(pix_nn, sizeof(long));
-	long	*iny = (long *) calloc(pix_nn, sizeof(long));
-	char	*peakpixel = (char *) calloc(pix_nn, sizeof(long));
+	preparePeakfinderWorkspace(ws, pix_nn, 0, 0);
+	long	*inx = ws->inx;
+	long	*iny = ws->iny;
+	char	*peakpixel = ws->peakpixel;
 	float	totI;
     float	maxI;
 	float	snr;
@@ -359,20 +926,19 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 	maxI = 0;
 	
 	/*
-	 *	Create a buffer for image data so we don't nuke the main image by mistake
-	 */
-	float *temp = (float*) calloc(pix_nn, sizeof(float));
-	memcpy(temp, data, pix_nn*sizeof(float));
-	
-	
-	/*
-	 *	Apply mask (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
+	 *	Copy image data into a buffer so we don't nuke the main image by mistake,
+	 *	applying the mask on the way (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
 	 */
+	float *temp = ws->temp;
 	for(long i=0;i<pix_nn;i++){
-		temp[i] *= mask[i];
+		temp[i] = data[i]*mask[i];
 	}
-	for(long i=0;i<pix_nn;i++){
-		peakpixel[i] = 0;
+	
+	// Union-find search: flag the pixels above threshold and label the connected regions up front
+	if(ws->peakSearch == PEAK_SEARCH_UNION_FIND) {
+		for(long i=0;i<pix_nn;i++)
+			ws->above[i] = (temp[i] > ADCthresh);
+		labelPeakRegions(ws, asic_nx, asic_ny, nasics_x, nasics_y);
 	}
 	
 	
@@ -405,54 +971,76 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 						peak_com_x = 0;
 						peak_com_y = 0;
 						
-						// Keep looping until the pixel count within this peak does not change
-						do {
+						if(ws->peakSearch == PEAK_SEARCH_UNION_FIND) {
+							// The region is already labelled: take its pixels in raster order.
+							// nat stays 1 ahead of the pixel count, as region growing counts its first pixel twice
+							int		region = ws->labels[e];
+							for(long k=ws->regionStart[region]; k<ws->regionStart[region+1]; k++) {
+								e = ws->regionPixels[k];
+								thisx = e % pix_nx;
+								thisy = e / pix_nx;
+								if (temp[e] > maxI)
+									maxI = temp[e];
+								totI += temp[e]; // add to integrated intensity
+								peak_com_x += temp[e]*( (float) thisx ); // for center of mass x
+								peak_com_y += temp[e]*( (float) thisy ); // for center of mass y
+								temp[e] = 0; // zero out this intensity so that we don't count it again
+								nat++;
+								peakpixel[e] = 1;
+								ws->touched[ws->nTouched++] = e;
+							}
+						}
+						else {
+							// Keep looping until the pixel count within this peak does not change
+							do {
 							
-							lastnat = nat;
-							// Loop through points known to be within this peak
-							for(long p=0; p<nat; p++){
-								// Loop through search pattern
-								for(long k=0; k<search_n; k++){
-									// Array bounds check
-									if((inx[p]+search_x[k]) < 0)
-										continue;
-									if((inx[p]+search_x[k]) >= asic_nx)
-										continue;
-									if((iny[p]+search_y[k]) < 0)
-										continue;
-									if((iny[p]+search_y[k]) >= asic_ny)
-										continue;
+								lastnat = nat;
+								// Loop through points known to be within this peak
+								for(long p=0; p<nat; p++){
+									// Loop through search pattern
+									for(long k=0; k<search_n; k++){
+										// Array bounds check
+										if((inx[p]+search_x[k]) < 0)
+											continue;
+										if((inx[p]+search_x[k]) >= asic_nx)
+											continue;
+										if((iny[p]+search_y[k]) < 0)
+											continue;
+										if((iny[p]+search_y[k]) >= asic_ny)
+											continue;
 									
-									// Neighbour point in big array
-									thisx = inx[p]+search_x[k]+mi*asic_nx;
-									thisy = iny[p]+search_y[k]+mj*asic_ny;
-									e = thisx + thisy*pix_nx;
+										// Neighbour point in big array
+										thisx = inx[p]+search_x[k]+mi*asic_nx;
+										thisy = iny[p]+search_y[k]+mj*asic_ny;
+										e = thisx + thisy*pix_nx;
 									
-									//if(e < 0 || e >= pix_nn){
-									//	printf("Array bounds error: e=%i\n",e);
-									//	continue;
-									//}
-									
-									// Above threshold?
-									if(temp[e] > ADCthresh && peakpixel[e] == 0){
-										//if(nat < 0 || nat >= global->pix_nn) {
-										//	printf("Array bounds error: nat=%i\n",nat);
-										//	break
+										//if(e < 0 || e >= pix_nn){
+										//	printf("Array bounds error: e=%i\n",e);
+										//	continue;
 										//}
-                                        if (temp[e] > maxI)
-                                            maxI = temp[e];
-										totI += temp[e]; // add to integrated intensity
-										peak_com_x += temp[e]*( (float) thisx ); // for center of mass x
-										peak_com_y += temp[e]*( (float) thisy ); // for center of mass y
-										temp[e] = 0; // zero out this intensity so that we don't count it again
-										inx[nat] = inx[p]+search_x[k];
-										iny[nat] = iny[p]+search_y[k];
-										nat++;
-										peakpixel[e] = 1;
+									
+										// Above threshold?
+										if(temp[e] > ADCthresh && peakpixel[e] == 0){
+											//if(nat < 0 || nat >= global->pix_nn) {
+											//	printf("Array bounds error: nat=%i\n",nat);
+											//	break
+											//}
+											if (temp[e] > maxI)
+												maxI = temp[e];
+											totI += temp[e]; // add to integrated intensity
+											peak_com_x += temp[e]*( (float) thisx ); // for center of mass x
+											peak_com_y += temp[e]*( (float) thisy ); // for center of mass y
+											temp[e] = 0; // zero out this intensity so that we don't count it again
+											inx[nat] = inx[p]+search_x[k];
+											iny[nat] = iny[p]+search_y[k];
+											nat++;
+											peakpixel[e] = 1;
+											ws->touched[ws->nTouched++] = e;
+										}
 									}
 								}
-							}
-						} while(lastnat != nat);
+							} while(lastnat != nat);
+						}
 						
 						
                         // Too many or too few pixels means ignore this 'peak'; move on now
@@ -585,10 +1173,7 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 	}
 	
 	
-	free(temp);
-	free(inx);
-	free(iny);
-	free(peakpixel);
+	clearPeakfinderWorkspace(ws);
 	
     return(peaklist->nPeaks);
 	
@@ -596,37 +1181,80 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 
 
 /*
- *	Peakfinder 8
- *	Version before modifications during Cherezov December 2014 LE80
- *	Count peaks by searching for connected pixels above threshold
- *	Anton Barty
+ *	One peakfinder8 call: what its search tasks share (all read-only apart from peakpixel,
+ *	which each task only touches within its own ASICs)
  */
-int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR, long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius) {
-	
-	// Derived values
-	long	pix_nx = asic_nx*nasics_x;
-	long	pix_ny = asic_ny*nasics_y;
-	long	pix_nn = pix_nx*pix_ny;
-	//long	asic_nn = asic_nx*asic_ny;
+typedef struct {
+	float	*temp;
+	char	*mask;
+	char	*peakpixel;
+	float	*roffset;
+	float	*rthreshold;
+	int		*pix_rbin;
+	tPeakfinderWorkspace	*ws;
+	long	asic_nx;
+	long	asic_ny;
+	long	nasics_x;
+	long	pix_nx;
+	long	pix_nn;
+	float	hitfinderMinSNR;
+	long	hitfinderMinPixCount;
+	long	hitfinderMaxPixCount;
+	long	hitfinderLocalBGRadius;
+} tPeakfinder8Frame;
+
+/*
+ *	Peak search over ASICs asic0 .. asic1-1 (numbered mi + mj*nasics_x), filling peaklist in the order found.
+ *	Each task has its own region-growing stacks, logs the pixels it flags in its own stretch of touched[]
+ *	and unflags them before it returns.
+ */
+typedef struct {
+	tPeakfinder8Frame	*frame;
+	long	asic0;
+	long	asic1;
+	long	*inx;
+	long	*iny;
+	long	*peakpixels;
+	long	*touched;
+	tPeakList	*peaklist;
+	long	peakCounter;		// Peaks found, including any beyond peaklist->nPeaks_max
+} tPeakfinder8Task;
+
+template <class L>
+static void *peakfinder8Search(void *threadarg) {
+	tPeakfinder8Task	*task = (tPeakfinder8Task *) threadarg;
+	tPeakfinder8Frame	*frame = task->frame;
+	tPeakfinderWorkspace	*ws = frame->ws;
+	tPeakList	*peaklist = task->peaklist;
+	
+	float	*temp = frame->temp;
+	char	*mask = frame->mask;
+	char	*peakpixel = frame->peakpixel;
+	float	*roffset = frame->roffset;
+	float	*rthreshold = frame->rthreshold;
+	int		*pix_rbin = frame->pix_rbin;
+	const long	asic_nx = L::asicNx(frame->asic_nx);
+	const long	asic_ny = L::asicNy(frame->asic_ny);
+	const long	nasics_x = L::nasicsX(frame->nasics_x);
+	const long	pix_nx = asic_nx*nasics_x;
+	long	pix_nn = frame->pix_nn;
+	float	hitfinderMinSNR = frame->hitfinderMinSNR;
+	long	hitfinderMinPixCount = frame->hitfinderMinPixCount;
+	long	hitfinderMaxPixCount = frame->hitfinderMaxPixCount;
+	long	hitfinderLocalBGRadius = frame->hitfinderLocalBGRadius;
 	long	hitfinderNpeaksMax = peaklist->nPeaks_max;
 	
-	
-	peaklist->nPeaks = 0;
-	peaklist->peakNpix = 0;
-	peaklist->peakTotal = 0;
-	
-	
-	// Variables for this hitfinder
 	long	nat = 0;
 	long	lastnat = 0;
-	//long	counter=0;
-	float	total;
 	int		search_x[] = {0,-1,0,1,-1,1,-1,0,1};
 	int		search_y[] = {0,-1,-1,-1,0,0,1,1,1};
 	int		search_n = 9;
 	long	e;
-	long	*inx = (long *) calloc(pix_nn, sizeof(long));
-	long	*iny = (long *) calloc(pix_nn, sizeof(long));
+	long	*inx = task->inx;
+	long	*iny = task->iny;
+	long	*peakpixels = task->peakpixels;
+	long	*touched = task->touched;
+	long	nTouched = 0;
 	float   thisI, thisIraw;
 	float	totI,totIraw;
 	float	maxI, maxIraw;
@@ -638,143 +1266,76 @@ int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r, long
 	long	fs, ss;
 	float	com_x, com_y, com_e;
 	float	thisADCthresh;
-	
-	
-	nat = 0;
-	//counter = 0;
-	total = 0.0;
-	snr=0;
-	maxI = 0;
-	
-	/*
-	 *	Create a buffer for image data so we don't nuke the main image by mistake
-	 */
-	float *temp = (float*) calloc(pix_nn, sizeof(float));
-	memcpy(temp, data, pix_nn*sizeof(float));
-	
-	
-	/*
-	 *	Apply mask (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
-	 */
-	for(long i=0;i<pix_nn;i++){
-		temp[i] *= mask[i];
-	}
-	
-	/*
-	 *	Determine noise and offset as a funciton of radius
-	 */
-	float	fminr, fmaxr;
-	long	lminr, lmaxr;
-	fminr = 1e9;
-	fmaxr = -1e9;
-	
-	// Figure out radius bounds
-	for(long i=0;i<pix_nn;i++){
-		if (pix_r[i] > fmaxr)
-			fmaxr = pix_r[i];
-		if (pix_r[i] < fminr)
-			fminr = pix_r[i];
-	}
-	lmaxr = (int)ceil(fmaxr)+1;
-	lminr = 0;
-	
-	// Allocate and zero arrays
-	float	*rsigma = (float*) calloc(lmaxr, sizeof(float));
-	float	*roffset = (float*) calloc(lmaxr, sizeof(float));
-	long	*rcount = (long*) calloc(lmaxr, sizeof(long));
-	float	*rthreshold = (float*) calloc(lmaxr, sizeof(float));
-	
-	long	*peakpixels = (long *) calloc(hitfinderMaxPixCount, sizeof(long));
-	char	*peakpixel = (char *) calloc(pix_nn, sizeof(char));
-	
-	for(long i=0; i<lmaxr; i++) {
-		rthreshold[i] = 1e9;
-	}
-	
-	// Compute sigma and average of data values at each radius
-	// From this, compute the ADC threshold to be applied at each radius
-	// Iterate a few times to reduce the effect of positive outliers (ie: peaks)
 	long	thisr;
-	float	thisoffset, thissigma;
-	for(long counter=0; counter<5; counter++) {
-		for(long i=0; i<lmaxr; i++) {
-			roffset[i] = 0;
-			rsigma[i] = 0;
-			rcount[i] = 0;
-		}
-		for(long i=0;i<pix_nn;i++){
-			if(mask[i] != 0) {
-				thisr = lrint(pix_r[i]);
-				if(temp[i] < rthreshold[thisr]) {
-					roffset[thisr] += temp[i];
-					rsigma[thisr] += (temp[i]*temp[i]);
-					rcount[thisr] += 1;
-				}
-			}
-		}
-		for(long i=0; i<lmaxr; i++) {
-			if(rcount[i] == 0) {
-				roffset[i] = 0;
-				rsigma[i] = 0;
-				rthreshold[i] = 1e9;
-				//rthreshold[i] = ADCthresh;		// For testing
-			}
-			else {
-				thisoffset = roffset[i]/rcount[i];
-				thissigma = sqrt(rsigma[i]/rcount[i] - ((roffset[i]/rcount[i])*(roffset[i]/rcount[i])));
-				roffset[i] = thisoffset;
-				rsigma[i] = thissigma;
-				rthreshold[i] = roffset[i] + hitfinderMinSNR*rsigma[i];
-				if(rthreshold[i] < ADCthresh)
-					rthreshold[i] = ADCthresh;
-				//rthreshold[i] = ADCthresh;		// For testing
-			}
-		}
-	}
-	
 	
 	com_x=0;
 	com_y=0;
 
 	// Loop over modules (8x8 array)
-	//counter = 0;
 	long peakCounter = 0;
-	for(long mj=0; mj<nasics_y; mj++){
-		for(long mi=0; mi<nasics_x; mi++){
-			
-			// Loop over pixels within a module
-			for(long j=1; j<asic_ny-1; j++){
-				for(long i=1; i<asic_nx-1; i++){
-					
-					
-					ss = (j+mj*asic_ny)*pix_nx;
-					fs = i+mi*asic_nx;
-					e = ss + fs;
+	for(long a=task->asic0; a<task->asic1; a++){
+		long	mj = a / nasics_x;
+		long	mi = a % nasics_x;
+		
+		// Loop over pixels within a module
+		for(long j=1; j<asic_ny-1; j++){
+			for(long i=1; i<asic_nx-1; i++){
+				
+				
+				ss = (j+mj*asic_ny)*pix_nx;
+				fs = i+mi*asic_nx;
+				e = ss + fs;
+				
+				if(e > pix_nn) {
+					printf("Array bounds error: e=%li\n",e);
+					exit(1);
+				}
+				
+				thisr = pix_rbin[e];
+				thisADCthresh = rthreshold[thisr];
+				
+				if(temp[e] > thisADCthresh && peakpixel[e] == 0){
+					// This might be the start of a new peak - start searching
+					inx[0] = i;
+					iny[0] = j;
+					peakpixels[0] = e;
+					nat = 1;
+					totI = 0;
+					totIraw = 0;
+					maxI = 0;
+					maxIraw = 0;
+					peak_com_x = 0;
+					peak_com_y = 0;
 					
-					if(e > pix_nn) {
-						printf("Array bounds error: e=%li\n",e);
-						exit(1);
+					if(ws->peakSearch == PEAK_SEARCH_UNION_FIND) {
+						// The region is already labelled: take its pixels in raster order.
+						// nat stays 1 ahead of the pixel count, as region growing counts its first pixel twice
+						int		region = ws->labels[e];
+						if(region < 0)
+							continue;
+						for(long k=ws->regionStart[region]; k<ws->regionStart[region+1]; k++) {
+							e = ws->regionPixels[k];
+							thisx = e % pix_nx;
+							thisy = e / pix_nx;
+							thisr = pix_rbin[e];
+							thisI = temp[e] - roffset[thisr];
+							totI += thisI; // add to integrated intensity
+							totIraw += temp[e];
+							peak_com_x += thisI*( (float) thisx ); // for center of mass x
+							peak_com_y += thisI*( (float) thisy ); // for center of mass y
+							peakpixel[e] = 1;
+							touched[nTouched++] = e;
+							if(nat < hitfinderMaxPixCount)
+								peakpixels[nat] = e;
+							if (thisI > maxI)
+								maxI = thisI;
+							nat++;
+						}
 					}
-					
-					thisr = lrint(pix_r[e]);
-					thisADCthresh = rthreshold[thisr];
-					
-					if(temp[e] > thisADCthresh && peakpixel[e] == 0){
-						// This might be the start of a new peak - start searching
-						inx[0] = i;
-						iny[0] = j;
-						peakpixels[0] = e;
-						nat = 1;
-						totI = 0;
-						totIraw = 0;
-						maxI = 0;
-						maxIraw = 0;
-						peak_com_x = 0;
-						peak_com_y = 0;
-						
+					else {
 						// Keep looping until the pixel count within this peak does not change
 						do {
-							
+						
 							lastnat = nat;
 							// Loop through points known to be within this peak
 							for(long p=0; p<nat; p++){
@@ -789,232 +1350,233 @@ int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r, long
 										continue;
 									if((iny[p]+search_y[k]) >= asic_ny)
 										continue;
-									
+								
 									// Neighbour point in big array
 									thisx = inx[p]+search_x[k]+mi*asic_nx;
 									thisy = iny[p]+search_y[k]+mj*asic_ny;
 									e = thisx + thisy*pix_nx;
-									
+								
 									//if(e < 0 || e >= pix_nn){
 									//	printf("Array bounds error: e=%i\n",e);
 									//	continue;
 									//}
-									
-									thisr = lrint(pix_r[e]);
-									thisADCthresh = rthreshold[thisr];
-									
-									// Above threshold?
-									if(temp[e] > thisADCthresh && peakpixel[e] == 0 && mask[e] != 0){
-										//if(nat < 0 || nat >= global->pix_nn) {
-										//	printf("Array bounds error: nat=%i\n",nat);
-										//	break
-										//}
-										thisI = temp[e] - roffset[thisr];
-										totI += thisI; // add to integrated intensity
-										totIraw += temp[e];
-										peak_com_x += thisI*( (float) thisx ); // for center of mass x
-										peak_com_y += thisI*( (float) thisy ); // for center of mass y
-										//temp[e] = 0; // zero out this intensity so that we don't count it again
-										inx[nat] = inx[p]+search_x[k];
-										iny[nat] = iny[p]+search_y[k];
-										peakpixel[e] = 1;
-										if(nat < hitfinderMaxPixCount)
-											peakpixels[nat] = e;
-										if (thisI > maxI)
-											maxI = thisI;
-										if (thisI > maxIraw)
-											maxIraw = temp[e];
-										
-										nat++;
-									}
-								}
-							}
-						} while(lastnat != nat);
-						
-						
-						// Too many or too few pixels means ignore this 'peak'; move on now
-						if(nat<hitfinderMinPixCount || nat>hitfinderMaxPixCount) {
-							continue;
-						}
-						
-						
-						/*
-						 *	Calculate center of mass for this peak from initial peak search
-						 */
-						com_x = peak_com_x/fabs(totI);
-						com_y = peak_com_y/fabs(totI);
-						com_e = lrint(com_x) + lrint(com_y)*pix_nx;
-
-						long   com_xi = lrint(com_x) - mi*asic_nx;
-						long   com_yi = lrint(com_y) - mj*asic_ny;
-						
-						
-						/*
-						 *	Calculate the local signal-to-noise ratio and local background in an annulus around this peak
-						 *	(excluding pixels which look like they might be part of another peak)
-						 */
-						float   localSigma=0;
-						float   localOffset=0;
-						long    ringWidth = 2*hitfinderLocalBGRadius;
-						
-						float   sumI = 0;
-						float   sumIsquared = 0;
-						long    np_sigma = 0;
-						long	np_counted = 0;
-						float	fbgr;
-						float	backgroundMaxI=0;
-						float	fBackgroundThresh=0;
-						
-						for(long bj=-ringWidth; bj<ringWidth; bj++){
-							for(long bi=-ringWidth; bi<ringWidth; bi++){
 								
-								// Within-ASIC check
-								if((com_xi+bi) < 0)
-									continue;
-								if((com_xi+bi) >= asic_nx)
-									continue;
-								if((com_yi+bj) < 0)
-									continue;
-								if((com_yi+bj) >= asic_ny)
-									continue;
-								
-								// Within outer ring check
-								fbgr = sqrt( bi*bi + bj*bj );
-								if( fbgr > ringWidth )// || fbgr <= hitfinderLocalBGRadius )				// || fbgr > hitfinderLocalBGRadius)
-									continue;
-								
-								// Position of this point in data stream
-								thisx = com_xi + bi + mi*asic_nx;
-								thisy = com_yi + bj + mj*asic_ny;
-								e = thisx + thisy*pix_nx;
-								
-								thisr = lrint(pix_r[e]);
-								thisADCthresh = rthreshold[thisr];
-								
-								// Intensity above background
-								thisI = temp[e];
-								
-								
-								// If above ADC threshold, this could be part of another peak
-								//if (temp[e] > thisADCthresh)
-								//	continue;
+									thisr = pix_rbin[e];
+									thisADCthresh = rthreshold[thisr];
 								
-								// Keep track of value and value-squared for offset and sigma calculation
-								// if(peakpixel[e] == 0 && mask[e] != 0) {
-								if(temp[e] < thisADCthresh && peakpixel[e] == 0 && mask[e] != 0) {
-									np_sigma++;
-									sumI += thisI;
-									sumIsquared += (thisI*thisI);
-									if(thisI > backgroundMaxI) {
-										backgroundMaxI = thisI;
+									// Above threshold?
+									if(temp[e] > thisADCthresh && peakpixel[e] == 0 && mask[e] != 0){
+										//if(nat < 0 || nat >= global->pix_nn) {
+										//	printf("Array bounds error: nat=%i\n",nat);
+										//	break
+										//}
+										thisI = temp[e] - roffset[thisr];
+										totI += thisI; // add to integrated intensity
+										totIraw += temp[e];
+										peak_com_x += thisI*( (float) thisx ); // for center of mass x
+										peak_com_y += thisI*( (float) thisy ); // for center of mass y
+										//temp[e] = 0; // zero out this intensity so that we don't count it again
+										inx[nat] = inx[p]+search_x[k];
+										iny[nat] = iny[p]+search_y[k];
+										peakpixel[e] = 1;
+										touched[nTouched++] = e;
+										if(nat < hitfinderMaxPixCount)
+											peakpixels[nat] = e;
+										if (thisI > maxI)
+											maxI = thisI;
+										if (thisI > maxIraw)
+											maxIraw = temp[e];
+									
+										nat++;
 									}
 								}
-								np_counted += 1;
 							}
-						}
-						
-						// Calculate local background and standard deviation
-						if (np_sigma != 0) {
-							localOffset = sumI/np_sigma;
-							localSigma = sqrt(sumIsquared/np_sigma - ((sumI/np_sigma)*(sumI/np_sigma)));
-						}
-						else {
-							localOffset = roffset[lrint(pix_r[lrint(com_e)])];
-							localSigma = 0.01;
-						}
-						
-						
-						/*
-						 *	Re-integrate (and re-centroid) peak using local background estimates
-						 */
-						totI = 0;
-						totIraw = 0;
-						maxI = 0;
-						maxIraw = 0;
-						peak_com_x = 0;
-						peak_com_y = 0;
-						for(long counter=1; counter<nat && counter <= hitfinderMaxPixCount; counter++) {
-							e = peakpixels[counter];
-							thisIraw = temp[e];
-							thisI = thisIraw - localOffset;
-							
-							totI += thisI;
-							totIraw += thisIraw;
-
-							// Remember that e = thisx + thisy*pix_nx;
-							ldiv_t xy = ldiv(e, pix_nx);
-							thisx = xy.rem;
-							thisy = xy.quot;
-							peak_com_x += thisI*( (float) thisx ); // for center of mass x
-							peak_com_y += thisI*( (float) thisy ); // for center of mass y
+						} while(lastnat != nat);
+					}
+					
+					
+					// Too many or too few pixels means ignore this 'peak'; move on now
+					if(nat<hitfinderMinPixCount || nat>hitfinderMaxPixCount) {
+						continue;
+					}
+					
+					
+					/*
+					 *	Calculate center of mass for this peak from initial peak search
+					 */
+					com_x = peak_com_x/fabs(totI);
+					com_y = peak_com_y/fabs(totI);
+					com_e = lrint(com_x) + lrint(com_y)*pix_nx;
 
-							if (thisIraw > maxIraw)
-								maxIraw = thisIraw;
-							if (thisI > maxI)
-								maxI = thisI;
+					long   com_xi = lrint(com_x) - mi*asic_nx;
+					long   com_yi = lrint(com_y) - mj*asic_ny;
+					
+					
+					/*
+					 *	Calculate the local signal-to-noise ratio and local background in an annulus around this peak
+					 *	(excluding pixels which look like they might be part of another peak)
+					 */
+					float   localSigma=0;
+					float   localOffset=0;
+					long    ringWidth = 2*hitfinderLocalBGRadius;
+					
+					float   sumI = 0;
+					float   sumIsquared = 0;
+					long    np_sigma = 0;
+					long	np_counted = 0;
+					float	fbgr;
+					float	backgroundMaxI=0;
+					float	fBackgroundThresh=0;
+					
+					for(long bj=-ringWidth; bj<ringWidth; bj++){
+						for(long bi=-ringWidth; bi<ringWidth; bi++){
+							
+							// Within-ASIC check
+							if((com_xi+bi) < 0)
+								continue;
+							if((com_xi+bi) >= asic_nx)
+								continue;
+							if((com_yi+bj) < 0)
+								continue;
+							if((com_yi+bj) >= asic_ny)
+								continue;
+							
+							// Within outer ring check
+							fbgr = sqrt( bi*bi + bj*bj );
+							if( fbgr > ringWidth )// || fbgr <= hitfinderLocalBGRadius )				// || fbgr > hitfinderLocalBGRadius)
+								continue;
+							
+							// Position of this point in data stream
+							thisx = com_xi + bi + mi*asic_nx;
+							thisy = com_yi + bj + mj*asic_ny;
+							e = thisx + thisy*pix_nx;
+							
+							thisr = pix_rbin[e];
+							thisADCthresh = rthreshold[thisr];
+							
+							// Intensity above background
+							thisI = temp[e];
+							
+							
+							// If above ADC threshold, this could be part of another peak
+							//if (temp[e] > thisADCthresh)
+							//	continue;
+							
+							// Keep track of value and value-squared for offset and sigma calculation
+							// if(peakpixel[e] == 0 && mask[e] != 0) {
+							if(temp[e] < thisADCthresh && peakpixel[e] == 0 && mask[e] != 0) {
+								np_sigma++;
+								sumI += thisI;
+								sumIsquared += (thisI*thisI);
+								if(thisI > backgroundMaxI) {
+									backgroundMaxI = thisI;
+								}
+							}
+							np_counted += 1;
 						}
-						com_x = peak_com_x/fabs(totI);
-						com_y = peak_com_y/fabs(totI);
-						com_e = lrint(com_x) + lrint(com_y)*pix_nx;
-
+					}
+					
+					// Calculate local background and standard deviation
+					if (np_sigma != 0) {
+						localOffset = sumI/np_sigma;
+						localSigma = sqrt(sumIsquared/np_sigma - ((sumI/np_sigma)*(sumI/np_sigma)));
+					}
+					else {
+						localOffset = roffset[pix_rbin[lrint(com_e)]];
+						localSigma = 0.01;
+					}
+					
+					
+					/*
+					 *	Re-integrate (and re-centroid) peak using local background estimates
+					 */
+					totI = 0;
+					totIraw = 0;
+					maxI = 0;
+					maxIraw = 0;
+					peak_com_x = 0;
+					peak_com_y = 0;
+					for(long counter=1; counter<nat && counter <= hitfinderMaxPixCount; counter++) {
+						e = peakpixels[counter];
+						thisIraw = temp[e];
+						thisI = thisIraw - localOffset;
 						
+						totI += thisI;
+						totIraw += thisIraw;
+
+						// Remember that e = thisx + thisy*pix_nx;
+						ldiv_t xy = ldiv(e, pix_nx);
+						thisx = xy.rem;
+						thisy = xy.quot;
+						peak_com_x += thisI*( (float) thisx ); // for center of mass x
+						peak_com_y += thisI*( (float) thisy ); // for center of mass y
+
+						if (thisIraw > maxIraw)
+							maxIraw = thisIraw;
+						if (thisI > maxI)
+							maxI = thisI;
+					}
+					com_x = peak_com_x/fabs(totI);
+					com_y = peak_com_y/fabs(totI);
+					com_e = lrint(com_x) + lrint(com_y)*pix_nx;
 
-						/*
-						 *	Calculate signal-to-noise and apply SNR criteria
-						 */
-						snr = (float) (totI)/localSigma;
-						//snr = (float) (maxI)/localSigma;
-						//snr = (float) (totIraw-nat*localOffset)/localSigma;
-						//snr = (float) (maxIraw-localOffset)/localSigma;
+					
+
+					/*
+					 *	Calculate signal-to-noise and apply SNR criteria
+					 */
+					snr = (float) (totI)/localSigma;
+					//snr = (float) (maxI)/localSigma;
+					//snr = (float) (totIraw-nat*localOffset)/localSigma;
+					//snr = (float) (maxIraw-localOffset)/localSigma;
+					
+					// The more pixels there are in the peak, the more relaxed we are about this criterion
+					if( snr < hitfinderMinSNR )        //   - nat +hitfinderMinPixCount
+						continue;
+					
+					// Is the maximum intensity in the peak enough above intensity in background region to be a peak and not noise?
+					// The more pixels there are in the peak, the more relaxed we are about this criterion
+					//fBackgroundThresh = hitfinderMinSNR - nat;
+					//if(fBackgroundThresh > 4) fBackgroundThresh = 4;
+					fBackgroundThresh = 1;
+					fBackgroundThresh *= (backgroundMaxI-localOffset);
+					if( maxI < fBackgroundThresh)
+						continue;
+					
+					
+					// This is a peak? If so, add info to peak list
+					if(nat>=hitfinderMinPixCount && nat<=hitfinderMaxPixCount ) {
 						
-						// The more pixels there are in the peak, the more relaxed we are about this criterion
-						if( snr < hitfinderMinSNR )        //   - nat +hitfinderMinPixCount
+						// This CAN happen!
+						if(totI == 0)
 							continue;
 						
-						// Is the maximum intensity in the peak enough above intensity in background region to be a peak and not noise?
-						// The more pixels there are in the peak, the more relaxed we are about this criterion
-						//fBackgroundThresh = hitfinderMinSNR - nat;
-						//if(fBackgroundThresh > 4) fBackgroundThresh = 4;
-						fBackgroundThresh = 1;
-						fBackgroundThresh *= (backgroundMaxI-localOffset);
-						if( maxI < fBackgroundThresh)
-							continue;
+						//com_x = peak_com_x/fabs(totI);
+						//com_y = peak_com_y/fabs(totI);
 						
+						e = lrint(com_x) + lrint(com_y)*pix_nx;
+						if(e < 0 || e >= pix_nn){
+							printf("Array bounds error: e=%ld\n",e);
+							continue;
+						}
 						
-						// This is a peak? If so, add info to peak list
-						if(nat>=hitfinderMinPixCount && nat<=hitfinderMaxPixCount ) {
-							
-							// This CAN happen!
-							if(totI == 0)
-								continue;
-							
-							//com_x = peak_com_x/fabs(totI);
-							//com_y = peak_com_y/fabs(totI);
-							
-							e = lrint(com_x) + lrint(com_y)*pix_nx;
-							if(e < 0 || e >= pix_nn){
-								printf("Array bounds error: e=%ld\n",e);
-								continue;
-							}
-							
-							// Remember peak information
-							if (peakCounter < hitfinderNpeaksMax) {
-								peaklist->peakNpix += nat;
-								peaklist->peakTotal += totI;
-								peaklist->peak_com_index[peakCounter] = e;
-								peaklist->peak_npix[peakCounter] = nat;
-								peaklist->peak_com_x[peakCounter] = com_x;
-								peaklist->peak_com_y[peakCounter] = com_y;
-								peaklist->peak_totalintensity[peakCounter] = totI;
-								peaklist->peak_maxintensity[peakCounter] = maxI;
-								peaklist->peak_sigma[peakCounter] = localSigma;
-								peaklist->peak_snr[peakCounter] = snr;
-								peakCounter++;
-								peaklist->nPeaks = peakCounter;
-							}
-							else {
-								peakCounter++;
-							}
+						// Remember peak information
+						if (peakCounter < hitfinderNpeaksMax) {
+							peaklist->peakNpix += nat;
+							peaklist->peakTotal += totI;
+							peaklist->peak_com_index[peakCounter] = e;
+							peaklist->peak_npix[peakCounter] = nat;
+							peaklist->peak_com_x[peakCounter] = com_x;
+							peaklist->peak_com_y[peakCounter] = com_y;
+							peaklist->peak_totalintensity[peakCounter] = totI;
+							peaklist->peak_maxintensity[peakCounter] = maxI;
+							peaklist->peak_sigma[peakCounter] = localSigma;
+							peaklist->peak_snr[peakCounter] = snr;
+							peakCounter++;
+							peaklist->nPeaks = peakCounter;
+						}
+						else {
+							peakCounter++;
 						}
 					}
 				}
@@ -1022,17 +1584,139 @@ int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r, long
 		}
 	}
 	
-	free(temp);
-	free(inx);
-	free(iny);
-	free(peakpixel);
-	free(peakpixels);
+	for(long k=0; k<nTouched; k++)
+		peakpixel[touched[k]] = 0;
 	
+	task->peakCounter = peakCounter;
+	return NULL;
+}
+
+
+/*
+ *	Peakfinder 8
+ *	Version before modifications during Cherezov December 2014 LE80
+ *	Count peaks by searching for connected pixels above threshold
+ *	Anton Barty
+ */
+int peakfinder8(tPeakList *peaklist, tPeakfinderWorkspace *ws, float *data, char *mask, tRadialBinIndex *rbins, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR, long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius) {
 	
-	free(roffset);
-	free(rsigma);
-	free(rcount);
-	free(rthreshold);
+	// Derived values
+	long	pix_nx = asic_nx*nasics_x;
+	long	pix_ny = asic_ny*nasics_y;
+	long	pix_nn = pix_nx*pix_ny;
+	long	asic_nn = asic_nx*asic_ny;
+	long	hitfinderNpeaksMax = peaklist->nPeaks_max;
+	
+	
+	peaklist->nPeaks = 0;
+	peaklist->peakNpix = 0;
+	peaklist->peakTotal = 0;
+	
+	preparePeakfinderWorkspace(ws, pix_nn, rbins->nBins, hitfinderMaxPixCount);
+	
+	/*
+	 *	Copy image data into a buffer so we don't nuke the main image by mistake,
+	 *	applying the mask on the way (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
+	 */
+	float *temp = ws->temp;
+	for(long i=0;i<pix_nn;i++){
+		temp[i] = data[i]*mask[i];
+	}
+	
+	/*
+	 *	Determine noise and offset as a funciton of radius
+	 *	Radius bins come from the detector's precomputed index (bins with no good pixels get threshold 1e9)
+	 */
+	peakfinder8RadialStatistics(ws, rbins, temp, mask, pix_nn, ADCthresh, hitfinderMinSNR);
+	float	*rthreshold = ws->rthreshold;
+	int		*pix_rbin = rbins->bin;
+	
+	// Union-find search: flag the pixels above their radial threshold and label the connected regions up front
+	if(ws->peakSearch == PEAK_SEARCH_UNION_FIND) {
+		for(long i=0;i<pix_nn;i++)
+			ws->above[i] = (temp[i] > rthreshold[pix_rbin[i]] && mask[i] != 0);
+		labelPeakRegions(ws, asic_nx, asic_ny, nasics_x, nasics_y);
+	}
+	
+	
+	/*
+	 *	Search the ASICs for peaks.
+	 *	With ws->nThreads > 1 the ASICs are split into contiguous ranges searched in parallel;
+	 *	no peak reaches beyond its ASIC, so joining the lists in ASIC order gives the same result as one serial search.
+	 */
+	tPeakfinder8Frame	frame;
+	frame.temp = temp;
+	frame.mask = mask;
+	frame.peakpixel = ws->peakpixel;
+	frame.roffset = ws->roffset;
+	frame.rthreshold = rthreshold;
+	frame.pix_rbin = pix_rbin;
+	frame.ws = ws;
+	frame.asic_nx = asic_nx;
+	frame.asic_ny = asic_ny;
+	frame.nasics_x = nasics_x;
+	frame.pix_nx = pix_nx;
+	frame.pix_nn = pix_nn;
+	frame.hitfinderMinSNR = hitfinderMinSNR;
+	frame.hitfinderMinPixCount = hitfinderMinPixCount;
+	frame.hitfinderMaxPixCount = hitfinderMaxPixCount;
+	frame.hitfinderLocalBGRadius = hitfinderLocalBGRadius;
+	
+	long	nasics = nasics_x*nasics_y;
+	long	nt = ws->nThreads;
+	if(nt < 1)
+		nt = 1;
+	if(nt > nasics)
+		nt = nasics;
+	preparePeakfinderHelpers(ws, nt-1, asic_nn+1, hitfinderMaxPixCount, hitfinderNpeaksMax);
+	
+	tPeakfinder8Task	*tasks = (tPeakfinder8Task *) threadTeamTasks(&ws->team, nt, sizeof(tPeakfinder8Task));
+	for(long t=0; t<nt; t++) {
+		tasks[t].frame = &frame;
+		tasks[t].asic0 = nasics*t/nt;
+		tasks[t].asic1 = nasics*(t+1)/nt;
+		tasks[t].touched = ws->touched + tasks[t].asic0*asic_nn;
+		if(t == 0) {
+			tasks[t].inx = ws->inx;
+			tasks[t].iny = ws->iny;
+			tasks[t].peakpixels = ws->peakpixels;
+			tasks[t].peaklist = peaklist;
+		}
+		else {
+			tPeakfinderHelper *helper = &ws->helpers[t-1];
+			tasks[t].inx = helper->inx;
+			tasks[t].iny = helper->iny;
+			tasks[t].peakpixels = helper->peakpixels;
+			tasks[t].peaklist = &helper->peaks;
+			resetPeakList(&helper->peaks);
+		}
+	}
+	
+	// Run ranges 1..nt-1 on the worker's team and range 0 here, with the search specialised for ws->layout
+	void	*(*search)(void *) = NULL;
+	DETECTOR_LAYOUT_SELECT(detectorLayout(ws->layout, asic_nx, asic_ny, nasics_x), search, peakfinder8Search);
+	threadTeamRun(&ws->team, search);
+	
+	// Append the other ranges' peaks as a serial search would have stored them
+	long peakCounter = tasks[0].peakCounter;
+	for(long t=1; t<nt; t++) {
+		tPeakList	*tp = tasks[t].peaklist;
+		for(long k=0; k<tasks[t].peakCounter; k++) {
+			if (peakCounter < hitfinderNpeaksMax) {
+				peaklist->peakNpix += tp->peak_npix[k];
+				peaklist->peakTotal += tp->peak_totalintensity[k];
+				peaklist->peak_com_index[peakCounter] = tp->peak_com_index[k];
+				peaklist->peak_npix[peakCounter] = tp->peak_npix[k];
+				peaklist->peak_com_x[peakCounter] = tp->peak_com_x[k];
+				peaklist->peak_com_y[peakCounter] = tp->peak_com_y[k];
+				peaklist->peak_totalintensity[peakCounter] = tp->peak_totalintensity[k];
+				peaklist->peak_maxintensity[peakCounter] = tp->peak_maxintensity[k];
+				peaklist->peak_sigma[peakCounter] = tp->peak_sigma[k];
+				peaklist->peak_snr[peakCounter] = tp->peak_snr[k];
+			}
+			peakCounter++;
+		}
+	}
 	
 	
 	peaklist->nPeaks = peakCounter;
@@ -1608,7 +2292,7 @@ int peakfinder8old(tPeakList *peaklist, float *data, char *mask, float *pix_r, l
  *	Peak finder 6
  *	Rick Kirian
  */
-int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR, long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius, float hitfinderMinPeakSeparation) {
+int peakfinder6(tPeakList *peaklist, tPeakfinderWorkspace *ws, float *data, char *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR, long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius, float hitfinderMinPeakSeparation) {
 
 	// Derived values
 	long	pix_nx = asic_nx*nasics_x;
@@ -1625,7 +2309,7 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 	int hit = 0;
 	int fail;
 	int stride = pix_nx;
-	int i,fs,ss,e,thise,p,ce,ne,nat,lastnat,cs,cf;
+	int fs,ss,e,thise,p,ce,ne,nat,lastnat,cs,cf;
 	int peakindex,newpeak;
 	float dist, itot, ftot, stot, maxI;
 	float thisI,snr,bg,bgsig;
@@ -1636,13 +2320,10 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 	maxI = 0;
 	
 	/* For counting neighbor pixels */
-	int *nexte = (int *) calloc(pix_nn,sizeof(int));
-	int *killpeak = (int *) calloc(pix_nn,sizeof(int));
-	for (i=0; i<pix_nn; i++){
-		killpeak[i] = 0;
-	}
+	preparePeakfinderWorkspace(ws, pix_nn, 0, 0);
+	int *nexte = ws->nexte;
 	
-	int * natmask = (int *) calloc(pix_nn, sizeof(int) );
+	int * natmask = ws->natmask;
 	for(long i=0; i<pix_nn; i++){
 		natmask[i] = mask[i];
 	}
@@ -1654,17 +2335,12 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 	
 	
 	/*
-	 *	Create a buffer for image data so we don't nuke the main image by mistake
-	 */
-	float *temp = (float*) calloc(pix_nn, sizeof(float));
-	memcpy(temp, data, pix_nn*sizeof(float));
-	
-	
-	/*
-	 *	Apply mask (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
+	 *	Copy image data into a buffer so we don't nuke the main image by mistake,
+	 *	applying the mask on the way (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
 	 */
+	float *temp = ws->temp;
 	for(long i=0;i<pix_nn;i++){
-		temp[i] *= mask[i];
+		temp[i] = data[i]*mask[i];
 	}
 	
 	// Loop over modules (8x8 array)
@@ -1823,10 +2499,6 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 	
 nohit:
 	
-	free(nexte);
-	free(natmask);
-	free(temp);
-	free(killpeak);
 
     return(peaklist->nPeaks);
 }
@@ -26,16 +26,25 @@ void initPixelmask(cEventData *eventData, cGlobal *global){
 	}
 }
 
-void checkSaturatedPixels(uint16_t *data_raw16, uint16_t *mask, long pix_nn, long pixelSaturationADC) {
+/*
+ *	Saturated pixels of raw data of any of the RAW_TYPE_* types
+ */
+template <class T>
+void checkSaturatedPixels(T *data_raw, uint16_t *mask, long pix_nn, long pixelSaturationADC) {
 	for(long i=0; i<pix_nn; i++) { 
-		if ( data_raw16[i] >= pixelSaturationADC)
+		if ( data_raw[i] >= pixelSaturationADC)
 			mask[i] |= PIXEL_IS_SATURATED;
 		else
 			mask[i] &= ~PIXEL_IS_SATURATED;
 	}
 }
 
-void checkSaturatedPixelsPnccd(uint16_t *data_raw16, uint16_t *mask){
+template void checkSaturatedPixels<uint16_t>(uint16_t*, uint16_t*, long, long);
+template void checkSaturatedPixels<int32_t>(int32_t*, uint16_t*, long, long);
+template void checkSaturatedPixels<float>(float*, uint16_t*, long, long);
+
+template <class T>
+void checkSaturatedPixelsPnccd(T *data_raw, uint16_t *mask){
 	long i,x,y,mx,my,q;
 	long asic_nx = PNCCD_ASIC_NX;
 	long asic_ny = PNCCD_ASIC_NY;
@@ -49,7 +58,7 @@ void checkSaturatedPixelsPnccd(uint16_t *data_raw16, uint16_t *mask){
 			for(y=0; y<asic_ny; y++){
 				for(x=0; x<asic_nx; x++){
 					i = my * (asic_ny*asic_nx*nasics_x) + y * asic_nx*nasics_x + mx*asic_nx + x;
-					if (data_raw16[i] > saturation_threshold[q]){
+					if (data_raw[i] > saturation_threshold[q]){
 						mask[i] |= PIXEL_IS_SATURATED; 
 					}
 				}
@@ -58,19 +67,38 @@ void checkSaturatedPixelsPnccd(uint16_t *data_raw16, uint16_t *mask){
 	}
 }
 
+template void checkSaturatedPixelsPnccd<uint16_t>(uint16_t*, uint16_t*);
+template void checkSaturatedPixelsPnccd<int32_t>(int32_t*, uint16_t*);
+template void checkSaturatedPixelsPnccd<float>(float*, uint16_t*);
+
+template <class T>
+static void checkSaturatedPixels(T *raw_data, uint16_t *mask, cGlobal *global, long detIndex) {
+	if ((strcmp(global->detector[detIndex].detectorType, "pnccd") == 0) && (global->detector[detIndex].maskPnccdSaturatedPixels)) {
+		DEBUG3("Check for saturated pixels (PNCCD). (detectorID=%ld)",global->detector[detIndex].detectorID);										
+		checkSaturatedPixelsPnccd(raw_data,mask);
+	} else {
+		DEBUG3("Check for saturated pixels (other than PNCCD). (detectorID=%ld)",global->detector[detIndex].detectorID);										
+		long		nn = global->detector[detIndex].pix_nn;
+		long		pixelSaturationADC = global->detector[detIndex].pixelSaturationADC;			
+		checkSaturatedPixels(raw_data, mask, nn, pixelSaturationADC);
+	}
+}
+
 void checkSaturatedPixels(cEventData *eventData, cGlobal *global){
 	DETECTOR_LOOP {
 		if (global->detector[detIndex].maskSaturatedPixels) {
-			uint16_t	*raw_data = eventData->detector[detIndex].data_raw16;
+			void		*raw_data = eventData->detector[detIndex].rawInput;
 			uint16_t	*mask = eventData->detector[detIndex].pixelmask;
-			if ((strcmp(global->detector[detIndex].detectorType, "pnccd") == 0) && (global->detector[detIndex].maskPnccdSaturatedPixels)) {
-				DEBUG3("Check for saturated pixels (PNCCD). (detectorID=%ld)",global->detector[detIndex].detectorID);										
-				checkSaturatedPixelsPnccd(raw_data,mask);
-			} else {
-				DEBUG3("Check for saturated pixels (other than PNCCD). (detectorID=%ld)",global->detector[detIndex].detectorID);										
-				long		nn = global->detector[detIndex].pix_nn;
-				long		pixelSaturationADC = global->detector[detIndex].pixelSaturationADC;			
-				checkSaturatedPixels(raw_data, mask, nn, pixelSaturationADC);
+			switch(eventData->detector[detIndex].rawType) {
+				case RAW_TYPE_INT32:
+					checkSaturatedPixels((int32_t*) raw_data, mask, global, detIndex);
+					break;
+				case RAW_TYPE_FLOAT:
+					checkSaturatedPixels((float*) raw_data, mask, global, detIndex);
+					break;
+				default:
+					checkSaturatedPixels((uint16_t*) raw_data, mask, global, detIndex);
+					break;
 			}
 		}
 	}
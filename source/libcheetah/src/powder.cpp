@@ -21,12 +21,97 @@
 #include "median.h"
 
 
+static void addEventToPowder(cEventData *eventData, cGlobal *global);
+
+
+/*
+ *	Events add to their powder shard (powderSequence % powderShards) strictly in the order they were queued
+ *	for the workers, whichever worker runs them, so that the shard sums (and their merge, in shard order) are the
+ *	same bit for bit as in a serial run. No worker waits for its turn: an event that comes to the powder early
+ *	is added at worker cleanup if its turn has come by then, or else parked, to be added and let go by the
+ *	worker that passes the turn on to it. Events that never add to the powder only pass their turn on.
+ */
+static bool isPowderTurn(cEventData *eventData, cGlobal *global) {
+	long seq = eventData->powderSequence;
+	if (global->nPowderTurns <= 0 || seq < 0)
+		return true;
+	pthread_mutex_lock(&global->powderTurn_mutex);
+	bool turn = (global->powderTurn[seq % global->nPowderTurns] == seq);
+	pthread_mutex_unlock(&global->powderTurn_mutex);
+	return turn;
+}
+
+static void passPowderTurn(cEventData *eventData, cGlobal *global) {
+	long seq = eventData->powderSequence;
+	if (global->nPowderTurns <= 0 || seq < 0 || eventData->powderTurnDone)
+		return;
+	eventData->powderTurnDone = true;
+
+	long n = global->nPowderTurns;
+	long shard = seq % n;
+	std::vector<cEventData*> &parked = global->powderTurnParked;
+	pthread_mutex_lock(&global->powderTurn_mutex);
+	global->powderTurn[shard] = seq + n;
+	// Then take the later events of the shard that are already parked, in order
+	while (true) {
+		std::vector<cEventData*>::iterator it = parked.begin();
+		while (it != parked.end() && (*it)->powderSequence != global->powderTurn[shard])
+			it++;
+		if (it == parked.end())
+			break;
+		cEventData *next = *it;
+		parked.erase(it);
+		pthread_mutex_unlock(&global->powderTurn_mutex);
+		next->powderTurnDone = true;
+		if (next->powderAddPending)
+			addEventToPowder(next, global);
+		releaseEvent(next, global);
+		pthread_mutex_lock(&global->powderTurn_mutex);
+		global->powderTurn[shard] += n;
+	}
+	pthread_mutex_unlock(&global->powderTurn_mutex);
+}
+
+/*
+ *	Worker cleanup: add the event if it came to the powder before its turn, and pass the turn on.
+ *	Returns true if the turn has still not come: the event is then parked, and belongs to the worker
+ *	that passes the turn on to it, so the caller must not touch it again.
+ */
+bool finishPowderTurn(cEventData *eventData, cGlobal *global) {
+	long seq = eventData->powderSequence;
+	if (global->nPowderTurns <= 0 || seq < 0 || eventData->powderTurnDone)
+		return false;
+	pthread_mutex_lock(&global->powderTurn_mutex);
+	if (global->powderTurn[seq % global->nPowderTurns] != seq) {
+		global->powderTurnParked.push_back(eventData);
+		pthread_mutex_unlock(&global->powderTurn_mutex);
+		return true;
+	}
+	pthread_mutex_unlock(&global->powderTurn_mutex);
+	if (eventData->powderAddPending)
+		addEventToPowder(eventData, global);
+	passPowderTurn(eventData, global);
+	return false;
+}
+
+
 /*
  *	Maintain running powder patterns
  */
 
 void addToPowder(cEventData *eventData, cGlobal *global) {
 
+	// Not this event's turn at its shard yet: it is added later, in its turn (see finishPowderTurn)
+	if (!isPowderTurn(eventData, global)) {
+		eventData->powderAddPending = true;
+		return;
+	}
+	addEventToPowder(eventData, global);
+	passPowderTurn(eventData, global);
+}
+
+static void addEventToPowder(cEventData *eventData, cGlobal *global) {
+
 	int hit = eventData->hit;
 	int	powderClass = eventData->powderClass;
     
@@ -54,42 +139,40 @@ void addToPowder(cEventData *eventData, cGlobal *global, int powderClass, long d
 		global->nPowderFrames[powderClass] += 1;
 	pthread_mutex_unlock(&global->detector[detIndex].powderData_mutex[powderClass]);
 	
-    double  *buffer;	
+	// Each event sums into the shard its place in the event order selects (see isPowderTurn);
+	// without shards, sum straight into the shared powder
+	long	nPowderShards = global->detector[detIndex].nPowderShards;
+	long	shard = -1;
+	if (nPowderShards > 0)
+		shard = (eventData->powderSequence >= 0) ? (eventData->powderSequence % nPowderShards) : 0;
+	float	powderthresh = global->powderthresh;
+
 	FOREACH_DATAFORMAT_T(i_f, cDataVersion::DATA_FORMATS) {
 		if (isBitOptionSet(global->detector[detIndex].powderFormat,*i_f)) {
 			cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].powderVersion, *i_f);
 			while (dataV.next()) {
-				pthread_mutex_t * mutex = dataV.getPowderMutex(powderClass);
+				pthread_mutex_t * mutex = (shard >= 0) ? dataV.getPowderShardMutex(shard) : dataV.getPowderMutex(powderClass);
 				float * data = dataV.getData();
-				double * powder = dataV.getPowder(powderClass);
-				double * powder_squared = dataV.getPowderSquared(powderClass);
-                // Powder squared
-				buffer = (double*) calloc(dataV.pix_nn, sizeof(double));
+				if (global->threadSafetyLevel > 0)
+					pthread_mutex_lock(mutex);
+				double * powder = (shard >= 0) ? dataV.getPowderShard(shard, powderClass) : dataV.getPowder(powderClass);
+				double * powder_squared = (shard >= 0) ? dataV.getPowderSquaredShard(shard, powderClass) : dataV.getPowderSquared(powderClass);
+				// Use double precision throughout the multiplication to reduce rounding errors in powder_squared
 				if(!global->usePowderThresh) {
-					for(long i=0; i<dataV.pix_nn; i++)
-                        // Use double precision throughout the multiplication to reduce rounding errors in powder_squared
-						buffer[i] = ((double) data[i])*data[i];
+					for(long i=0; i<dataV.pix_nn; i++) {
+						powder[i] += data[i];
+						powder_squared[i] += ((double) data[i])*data[i];
+					}
 				}
 				else {
-					for(long i=0; i<dataV.pix_nn; i++){
-						if(data[i] > global->powderthresh)
-                            // Use double precision throughout the multiplication to reduce rounding errors in powder_squared
-							buffer[i] = ((double) data[i])*data[i];
-						else
-							buffer[i] = 0;
+					for(long i=0; i<dataV.pix_nn; i++) {
+						powder[i] += data[i];
+						if(data[i] > powderthresh)
+							powder_squared[i] += ((double) data[i])*data[i];
 					}
 				}
-				if (global->threadSafetyLevel > 0)
-					pthread_mutex_lock(mutex);
-                for(long i=0; i<dataV.pix_nn; i++){
-                    // Powder
-                    powder[i] += data[i];
-                    // Powder squared
-					powder_squared[i] += buffer[i];
-				}
 				if (global->threadSafetyLevel > 0)
 					pthread_mutex_unlock(mutex);
-				free(buffer);
 			}
 		}
 	}
@@ -106,7 +189,7 @@ void addToPowder(cEventData *eventData, cGlobal *global, int powderClass, long d
 		long	pix_nx = global->detector[detIndex].pix_nx;
 		long	pix_ny = global->detector[detIndex].pix_ny;
 		
-		for(long i=0; i<=eventData->peaklist.nPeaks && i<eventData->peaklist.nPeaks_max; i++) {
+		for(long i=0; i<eventData->peaklist.nPeaks && i<eventData->peaklist.nPeaks_max; i++) {
 						
 			// Peak position and value
 			ci = eventData->peaklist.peak_com_index[i];
@@ -146,6 +229,62 @@ void addToPowder(cEventData *eventData, cGlobal *global, int powderClass, long d
 }
 
 
+/*
+ *	Rebuild the shared powder sums from the per-worker shards
+ *	Shards keep running totals and are always added in shard order, so the result does not depend on
+ *	how often this is called (with a single worker it is exactly the serial sum).
+ *	Call before anything reads the powder arrays (assemble2DPowder, saveRunningSums, writeAccumulatedCXI).
+ */
+void mergePowderShards(cGlobal *global) {
+	DETECTOR_LOOP {
+		cPixelDetectorCommon *detector = &global->detector[detIndex];
+		if (detector->nPowderShards <= 0)
+			continue;
+		FOREACH_DATAFORMAT_T(i_f, cDataVersion::DATA_FORMATS) {
+			if (!isBitOptionSet(detector->powderFormat, *i_f))
+				continue;
+			cDataVersion dataV(NULL, detector, detector->powderVersion, *i_f);
+			while (dataV.next()) {
+				for(long powderClass=0; powderClass < global->nPowderClasses; powderClass++) {
+					double *powder = dataV.getPowder(powderClass);
+					double *powder_squared = dataV.getPowderSquared(powderClass);
+					pthread_mutex_t *mutex = dataV.getPowderMutex(powderClass);
+					long nMerged = 0;
+					pthread_mutex_lock(mutex);
+					for(long shard=0; shard < detector->nPowderShards; shard++) {
+						pthread_mutex_t *shardMutex = dataV.getPowderShardMutex(shard);
+						pthread_mutex_lock(shardMutex);
+						if (dataV.hasPowderShard(shard, powderClass)) {
+							double *sum = dataV.getPowderShard(shard, powderClass);
+							double *sum_squared = dataV.getPowderSquaredShard(shard, powderClass);
+							if (nMerged == 0) {
+								memcpy(powder, sum, dataV.pix_nn*sizeof(double));
+								memcpy(powder_squared, sum_squared, dataV.pix_nn*sizeof(double));
+							}
+							else {
+								for(long i=0; i<dataV.pix_nn; i++) {
+									powder[i] += sum[i];
+									powder_squared[i] += sum_squared[i];
+								}
+							}
+							nMerged += 1;
+						}
+						pthread_mutex_unlock(shardMutex);
+					}
+					// Nothing in this class yet: the total is zero, whatever the arrays were left holding
+					// (cheetah-mpi reduces the totals of all ranks into rank 0's arrays in place)
+					if (nMerged == 0) {
+						memset(powder, 0, dataV.pix_nn*sizeof(double));
+						memset(powder_squared, 0, dataV.pix_nn*sizeof(double));
+					}
+					pthread_mutex_unlock(mutex);
+				}
+			}
+		}
+	}
+}
+
+
 void saveRunningSums(cGlobal *global, int detIndex) {
 	//	Save powder patterns from different classes
     for(long powderType=0; powderType < global->nPowderClasses; powderType++) {
@@ -171,6 +310,8 @@ void saveRunningSums(cGlobal *global, int detIndex) {
  *  Also for deciding whether to calculate gain, darkcal, etc.
  */
 void saveRunningSums(cGlobal *global) {
+    if(!global->savesRunningSums())
+        return;
     printf("Writing powder patterns to file:\n");
     for(int detIndex=0; detIndex<global->nDetectors; detIndex++) {
         saveRunningSums(global, detIndex);
@@ -213,9 +354,8 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
      *	Filename
      */
     char	filename[1024];
-    char	filenamebase[1024];
-    sprintf(filenamebase,"r%04u-detector%ld-class%d", global->runNumber, global->detector[detIndex].detectorID, powderClass);
-    sprintf(filename,"%s-sum.h5",filenamebase);
+    snprintf(filename, sizeof(filename), "r%04u-detector%ld-class%d-sum.h5", global->runNumber, global->detector[detIndex].detectorID, powderClass);
+    global->addRunShardSumSuffix(filename);
     printf("%s\n",filename);
 	
     /*
@@ -291,7 +431,8 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
 				H5Dclose(dh);
 				if (dataV.isMainDataset) {
 					// Create symbolic link if this is the main dataset
-					sprintf(sBuffer,"/data/%s",dataV.name);
+					if (snprintf(sBuffer, sizeof(sBuffer), "/data/%s",dataV.name) >= (int) sizeof(sBuffer))
+						ERROR("Dataset name too long: %s\n", sBuffer);
 					H5Lcreate_soft(sBuffer, fh, "/data/data",0,0);
 					H5Lcreate_soft(sBuffer, fh, "/data/correcteddata",0,0);
 				}
@@ -307,11 +448,21 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
 				for (long i=0; i<dataV.pix_nn; i++) {
                     powderSigmaBuffer[i] = sqrt(powderSquaredBuffer[i]/nframes - (powderBuffer[i]/nframes)*(powderBuffer[i]/nframes));
 				}
-				sprintf(sBuffer,"%s_sigma",dataV.name);
+				if (snprintf(sBuffer, sizeof(sBuffer), "%s_sigma",dataV.name) >= (int) sizeof(sBuffer))
+					ERROR("Dataset name too long: %s\n", sBuffer);
 				dh = H5Dcreate(gh, sBuffer, H5T_NATIVE_DOUBLE, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
 				if (dh < 0) ERROR("Could not create dataset.\n");
 				H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderSigmaBuffer);
 				H5Dclose(dh);
+				// Part of a run: keep the sum of squares so that cheetah-merge can combine the sigmas
+				if (global->keepsRunShardSums()) {
+					if (snprintf(sBuffer, sizeof(sBuffer), "%s_squared",dataV.name) >= (int) sizeof(sBuffer))
+						ERROR("Dataset name too long: %s\n", sBuffer);
+					dh = H5Dcreate(gh, sBuffer, H5T_NATIVE_DOUBLE, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
+					if (dh < 0) ERROR("Could not create dataset.\n");
+					H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderSquaredBuffer);
+					H5Dclose(dh);
+				}
                 free(powderBuffer);
 				free(powderSquaredBuffer);
 				free(powderSigmaBuffer);
@@ -392,7 +543,9 @@ void saveDarkcal(cGlobal *global, int detIndex) {
 	//sprintf(filename,"r%04u-%s-%li-darkcal.h5",global->runNumber,detector->detectorName,detector->detectorID);
 	//sprintf(filename,"r%04u-%s-detectorID%li-darkcal.h5",global->runNumber,detector->detectorName,detector->detectorID);
 	//sprintf(filename,"%s-r%04u-%s-detector%li-darkcal.h5",global->experimentID, global->runNumber,detector->detectorName,detector->detectorID);
-    sprintf(filename,"%s-r%04u-detector%li-darkcal.h5",global->experimentID, global->runNumber,detector->detectorID);
+    if (snprintf(filename, sizeof(filename), "%s-r%04u-detector%li-darkcal.h5",global->experimentID, global->runNumber,detector->detectorID) >= (int) sizeof(filename))
+        ERROR("File name too long: %s\n", filename);
+    global->addRunShardSumSuffix(filename);
 
 	float *buffer = (float*) calloc(pix_nn, sizeof(float));
 	pthread_mutex_lock(&detector->powderData_mutex[0]);
@@ -461,7 +614,9 @@ void saveGaincal(cGlobal *global, int detIndex) {
 	}
 
 	char	filename[1024];
-	sprintf(filename,"r%04u-%s-gaincal.h5",global->runNumber, detector->detectorName);
+	if (snprintf(filename, sizeof(filename), "r%04u-%s-gaincal.h5",global->runNumber, detector->detectorName) >= (int) sizeof(filename))
+		ERROR("File name too long: %s\n", filename);
+	global->addRunShardSumSuffix(filename);
     //printf("Saving gaincal to file: %s\n", filename);
     printf("%s\n", filename);
 #ifdef H5F_ACC_SWMR_WRITE
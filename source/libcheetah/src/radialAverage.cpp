@@ -24,81 +24,82 @@
 
 /*
  *  Calculate radial averages
- *  (repeated once for each different data type)
+ *  (repeated once for each different data type; cDataVersion otherwise does this when one is first asked for)
  */
 
 void calculateRadialAverage(cEventData *eventData, cGlobal *global) {
  	DETECTOR_LOOP {
 		if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE)) {
-			cDataVersion dataV_2d(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_NON_ASSEMBLED);
 			cDataVersion dataV_r(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE);
-			while (dataV_2d.next() && dataV_r.next()) {
-				long	 radial_nn = global->detector[detIndex].radial_nn;
-				long     pix_nn = global->detector[detIndex].pix_nn;
-				float    *pix_r = global->detector[detIndex].pix_r;
-				float    *data_r = dataV_r.getData();
-				float    *data_2d = dataV_2d.getData();				
-				uint16_t *pixelmask_r = dataV_r.getPixelmask();
-				uint16_t *pixelmask_2d = dataV_2d.getPixelmask();				
-				calculateRadialAverage(data_2d, pixelmask_2d, data_r, pixelmask_r, pix_r, radial_nn, pix_nn);
+			while (dataV_r.next()) {
+				dataV_r.getData();
 			}
 		}
 	}
 }
 
+/*
+ *	Radial average over the detector's radius bins (pix_rbins: lrint(pix_r) per pixel, computed once with the geometry).
+ *	One sequential sweep over the pixels; masked-out pixels are selected away rather than branched over,
+ *	and counted in the same pass (event masks change from frame to frame, so counts are not cached).
+ *	pixelmask2d == NULL means every pixel counts (powders), so the counts are just the bin sizes;
+ *	pixelmaskRadial may be NULL when no radial mask is wanted.
+ *	Bins that receive no values are 0 and PIXEL_IS_MISSING.
+ */
 template <class T>
-void calculateRadialAverage(T *data2d, uint16_t *pixelmask2d, T *dataRadial, uint16_t *pixelmaskRadial, float * pix_r, long radial_nn, long pix_nn) {
+void calculateRadialAverage(T *data2d, uint16_t *pixelmask2d, T *dataRadial, uint16_t *pixelmaskRadial, tRadialBinIndex *rbins, long radial_nn) {
 
-	// Alloc temporary arrays
-	int *      tempRadialAverageCounter = (int*) calloc(radial_nn, sizeof(int));
-	uint16_t * tempBadBins              = (uint16_t*) calloc(radial_nn, sizeof(uint16_t));
 	uint16_t maskOutBits = PIXEL_IS_INVALID | PIXEL_IS_SATURATED | PIXEL_IS_HOT | PIXEL_IS_DEAD | PIXEL_IS_SHADOWED | PIXEL_IS_TO_BE_IGNORED | PIXEL_IS_BAD | PIXEL_IS_MISSING | PIXEL_IS_NOISY;
+	long	pix_nn = rbins->pix_nn;
+	long	nBins = rbins->nBins < radial_nn ? rbins->nBins : radial_nn;
+	int		*bin = rbins->bin;
+	long	*count = (long*) calloc(radial_nn, sizeof(long));
 	
-	// Init arrays
-	for(long i=0; i<radial_nn; i++) {
-		dataRadial[i] = 0.;
-		pixelmaskRadial[i] = 0;
-		tempBadBins[i] = PIXEL_IS_MISSING;
+	for(long rbin=0; rbin<radial_nn; rbin++)
+		dataRadial[rbin] = 0;
+
+	if(pixelmask2d == NULL) {
+		for(long i=0; i<pix_nn; i++)
+			dataRadial[bin[i]] += data2d[i];
+		for(long rbin=0; rbin<nBins; rbin++)
+			count[rbin] = rbins->start[rbin+1] - rbins->start[rbin];
 	}
-	
-	// Radial average
-	long	rbin;
-	for(long i=0; i<pix_nn; i++){
-        // Radius of this pixel
-		rbin = lrint(pix_r[i]);
-		
-		// Array bounds check (paranoia)
-		if(rbin < 0){
-			rbin = 0;
+	else {
+		uint16_t *mask = pixelmaskRadial;
+		if(mask == NULL)
+			mask = (uint16_t*) malloc(radial_nn*sizeof(uint16_t));
+		for(long rbin=0; rbin<radial_nn; rbin++)
+			mask[rbin] = 0;
+
+		for(long i=0; i<pix_nn; i++) {
+			long		rbin = bin[i];
+			uint16_t	m = pixelmask2d[i];
+			bool		good = isNoneOfBitOptionsSet(m, maskOutBits);
+			dataRadial[rbin] += good ? data2d[i] : 0;
+			count[rbin] += good;
+			mask[rbin] |= good ? m : 0;
 		}
-
-		// Don't count bad pixels in radial average
-        if (isAnyOfBitOptionsSet(pixelmask2d[i],maskOutBits)) {
-			tempBadBins[rbin] |= pixelmaskRadial[rbin];
-			continue;
-		}
-
-        // Add to average
-		dataRadial[rbin] += data2d[i];
-		tempRadialAverageCounter[rbin] += 1;
-	    pixelmaskRadial[rbin] |= pixelmask2d[i];
+		if(mask != pixelmaskRadial)
+			free(mask);
 	}
 
 	// Divide by number of actual pixels in ring to get the average
 	for(long rbin=0; rbin<radial_nn; rbin++) {
-        // Check if radial bin did receive any values
-		if (tempRadialAverageCounter[rbin] == 0) {
-			pixelmaskRadial[rbin] |= tempBadBins[rbin];
-		} else {
-			dataRadial[rbin] /= tempRadialAverageCounter[rbin];
+		if(count[rbin] == 0) {
+			dataRadial[rbin] = 0;
+			if(pixelmaskRadial != NULL)
+				pixelmaskRadial[rbin] = PIXEL_IS_MISSING;
 		}
+		else
+			dataRadial[rbin] /= count[rbin];
 	}
-
-	// Free temporary arrays
-	free(tempRadialAverageCounter);
-	free(tempBadBins);
+	free(count);
 }
 
+// Event data (see cDataVersion::materialize) and powders
+template void calculateRadialAverage<float>(float*, uint16_t*, float*, uint16_t*, tRadialBinIndex*, long);
+template void calculateRadialAverage<double>(double*, uint16_t*, double*, uint16_t*, tRadialBinIndex*, long);
+
 
 /*
  * Calculate radial average of powder data
@@ -107,20 +108,15 @@ void calculateRadialAveragePowder(cGlobal *global) {
  	DETECTOR_LOOP {
 		if (isBitOptionSet(global->detector[detIndex].powderFormat, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE)) {
 			long	 radial_nn = global->detector[detIndex].radial_nn;
-			long     pix_nn = global->detector[detIndex].pix_nn;
-			float    *pix_r = global->detector[detIndex].pix_r;
+			tRadialBinIndex *rbins = &global->detector[detIndex].pix_rbins;
 			cDataVersion dataV_2d(NULL, &global->detector[detIndex], global->detector[detIndex].powderVersion, cDataVersion::DATA_FORMAT_NON_ASSEMBLED);
 			cDataVersion dataV_r(NULL, &global->detector[detIndex], global->detector[detIndex].powderVersion, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE);
 			while (dataV_2d.next() && dataV_r.next()) {
 				for (long powderClass=0; powderClass < global->detector[detIndex].nPowderClasses; powderClass++) {
 					double * powder_r = dataV_r.getPowder(powderClass);
 					double * powder_2d = dataV_2d.getPowder(powderClass);
-					uint16_t *buffer_2d = (uint16_t *) calloc(pix_nn,sizeof(uint16_t));
-					uint16_t *buffer_radial = (uint16_t *) calloc(radial_nn,sizeof(uint16_t));
-					calculateRadialAverage(powder_2d, buffer_2d , powder_r, buffer_radial, pix_r, radial_nn, pix_nn);
 					// Currently we do not save any mask for the powders
-					free(buffer_radial);
-					free(buffer_2d);
+					calculateRadialAverage(powder_2d, (uint16_t *) NULL, powder_r, (uint16_t *) NULL, rbins, radial_nn);
 				}
 			}
 		}
@@ -155,7 +151,9 @@ void addToRadialAverageStack(cEventData *eventData, cGlobal *global, int powderC
     cPixelDetectorCommon     *detector = &global->detector[detIndex];
     
     float   *stack = detector->radialAverageStack[powderClass];
-    float   *radialAverage = eventData->detector[detIndex].radialAverage_detPhotCorr;
+    cDataVersion radialV(&eventData->detector[detIndex], detector, cDataVersion::DATA_VERSION_DETECTOR_AND_PHOTON_CORRECTED, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE);
+    radialV.next();
+    float   *radialAverage = radialV.getData();
     long	radial_nn = detector->radial_nn;
     long    stackCounter = detector->radialStackCounter[powderClass];
     long    stackSize = detector->radialStackSize;
@@ -237,6 +235,7 @@ void saveRadialAverageStack(cGlobal *global, int powderClass, int detIndex) {
 	
 	
     sprintf(filename,"r%04u-radialstack-detector%d-class%i-stack%li.h5", global->runNumber, detIndex, powderClass, stackNum);
+    global->addRunShardSuffix(filename);
     //sprintf(filename,"r%04u-radialstack-detector%d-class%i-%06ld.h5", global->runNumber, detIndex, powderClass, frameNum);
     printf("Saving radial stack: %s\n", filename);
     
@@ -13,6 +13,9 @@
 #include <pthread.h>
 #include <math.h>
 #include <fstream> 
+#include <limits>
+#include <zlib.h>
+#include <hdf5_hl.h>
 
 #include <saveCXI.h>
 
@@ -97,6 +100,11 @@ namespace CXI{
 				dims[0] = 1;
 			}
 		}
+		// Compressed image stacks hold one frame per chunk, so that each frame can be compressed on its own
+		bool compressed = deflateLevel > 0 && stackSize == H5S_UNLIMITED && ndims >= 3 && heightChunkSize == 0;
+		if(compressed){
+			dims[0] = 1;
+		}
 		hsize_t maxdims[4] = {stackSize,length,height,width};
 		hid_t dataspace = H5Screate_simple(ndims, dims, maxdims);
 		if( dataspace<0 ) {ERROR("Cannot create dataspace.\n");}
@@ -105,6 +113,10 @@ namespace CXI{
 			H5Pset_chunk(cparms, ndims, dims);
 		}
 		//  H5Pset_deflate (cparms, 2);
+		if(compressed){
+			H5Pset_shuffle(cparms);
+			H5Pset_deflate(cparms, deflateLevel);
+		}
 		hid_t dapl_id = H5Pcreate(H5P_DATASET_ACCESS);
 		if((ndims == 3 || ndims == 4) && chunkSize){
 			H5Pset_chunk_cache(dapl_id,H5D_CHUNK_CACHE_NSLOTS_DEFAULT,1024*1024*16,1);
@@ -119,7 +131,9 @@ namespace CXI{
 		if(stackSize == H5S_UNLIMITED){
 			addStackAttributes(dataset,ndims,userAxis);
 		}
-		return addNode(s, dataset, Dataset);    
+		Node * n = addNode(s, dataset, Dataset);
+		n->frameChunks = compressed;
+		return n;
 	}
 
 	H5T_conv_ret_t handle_conversion_exceptions( H5T_conv_except_t except_type, hid_t , hid_t,
@@ -164,8 +178,226 @@ namespace CXI{
 	}
 
 
+	void Node::initSlab(){
+		slabFrames = 1;
+		slab = NULL;
+		slabStart = 0;
+		slabCount = 0;
+		slabSliceBytes = 0;
+		slabType = -1;
+	}
+
+	/*
+	 *	Copy one stack slice into the slab, writing out the slab first if the slice falls outside it.
+	 *	Returns false if this dataset can not be buffered, in which case the caller writes the slice directly.
+	 */
+	template <class T>
+	bool Node::bufferSlice(T * data, int stackSlice, int sliceSize){
+		if(slab == NULL){
+			// Size the slab from the dataset on the first slice
+			hsize_t dims[4];
+			hsize_t mdims[4];
+			hid_t dataspace = H5Dget_space(hid());
+			if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
+			int ndims = H5Sget_simple_extent_ndims(dataspace);
+			H5Sget_simple_extent_dims(dataspace, dims, mdims);
+			H5Sclose(dataspace);
+			if(ndims < 1 || mdims[0] != H5S_UNLIMITED){
+				slabFrames = 1;
+				return false;
+			}
+			hsize_t sliceElements = 1;
+			for(int i=1; i<ndims; i++){
+				sliceElements *= dims[i];
+			}
+			hid_t memType = get_datatype(data);
+			if(memType == H5T_NATIVE_CHAR){
+				// Only single strings; arrays of strings are written directly
+				if(sliceElements != 1){
+					slabFrames = 1;
+					return false;
+				}
+				slabType = H5Dget_type(hid());
+			}
+			else{
+				slabType = H5Tcopy(memType);
+			}
+			slabSliceBytes = sliceElements*H5Tget_size(slabType);
+			// Cap the slab at one 2D chunk, full detector frames gain nothing from being held back
+			if((long) slabFrames*slabSliceBytes > CXI::chunkSize2D){
+				slabFrames = CXI::chunkSize2D/slabSliceBytes;
+			}
+			if(slabFrames <= 1){
+				slabFrames = 1;
+				H5Tclose(slabType);
+				slabType = -1;
+				return false;
+			}
+			slab = (char *) calloc(slabFrames, slabSliceBytes);
+			slabFilled.assign(slabFrames, false);
+			slabStart = stackSlice;
+			slabCount = 0;
+		}
+		// Let write() report slices that do not match the dataset
+		if(typeid(T) != typeid(char) && sliceSize != 0 && (size_t) sliceSize*sizeof(T) != slabSliceBytes){
+			return false;
+		}
+
+		if(stackSlice < slabStart || stackSlice >= slabStart+slabFrames){
+			flushSlab();
+			slabStart = stackSlice;
+		}
+		long slot = stackSlice-slabStart;
+		char * dst = slab + slot*slabSliceBytes;
+		if(typeid(T) == typeid(char)){
+			strncpy(dst, (const char *) data, slabSliceBytes);
+		}
+		else{
+			memcpy(dst, data, slabSliceBytes);
+		}
+		if(!slabFilled[slot]){
+			slabFilled[slot] = true;
+			slabCount++;
+		}
+		if(slabCount == slabFrames){
+			flushSlab();
+		}
+		return true;
+	}
+
+	/*
+	 *	Write the slab out, one H5Dwrite per run of consecutive slices
+	 */
+	void Node::flushSlab(){
+		if(slabCount == 0){
+			return;
+		}
+		long i = 0;
+		while(i < slabFrames){
+			if(!slabFilled[i]){
+				i++;
+				continue;
+			}
+			long n = 1;
+			while(i+n < slabFrames && slabFilled[i+n]){
+				n++;
+			}
+			writeSlabRun(i, n);
+			i += n;
+		}
+		slabFilled.assign(slabFrames, false);
+		slabCount = 0;
+	}
+
+	void Node::writeSlabRun(long first, long n){
+		hsize_t block[4];
+		hsize_t mdims[4];
+		hsize_t count[4] = {1,1,1,1};
+		hsize_t stride[4] = {1,1,1,1};
+		long lastSlice = slabStart+first+n-1;
+		hid_t dataset = hid();
+		hid_t dataspace = H5Dget_space(dataset);
+		if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
+		int ndims = H5Sget_simple_extent_ndims(dataspace);
+		H5Sget_simple_extent_dims(dataspace, block, mdims);
+		/* check if we need to extend the dataset */
+		if((long)block[0] <= lastSlice){
+			while((long)block[0] <= lastSlice){
+				block[0] *= 2;
+			}
+			H5Dset_extent (dataset, block);
+			H5Sclose(dataspace);
+			dataspace = H5Dget_space (dataset);
+			if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
+		}
+		hsize_t offset[4] = {(hsize_t) (slabStart+first),0,0,0};
+		block[0] = n;
+		hid_t memspace = H5Screate_simple (ndims, block, NULL);
+		if(H5Sselect_hyperslab (dataspace, H5S_SELECT_SET, offset, stride, count, block) < 0){
+			ERROR("Cannot select hyperslab.\n");
+		}
+		hid_t xfer_plist_id = H5Pcreate(H5P_DATASET_XFER);
+		H5Pset_type_conv_cb(xfer_plist_id, handle_conversion_exceptions, &ignoreConversionExceptions);
+		if(H5Dwrite (dataset, slabType, memspace, dataspace, xfer_plist_id, slab+first*slabSliceBytes) < 0){
+ 			ERROR("Cannot write to file.\n");
+		}
+		writeNumEvents(dataset,lastSlice);
+		H5Sclose(memspace);
+		H5Sclose(dataspace);
+		H5Pclose(xfer_plist_id);
+	}
+
+	void Node::setSlabFrames(int n){
+		// Frames stored one per chunk are written as they come (see writeChunk)
+		if(type == Dataset && slab == NULL && !frameChunks){
+			slabFrames = n;
+		}
+		for(Iter it = children.begin(); it != children.end(); it++) {
+			it->second->setSlabFrames(n);
+		}
+	}
+
+	void Node::flushSlabs(){
+		if(type == Dataset && hid() >= 0){
+			flushSlab();
+		}
+		for(Iter it = children.begin(); it != children.end(); it++) {
+			it->second->flushSlabs();
+		}
+	}
+
+	void Node::setDeflateLevel(int level){
+		deflateLevel = level;
+		for(Iter it = children.begin(); it != children.end(); it++) {
+			it->second->setDeflateLevel(level);
+		}
+	}
+
+	bool Node::writeChunk(const char * chunk, size_t size, size_t elementSize, int stackSlice){
+		if(!frameChunks || stackSlice < 0){
+			return false;
+		}
+		hid_t dataset = hid();
+		hid_t datatype = H5Dget_type(dataset);
+		size_t fileElementSize = H5Tget_size(datatype);
+		H5Tclose(datatype);
+		if(fileElementSize != elementSize){
+			return false;
+		}
+
+		hsize_t block[4];
+		hsize_t mdims[4];
+		hid_t dataspace = H5Dget_space(dataset);
+		if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
+		H5Sget_simple_extent_dims(dataspace, block, mdims);
+		H5Sclose(dataspace);
+		/* check if we need to extend the dataset */
+		if((int)block[0] <= stackSlice){
+			while((int)block[0] <= stackSlice){
+				block[0] *= 2;
+			}
+			H5Dset_extent (dataset, block);
+		}
+
+		/* the chunk went through all filters of the dataset (shuffle and deflate), so the filter mask is 0 */
+		hsize_t offset[4] = {(hsize_t) stackSlice,0,0,0};
+		#if H5_VERSION_GE(1,10,3)
+		herr_t w = H5Dwrite_chunk(dataset, H5P_DEFAULT, 0, offset, size, chunk);
+		#else
+		herr_t w = H5DOwrite_chunk(dataset, H5P_DEFAULT, 0, offset, size, chunk);
+		#endif
+		if( w<0 ){
+ 			ERROR("Cannot write chunk to file.\n");
+		}
+		writeNumEvents(dataset,stackSlice);
+		return true;
+	}
+
 	template <class T> 
 	void Node::write(T * data, int stackSlice, int sliceSize, bool variableSlice){  
+		if(slabFrames > 1 && stackSlice >= 0 && !variableSlice && bufferSlice(data, stackSlice, sliceSize)){
+			return;
+		}
 		bool sliced = true;
 		if(stackSlice == -1){
 			stackSlice = 0;
@@ -374,6 +606,7 @@ namespace CXI{
 
 	Node * Node::addNode(const char * s, hid_t oid, Type t){
 		Node * n = new Node(s, oid, this, t, ignoreConversionExceptions);
+		n->deflateLevel = deflateLevel;
 		children[s] = n;
 		return n;
 	}
@@ -571,17 +804,9 @@ static T * generateThumbnail(const T * src,const int srcWidth, const int srcHeig
 
 
 /*
- *	Create the initial skeleton for the CXI file.
- *  We'll rely on HDF5 automatic error reporting. It's usually loud enough.
+ *	Type conversion exceptions (while saving) not to warn about
  */
-static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
-	int debugLevel = global->debugLevel;
-
-	using CXI::Node;
-	
-	DEBUGL2_ONLY{ DEBUG("Create Skeleton."); }
-
-
+static int conversionIgnoreFlags(cGlobal *global){
 	int ignoreConversionFlags = 0;
 	if(global->ignoreConversionOverflow){
 		ignoreConversionFlags |= CXI::IgnoreOverflow;
@@ -595,9 +820,13 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 	if(global->ignoreConversionNAN){
 		ignoreConversionFlags |= CXI::IgnoreNAN;
 	}
-	CXI::Node *root = new Node(filename,global->cxiSWMR,ignoreConversionFlags);
+	return ignoreConversionFlags;
+}
 
-	// Check what data type format we want to save things in. Defaults to float
+/*
+ *	Data type the images are saved in (dataSaveFormat). Defaults to float
+ */
+static hid_t dataSaveType(cGlobal *global){
 	hid_t h5type = H5T_NATIVE_FLOAT;
 	if(!strcasecmp(global->dataSaveFormat,"INT16")){
 		h5type = H5T_STD_I16LE;
@@ -608,6 +837,27 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 	else if(!strcasecmp(global->dataSaveFormat,"float")){
 		h5type = H5T_NATIVE_FLOAT;
 	}
+	return h5type;
+}
+
+
+/*
+ *	Create the initial skeleton for the CXI file.
+ *  We'll rely on HDF5 automatic error reporting. It's usually loud enough.
+ */
+static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
+	int debugLevel = global->debugLevel;
+
+	using CXI::Node;
+	
+	DEBUGL2_ONLY{ DEBUG("Create Skeleton."); }
+
+
+	CXI::Node *root = new Node(filename,global->cxiSWMR,conversionIgnoreFlags(global));
+	root->setDeflateLevel(global->cxiCompression);
+
+	// Check what data type format we want to save things in. Defaults to float
+	hid_t h5type = dataSaveType(global);
 	
 
 	root->createDataset("cxi_version",H5T_NATIVE_INT,1)->write(&CXI::version);
@@ -646,9 +896,6 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 		long pix_nn = global->detector[detIndex].pix_nn;
 		long pix_nx = global->detector[detIndex].pix_nx;
 		long pix_ny = global->detector[detIndex].pix_ny;
-		float* pix_x = global->detector[detIndex].pix_x;
-		float* pix_y = global->detector[detIndex].pix_y;
-		float* pix_r = global->detector[detIndex].pix_r;
 		long image_nn = global->detector[detIndex].image_nn;
 		long image_nx = global->detector[detIndex].image_nx;
 		long image_ny = global->detector[detIndex].image_ny;
@@ -698,11 +945,11 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 					}				
 					long nn = asic_nn*nasics_x*nasics_y;
 					uint16_t* mask = (uint16_t *) calloc(nn, sizeof(uint16_t));
-					stackModulesMask(pixelmask_shared, mask, asic_nx, asic_ny, nasics_x, nasics_y);
+					stackModulesMask(pixelmask_shared, mask, asic_nx, asic_ny, nasics_x, nasics_y, global->detector[detIndex].kernelLayout);
 					data_node->createDataset("mask_shared",H5T_NATIVE_UINT16,asic_nx, asic_ny, nasics)->write(mask, -1, nn);
-					stackModulesMask(pixelmask_shared_max, mask, asic_nx, asic_ny, nasics_x, nasics_y);
+					stackModulesMask(pixelmask_shared_max, mask, asic_nx, asic_ny, nasics_x, nasics_y, global->detector[detIndex].kernelLayout);
 					data_node->createDataset("mask_shared_max",H5T_NATIVE_UINT16,asic_nx, asic_ny, nasics)->write(mask, -1, nn);
-					stackModulesMask(pixelmask_shared_min, mask, asic_nx, asic_ny, nasics_x, nasics_y);
+					stackModulesMask(pixelmask_shared_min, mask, asic_nx, asic_ny, nasics_x, nasics_y, global->detector[detIndex].kernelLayout);
 					data_node->createDataset("mask_shared_min",H5T_NATIVE_UINT16,asic_nx, asic_ny, nasics)->write(mask, -1, nn);					
 					free(mask);
 
@@ -771,8 +1018,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 					data_node->createStack("mask",H5T_NATIVE_UINT16, image_nx, image_ny);
 				}
 				uint16_t *image_pixelmask_shared = (uint16_t*) calloc(image_nn,sizeof(uint16_t));
-				assemble2DMask(image_pixelmask_shared, pixelmask_shared, 
-							   pix_x, pix_y, pix_nn, image_nx, image_nn, global->assembleInterpolation);
+				assemble2DMask(image_pixelmask_shared, pixelmask_shared, &global->detector[detIndex].pix_assembly);
 				data_node->createDataset("mask_shared",H5T_NATIVE_UINT16,image_nx, image_ny)->write(image_pixelmask_shared, -1, image_nn);
 				free(image_pixelmask_shared);      
 				data_node->createStack("data_type",H5T_NATIVE_CHAR,CXI::stringSize);
@@ -815,8 +1061,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 					data_node->createStack("mask",H5T_NATIVE_UINT16, imageXxX_nx, imageXxX_ny);
 				}
 				uint16_t *image_pixelmask_shared = (uint16_t*) calloc( image_nn,sizeof(uint16_t));
-				assemble2DMask(image_pixelmask_shared, pixelmask_shared,
-							   pix_x, pix_y, pix_nn, image_nx, image_nn, global->assembleInterpolation);
+				assemble2DMask(image_pixelmask_shared, pixelmask_shared, &global->detector[detIndex].pix_assembly);
 				uint16_t *imageXxX_pixelmask_shared = (uint16_t*) calloc(imageXxX_nn, sizeof(uint16_t));
 				if(global->detector[detIndex].downsamplingConservative==1){
 					downsampleMaskConservative(image_pixelmask_shared,imageXxX_pixelmask_shared, image_nn, image_nx, imageXxX_nn, imageXxX_nx, downsampling, debugLevel);
@@ -867,7 +1112,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 				uint16_t *radial_pixelmask_shared = (uint16_t*) calloc(radial_nn,sizeof(uint16_t));
 				float *foo1 = (float *) calloc(pix_nn,sizeof(float));
 				float *foo2 = (float *) calloc(radial_nn,sizeof(float));
-				calculateRadialAverage(foo1, pixelmask_shared, foo2, radial_pixelmask_shared, pix_r, radial_nn, pix_nn);
+				calculateRadialAverage(foo1, pixelmask_shared, foo2, radial_pixelmask_shared, &global->detector[detIndex].pix_rbins, radial_nn);
 				data_node->createDataset("mask_shared",H5T_NATIVE_UINT16, radial_nn)->write(radial_pixelmask_shared, -1, radial_nn);
 				free(radial_pixelmask_shared);
 				free(foo1);
@@ -1042,21 +1287,46 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 
 		POWDER_LOOP{
 			Node * cl = det_node->createGroup("class",powderClass+1);
+			// Part of a run: also the sums behind mean and sigma, so that cheetah-merge can combine the parts
+			bool sums = global->keepsRunShardSums();
+			if (sums) {
+				cl->createDataset("nframes",H5T_NATIVE_LONG,1);
+			}
 			// Mean and sigma
 			FOREACH_DATAFORMAT_T(i_f, cDataVersion::DATA_FORMATS) {
 				if (isBitOptionSet(global->detector[detIndex].powderFormat,*i_f)) {
 					cDataVersion dataV(NULL, &global->detector[detIndex], global->detector[detIndex].powderVersion, *i_f);
 					while (dataV.next()) {
 						if (*i_f != cDataVersion::DATA_FORMAT_RADIAL_AVERAGE) {
-							sprintf(sBuffer,"mean_%s",dataV.name);
+							if (snprintf(sBuffer, sizeof(sBuffer), "mean_%s",dataV.name) >= (int) sizeof(sBuffer))
+								ERROR("Dataset name too long: %s\n", sBuffer);
 							cl->createDataset(sBuffer,H5T_NATIVE_DOUBLE,dataV.pix_nx,dataV.pix_ny);
-							sprintf(sBuffer,"sigma_%s",dataV.name);
+							if (snprintf(sBuffer, sizeof(sBuffer), "sigma_%s",dataV.name) >= (int) sizeof(sBuffer))
+								ERROR("Dataset name too long: %s\n", sBuffer);
 							cl->createDataset(sBuffer,H5T_NATIVE_DOUBLE,dataV.pix_nx,dataV.pix_ny);				
+							if (sums) {
+								if (snprintf(sBuffer, sizeof(sBuffer), "sum_%s",dataV.name) >= (int) sizeof(sBuffer))
+									ERROR("Dataset name too long: %s\n", sBuffer);
+								cl->createDataset(sBuffer,H5T_NATIVE_DOUBLE,dataV.pix_nx,dataV.pix_ny);
+								if (snprintf(sBuffer, sizeof(sBuffer), "sum_squared_%s",dataV.name) >= (int) sizeof(sBuffer))
+									ERROR("Dataset name too long: %s\n", sBuffer);
+								cl->createDataset(sBuffer,H5T_NATIVE_DOUBLE,dataV.pix_nx,dataV.pix_ny);
+							}
 						} else {
-							sprintf(sBuffer,"mean_%s",dataV.name);
+							if (snprintf(sBuffer, sizeof(sBuffer), "mean_%s",dataV.name) >= (int) sizeof(sBuffer))
+								ERROR("Dataset name too long: %s\n", sBuffer);
 							cl->createDataset(sBuffer,H5T_NATIVE_DOUBLE,dataV.pix_nn);
-							sprintf(sBuffer,"sigma_%s",dataV.name);
+							if (snprintf(sBuffer, sizeof(sBuffer), "sigma_%s",dataV.name) >= (int) sizeof(sBuffer))
+								ERROR("Dataset name too long: %s\n", sBuffer);
 							cl->createDataset(sBuffer,H5T_NATIVE_DOUBLE,dataV.pix_nn);									
+							if (sums) {
+								if (snprintf(sBuffer, sizeof(sBuffer), "sum_%s",dataV.name) >= (int) sizeof(sBuffer))
+									ERROR("Dataset name too long: %s\n", sBuffer);
+								cl->createDataset(sBuffer,H5T_NATIVE_DOUBLE,dataV.pix_nn);
+								if (snprintf(sBuffer, sizeof(sBuffer), "sum_squared_%s",dataV.name) >= (int) sizeof(sBuffer))
+									ERROR("Dataset name too long: %s\n", sBuffer);
+								cl->createDataset(sBuffer,H5T_NATIVE_DOUBLE,dataV.pix_nn);
+							}
 						}
 					}
 				}
@@ -1074,7 +1344,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 			sprintf(sBuffer,"pixel_histogram");
 			Node * hist_node = det_node->createGroup(sBuffer);
 			sprintf(sBuffer,"histogram");
-			hist_node->createDataset(sBuffer, H5T_NATIVE_UINT16, global->detector[detIndex].histogramNbins, global->detector[detIndex].histogram_nfs, global->detector[detIndex].histogram_nss);
+			hist_node->createDataset(sBuffer, H5T_NATIVE_UINT32, global->detector[detIndex].histogramNbins, global->detector[detIndex].histogram_nfs, global->detector[detIndex].histogram_nss);
 			sprintf(sBuffer,"histogram_scale");
 			hist_node->createDataset(sBuffer, H5T_NATIVE_FLOAT, global->detector[detIndex].histogramNbins)->write(global->detector[detIndex].histogramScale);
 		}
@@ -1112,11 +1382,14 @@ static std::vector<CXI::Node* > openFiles = std::vector<CXI::Node *>();
 static CXI::Node * getCXIFileByName(cGlobal *global, int powderClass){
 	char filename[MAX_FILENAME_LENGTH];
 	if(global->saveByPowderClass){
-		sprintf(filename,"%s-r%04d-class%d.cxi", global->experimentID, global->runNumber, powderClass);
+		if (snprintf(filename, sizeof(filename), "%s-r%04d-class%d.cxi", global->experimentID, global->runNumber, powderClass) >= (int) sizeof(filename))
+			ERROR("File name too long: %s\n", filename);
 	}
 	else{
-		sprintf(filename,"%s-r%04d.cxi", global->experimentID, global->runNumber);
+		if (snprintf(filename, sizeof(filename), "%s-r%04d.cxi", global->experimentID, global->runNumber) >= (int) sizeof(filename))
+			ERROR("File name too long: %s\n", filename);
 	}
+	global->addRunShardSuffix(filename);
 
 	pthread_mutex_lock(&global->framefp_mutex);
 	/* search again to be sure */
@@ -1130,6 +1403,13 @@ static CXI::Node * getCXIFileByName(cGlobal *global, int powderClass){
 	openFilenames.push_back(filename);
 	DEBUG2("Creating a new file.");
 	CXI::Node *cxi = createCXISkeleton(filename,global);
+	// Only the CXI writer thread writes event stacks, so they can be collected into slabs
+	// (the hit statistics below are written by all the workers and stay unbuffered)
+	if(global->cxiWriter != NULL){
+		cxi->setSlabFrames(global->cxiSlabFrames);
+		(*cxi)["cheetah"]["global_data"]["hit"].setSlabFrames(1);
+		(*cxi)["cheetah"]["global_data"]["nPeaks"].setSlabFrames(1);
+	}
 	openFiles.push_back(cxi);
 	pthread_mutex_unlock(&global->framefp_mutex);
 	return cxi;
@@ -1137,6 +1417,9 @@ static CXI::Node * getCXIFileByName(cGlobal *global, int powderClass){
 
 void writeAccumulatedCXI(cGlobal * global){
 	using CXI::Node;
+	// Parts of a run reduced into part 0 leave the running sums to it
+	if(!global->savesRunningSums())
+		return;
 	#ifdef H5F_ACC_SWMR_WRITE
 	if(global->cxiSWMR){
 		pthread_mutex_lock(&global->swmr_mutex);
@@ -1149,6 +1432,9 @@ void writeAccumulatedCXI(cGlobal * global){
 			CXI::Node * cxi = getCXIFileByName(global, powderClass);
 			Node & det_node = (*cxi)["cheetah"]["global_data"].child("detector",detIndex+1);
 			Node & cl = det_node.child("class",powderClass+1);
+			if(global->keepsRunShardSums()){
+				cl["nframes"].write(&global->detector[detIndex].nPowderFrames[powderClass], -1, 1);
+			}
 			FOREACH_DATAFORMAT_T(i_f, cDataVersion::DATA_FORMATS) {
 				if (isBitOptionSet(global->detector[detIndex].powderFormat,*i_f)) {
 					cDataVersion dataV(NULL, &global->detector[detIndex], global->detector[detIndex].powderVersion, *i_f);
@@ -1165,10 +1451,20 @@ void writeAccumulatedCXI(cGlobal * global){
 							sigma[i] =	sqrt((powder_squared[i] - powder[i]*powder[i]/(1.*global->detector[detIndex].nPowderFrames[powderClass]))/(1.*global->detector[detIndex].nPowderFrames[powderClass]));
                             //sigma[i] =	sqrt( fabs(powder_squared[i] - powder[i]*powder[i]/(1.*global->detector[detIndex].nPowderFrames[powderClass])) / (1.*global->detector[detIndex].nPowderFrames[powderClass]) );
 						}
-						sprintf(sBuffer,"mean_%s",dataV.name); 
+						if (snprintf(sBuffer, sizeof(sBuffer), "mean_%s",dataV.name) >= (int) sizeof(sBuffer))
+							ERROR("Dataset name too long: %s\n", sBuffer);
 						cl[sBuffer].write(mean, -1, pix_nn);
-						sprintf(sBuffer,"sigma_%s",dataV.name); 
+						if (snprintf(sBuffer, sizeof(sBuffer), "sigma_%s",dataV.name) >= (int) sizeof(sBuffer))
+							ERROR("Dataset name too long: %s\n", sBuffer);
 						cl[sBuffer].write(sigma, -1, pix_nn);
+						if(global->keepsRunShardSums()){
+							if (snprintf(sBuffer, sizeof(sBuffer), "sum_%s",dataV.name) >= (int) sizeof(sBuffer))
+								ERROR("Dataset name too long: %s\n", sBuffer);
+							cl[sBuffer].write(powder, -1, pix_nn);
+							if (snprintf(sBuffer, sizeof(sBuffer), "sum_squared_%s",dataV.name) >= (int) sizeof(sBuffer))
+								ERROR("Dataset name too long: %s\n", sBuffer);
+							cl[sBuffer].write(powder_squared, -1, pix_nn);
+						}
 						free(mean);
 						free(sigma);
 					}      
@@ -1192,7 +1488,8 @@ void writeAccumulatedCXI(cGlobal * global){
 				long     N = global->detector[detIndex].histogram_nfs *
 					         global->detector[detIndex].histogram_nss *
 					         global->detector[detIndex].histogramNbins;
-				uint16_t *histData = global->detector[detIndex].histogramData;
+				uint32_t *histData = global->detector[detIndex].histogramData;
+				flushHistogramShards(global, detIndex);
 				det_node["pixel_histogram"]["histogram"].write(histData, -1, N);
 			}
 		}
@@ -1210,6 +1507,7 @@ void writeAccumulatedCXI(cGlobal * global){
  *	Close CXI files
  */
 static void  closeCXI(CXI::Node *cxi){
+	cxi->flushSlabs();
 	cxi->trimAll();
 	H5Fflush(cxi->hid(), H5F_SCOPE_GLOBAL);
 	H5Fclose(cxi->hid());
@@ -1239,20 +1537,28 @@ void closeCXIFiles(cGlobal * global){
 
 
 /*
- *	Flush CXI file data
+ *	Flush CXI file data, including the slices still held in the writer's partly filled slabs
  */
 static void  flushCXI(CXI::Node *cxi){
+	cxi->flushSlabs();
 	H5Fflush(cxi->hid(), H5F_SCOPE_GLOBAL);
 }
 
 void flushCXIFiles(cGlobal * global){
 	
 	/* Go through each file and resize them to their right size */
+	// (the slabs belong to the CXI writer, so it has to stay out while they are written here)
+	if(global->cxiWriter != NULL){
+		global->cxiWriter->lockWrites();
+	}
 	pthread_mutex_lock(&global->framefp_mutex);
 	for(uint i = 0;i<openFilenames.size();i++){
 		flushCXI(openFiles[i]);
 	}
 	pthread_mutex_unlock(&global->framefp_mutex);
+	if(global->cxiWriter != NULL){
+		global->cxiWriter->unlockWrites();
+	}
 }
 
 
@@ -1278,6 +1584,186 @@ void writeCXIHitstats(cEventData *info, cGlobal *global ){
 }
 
 
+/*
+ *	Compressed frames (cxiCompression): the workers convert each image of a hit to the file datatype,
+ *	shuffle and deflate it exactly like the HDF5 filters of its stack would, and keep the result with the event.
+ *	The CXI writer then hands these chunks to HDF5 as they are, so compression runs on all worker threads
+ *	and only the chunk write itself is left to the single writer.
+ */
+static tCXIChunk * findCXIChunk(cEventData *eventData, const void *source, long nn){
+	for(long i=0; i<eventData->nCXIChunks; i++){
+		if(eventData->cxiChunks[i].source == source && eventData->cxiChunks[i].nn == nn){
+			return &eventData->cxiChunks[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Float to integer the way HDF5 converts (clip to the range, drop the fractional part),
+ *	except that NAN becomes 0. Each kind of exception is reported once per frame.
+ */
+template <class T>
+static void convertFrame(const float *in, T *out, long nn, int ignoreFlags){
+	const double hi = std::numeric_limits<T>::max();
+	const double lo = std::numeric_limits<T>::min();
+	bool overflowHi = false, overflowLo = false, truncated = false, nan = false;
+	for(long i=0; i<nn; i++){
+		double v = in[i];
+		if(v > hi){
+			out[i] = std::numeric_limits<T>::max();
+			overflowHi = true;
+		}
+		else if(v < lo){
+			out[i] = std::numeric_limits<T>::min();
+			overflowLo = true;
+		}
+		else if(v == v){
+			out[i] = (T) v;
+			truncated |= (out[i] != v);
+		}
+		else{
+			out[i] = 0;
+			nan = true;
+		}
+	}
+	if(overflowHi)
+		CXI::handle_conversion_exceptions(H5T_CONV_EXCEPT_RANGE_HI, -1, -1, NULL, NULL, &ignoreFlags);
+	if(overflowLo)
+		CXI::handle_conversion_exceptions(H5T_CONV_EXCEPT_RANGE_LOW, -1, -1, NULL, NULL, &ignoreFlags);
+	if(truncated)
+		CXI::handle_conversion_exceptions(H5T_CONV_EXCEPT_TRUNCATE, -1, -1, NULL, NULL, &ignoreFlags);
+	if(nan)
+		CXI::handle_conversion_exceptions(H5T_CONV_EXCEPT_NAN, -1, -1, NULL, NULL, &ignoreFlags);
+}
+
+/*
+ *	Shuffle and deflate one frame (already in the file datatype) into the next chunk of the event
+ */
+static void addCXIChunk(cEventData *eventData, const void *source, const void *frame, long nn, size_t elementSize, int level){
+	// HDF5 shuffle filter: first bytes of all elements, then second bytes, ...
+	uLong bytes = nn*elementSize;
+	const unsigned char *in = (const unsigned char *) frame;
+	unsigned char *shuffled = (unsigned char *) malloc(bytes);
+	for(size_t b=0; b<elementSize; b++){
+		unsigned char *out = shuffled + b*nn;
+		for(long i=0; i<nn; i++){
+			out[i] = in[i*elementSize+b];
+		}
+	}
+
+	// Chunk buffers are kept when the event structure is recycled
+	if(eventData->nCXIChunks == (long) eventData->cxiChunks.size()){
+		tCXIChunk empty = {};
+		eventData->cxiChunks.push_back(empty);
+	}
+	tCXIChunk *chunk = &eventData->cxiChunks[eventData->nCXIChunks];
+	uLongf size = compressBound(bytes);
+	if(chunk->capacity < size){
+		free(chunk->buffer);
+		chunk->buffer = (char *) malloc(size);
+		chunk->capacity = size;
+	}
+	// HDF5 deflate filter: zlib stream of the shuffled frame
+	// (if this fails the writer leaves the frame to the HDF5 filters)
+	int ret = compress2((Bytef *) chunk->buffer, &size, shuffled, bytes, level);
+	free(shuffled);
+	if(ret != Z_OK){
+		return;
+	}
+	chunk->source = source;
+	chunk->nn = nn;
+	chunk->elementSize = elementSize;
+	chunk->size = size;
+	eventData->nCXIChunks++;
+}
+
+static void addCXIDataChunk(cEventData *eventData, const float *data, long nn, hid_t h5type, int level, int ignoreFlags){
+	if(findCXIChunk(eventData, data, nn) != NULL){
+		return;
+	}
+	if(H5Tequal(h5type, H5T_NATIVE_FLOAT) > 0){
+		addCXIChunk(eventData, data, data, nn, sizeof(float), level);
+	}
+	else if(H5Tequal(h5type, H5T_NATIVE_INT16) > 0){
+		int16_t *frame = (int16_t *) malloc(nn*sizeof(int16_t));
+		convertFrame(data, frame, nn, ignoreFlags);
+		addCXIChunk(eventData, data, frame, nn, sizeof(int16_t), level);
+		free(frame);
+	}
+	else if(H5Tequal(h5type, H5T_NATIVE_INT32) > 0){
+		int32_t *frame = (int32_t *) malloc(nn*sizeof(int32_t));
+		convertFrame(data, frame, nn, ignoreFlags);
+		addCXIChunk(eventData, data, frame, nn, sizeof(int32_t), level);
+		free(frame);
+	}
+	// Any other file datatype (a foreign byte order) is left to the HDF5 filters
+}
+
+static void addCXIMaskChunk(cEventData *eventData, const uint16_t *mask, long nn, int level){
+	if(findCXIChunk(eventData, mask, nn) == NULL){
+		addCXIChunk(eventData, mask, mask, nn, sizeof(uint16_t), level);
+	}
+}
+
+/*
+ *	Compress the image stacks writeCXI() is going to write for this event
+ *	(non-assembled, assembled and downsampled data and masks; modular stacks, thumbnails and
+ *	anything else without a chunk here are compressed by HDF5 when written)
+ */
+void compressCXIFrames(cEventData *eventData, cGlobal *global){
+	eventData->nCXIChunks = 0;
+	if(global->cxiCompression <= 0){
+		return;
+	}
+	int level = global->cxiCompression;
+	int ignoreFlags = conversionIgnoreFlags(global);
+	hid_t h5type = dataSaveType(global);
+
+	DETECTOR_LOOP {
+		bool saveMask = global->detector[detIndex].savePixelmask;
+		if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_NON_ASSEMBLED) && !global->saveModular) {
+			long pix_nn = global->detector[detIndex].pix_nn;
+			cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_NON_ASSEMBLED);
+			while (dataV.next()) {
+				addCXIDataChunk(eventData, dataV.getData(), pix_nn, h5type, level, ignoreFlags);
+				if(saveMask)
+					addCXIMaskChunk(eventData, dataV.getPixelmask(), pix_nn, level);
+			}
+		}
+		if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_ASSEMBLED)) {
+			long image_nn = global->detector[detIndex].image_nn;
+			cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_ASSEMBLED);
+			while (dataV.next()) {
+				addCXIDataChunk(eventData, dataV.getData(), image_nn, h5type, level, ignoreFlags);
+				if(saveMask)
+					addCXIMaskChunk(eventData, dataV.getPixelmask(), image_nn, level);
+			}
+		}
+		if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)) {
+			long imageXxX_nn = global->detector[detIndex].imageXxX_nn;
+			cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED);
+			while (dataV.next()) {
+				addCXIDataChunk(eventData, dataV.getData(), imageXxX_nn, h5type, level, ignoreFlags);
+				if(saveMask)
+					addCXIMaskChunk(eventData, dataV.getPixelmask(), imageXxX_nn, level);
+			}
+		}
+	}
+}
+
+/*
+ *	Write one image of the event to its stack, as the chunk the worker compressed if there is one
+ */
+template <class T>
+static void writeCXIFrame(CXI::Node & node, cEventData *eventData, T *data, int stackSlice, long nn){
+	tCXIChunk *chunk = findCXIChunk(eventData, data, nn);
+	if(chunk == NULL || !node.writeChunk(chunk->buffer, chunk->size, chunk->elementSize, stackSlice)){
+		node.write(data, stackSlice, nn);
+	}
+}
+
+
 void writeCXI(cEventData *eventData, cGlobal *global ){
 	DEBUG2("Write a data of one frame to CXI file.");
 	using CXI::Node;
@@ -1373,7 +1859,7 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
 					
 					long nn = asic_nn*nasics;
 					float * dataModular = (float *) calloc(nn, sizeof(float));
-					stackModulesData(data, dataModular, asic_nx, asic_ny, nasics_x, nasics_y);
+					stackModulesData(data, dataModular, asic_nx, asic_ny, nasics_x, nasics_y, global->detector[detIndex].kernelLayout);
 					data_node["data"].write(dataModular, stackSlice, nn);
 					free(dataModular);
 
@@ -1398,7 +1884,7 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
 					if(global->detector[detIndex].savePixelmask){
 						nn = asic_nn*nasics_x*nasics_y;
 						uint16_t* maskModular = (uint16_t *) calloc(nn, sizeof(uint16_t));
-						stackModulesMask(eventData->detector[detIndex].pixelmask, maskModular, asic_nx, asic_ny, nasics_x, nasics_y);
+						stackModulesMask(eventData->detector[detIndex].pixelmask, maskModular, asic_nx, asic_ny, nasics_x, nasics_y, global->detector[detIndex].kernelLayout);
 						data_node["mask"].write(maskModular,stackSlice, nn);
 						free(maskModular);
 					}
@@ -1406,9 +1892,9 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
 				else {
 					// Non-assembled images (3D: N_frames x Ny_frame x Nx_frame)
 					Node & data_node = detector[dataV.name_version];
-					data_node["data"].write(data, stackSlice, pix_nn);	
+					writeCXIFrame(data_node["data"], eventData, data, stackSlice, pix_nn);	
 					if(global->detector[detIndex].savePixelmask){
-						data_node["mask"].write(pixelmask, stackSlice, pix_nn);
+						writeCXIFrame(data_node["mask"], eventData, pixelmask, stackSlice, pix_nn);
 					}
 					long nn = (pix_nx/CXI::thumbnailScale) * (pix_ny/CXI::thumbnailScale);
 					float * thumbnail = generateThumbnail(data, pix_nx, pix_ny, CXI::thumbnailScale);
@@ -1429,9 +1915,9 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
 				float * data = dataV.getData();
 				uint16_t * pixelmask = dataV.getPixelmask();
 				Node & data_node = root["entry_1"].child("image",i_image)[dataV.name_version];
-				data_node["data"].write(data, stackSlice, image_nn);
+				writeCXIFrame(data_node["data"], eventData, data, stackSlice, image_nn);
 				if(global->detector[detIndex].savePixelmask){
-					data_node["mask"].write(pixelmask, stackSlice, image_nn);
+					writeCXIFrame(data_node["mask"], eventData, pixelmask, stackSlice, image_nn);
 				}
 				long nn = (image_nx/CXI::thumbnailScale) * (image_ny/CXI::thumbnailScale);
 				float * thumbnail = generateThumbnail(data,image_nx,image_ny,CXI::thumbnailScale);
@@ -1452,9 +1938,9 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
 				float * data = dataV.getData();
 				uint16_t * pixelmask = dataV.getPixelmask();
 				Node & data_node = root["entry_1"].child("image",i_image)[dataV.name_version];
-				data_node["data"].write(data, stackSlice, imageXxX_nn);
+				writeCXIFrame(data_node["data"], eventData, data, stackSlice, imageXxX_nn);
 				if(global->detector[detIndex].savePixelmask){
-					data_node["mask"].write(pixelmask, stackSlice, imageXxX_nn);
+					writeCXIFrame(data_node["mask"], eventData, pixelmask, stackSlice, imageXxX_nn);
 				}
 				long nn = (imageXxX_nx/CXI::thumbnailScale) * (imageXxX_ny/CXI::thumbnailScale);
 				float * thumbnail = generateThumbnail(data,imageXxX_nx,imageXxX_ny,CXI::thumbnailScale);
@@ -1597,6 +2083,7 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
 	#ifdef H5F_ACC_SWMR_WRITE
 	if(global->cxiSWMR){
 		if(global->cxiFlushPeriod && (stackSlice % global->cxiFlushPeriod) == 0){
+			cxi->flushSlabs();
 			H5Fflush(cxi->hid(),H5F_SCOPE_LOCAL);
 		}
 		
@@ -171,11 +171,14 @@ void writeHDF5(cEventData *eventData, cGlobal *global){
 				return;
 			}
 			// Which type of data to save (default to detector corrected)
-			float *data_to_save = eventData->detector[detIndex].image_detCorr;
+			cDataVersion::dataVersion_t version_to_save = cDataVersion::DATA_VERSION_DETECTOR_CORRECTED;
 			if(global->detector[detIndex].saveDetectorRaw)
-				data_to_save = eventData->detector[detIndex].image_raw;
+				version_to_save = cDataVersion::DATA_VERSION_RAW;
 			else if (global->detector[detIndex].saveDetectorAndPhotonCorrected)
-				data_to_save = eventData->detector[detIndex].image_detPhotCorr;
+				version_to_save = cDataVersion::DATA_VERSION_DETECTOR_AND_PHOTON_CORRECTED;
+			cDataVersion imageV(&eventData->detector[detIndex], &global->detector[detIndex], version_to_save, cDataVersion::DATA_FORMAT_ASSEMBLED);
+			imageV.next();
+			float *data_to_save = imageV.getData();
 			
 			hdf_error = H5Dwrite(dataset_id, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, data_to_save);
 			if ( hdf_error < 0 ) {
@@ -196,7 +199,7 @@ void writeHDF5(cEventData *eventData, cGlobal *global){
 					H5Fclose(hdf_fileID);
 					return;
 				}
-				hdf_error = H5Dwrite(dataset_id, H5T_NATIVE_UINT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, eventData->detector[detIndex].image_pixelmask);
+				hdf_error = H5Dwrite(dataset_id, H5T_NATIVE_UINT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, imageV.getPixelmask());
 				if ( hdf_error < 0 ) {
 					ERROR("%li: Couldn't write data\n", eventData->threadNum);
 					H5Dclose(dataspace_id);
@@ -341,15 +344,17 @@ void writeHDF5(cEventData *eventData, cGlobal *global){
 		if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE)) {
 			size[0] = global->detector[detIndex].radial_nn;
 			dataspace_id = H5Screate_simple(1, size, NULL);
+			cDataVersion radialV(&eventData->detector[detIndex], &global->detector[detIndex], cDataVersion::DATA_VERSION_DETECTOR_AND_PHOTON_CORRECTED, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE);
+			radialV.next();
 			
 			sprintf(fieldID, "radialAverage%li", detIndex);
 			dataset_id = H5Dcreate(gid, fieldID, H5T_NATIVE_FLOAT, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-			H5Dwrite(dataset_id, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, eventData->detector[detIndex].radialAverage_detPhotCorr);
+			H5Dwrite(dataset_id, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, radialV.getData());
 			H5Dclose(dataset_id);
 			
 			sprintf(fieldID, "radialAverage%li_pixelmask", detIndex);
 			dataset_id = H5Dcreate(gid, fieldID, H5T_NATIVE_UINT16, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-			H5Dwrite(dataset_id, H5T_NATIVE_UINT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, eventData->detector[detIndex].radialAverage_pixelmask);
+			H5Dwrite(dataset_id, H5T_NATIVE_UINT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, radialV.getPixelmask());
 			H5Dclose(dataset_id);
 			
 			//sprintf(fieldID, "radialAverageCounter%li", detIndex);
@@ -128,6 +128,7 @@ void saveFEEspectrumStack(cGlobal *global, int powderClass) {
         nRows = (stackCounter % stackSize);
 	
     sprintf(filename,"r%04u-FEEspectrum-class%i-stack%li.h5", global->runNumber, powderClass, stackNum);
+    global->addRunShardSuffix(filename);
     printf("Saving FEE spectral stack: %s\n", filename);
     writeSimpleHDF5(filename, stack, speclength, nRows, H5T_NATIVE_FLOAT);
 	
@@ -281,6 +282,7 @@ void saveEspectrumStack(cGlobal *global, int powderClass) {
 	
 	
     sprintf(filename,"r%04u-espectrumstack-class%i-stack%li.h5", global->runNumber, powderClass, stackNum);
+    global->addRunShardSuffix(filename);
     printf("Saving spectral stack: %s\n", filename);
     writeSimpleHDF5(filename, stack, speclength, nRows, H5T_NATIVE_FLOAT);
 	
@@ -352,6 +354,7 @@ void saveIntegratedRunSpectrum(cGlobal *global) {
 		}
 
 		sprintf(filename,"r%04u-energySpectrum-darkcal.h5", global->runNumber);
+		global->addRunShardSuffix(filename);
 		printf("Saving energy spectrum darkcal to file: %s\n", filename);
         
 		writeSimpleHDF5(filename, espectrumDark, global->espectrumWidth, global->espectrumLength, H5T_NATIVE_DOUBLE);
@@ -377,6 +380,7 @@ void saveIntegratedRunSpectrum(cGlobal *global) {
 	}
 
 	sprintf(filename,"r%04u-integratedEnergySpectrum.h5", global->runNumber);
+	global->addRunShardSuffix(filename);
 	printf("Saving run-integrated energy spectrum: %s\n", filename);
 
 	writeSpectrumInfoHDF5(filename, espectrumScale, global->espectrumRun, global->espectrumLength, H5T_NATIVE_DOUBLE, &maxindex, 1, H5T_NATIVE_INT);
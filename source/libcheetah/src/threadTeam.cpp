@@ -0,0 +1,156 @@
+/*
+ *  threadTeam.cpp
+ *  cheetah
+ *
+ *  Helper threads a worker keeps for splitting one frame's work over several threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "threadTeam.h"
+
+
+/*
+ *	Helper thread: sleeps until the next round, runs its task if the round has one for it, and reports back
+ */
+static void *threadTeamHelper(void *threadarg) {
+	tThreadTeamHelper *helper = (tThreadTeamHelper *) threadarg;
+	tThreadTeam *team = helper->team;
+
+	pthread_mutex_lock(&team->mutex);
+	while (true) {
+		while (team->round == helper->round && !team->stopping)
+			pthread_cond_wait(&team->roundStart, &team->mutex);
+		if (team->stopping)
+			break;
+		helper->round = team->round;
+		if (helper->task >= team->roundTasks)
+			continue;
+		void	*(*func)(void *) = team->func;
+		void	*task = team->tasks + helper->task*team->taskSize;
+		pthread_mutex_unlock(&team->mutex);
+		func(task);
+		pthread_mutex_lock(&team->mutex);
+		team->nPending -= 1;
+		if (team->nPending == 0)
+			pthread_cond_signal(&team->roundDone);
+	}
+	pthread_mutex_unlock(&team->mutex);
+	return NULL;
+}
+
+/*
+ *	Stop and join the helpers (between rounds)
+ */
+static void stopThreadTeamHelpers(tThreadTeam *team) {
+	if (team->nHelpers > 0) {
+		pthread_mutex_lock(&team->mutex);
+		team->stopping = true;
+		pthread_cond_broadcast(&team->roundStart);
+		pthread_mutex_unlock(&team->mutex);
+		for (long i=0; i<team->nHelpers; i++)
+			pthread_join(team->threads[i], NULL);
+	}
+	free(team->threads);
+	free(team->helpers);
+	team->threads = NULL;
+	team->helpers = NULL;
+	team->nHelpers = 0;
+	team->nRequested = 0;
+	team->stopping = false;
+}
+
+/*
+ *	(Re)start the team with n helpers, for tasks 1 .. n
+ *	A helper that fails to start is left out, and the worker runs its tasks itself
+ */
+static void startThreadTeamHelpers(tThreadTeam *team, long n) {
+	if (!team->initialised) {
+		pthread_mutex_init(&team->mutex, NULL);
+		pthread_cond_init(&team->roundStart, NULL);
+		pthread_cond_init(&team->roundDone, NULL);
+		team->initialised = true;
+	}
+	stopThreadTeamHelpers(team);
+
+	team->nRequested = n;
+	team->threads = (pthread_t *) calloc(n, sizeof(pthread_t));
+	team->helpers = (tThreadTeamHelper *) calloc(n, sizeof(tThreadTeamHelper));
+	for (long i=0; i<n; i++) {
+		team->helpers[i].team = team;
+		team->helpers[i].task = i+1;
+		team->helpers[i].round = team->round;
+		if (pthread_create(&team->threads[i], NULL, threadTeamHelper, (void *) &team->helpers[i]) != 0) {
+			printf("Warning: failed to create helper thread %li of %li\n", i+1, n);
+			break;
+		}
+		team->nHelpers += 1;
+	}
+}
+
+
+/*
+ *	Task array of the next round: nTasks tasks of taskSize bytes, zeroed, kept by the team from one round to the next
+ */
+void *threadTeamTasks(tThreadTeam *team, long nTasks, size_t taskSize) {
+	size_t	size = nTasks*taskSize;
+	if (size > team->tasksAllocated) {
+		free(team->tasks);
+		team->tasks = (char *) calloc(nTasks, taskSize);
+		team->tasksAllocated = size;
+	}
+	else {
+		memset(team->tasks, 0, size);
+	}
+	team->nTasks = nTasks;
+	team->taskSize = taskSize;
+	return team->tasks;
+}
+
+/*
+ *	Run func on every task set up by threadTeamTasks: task 0 here, the others on the helpers; returns when all are done
+ */
+void threadTeamRun(tThreadTeam *team, void *(*func)(void *)) {
+	long	nTasks = team->nTasks;
+	if (nTasks <= 1) {
+		if (nTasks == 1)
+			func((void *) team->tasks);
+		return;
+	}
+
+	// More helpers than last time: restart the team with enough of them
+	if (team->nRequested < nTasks-1)
+		startThreadTeamHelpers(team, nTasks-1);
+	long	nHelped = (team->nHelpers < nTasks-1) ? team->nHelpers : nTasks-1;
+
+	pthread_mutex_lock(&team->mutex);
+	team->func = func;
+	team->roundTasks = nHelped+1;
+	team->nPending = nHelped;
+	team->round += 1;
+	pthread_cond_broadcast(&team->roundStart);
+	pthread_mutex_unlock(&team->mutex);
+
+	func((void *) team->tasks);
+	for (long t=nHelped+1; t<nTasks; t++)
+		func((void *) (team->tasks + t*team->taskSize));
+
+	pthread_mutex_lock(&team->mutex);
+	while (team->nPending > 0)
+		pthread_cond_wait(&team->roundDone, &team->mutex);
+	pthread_mutex_unlock(&team->mutex);
+}
+
+void freeThreadTeam(tThreadTeam *team) {
+	if (team->initialised) {
+		stopThreadTeamHelpers(team);
+		pthread_cond_destroy(&team->roundDone);
+		pthread_cond_destroy(&team->roundStart);
+		pthread_mutex_destroy(&team->mutex);
+	}
+	free(team->tasks);
+	memset(team, 0, sizeof(tThreadTeam));
+}
@@ -122,6 +122,7 @@ void saveTimeToolStack(cGlobal *global, int powderClass) {
         nRows = (stackCounter % stackSize);
 	
     sprintf(filename,"r%04u-TimeTool-class%i-stack%li.h5", global->runNumber, powderClass, stackNum);
+    global->addRunShardSuffix(filename);
     printf("Saving time tool stack: %s\n", filename);
     writeSimpleHDF5(filename, stack, length, nRows, H5T_NATIVE_FLOAT);
 	
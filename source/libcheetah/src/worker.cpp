@@ -29,7 +29,8 @@
 
 
 /*
- *	Worker thread function for processing each cspad data frame
+ *	Worker function for processing each cspad data frame
+ *	Runs either directly in the caller (single-threaded mode) or as a task on one of the worker pool threads
  */
 void *worker(void *threadarg) {
 
@@ -39,6 +40,8 @@ void *worker(void *threadarg) {
 	int             hit = 0;
 	float hitRatio;
 	double processRate;
+	double correctionSeconds[N_CORRECTION_STAGES] = {0};
+	double tStage;
 	eventData = (cEventData*) threadarg;
 	global = eventData->pGlobal;
 	
@@ -97,23 +100,34 @@ void *worker(void *threadarg) {
 	// Initialise pixelmask with pixelmask_shared
 	initPixelmask(eventData, global);
 	
-	// Initialise raw data array (float) THIS MIGHT SLOW THINGS DOWN, WE MIGHT WANT TO CHANGE THIS
-	initRaw(eventData, global);
-	
-	
 	//-------------------------//
 	//---DETECTOR-CORRECTION---//
 	//-------------------------//
 	DEBUG2("Detector correction");
+	tStage = correctionTimer();
 
-	// Initialise data_detCorr with data_raw16
-	initDetectorCorrection(eventData,global);
+	if(global->fusedDetectorCorrection) {
+		// Raw data arrays, saturated pixels and darkcal in one pass
+		// (also gain, bad pixels, polarization and solid angle for detectors without common mode correction)
+		applyDetectorOffsetCorrections(eventData, global);
+		correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_FUSED_OFFSET, &tStage);
+	}
+	else {
+		// Initialise raw data array (float) THIS MIGHT SLOW THINGS DOWN, WE MIGHT WANT TO CHANGE THIS
+		initRaw(eventData, global);
+		
+		// Initialise data_detCorr with data_raw16
+		initDetectorCorrection(eventData,global);
+		correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_RAW, &tStage);
 
-	// Check for saturated pixels before applying any other corrections
-	checkSaturatedPixels(eventData, global);
+		// Check for saturated pixels before applying any other corrections
+		checkSaturatedPixels(eventData, global);
+		correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_SATURATION, &tStage);
 
-	// Subtract darkcal image (static electronic offsets)
-	subtractDarkcal(eventData, global);
+		// Subtract darkcal image (static electronic offsets)
+		subtractDarkcal(eventData, global);
+		correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_DARKCAL, &tStage);
+	}
 	
 	// If no darkcal file: Subtract persistent background here (background = photon background + static electronic offsets)
 	// Commenting this out because it was was causing crashes with memory access violations (and the problem went away when this was commented out) <-- Anton 14 Dec 2014
@@ -137,18 +151,27 @@ void *worker(void *threadarg) {
 	pnccdFixWiringError(eventData, global);
 	pnccdLineInterpolation(eventData, global);
 	pnccdLineMasking(eventData, global);
+	correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_COMMON_MODE, &tStage);
 	
-	// Apply gain correction
-	applyGainCorrection(eventData, global);
-	
-	// Zero out bad pixels
-	setBadPixelsToZero(eventData, global);
- 
-    // Apply polarization correction
-    applyPolarizationCorrection(eventData, global);
-    
-    // Apply solid angle correction
-    applySolidAngleCorrection(eventData, global);
+	if(global->fusedDetectorCorrection) {
+		// Gain, bad pixels, polarization and solid angle in one pass (detectors with common mode correction)
+		applyDetectorGainCorrections(eventData, global);
+		correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_FUSED_GAIN, &tStage);
+	}
+	else {
+		// Apply gain correction
+		applyGainCorrection(eventData, global);
+		correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_GAIN, &tStage);
+		
+		// Zero out bad pixels
+		setBadPixelsToZero(eventData, global);
+		correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_BAD_PIXELS, &tStage);
+	 
+		// Apply polarization and solid angle correction (precomputed map)
+		applyGeometricCorrection(eventData, global);
+		correctionTimerLap(global, correctionSeconds, CORRECTION_STAGE_GEOMETRY, &tStage);
+	}
+	addCorrectionTiming(global, correctionSeconds);
     
 	//  Inside-thread speed test
 	if(global->ioSpeedTest==4) {
@@ -157,10 +180,8 @@ void *worker(void *threadarg) {
 	}
   
 	// Subtract residual common mode offsets (cmModule=2)
+	// (this also sets the bad pixels it shifted back to zero)
 	cspadModuleSubtract2(eventData, global);
-  
-	// Set bad pixels to zero
-	setBadPixelsToZero(eventData, global);
 	
 	// Identify hot pixels and set them to zero
 	updateHotPixelBuffer(eventData, global);
@@ -277,9 +298,8 @@ hitknown:
 		goto cleanup;
 	}
 
-	// Assemble, downsample and radially average current frame
-	assemble2D(eventData, global);
-//	downsample(eventData, global);
+	// Assembled, downsampled and radially averaged data are no longer made here for every frame:
+	// cDataVersion materializes them for this event when powder, histogram or saving first asks
   
 	// Powder
 	// Maintain a running sum of data (powder patterns)
@@ -340,7 +360,17 @@ hitknown:
             DEBUG2("About to write frame.");
             if(global->saveCXI){
                 printf("r%04u:%li (%2.1lf Hz, %3.3f %% hits): Writing %s (hit=%i,npeaks=%i)\n", global->runNumber, eventData->threadNum, processRate, hitRatio, eventData->eventStamp, hit, eventData->nPeaks);
-                writeCXI(eventData, global);
+                // With a CXI writer thread the frame is written after the worker is done with the event (see cleanup)
+                // (what it saves is materialized, and with cxiCompression compressed, here so the writer only writes)
+                if(global->cxiWriter != NULL && eventData->useThreads == 1) {
+                    assemble2D(eventData, global);
+                    downsample(eventData, global);
+                    calculateRadialAverage(eventData, global);
+                    compressCXIFrames(eventData, global);
+                    eventData->cxiWritePending = true;
+                }
+                else
+                    writeCXI(eventData, global);
             } else if(global->saveSACLA) {
                 printf("r%04u:%li (%2.1lf Hz, %3.3f %% hits): Writing %s (hit=%i,npeaks=%i)\n", global->runNumber, eventData->threadNum, processRate, hitRatio, eventData->eventStamp, hit, eventData->nPeaks);
                 writeSACLA(eventData, global);				
@@ -392,6 +422,10 @@ hitknown:
 cleanup:
 	DEBUG2("Clean up and exit");
 
+	// Add the event to the powder now if it came there before its turn, and pass the turn on
+	// (if its turn has still not come, the event is parked, and from here on belongs to the worker passing the turn on to it)
+	bool parked = finishPowderTurn(eventData, global);
+
 	
 	// Save accumulated data periodically
     pthread_mutex_lock(&global->saveinterval_mutex);
@@ -401,52 +435,40 @@ cleanup:
 	
 	
 	// Save some types of information from time to time (for example, powder patterns get updated while running)
-	if(global->saveInterval!=0 && (global->nprocessedframes%global->saveInterval)==0 && (global->nprocessedframes > global->detector[0].startFrames+50) ){
+	// (front ends reducing the parts of a run do this for all parts at once)
+	if(global->saveInterval!=0 && global->reduceRunShards == NULL && (global->nprocessedframes%global->saveInterval)==0 && (global->nprocessedframes > global->detector[0].startFrames+50) ){
 		DEBUG3("Save data.");
-		// Assemble, downsample and radially average powder
-		assemble2DPowder(global);
-		downsamplePowder(global);
-		calculateRadialAveragePowder(global);
-		// Save accumulated data
-		if(global->saveCXI){
-			writeAccumulatedCXI(global);
-		} 
-		if(global->writeRunningSumsFiles){
-			saveRunningSums(global);
-			saveHistograms(global);
-			saveSpectrumStacks(global);
-			if (global->useTimeTool) {
-				saveTimeToolStacks(global);
-			}
-		}
-		global->updateLogfile();
-		global->writeStatus("Not finished");
-
-		// try this - periodically flush the H5 file to let us to see data as it's being saved 
-		if(global->saveCXI) {
-			flushCXIFiles(global);
-		}
+		cheetahSaveInterval(global);
 	}
 	
 	
 	pthread_mutex_unlock(&global->saveinterval_mutex);
 
-	// Decrement thread pool counter by one
-	pthread_mutex_lock(&global->nActiveThreads_mutex);
-	global->nActiveCheetahThreads -= 1;
-	pthread_mutex_unlock(&global->nActiveThreads_mutex);
-	sem_post(&global->availableCheetahThreads);
-
 	global->processRateMonitor.frameFinished();
 
 	// Free memory only if running multi-threaded
-	if(eventData->useThreads == 1) {
-		cheetahDestroyEvent(eventData);
-		pthread_exit(NULL);
+	// (the pool thread that called us goes straight back to the queue for the next event)
+	if(!parked && eventData->useThreads == 1) {
+		releaseEvent(eventData, global);
 	}
-	else {
-		return(NULL);
+	return(NULL);
+}
+
+
+/*
+ *	Let go of an event the workers are done with (multithreaded mode)
+ */
+void releaseEvent(cEventData *eventData, cGlobal *global) {
+	// Pass pending hits on to the CXI writer, which frees the event and decrements the counter once written
+	if(eventData->cxiWritePending && global->cxiWriter->push(eventData) == 0) {
+		return;
 	}
+	cheetahDestroyEvent(eventData);
+
+	// Decrement active event counter by one
+	pthread_mutex_lock(&global->nActiveThreads_mutex);
+	global->nActiveCheetahThreads -= 1;
+	pthread_mutex_unlock(&global->nActiveThreads_mutex);
 }
 
 
@@ -0,0 +1,153 @@
+/*
+ *  workerPool.cpp
+ *  cheetah
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cheetah.h"
+#include "workerPool.h"
+
+cWorkerPool::cWorkerPool(long nWorkers0, long queueDepth0) {
+	nWorkers = nWorkers0;
+	queueDepth = queueDepth0;
+	if (nWorkers < 1) nWorkers = 1;
+	if (queueDepth < 1) queueDepth = nWorkers;
+
+	// Ring buffer of events waiting for a worker
+	queue = (cEventData **) calloc(queueDepth, sizeof(cEventData *));
+	queueHead = 0;
+	queueCount = 0;
+	nQueued = 0;
+	stopping = false;
+	pthread_mutex_init(&queue_mutex, NULL);
+	pthread_cond_init(&queueNotEmpty, NULL);
+	pthread_cond_init(&queueNotFull, NULL);
+
+	// Start the workers (joinable, so that shutdown() can wait for them)
+	// (a worker that failed to start is left out, shutdown() only joins the ones that did)
+	threads = (pthread_t *) calloc(nWorkers, sizeof(pthread_t));
+	threadStarted = (bool *) calloc(nWorkers, sizeof(bool));
+	workerArgs = (tWorkerArg *) calloc(nWorkers, sizeof(tWorkerArg));
+	long nStarted = 0;
+	for (long i=0; i<nWorkers; i++) {
+		workerArgs[i].pool = this;
+		workerArgs[i].workerID = i;
+		if (pthread_create(&threads[i], NULL, workerLoop, (void *) &workerArgs[i]) != 0) {
+			printf("Warning: failed to create worker thread %li of %li\n", i, nWorkers);
+			continue;
+		}
+		threadStarted[i] = true;
+		nStarted += 1;
+	}
+	if (nStarted == 0) {
+		ERROR("Failed to create any of %li worker threads", nWorkers);
+	}
+}
+
+cWorkerPool::~cWorkerPool() {
+	shutdown();
+	free(threads);
+	free(threadStarted);
+	free(workerArgs);
+	free(queue);
+	pthread_cond_destroy(&queueNotFull);
+	pthread_cond_destroy(&queueNotEmpty);
+	pthread_mutex_destroy(&queue_mutex);
+}
+
+/*
+ *	Queue an event for processing
+ *	Blocks while the queue is full; returns ETIMEDOUT if no slot became free within timeoutInSeconds
+ *	(a timeout of 0 or less waits forever)
+ *	The event is numbered here, under the queue mutex, so the numbers follow the order of the queue
+ *	whichever thread pushes (the powder shards add events in this order, see powder.cpp)
+ */
+int cWorkerPool::push(cEventData *eventData, int timeoutInSeconds) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeoutInSeconds;
+
+	pthread_mutex_lock(&queue_mutex);
+	while (queueCount == queueDepth && !stopping) {
+		if (timeoutInSeconds > 0) {
+			if (pthread_cond_timedwait(&queueNotFull, &queue_mutex, &ts) == ETIMEDOUT) {
+				pthread_mutex_unlock(&queue_mutex);
+				return ETIMEDOUT;
+			}
+		}
+		else {
+			pthread_cond_wait(&queueNotFull, &queue_mutex);
+		}
+	}
+	if (stopping) {
+		pthread_mutex_unlock(&queue_mutex);
+		return -1;
+	}
+	eventData->powderSequence = nQueued;
+	nQueued += 1;
+	queue[(queueHead + queueCount) % queueDepth] = eventData;
+	queueCount += 1;
+	pthread_cond_signal(&queueNotEmpty);
+	pthread_mutex_unlock(&queue_mutex);
+	return 0;
+}
+
+/*
+ *	Take the next event off the queue (NULL once the pool is shutting down and the queue is empty)
+ */
+cEventData *cWorkerPool::pop() {
+	cEventData *eventData = NULL;
+	pthread_mutex_lock(&queue_mutex);
+	while (queueCount == 0 && !stopping) {
+		pthread_cond_wait(&queueNotEmpty, &queue_mutex);
+	}
+	if (queueCount > 0) {
+		eventData = queue[queueHead];
+		queueHead = (queueHead + 1) % queueDepth;
+		queueCount -= 1;
+		pthread_cond_signal(&queueNotFull);
+	}
+	pthread_mutex_unlock(&queue_mutex);
+	return eventData;
+}
+
+/*
+ *	Let the workers finish whatever is still queued, then join them
+ */
+void cWorkerPool::shutdown() {
+	pthread_mutex_lock(&queue_mutex);
+	if (stopping) {
+		pthread_mutex_unlock(&queue_mutex);
+		return;
+	}
+	stopping = true;
+	pthread_cond_broadcast(&queueNotEmpty);
+	pthread_cond_broadcast(&queueNotFull);
+	pthread_mutex_unlock(&queue_mutex);
+
+	for (long i=0; i<nWorkers; i++) {
+		if (threadStarted[i])
+			pthread_join(threads[i], NULL);
+		threadStarted[i] = false;
+	}
+}
+
+/*
+ *	Each worker tags the events it runs with its own index (eventData->threadID),
+ *	which selects the worker's private scratch space (peakfinder and common mode workspaces)
+ */
+void *cWorkerPool::workerLoop(void *threadarg) {
+	tWorkerArg *arg = (tWorkerArg *) threadarg;
+	cWorkerPool *pool = arg->pool;
+	cEventData *eventData;
+	while ((eventData = pool->pop()) != NULL) {
+		eventData->threadID = arg->workerID;
+		worker((void *) eventData);
+	}
+	return NULL;
+}
@@ -0,0 +1,36 @@
+//
+//  benchTiming.h
+//  cheetah
+//
+//  Wall clock and pass/fail report shared by the benchmark programs
+//
+
+#ifndef cheetah_benchTiming_h
+#define cheetah_benchTiming_h
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ *	Monotonic wall clock time in seconds
+ */
+static inline double wallTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/*
+ *	Exit status of a benchmark: 0 if the optimised kernels agreed with the reference everywhere, 1 otherwise
+ *	(ctest runs the benchmarks on small inputs and fails on a nonzero status)
+ */
+static inline int benchResult(long nDiff) {
+	if (nDiff != 0) {
+		printf("FAILED: %li difference(s) from the reference\n", nDiff);
+		return 1;
+	}
+	printf("Passed: no differences from the reference\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ *  bench_commonMode.cpp
+ *  cheetah
+ *
+ *  Times the per-ASIC common mode (cmModule) with the exact selection and the
+ *  histogram estimator, serially and split over threads, against the original
+ *  cspadModuleSubtract loop, and checks that they agree (exit status 1 on any difference).
+ *
+ *  Usage: bench_commonMode [cmFloor] [nFrames] [nThreads]
+ *  Defaults: one CSPAD (8 x 8 ASICs of 194 x 185 pixels), cmFloor 0.1, 20 frames, 4 threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <hdf5.h>
+
+#include "cheetah.h"
+#include "median.h"
+#include "benchTiming.h"
+
+/*
+ *	cspadModuleSubtract as it was before the common mode workspace
+ */
+static void referenceModuleSubtract(float *data, uint16_t *mask, float threshold, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
+	long	e, mval, counter;
+	float	median;
+	float	*buffer = (float*) calloc(asic_nx*asic_ny, sizeof(float));
+
+	for(long mi=0; mi<nasics_x; mi++){
+		for(long mj=0; mj<nasics_y; mj++){
+			for(long i=0; i<asic_nx*asic_ny; i++)
+				buffer[i] = 0;
+			counter = 0;
+			for(long j=0; j<asic_ny; j++){
+				for(long i=0; i<asic_nx; i++){
+					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
+					e += i + mi*asic_nx;
+					if( isBitOptionUnset(mask[e],PIXEL_IS_BAD) ) {
+						buffer[counter++] = data[e];
+					}
+				}
+			}
+			if(counter>0) {
+				mval = lrint(counter*threshold);
+				if(mval < 0)
+					mval = 1;
+				median = kth_smallest(buffer, counter, mval);
+			}
+			else
+				median = 0;
+			for(long j=0; j<asic_ny; j++){
+				for(long i=0; i<asic_nx; i++){
+					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
+					e += i + mi*asic_nx;
+					data[e] -= median;
+				}
+			}
+		}
+	}
+	free(buffer);
+}
+
+static double timeFrames(float *frames, float *result, uint16_t *mask, long nFrames, long pix_nn, float threshold, tCommonModeWorkspace *ws) {
+	double t = 0;
+	for (long f=0; f<nFrames; f++) {
+		memcpy(result, frames+f*pix_nn, pix_nn*sizeof(float));
+		double t0 = wallTime();
+		if (ws == NULL)
+			referenceModuleSubtract(result, mask, threshold, 194, 185, 8, 8);
+		else
+			cspadModuleSubtract(result, mask, threshold, 194, 185, 8, 8, ws);
+		t += wallTime() - t0;
+	}
+	return 1e3*t/nFrames;
+}
+
+static long countDifferences(float *frames, float *reference, float *result, uint16_t *mask, long nFrames, long pix_nn, float threshold, tCommonModeWorkspace *ws) {
+	long nDiff = 0;
+	for (long f=0; f<nFrames; f++) {
+		memcpy(reference, frames+f*pix_nn, pix_nn*sizeof(float));
+		memcpy(result, frames+f*pix_nn, pix_nn*sizeof(float));
+		referenceModuleSubtract(reference, mask, threshold, 194, 185, 8, 8);
+		cspadModuleSubtract(result, mask, threshold, 194, 185, 8, 8, ws);
+		for (long i=0; i<pix_nn; i++)
+			if (memcmp(&result[i], &reference[i], sizeof(float)))
+				nDiff++;
+	}
+	return nDiff;
+}
+
+int main(int argc, char **argv) {
+	float threshold = (argc > 1) ? atof(argv[1]) : 0.1;
+	long nFrames = (argc > 2) ? atol(argv[2]) : 20;
+	long nThreads = (argc > 3) ? atol(argv[3]) : 4;
+	long asic_nx = 194;
+	long asic_ny = 185;
+	long nasics_x = 8;
+	long nasics_y = 8;
+	long pix_nx = asic_nx*nasics_x;
+	long pix_nn = pix_nx*asic_ny*nasics_y;
+
+	// Dark-subtracted frames: per-ASIC offset drifting from frame to frame, read noise, photons and Bragg spots
+	float *frames = (float *) calloc(nFrames*pix_nn, sizeof(float));
+	uint16_t *mask = (uint16_t *) calloc(pix_nn, sizeof(uint16_t));
+	srand(1);
+	for (long i=0; i<pix_nn; i++)
+		if (rand() % 100 == 0)
+			mask[i] = PIXEL_IS_BAD;
+	for (long f=0; f<nFrames; f++) {
+		float *frame = frames + f*pix_nn;
+		for (long i=0; i<pix_nn; i++) {
+			long asic = ((i/pix_nx)/asic_ny)*nasics_x + (i%pix_nx)/asic_nx;
+			float offset = 20.0f*sinf(0.7f*asic + 0.3f*f);
+			float noise = ((rand() % 1000) + (rand() % 1000) - 1000) * 0.01f;
+			frame[i] = offset + noise + 30.0f*(rand() % 20 == 0);
+			if (rand() % 2000 == 0)
+				frame[i] += 5000;
+		}
+	}
+
+	float *reference = (float *) calloc(pix_nn, sizeof(float));
+	float *result = (float *) calloc(pix_nn, sizeof(float));
+	tCommonModeWorkspace ws;
+	memset(&ws, 0, sizeof(tCommonModeWorkspace));
+
+	printf("CSPAD frame, %li x %li ASICs of %li x %li pixels, cmFloor %g, %li frames\n", nasics_x, nasics_y, asic_nx, asic_ny, threshold, nFrames);
+	double tReference = timeFrames(frames, result, mask, nFrames, pix_nn, threshold, NULL);
+	printf("original loop                 %8.3f ms/frame\n", tReference);
+
+	int estimators[2] = {CM_ESTIMATOR_SELECT, CM_ESTIMATOR_HISTOGRAM};
+	const char *names[2] = {"select", "histogram"};
+	long threadCounts[2] = {1, nThreads};
+	long nDiffTotal = 0;
+	for (int e=0; e<2; e++) {
+		for (int k=0; k<((nThreads > 1) ? 2 : 1); k++) {
+			long nt = threadCounts[k];
+			ws.estimator = estimators[e];
+			ws.nThreads = nt;
+			double tEstimator = timeFrames(frames, result, mask, nFrames, pix_nn, threshold, &ws);
+			long nDiff = countDifferences(frames, reference, result, mask, nFrames, pix_nn, threshold, &ws);
+			nDiffTotal += nDiff;
+			printf("%-10s %2li thread(s)      %8.3f ms/frame (x%5.1f, %li diff)\n", names[e], nt, tEstimator, tReference/tEstimator, nDiff);
+		}
+	}
+
+	freeCommonModeWorkspace(&ws);
+	free(frames);
+	free(mask);
+	free(reference);
+	free(result);
+	return benchResult(nDiffTotal);
+}
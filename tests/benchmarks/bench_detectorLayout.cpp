@@ -0,0 +1,138 @@
+/*
+ *  bench_detectorLayout.cpp
+ *  cheetah
+ *
+ *  Times the kernels specialised for a detector layout against their generic
+ *  instantiation on a CSPAD frame and checks that both give the same result
+ *  (exit status 1 on any difference).
+ *
+ *  Usage: bench_detectorLayout [repeats]
+ *  Defaults: one CSPAD (8 x 8 ASICs of 194 x 185 pixels), 10 repeats
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <hdf5.h>
+
+#include "cheetah.h"
+#include "benchTiming.h"
+
+static const long asic_nx = CSPAD_ASIC_NX;
+static const long asic_ny = CSPAD_ASIC_NY;
+static const long nasics_x = CSPAD_nASICS_X;
+static const long nasics_y = CSPAD_nASICS_Y;
+static const long pix_nn = asic_nx*nasics_x*asic_ny*nasics_y;
+
+/*
+ *	One kernel on a copy of the frame, with the given layout
+ */
+static void runKernel(int kernel, int layout, float *frame, uint16_t *mask, char *peakmask, tRadialBinIndex *rbins, tCommonModeWorkspace *cmws, tPeakfinderWorkspace *pfws, tPeakList *peaklist, float *out) {
+	memcpy(out, frame, pix_nn*sizeof(float));
+	switch(kernel) {
+		case 0:
+			cmws->layout = layout;
+			cspadModuleSubtract(out, mask, 0.1, asic_nx, asic_ny, nasics_x, nasics_y, cmws);
+			break;
+		case 1:
+			cspadSubtractUnbondedPixels(out, asic_nx, asic_ny, nasics_x, nasics_y, layout);
+			break;
+		case 2:
+			subtractLocalBackground(out, 4, asic_nx, asic_ny, nasics_x, nasics_y, LOCAL_BACKGROUND_MEDIAN, 0.5, layout);
+			break;
+		case 3:
+			subtractLocalBackground(out, 4, asic_nx, asic_ny, nasics_x, nasics_y, LOCAL_BACKGROUND_MEAN, 0.5, layout);
+			break;
+		case 4:
+			stackModulesData(frame, out, asic_nx, asic_ny, nasics_x, nasics_y, layout);
+			break;
+		case 5:
+			pfws->layout = layout;
+			peakfinder8(peaklist, pfws, out, peakmask, rbins, asic_nx, asic_ny, nasics_x, nasics_y, 100, 6, 2, 50, 3);
+			// Compare the peak list rather than the frame
+			memset(out, 0, pix_nn*sizeof(float));
+			for (long k=0; k<peaklist->nPeaks && k<pix_nn/4; k++) {
+				out[4*k] = peaklist->peak_com_x[k];
+				out[4*k+1] = peaklist->peak_com_y[k];
+				out[4*k+2] = peaklist->peak_totalintensity[k];
+				out[4*k+3] = peaklist->peak_snr[k];
+			}
+			break;
+	}
+}
+
+int main(int argc, char **argv) {
+	long repeats = (argc > 1) ? atol(argv[1]) : 10;
+	long pix_nx = asic_nx*nasics_x;
+
+	// Dark-subtracted frame with photons and Bragg spots, radius from the frame centre
+	float *frame = (float *) calloc(pix_nn, sizeof(float));
+	float *pix_r = (float *) calloc(pix_nn, sizeof(float));
+	uint16_t *mask = (uint16_t *) calloc(pix_nn, sizeof(uint16_t));
+	char *peakmask = (char *) calloc(pix_nn, sizeof(char));
+	srand(1);
+	for (long i=0; i<pix_nn; i++) {
+		float x = (i % pix_nx) - pix_nx/2;
+		float y = (i / pix_nx) - (pix_nn/pix_nx)/2;
+		pix_r[i] = sqrtf(x*x + y*y);
+		frame[i] = 100*expf(-pix_r[i]/600) + (rand() % 40) - 20 + 0.25f*(rand() % 4);
+		if (rand() % 2000 == 0)
+			frame[i] += 3000;
+		if (rand() % 100 == 0)
+			mask[i] = PIXEL_IS_BAD;
+		peakmask[i] = (mask[i] == 0);
+	}
+
+	tRadialBinIndex rbins;
+	memset(&rbins, 0, sizeof(rbins));
+	buildRadialBinIndex(&rbins, pix_r, pix_nn);
+	tCommonModeWorkspace cmws;
+	memset(&cmws, 0, sizeof(cmws));
+	cmws.estimator = CM_ESTIMATOR_HISTOGRAM;
+	cmws.nThreads = 1;
+	tPeakfinderWorkspace pfws;
+	memset(&pfws, 0, sizeof(pfws));
+	preparePeakfinderWorkspace(&pfws, pix_nn, rbins.nBins, 50);
+	pfws.nThreads = 1;
+	tPeakList peaklist;
+	allocatePeakList(&peaklist, 2048);
+
+	float *generic = (float *) calloc(pix_nn, sizeof(float));
+	float *specialised = (float *) calloc(pix_nn, sizeof(float));
+	const char *names[6] = {"cspadModuleSubtract", "cspadSubtractUnbondedPixels", "subtractLocalBackground median", "subtractLocalBackground mean", "stackModulesData", "peakfinder8"};
+
+	printf("CSPAD frame, %li x %li ASICs of %li x %li pixels, %li repeats\n", nasics_x, nasics_y, asic_nx, asic_ny, repeats);
+	printf("kernel                              generic     specialised\n");
+	long nDiffTotal = 0;
+	for (int kernel=0; kernel<6; kernel++) {
+		double t = wallTime();
+		for (long n=0; n<repeats; n++)
+			runKernel(kernel, DETECTOR_LAYOUT_GENERIC, frame, mask, peakmask, &rbins, &cmws, &pfws, &peaklist, generic);
+		double tGeneric = (wallTime() - t)/repeats;
+
+		t = wallTime();
+		for (long n=0; n<repeats; n++)
+			runKernel(kernel, DETECTOR_LAYOUT_CSPAD, frame, mask, peakmask, &rbins, &cmws, &pfws, &peaklist, specialised);
+		double tSpecialised = (wallTime() - t)/repeats;
+
+		long nDiff = 0;
+		for (long i=0; i<pix_nn; i++)
+			if (memcmp(&generic[i], &specialised[i], sizeof(float)))
+				nDiff++;
+		nDiffTotal += nDiff;
+		printf("%-32s %8.3f ms   %8.3f ms (x%4.2f, %li diff)\n", names[kernel], 1e3*tGeneric, 1e3*tSpecialised, tGeneric/tSpecialised, nDiff);
+	}
+
+	freePeakList(peaklist);
+	freePeakfinderWorkspace(&pfws);
+	freeCommonModeWorkspace(&cmws);
+	freeRadialBinIndex(&rbins);
+	free(frame);
+	free(pix_r);
+	free(mask);
+	free(peakmask);
+	free(generic);
+	free(specialised);
+	return benchResult(nDiffTotal);
+}
@@ -0,0 +1,142 @@
+/*
+ *  bench_frameBuffer.cpp
+ *  cheetah
+ *
+ *  Times the fused cFrameBuffer statistics update against the original
+ *  separate mean / std / above-threshold sweeps and checks that they agree
+ *  (exit status 1 on any difference).
+ *
+ *  Usage: bench_frameBuffer [pix_nn] [depth] [nThreads]
+ *  Defaults: one CSPAD (1480 x 1552 pixels), 50 frames, 4 threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "frameBuffer.h"
+#include "benchTiming.h"
+
+/*
+ *	The per-method loops as they were before the fused kernel
+ */
+static void referenceMean(float *frames, long pix_nn, long depth, float *mean) {
+	double * sum = (double *) calloc(pix_nn,sizeof(double));
+	for(long j=0; j< depth; j++) {
+		for(long i=0; i<pix_nn; i++) {
+			sum[i] += frames[j*pix_nn+i];
+		}
+	}
+	for(long i=0; i<pix_nn; i++) {
+		mean[i] = sum[i]/depth;
+	}
+	free(sum);
+}
+
+static void referenceStd(float *frames, long pix_nn, long depth, float *std) {
+	double v;
+	double * sum = (double *) calloc(pix_nn,sizeof(double));
+	double * sumsq = (double *) calloc(pix_nn,sizeof(double));
+	for(long j=0; j< depth; j++) {
+		for(long i=0; i<pix_nn; i++) {
+			v = frames[j*pix_nn+i];
+			sum[i] += v;
+			sumsq[i] += v*v;
+		}
+	}
+	for(long i=0; i<pix_nn; i++) {
+		std[i] = sqrt(sumsq[i]/depth - (sum[i]/depth)*(sum[i]/depth));
+	}
+	free(sum);
+	free(sumsq);
+}
+
+static void referenceAbsAboveThresh(float *frames, long pix_nn, long depth, float threshold, float *absAboveThresh) {
+	long * n = (long *) calloc(pix_nn,sizeof(long));
+	for (long j=0; j<depth; j++) {
+		for (long i=0; i<pix_nn; i++) {
+			n[i] += (fabs(frames[j*pix_nn+i])>threshold)?(1):(0);
+		}
+	}
+	for (long i=0; i<pix_nn; i++) {
+		absAboveThresh[i] = ((float) n[i])/((float) depth);
+	}
+	free(n);
+}
+
+static long countDifferences(float *a, float *b, long n) {
+	long nDiff = 0;
+	for (long i=0; i<n; i++) {
+		if (a[i] != b[i] && !(isnan(a[i]) && isnan(b[i])))
+			nDiff++;
+	}
+	return nDiff;
+}
+
+int main(int argc, char **argv) {
+	long pix_nn = (argc > 1) ? atol(argv[1]) : 1480*1552;
+	long depth = (argc > 2) ? atol(argv[2]) : 50;
+	long nThreads = (argc > 3) ? atol(argv[3]) : 4;
+	float threshold = 1000;
+	double t;
+
+	printf("Frame buffer of %li pixels x %li frames (%.0f MB), %li threads\n", pix_nn, depth, pix_nn*depth*sizeof(float)/1e6, nThreads);
+
+	// Fill the ring buffer and keep a plain copy for the reference loops
+	cFrameBuffer *frameBuffer = new cFrameBuffer(pix_nn, depth, 1);
+	float *frames = (float *) calloc(pix_nn*depth, sizeof(float));
+	srand(1);
+	for (long j=0; j<depth; j++) {
+		float *frame = frames + j*pix_nn;
+		for (long i=0; i<pix_nn; i++) {
+			frame[i] = (rand() % 2000) - 500 + 0.25f*(rand() % 4);
+		}
+		frameBuffer->writeNextFrame(frame);
+	}
+
+	float *refMean = (float *) calloc(pix_nn, sizeof(float));
+	float *refStd = (float *) calloc(pix_nn, sizeof(float));
+	float *refAbove = (float *) calloc(pix_nn, sizeof(float));
+	float *mean = (float *) calloc(pix_nn, sizeof(float));
+	float *std = (float *) calloc(pix_nn, sizeof(float));
+	float *above = (float *) calloc(pix_nn, sizeof(float));
+
+	t = wallTime();
+	referenceMean(frames, pix_nn, depth, refMean);
+	referenceStd(frames, pix_nn, depth, refStd);
+	referenceAbsAboveThresh(frames, pix_nn, depth, threshold, refAbove);
+	double tReference = wallTime() - t;
+	long nDiff = 0;
+	printf("Separate sweeps (mean, std, absAboveThresh):  %8.3f s\n", tReference);
+
+	for (long nt=1; nt<=nThreads; nt = (nt == nThreads) ? nt+1 : std::min(2*nt, nThreads)) {
+		frameBuffer->nThreads = nt;
+		t = wallTime();
+		frameBuffer->updateStatistics(true, true, true, threshold);
+		double tFused = wallTime() - t;
+
+		frameBuffer->copyMean(mean);
+		frameBuffer->copyStd(std);
+		frameBuffer->copyAbsAboveThresh(above);
+		long nDiffMean = countDifferences(mean, refMean, pix_nn);
+		long nDiffStd = countDifferences(std, refStd, pix_nn);
+		long nDiffAbove = countDifferences(above, refAbove, pix_nn);
+		nDiff += nDiffMean + nDiffStd + nDiffAbove;
+		printf("Fused kernel, %2li thread(s):                   %8.3f s  (x%.1f)  differences: mean %li, std %li, absAboveThresh %li\n",
+			   nt, tFused, tReference/tFused,
+			   nDiffMean, nDiffStd, nDiffAbove);
+	}
+
+	free(refMean);
+	free(refStd);
+	free(refAbove);
+	free(mean);
+	free(std);
+	free(above);
+	free(frames);
+	delete frameBuffer;
+	return benchResult(nDiff);
+}
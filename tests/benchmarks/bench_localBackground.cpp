@@ -0,0 +1,116 @@
+/*
+ *  bench_localBackground.cpp
+ *  cheetah
+ *
+ *  Times the sliding-window local background (median and mean modes) against
+ *  the original per-pixel kth_smallest window and checks the median agrees
+ *  (exit status 1 on any difference).
+ *
+ *  Usage: bench_localBackground [rmin] [rmax]
+ *  Defaults: one CSPAD (8 x 8 ASICs of 194 x 185 pixels), radius 2 to 10
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <hdf5.h>
+
+#include "cheetah.h"
+#include "median.h"
+#include "benchTiming.h"
+
+/*
+ *	The local background subtraction as it was before the sliding-window engine
+ */
+static void referenceLocalBackground(float *data, long radius, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
+	long	pix_nx = asic_nx*nasics_x;
+	long	pix_nn = pix_nx*asic_ny*nasics_y;
+	long	asic_nn = asic_nx*asic_ny;
+	long	nn = (2*radius+1)*(2*radius+1);
+	float	*asic_buffer = (float*) calloc(asic_nn, sizeof(float));
+	float	*median_buffer = (float*) calloc(nn, sizeof(float));
+	float	*localBg = (float*) calloc(pix_nn, sizeof(float));
+
+	for(long mj=0; mj<nasics_y; mj++){
+		for(long mi=0; mi<nasics_x; mi++){
+			for(long j=0; j<asic_ny; j++)
+				for(long i=0; i<asic_nx; i++)
+					asic_buffer[i+j*asic_nx] = data[(j+mj*asic_ny)*pix_nx + i+mi*asic_nx];
+			for(long j=0; j<asic_ny; j++){
+				for(long i=0; i<asic_nx; i++){
+					long counter = 0;
+					for(long jj=-radius; jj<=radius; jj++){
+						for(long ii=-radius; ii<=radius; ii++){
+							if((i+ii) < 0 || (i+ii) >= asic_nx || (j+jj) < 0 || (j+jj) >= asic_ny)
+								continue;
+							median_buffer[counter++] = asic_buffer[(j+jj)*asic_nx + i+ii];
+						}
+					}
+					localBg[(j+mj*asic_ny)*pix_nx + i+mi*asic_nx] = kth_smallest(median_buffer, counter, counter/2);
+				}
+			}
+		}
+	}
+	for(long i=0;i<pix_nn;i++)
+		data[i] -= localBg[i];
+	free(localBg);
+	free(asic_buffer);
+	free(median_buffer);
+}
+
+int main(int argc, char **argv) {
+	long rmin = (argc > 1) ? atol(argv[1]) : 2;
+	long rmax = (argc > 2) ? atol(argv[2]) : 10;
+	long asic_nx = 194;
+	long asic_ny = 185;
+	long nasics_x = 8;
+	long nasics_y = 8;
+	long pix_nn = asic_nx*nasics_x*asic_ny*nasics_y;
+
+	// Photon-counting-like background with some Bragg spots and a few repeated values
+	float *frame = (float *) calloc(pix_nn, sizeof(float));
+	srand(1);
+	for (long i=0; i<pix_nn; i++) {
+		frame[i] = (rand() % 200) - 50 + 0.5f*(rand() % 2);
+		if (rand() % 500 == 0)
+			frame[i] += 5000;
+	}
+
+	float *reference = (float *) calloc(pix_nn, sizeof(float));
+	float *result = (float *) calloc(pix_nn, sizeof(float));
+
+	printf("CSPAD frame, %li x %li ASICs of %li x %li pixels\n", nasics_x, nasics_y, asic_nx, asic_ny);
+	long nDiffTotal = 0;
+	printf("radius   kth_smallest      sliding median           sliding mean\n");
+	for (long radius=rmin; radius<=rmax; radius++) {
+		double t;
+		memcpy(reference, frame, pix_nn*sizeof(float));
+		t = wallTime();
+		referenceLocalBackground(reference, radius, asic_nx, asic_ny, nasics_x, nasics_y);
+		double tReference = wallTime() - t;
+
+		memcpy(result, frame, pix_nn*sizeof(float));
+		t = wallTime();
+		subtractLocalBackground(result, radius, asic_nx, asic_ny, nasics_x, nasics_y, LOCAL_BACKGROUND_MEDIAN, 0.5, DETECTOR_LAYOUT_CSPAD);
+		double tMedian = wallTime() - t;
+		long nDiff = 0;
+		for (long i=0; i<pix_nn; i++)
+			if (memcmp(&result[i], &reference[i], sizeof(float)))
+				nDiff++;
+		nDiffTotal += nDiff;
+
+		memcpy(result, frame, pix_nn*sizeof(float));
+		t = wallTime();
+		subtractLocalBackground(result, radius, asic_nx, asic_ny, nasics_x, nasics_y, LOCAL_BACKGROUND_MEAN, 0.5, DETECTOR_LAYOUT_CSPAD);
+		double tMean = wallTime() - t;
+
+		printf("%6li   %8.3f s     %8.3f s (x%5.1f, %li diff)   %8.3f s (x%5.1f)\n",
+			   radius, tReference, tMedian, tReference/tMedian, nDiff, tMean, tReference/tMean);
+	}
+
+	free(frame);
+	free(reference);
+	free(result);
+	return benchResult(nDiffTotal);
+}
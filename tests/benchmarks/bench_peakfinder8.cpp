@@ -0,0 +1,216 @@
+/*
+ *  bench_peakfinder8.cpp
+ *  cheetah
+ *
+ *  Times the peakfinder8 per-radius noise statistics using the precomputed
+ *  radius-bin index against the original sweep over the whole frame (lrint(pix_r)
+ *  on every pixel in each of the 5 iterations) and checks the thresholds agree,
+ *  then times the whole of peakfinder8 with its radial statistics and ASIC search
+ *  split over 1 .. maxThreads threads and checks the peak list does not change
+ *  (exit status 1 on any difference).
+ *
+ *  Usage: bench_peakfinder8 [maxThreads] [repeats]
+ *  Defaults: one CSPAD (8 x 8 ASICs of 194 x 185 pixels), up to 4 threads, 10 repeats
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <hdf5.h>
+
+#include "cheetah.h"
+#include "benchTiming.h"
+
+/*
+ *	The radial statistics of peakfinder8 as they were before the radius-bin index
+ */
+static void referenceRadialStatistics(float *temp, char *mask, float *pix_r, long pix_nn, float ADCthresh, float hitfinderMinSNR,
+									  float *roffset, float *rsigma, float *rthreshold, long *rcount) {
+	float	fminr, fmaxr;
+	long	lmaxr;
+	fminr = 1e9;
+	fmaxr = -1e9;
+	for(long i=0;i<pix_nn;i++){
+		if (pix_r[i] > fmaxr)
+			fmaxr = pix_r[i];
+		if (pix_r[i] < fminr)
+			fminr = pix_r[i];
+	}
+	lmaxr = (int)ceil(fmaxr)+1;
+
+	for(long i=0; i<lmaxr; i++) {
+		rthreshold[i] = 1e9;
+	}
+	long	thisr;
+	float	thisoffset, thissigma;
+	for(long counter=0; counter<5; counter++) {
+		for(long i=0; i<lmaxr; i++) {
+			roffset[i] = 0;
+			rsigma[i] = 0;
+			rcount[i] = 0;
+		}
+		for(long i=0;i<pix_nn;i++){
+			if(mask[i] != 0) {
+				thisr = lrint(pix_r[i]);
+				if(temp[i] < rthreshold[thisr]) {
+					roffset[thisr] += temp[i];
+					rsigma[thisr] += (temp[i]*temp[i]);
+					rcount[thisr] += 1;
+				}
+			}
+		}
+		for(long i=0; i<lmaxr; i++) {
+			if(rcount[i] == 0) {
+				roffset[i] = 0;
+				rsigma[i] = 0;
+				rthreshold[i] = 1e9;
+			}
+			else {
+				thisoffset = roffset[i]/rcount[i];
+				thissigma = sqrt(rsigma[i]/rcount[i] - ((roffset[i]/rcount[i])*(roffset[i]/rcount[i])));
+				roffset[i] = thisoffset;
+				rsigma[i] = thissigma;
+				rthreshold[i] = roffset[i] + hitfinderMinSNR*rsigma[i];
+				if(rthreshold[i] < ADCthresh)
+					rthreshold[i] = ADCthresh;
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	long maxThreads = (argc > 1) ? atol(argv[1]) : 4;
+	long repeats = (argc > 2) ? atol(argv[2]) : 10;
+	long asic_nx = 194;
+	long asic_ny = 185;
+	long nasics_x = 8;
+	long nasics_y = 8;
+	long pix_nx = asic_nx*nasics_x;
+	long pix_nn = pix_nx*asic_ny*nasics_y;
+	float ADCthresh = 50;
+	float minSNR = 6;
+
+	/*
+	 *	CSPAD-like geometry: pairs of ASICs side by side, 8 rows per quadrant,
+	 *	each quadrant of the raw layout rotated by a further 90 degrees about the beam
+	 */
+	float *pix_r = (float *) calloc(pix_nn, sizeof(float));
+	for(long mj=0; mj<nasics_y; mj++) {
+		for(long mi=0; mi<nasics_x; mi++) {
+			long quadrant = mi/2;
+			for(long j=0; j<asic_ny; j++) {
+				for(long i=0; i<asic_nx; i++) {
+					float x = 20 + (mi%2)*(asic_nx+3) + i;
+					float y = 20 + mj*(asic_ny+8) + j;
+					float xr = x, yr = y;
+					for(long q=0; q<quadrant; q++) {
+						float t = xr;
+						xr = -yr;
+						yr = t;
+					}
+					pix_r[(j+mj*asic_ny)*pix_nx + i+mi*asic_nx] = sqrt(xr*xr + yr*yr);
+				}
+			}
+		}
+	}
+
+	// Background falling off with radius, some Bragg spots and a few bad pixels
+	float *data = (float *) calloc(pix_nn, sizeof(float));
+	char *mask = (char *) calloc(pix_nn, sizeof(char));
+	srand(1);
+	for (long i=0; i<pix_nn; i++) {
+		data[i] = 200*exp(-pix_r[i]/800) + (rand() % 40) - 20 + 0.25f*(rand() % 4);
+		if (rand() % 2000 == 0)
+			data[i] += 3000;
+		mask[i] = (rand() % 100 != 0);
+	}
+	float *temp = (float *) calloc(pix_nn, sizeof(float));
+	for (long i=0; i<pix_nn; i++)
+		temp[i] = data[i]*mask[i];
+
+	double t = wallTime();
+	tRadialBinIndex rbins;
+	memset(&rbins, 0, sizeof(rbins));
+	buildRadialBinIndex(&rbins, pix_r, pix_nn);
+	double tBuild = wallTime() - t;
+
+	// The reference sizes its arrays by ceil(max radius)+1, one more than the index may need
+	long nBins = rbins.nBins;
+	float *roffset = (float *) calloc(nBins+1, sizeof(float));
+	float *rsigma = (float *) calloc(nBins+1, sizeof(float));
+	float *rthreshold = (float *) calloc(nBins+1, sizeof(float));
+	long *rcount = (long *) calloc(nBins+1, sizeof(long));
+
+	t = wallTime();
+	for (long n=0; n<repeats; n++)
+		referenceRadialStatistics(temp, mask, pix_r, pix_nn, ADCthresh, minSNR, roffset, rsigma, rthreshold, rcount);
+	double tReference = (wallTime() - t)/repeats;
+
+	printf("CSPAD frame, %li x %li ASICs of %li x %li pixels, %li radius bins\n", nasics_x, nasics_y, asic_nx, asic_ny, nBins);
+	printf("Index built in %.3f ms\n", 1e3*tBuild);
+	printf("threads   whole-frame sweep      bin index               peakfinder8\n");
+
+	tPeakfinderWorkspace ws;
+	memset(&ws, 0, sizeof(ws));
+	tPeakList peaklist;
+	allocatePeakList(&peaklist, 2048);
+	long nSerialPeaks = 0;
+	long *serialIndex = (long *) calloc(2048, sizeof(long));
+	float *serialIntensity = (float *) calloc(2048, sizeof(float));
+	long nDiffTotal = 0;
+	for (long nt=1; nt<=maxThreads; nt++) {
+		preparePeakfinderWorkspace(&ws, pix_nn, nBins, 50);
+		ws.nThreads = nt;
+
+		t = wallTime();
+		for (long n=0; n<repeats; n++)
+			peakfinder8RadialStatistics(&ws, &rbins, temp, mask, pix_nn, ADCthresh, minSNR);
+		double tIndex = (wallTime() - t)/repeats;
+
+		long nDiff = 0;
+		for (long r=0; r<nBins; r++)
+			if (memcmp(&ws.rthreshold[r], &rthreshold[r], sizeof(float)) || memcmp(&ws.roffset[r], &roffset[r], sizeof(float)))
+				nDiff++;
+
+		t = wallTime();
+		long nPeaks = 0;
+		for (long n=0; n<repeats; n++)
+			nPeaks = peakfinder8(&peaklist, &ws, data, mask, &rbins, asic_nx, asic_ny, nasics_x, nasics_y, ADCthresh, minSNR, 2, 50, 3);
+		double tPeakfinder = (wallTime() - t)/repeats;
+
+		// Peaks of the split search against those of one thread
+		long nPeakDiff = 0;
+		long nStored = (nPeaks < peaklist.nPeaks_max) ? nPeaks : peaklist.nPeaks_max;
+		if (nt == 1) {
+			nSerialPeaks = nPeaks;
+			memcpy(serialIndex, peaklist.peak_com_index, nStored*sizeof(long));
+			memcpy(serialIntensity, peaklist.peak_totalintensity, nStored*sizeof(float));
+		}
+		else if (nPeaks != nSerialPeaks)
+			nPeakDiff++;
+		else
+			for (long k=0; k<nStored; k++)
+				if (peaklist.peak_com_index[k] != serialIndex[k] || memcmp(&peaklist.peak_totalintensity[k], &serialIntensity[k], sizeof(float)))
+					nPeakDiff++;
+		nDiffTotal += nDiff + nPeakDiff;
+
+		printf("%7li   %8.3f ms        %8.3f ms (x%5.1f, %li diff)   %8.3f ms (%li peaks, %li diff)\n",
+			   nt, 1e3*tReference, 1e3*tIndex, tReference/tIndex, nDiff, 1e3*tPeakfinder, nPeaks, nPeakDiff);
+	}
+
+	freePeakList(peaklist);
+	freePeakfinderWorkspace(&ws);
+	freeRadialBinIndex(&rbins);
+	free(roffset);
+	free(rsigma);
+	free(rthreshold);
+	free(rcount);
+	free(pix_r);
+	free(data);
+	free(mask);
+	free(temp);
+	free(serialIndex);
+	free(serialIntensity);
+	return benchResult(nDiffTotal);
+}